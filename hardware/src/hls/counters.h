@@ -0,0 +1,67 @@
+#ifndef _COUNTERS_H_
+#define _COUNTERS_H_
+
+/* Memory for counters that are read, incremented and written back at II=1. The
+ * read of one iteration may be scheduled before the write of the previous ones has
+ * landed, so the last FORWARD writes are kept in registers and take precedence
+ * over the memory on a read of the same address. Callers do at most one read and
+ * one write per iteration. */
+template<typename T, int DEPTH, int FORWARD = 2>
+class ForwardedMemory {
+public:
+    static constexpr int ADDR_BITS = DEPTH > 1 ? sizeof(DEPTH) * 8 - 1 - __builtin_clz(DEPTH) : 1;
+    using addr_t = ap_uint<ADDR_BITS>;
+
+private:
+    static_assert((DEPTH & (DEPTH - 1)) == 0, "DEPTH must be a power of two");
+
+    T mem[DEPTH];
+    addr_t last_addr[FORWARD];
+    T last_value[FORWARD];
+    ap_uint<1> last_valid[FORWARD];
+
+public:
+    ForwardedMemory() {
+        for (int i = 0; i < DEPTH; i++) {
+            mem[i] = T();
+        }
+        for (int i = 0; i < FORWARD; i++) {
+            last_valid[i] = 0;
+        }
+    }
+
+    T read(addr_t addr) {
+#pragma HLS DEPENDENCE variable=mem inter false
+        T value = mem[addr];
+        /* Oldest first, so the most recent write wins */
+        for (int i = FORWARD - 1; i >= 0; i--) {
+#pragma HLS unroll
+            if (last_valid[i] && last_addr[i] == addr) {
+                value = last_value[i];
+            }
+        }
+        return value;
+    }
+
+    void write(addr_t addr, T value) {
+#pragma HLS DEPENDENCE variable=mem inter false
+        mem[addr] = value;
+        for (int i = FORWARD - 1; i > 0; i--) {
+#pragma HLS unroll
+            last_addr[i] = last_addr[i - 1];
+            last_value[i] = last_value[i - 1];
+            last_valid[i] = last_valid[i - 1];
+        }
+        last_addr[0] = addr;
+        last_value[0] = value;
+        last_valid[0] = 1;
+    }
+};
+
+/* Packets and bytes that hit one rule slot */
+struct slot_counter_t {
+    ap_uint<64> packets = 0;
+    ap_uint<64> bytes = 0;
+};
+
+#endif // _COUNTERS_H_
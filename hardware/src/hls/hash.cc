@@ -2,10 +2,11 @@
 #include <ap_int.h>
 #include "hash.h"
 
-ToeplitzHash::ToeplitzHash() {
-    /* Initialize the Toeplitz key with a predefined 320-bit value.
+template<int TABLES, int TABLE_SIZE, int WAYS>
+ToeplitzHash<TABLES, TABLE_SIZE, WAYS>::ToeplitzHash() {
+    /* Initialize the Toeplitz key with a predefined 576-bit value.
      * This key is used in the hash computation.
-     * The key is represented as an ap_uint<320> where each bit can be accessed. */
+     * The key is represented as an ap_uint<576> where each bit can be accessed. */
     toeplitz_key.range(31, 0)     = 0xD6E31417;
     toeplitz_key.range(63, 32)    = 0x376CC87E;
     toeplitz_key.range(95, 64)    = 0x011BA7A6;
@@ -16,30 +17,106 @@ ToeplitzHash::ToeplitzHash() {
     toeplitz_key.range(255, 224)  = 0xD9270F6F;
     toeplitz_key.range(287, 256)  = 0x18DC4386;
     toeplitz_key.range(319, 288)  = 0x7C9C37DE;
+    toeplitz_key.range(351, 320)  = 0x6A42B73B;
+    toeplitz_key.range(383, 352)  = 0xBEAC01FA;
+    toeplitz_key.range(415, 384)  = 0x3D2F1E0C;
+    toeplitz_key.range(447, 416)  = 0x9B5A4C37;
+    toeplitz_key.range(479, 448)  = 0x5C8E0F71;
+    toeplitz_key.range(511, 480)  = 0xA3E4B215;
+    toeplitz_key.range(543, 512)  = 0x47D1C96E;
+    toeplitz_key.range(575, 544)  = 0xE0295B83;
+
+    for (int bank = 0; bank < NUM_BANKS; bank++) {
+        for (int t = 0; t < TABLES; t++) {
+            mask[bank][t] = 0;
+            for (int way = 0; way < WAYS; way++) {
+                for (int i = 0; i < TABLE_SIZE; i++) {
+                    table[bank][t][way][i].valid = 0;
+                }
+            }
+        }
+    }
+}
+
+template<int TABLES, int TABLE_SIZE, int WAYS>
+hash_input_t ToeplitzHash<TABLES, TABLE_SIZE, WAYS>::fold(flow_key_t key) {
+    ip_addr_t dest_ip = key.range(127, 0);
+    ip_addr_t src_ip  = key.range(271, 144);
+    ap_uint<32> dest_fold = dest_ip.range(31, 0) ^ dest_ip.range(63, 32) ^
+                            dest_ip.range(95, 64) ^ dest_ip.range(127, 96);
+    ap_uint<32> src_fold  = src_ip.range(31, 0) ^ src_ip.range(63, 32) ^
+                            src_ip.range(95, 64) ^ src_ip.range(127, 96);
+    return (key.range(295, 288), key.range(287, 272), src_fold, key.range(143, 128), dest_fold);
 }
 
-ap_uint<32> ToeplitzHash::compute_hash(ap_uint<32> ip, ap_uint<16> port) {
+template<int TABLES, int TABLE_SIZE, int WAYS>
+ap_uint<32> ToeplitzHash<TABLES, TABLE_SIZE, WAYS>::compute_hash(flow_key_t key, int way) {
 #pragma HLS expression_balance
+    hash_input_t input = fold(key);
+    int base = way * KEY_STRIDE;
     ap_uint<32> hash = 0;
-    for (int i = 0; i < 32; i++) {
+    for (int i = 0; i < HASH_INPUT_BITS; i++) {
 #pragma HLS unroll
-        hash ^= get_window(ip[i], i);
+        hash ^= get_window(input[i], base + i);
     }
-    for (int i = 0; i < 16; i++) {
+    return hash;
+}
+
+template<int TABLES, int TABLE_SIZE, int WAYS>
+ap_uint<8> ToeplitzHash<TABLES, TABLE_SIZE, WAYS>::lookup(flow_key_t key, ap_uint<1> bank,
+                                                           ap_uint<8> default_action,
+                                                           ap_uint<1> &hit, slot_t &slot,
+                                                           RateMeter::bucket_t &bucket,
+                                                           ap_uint<16> &queue) {
+    ap_uint<8> action = default_action;
+    ap_uint<17> best = 0;   /* priority + 1 of the best match so far, 0 for none */
+    slot = 0;
+    bucket = 0;
+    queue = QUEUE_RSS;
+
+    /* Tables and ways are separate memories, so every slot is read in the same
+     * cycle. The host never stores a key in more than one way of a table. */
+    for (int t = TABLES - 1; t >= 0; t--) {
+#pragma HLS unroll
+        flow_key_t masked = key & mask[bank][t];
+        for (int way = 0; way < WAYS; way++) {
 #pragma HLS unroll
-        hash ^= get_window(port[i], i + 32);
+            int index = compute_hash(masked, way) & HASH_MASK;
+            Entry entry = table[bank][t][way][index];
+            if (entry.valid && entry.key == masked && entry.priority + 1 >= best) {
+                action = entry.action;
+                best = entry.priority + 1;
+                slot = (ap_uint<TABLE_BITS>(t), ap_uint<WAY_BITS>(way), ap_uint<HASH_BITS>(index));
+                bucket = entry.bucket;
+                queue = entry.queue;
+            }
+        }
     }
-    return hash;
+    hit = best != 0;
+    return action;
 }
 
-ap_uint<32> ToeplitzHash::lookup(ap_uint<32> ip, ap_uint<16> port) {
-    ap_uint<32> hash = compute_hash(ip, port);
-    int index = hash & HASH_MASK;
-    return table[index];
+template<int TABLES, int TABLE_SIZE, int WAYS>
+void ToeplitzHash<TABLES, TABLE_SIZE, WAYS>::insert(ap_uint<TABLE_BITS> table_idx,
+                                                    ap_uint<WAY_BITS> way,
+                                                    ap_uint<HASH_BITS> index, flow_key_t key,
+                                                    ap_uint<8> action, ap_uint<16> priority,
+                                                    RateMeter::bucket_t bucket,
+                                                    ap_uint<16> queue, ap_uint<1> bank) {
+    Entry entry;
+    entry.valid = action != ACTION_INVALID;
+    entry.key = key;
+    entry.action = action;
+    entry.priority = priority;
+    entry.bucket = bucket;
+    entry.queue = queue;
+    table[bank][table_idx][way][index] = entry;
 }
 
-void ToeplitzHash::insert(ap_uint<32> ip, ap_uint<16> port, ap_uint<32> value) {
-    ap_uint<32> hash = compute_hash(ip, port);
-    int index = hash & HASH_MASK;
-    table[index] = value;
+template<int TABLES, int TABLE_SIZE, int WAYS>
+void ToeplitzHash<TABLES, TABLE_SIZE, WAYS>::set_mask(ap_uint<TABLE_BITS> table_idx,
+                                                      flow_key_t value, ap_uint<1> bank) {
+    mask[bank][table_idx] = value;
 }
+
+template class ToeplitzHash<RULE_TABLES, RULE_TABLE_SIZE, RULE_TABLE_WAYS>;
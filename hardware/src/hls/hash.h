@@ -1,29 +1,121 @@
 #ifndef _HASH_H_
 #define _HASH_H_
 
+#include "meter.h"
+
+/* Rules match on the 5-tuple with 128-bit addresses; IPv4 addresses are widened
+ * to IPv4-mapped IPv6 addresses (::ffff:a.b.c.d). Bytes of an address are in bus
+ * order, so byte i of it is bits [8i+7:8i] and an IPv4 address is bits [127:96]:
+ * [127:0] dest_ip, [143:128] dest_port, [271:144] src_ip, [287:272] src_port,
+ * [295:288] protocol. */
+static const int IP_ADDR_BITS  = 128;
+static const int FLOW_KEY_BITS = 296;
+using ip_addr_t  = ap_uint<IP_ADDR_BITS>;
+using flow_key_t = ap_uint<FLOW_KEY_BITS>;
+
+/* Slots are chosen by hashing a key with both addresses folded to 32 bits (the XOR of
+ * their four words), so a 104-bit Toeplitz hash covers IPv6 keys. The full key is
+ * still stored and compared, folding only makes different keys share candidate
+ * slots: [31:0] dest_ip, [47:32] dest_port, [79:48] src_ip, [95:80] src_port,
+ * [103:96] protocol. */
+static const int HASH_INPUT_BITS = 104;
+using hash_input_t = ap_uint<HASH_INPUT_BITS>;
+
+/* Tuple space search over a few masked tables: every table holds rules that share
+ * one mask (a set of wildcarded fields), a packet key is masked and looked up in all
+ * tables at once, and the matching rule with the highest priority wins.
+ *
+ * Each table is a multi-way cuckoo table: a key may live in one slot of each way,
+ * chosen by a different Toeplitz hash per way, and all ways are probed in parallel.
+ * The host computes the same hashes and does all cuckoo displacement, so the core
+ * only ever writes a given (table, way, index) slot. */
+template<int TABLES, int TABLE_SIZE, int WAYS>
 class ToeplitzHash {
-private:
-    static const int HASH_TABLE_SIZE = 32;
-    /* Number of bits needed to index into the hash table.
-     * This is calculated as the number of bits in HASH_TABLE_SIZE minus
-     * the number of leading zeros in HASH_TABLE_SIZE, minus one.
+public:
+    /* Rules are written into the inactive bank and made visible all at once by
+     * swapping banks, so a packet never sees a partially applied rule set. */
+    static const int NUM_BANKS = 2;
+
+    /* Writing this action clears a slot */
+    static const int ACTION_INVALID = 0xFF;
+
+    /* Forward while the rule's token bucket conforms, drop otherwise */
+    static const int ACTION_RATE_LIMIT = 2;
+
+    /* Forward to the C2H queue of the rule, or to one picked by RSS when the rule's
+     * queue is QUEUE_RSS. A miss leaves the queue at QUEUE_RSS. */
+    static const int ACTION_STEER = 3;
+    static const int QUEUE_RSS = 0xFFFF;
+
+    /* Each slot keeps the full masked key it was programmed with, so a packet only
+     * takes the action of a rule that matches it rather than that of any rule
+     * hashing to the same slot. */
+    struct Entry {
+        ap_uint<1>  valid;
+        flow_key_t  key;
+        ap_uint<8>  action;
+        ap_uint<16> priority;
+        RateMeter::bucket_t bucket; /* for ACTION_RATE_LIMIT */
+        ap_uint<16> queue;          /* for ACTION_STEER */
+    };
+
+    /* Number of bits needed to index into one way of the table.
+     * This is calculated as the number of bits in TABLE_SIZE minus
+     * the number of leading zeros in TABLE_SIZE, minus one.
      * This ensures we have enough bits to cover all indices in the table. */
-    static constexpr int HASH_BITS = sizeof(HASH_TABLE_SIZE) * 8 - 1 -
-                                     __builtin_clz(HASH_TABLE_SIZE);
+    static constexpr int HASH_BITS  = sizeof(TABLE_SIZE) * 8 - 1 - __builtin_clz(TABLE_SIZE);
+    static constexpr int WAY_BITS   = WAYS > 1 ? sizeof(WAYS) * 8 - 1 - __builtin_clz(WAYS) : 1;
+    static constexpr int TABLE_BITS = TABLES > 1 ? sizeof(TABLES) * 8 - 1 - __builtin_clz(TABLES) : 1;
     static constexpr uint32_t HASH_MASK = (1ULL << HASH_BITS) - 1;
 
-    ap_uint<320> toeplitz_key;
-    ap_uint<32> table[HASH_TABLE_SIZE];
+    /* (table, way, index) of a slot, which is also how the host numbers slots */
+    static constexpr int SLOT_BITS = TABLE_BITS + WAY_BITS + HASH_BITS;
+    using slot_t = ap_uint<SLOT_BITS>;
+
+    /* A 104-bit hash input uses a 135-bit stretch of the Toeplitz key, so the 576-bit key
+     * gives each of up to four ways its own hash function */
+    static const int KEY_BITS   = 576;
+    static const int KEY_STRIDE = 136;
+
+private:
+    static_assert((TABLE_SIZE & (TABLE_SIZE - 1)) == 0, "TABLE_SIZE must be a power of two");
+    static_assert((WAYS & (WAYS - 1)) == 0, "WAYS must be a power of two");
+    static_assert((TABLES & (TABLES - 1)) == 0, "TABLES must be a power of two");
+    static_assert(WAYS * KEY_STRIDE <= KEY_BITS, "Not enough Toeplitz key bits for WAYS");
+
+    ap_uint<KEY_BITS> toeplitz_key;
+    Entry table[NUM_BANKS][TABLES][WAYS][TABLE_SIZE];
+    flow_key_t mask[NUM_BANKS][TABLES];
 
     ap_uint<32> get_window(ap_uint<1> bit, int offset) {
         return bit ? toeplitz_key.range(offset + 31, offset) : 0;
     }
-    ap_uint<32> compute_hash(ap_uint<32> ip, ap_uint<16> port);
+    static hash_input_t fold(flow_key_t key);
 
 public:
     ToeplitzHash();
-    ap_uint<32> lookup(ap_uint<32> ip, ap_uint<16> port);
-    void insert(ap_uint<32> ip, ap_uint<16> port, ap_uint<32> value);
+
+    /* Hash of one way; also indexes the rows of the drop sketch */
+    ap_uint<32> compute_hash(flow_key_t key, int way);
+
+    /* Returns the action of the highest priority matching rule (the lowest table on
+     * a tie), or default_action on a miss. hit and slot tell which slot matched, and
+     * bucket and queue are the token bucket and C2H queue of the rule. */
+    ap_uint<8> lookup(flow_key_t key, ap_uint<1> bank, ap_uint<8> default_action,
+                      ap_uint<1> &hit, slot_t &slot, RateMeter::bucket_t &bucket,
+                      ap_uint<16> &queue);
+    void insert(ap_uint<TABLE_BITS> table_idx, ap_uint<WAY_BITS> way,
+                ap_uint<HASH_BITS> index, flow_key_t key, ap_uint<8> action,
+                ap_uint<16> priority, RateMeter::bucket_t bucket, ap_uint<16> queue,
+                ap_uint<1> bank);
+    void set_mask(ap_uint<TABLE_BITS> table_idx, flow_key_t value, ap_uint<1> bank);
 };
 
+/* Table geometry used by the core; each bank holds RULE_TABLES * RULE_TABLE_SIZE *
+ * RULE_TABLE_WAYS rules. Keep software/src/filter_geometry.h in sync. */
+static const int RULE_TABLES     = 4;
+static const int RULE_TABLE_SIZE = 2048;
+static const int RULE_TABLE_WAYS = 4;
+using RuleTable = ToeplitzHash<RULE_TABLES, RULE_TABLE_SIZE, RULE_TABLE_WAYS>;
+
 #endif // _HASH_H_
@@ -0,0 +1,59 @@
+#include <stdint.h>
+#include <ap_int.h>
+#include "meter.h"
+
+template<int BUCKETS>
+TokenBuckets<BUCKETS>::TokenBuckets() {
+    for (int i = 0; i < BUCKETS; i++) {
+        config[i].rate = 0;
+        config[i].burst = 0;
+        config[i].bytes = 0;
+        config[i].gen = 0;
+    }
+}
+
+template<int BUCKETS>
+void TokenBuckets<BUCKETS>::configure(bucket_t bucket, ap_uint<64> rate, ap_uint<32> burst,
+                                      ap_uint<1> bytes) {
+    Config entry = config[bucket];
+    entry.rate = rate;
+    entry.burst = burst;
+    entry.bytes = bytes;
+    entry.gen++;
+    config[bucket] = entry;
+}
+
+template<int BUCKETS>
+bool TokenBuckets<BUCKETS>::conform(bucket_t bucket, ap_uint<16> frame_bytes,
+                                    ap_uint<64> now) {
+    Config entry = config[bucket];
+    State current = state.read(bucket);
+
+    /* Elapsed time is capped at 2^32 cycles (17s at 250MHz), which refills any
+     * bucket whose rate and burst are at least a token per 17s */
+    ap_uint<64> full = ap_uint<64>(entry.burst) << FRAC_BITS;
+    ap_uint<64> tokens = full;
+    if (current.gen == entry.gen) {
+        ap_uint<64> elapsed = now - current.stamp;
+        ap_uint<32> cycles = elapsed.range(63, 32) != 0 ? ap_uint<32>(0xFFFFFFFF) :
+                                                          ap_uint<32>(elapsed.range(31, 0));
+        ap_uint<96> refill = cycles * entry.rate;
+        ap_uint<96> filled = refill + current.tokens;
+        tokens = filled > full ? full : ap_uint<64>(filled.range(63, 0));
+    }
+
+    ap_uint<64> cost = ap_uint<64>(entry.bytes ? frame_bytes : ap_uint<16>(1)) << FRAC_BITS;
+    bool pass = tokens >= cost;
+    if (pass) {
+        tokens -= cost;
+    }
+
+    State next;
+    next.tokens = tokens;
+    next.stamp = now;
+    next.gen = entry.gen;
+    state.write(bucket, next);
+    return pass;
+}
+
+template class TokenBuckets<RATE_BUCKETS>;
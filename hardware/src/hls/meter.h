@@ -0,0 +1,54 @@
+#ifndef _METER_H_
+#define _METER_H_
+
+#include "counters.h"
+
+/* Token buckets for rate limiting rules. Tokens are fixed point with FRAC_BITS
+ * fractional bits, so rates well below one token per cycle can be expressed: a
+ * bucket gains rate tokens per clock cycle up to burst, and a frame passes if the
+ * bucket holds its cost (one token per packet, or one per byte), which is then
+ * taken out. Refilling is done lazily from the cycle of the previous frame. */
+template<int BUCKETS>
+class TokenBuckets {
+public:
+    static constexpr int FRAC_BITS   = 32;
+    static constexpr int BUCKET_BITS = sizeof(BUCKETS) * 8 - 1 - __builtin_clz(BUCKETS);
+    using bucket_t = ap_uint<BUCKET_BITS>;
+
+    struct Config {
+        ap_uint<64> rate;   /* tokens per cycle, FRAC_BITS fractional bits */
+        ap_uint<32> burst;  /* whole tokens */
+        ap_uint<1>  bytes;  /* a token is a byte rather than a packet */
+        ap_uint<8>  gen;    /* bumped on every configure() */
+    };
+
+private:
+    static_assert((BUCKETS & (BUCKETS - 1)) == 0, "BUCKETS must be a power of two");
+
+    /* A bucket whose generation differs from its configuration has been
+     * reconfigured since it was last used and starts out full */
+    struct State {
+        ap_uint<64> tokens;
+        ap_uint<64> stamp;
+        ap_uint<8>  gen;
+    };
+
+    Config config[BUCKETS];
+    ForwardedMemory<State, BUCKETS> state;
+
+public:
+    TokenBuckets();
+
+    void configure(bucket_t bucket, ap_uint<64> rate, ap_uint<32> burst, ap_uint<1> bytes);
+
+    /* Charge a frame of frame_bytes to bucket at cycle now; returns whether it
+     * conforms. A frame that does not conform takes no tokens. */
+    bool conform(bucket_t bucket, ap_uint<16> frame_bytes, ap_uint<64> now);
+};
+
+/* Buckets available to the rules of both banks; a rule refers to one by index.
+ * Keep software/src/filter_geometry.h in sync. */
+static const int RATE_BUCKETS = 1024;
+using RateMeter = TokenBuckets<RATE_BUCKETS>;
+
+#endif // _METER_H_
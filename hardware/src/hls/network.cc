@@ -29,8 +29,8 @@ void EthernetHeader::deserialize(const ap_uint<512> &data, const int phit_idx) {
 void IPv4Header::serialize(ap_uint<512> &data, const int phit_idx) const {
     switch (phit_idx) {
         case 0:
-            data.range(115, 112) = version;
-            data.range(119, 116) = ihl;
+            data.range(119, 116) = version;
+            data.range(115, 112) = ihl;
             data.range(127, 120) = dscp_ecn;
             data.range(143, 128) = total_length;
             data.range(159, 144) = identification;
@@ -50,8 +50,8 @@ void IPv4Header::serialize(ap_uint<512> &data, const int phit_idx) const {
 void IPv4Header::deserialize(const ap_uint<512> &data, const int phit_idx) {
     switch (phit_idx) {
         case 0:
-            version         = data.range(115, 112);
-            ihl             = data.range(119, 116);
+            version         = data.range(119, 116);
+            ihl             = data.range(115, 112);
             dscp_ecn        = data.range(127, 120);
             total_length    = data.range(143, 128);
             identification  = data.range(159, 144);
@@ -68,6 +68,45 @@ void IPv4Header::deserialize(const ap_uint<512> &data, const int phit_idx) {
     }
 }
 
+/* Fields that do not sit on byte boundaries are kept as numbers, the others in bus
+ * byte order like the rest of the headers */
+void IPv6Header::serialize(ap_uint<512> &data, const int phit_idx) const {
+    switch (phit_idx) {
+        case 0:
+            data.range(119, 116) = version;
+            data.range(115, 112) = traffic_class.range(7, 4);
+            data.range(127, 124) = traffic_class.range(3, 0);
+            data.range(123, 120) = flow_label.range(19, 16);
+            data.range(135, 128) = flow_label.range(15, 8);
+            data.range(143, 136) = flow_label.range(7, 0);
+            data.range(159, 144) = payload_length;
+            data.range(167, 160) = next_header;
+            data.range(175, 168) = hop_limit;
+            data.range(303, 176) = src_ip;
+            data.range(431, 304) = dest_ip;
+            break;
+        default:
+            break;
+    }
+}
+
+void IPv6Header::deserialize(const ap_uint<512> &data, const int phit_idx) {
+    switch (phit_idx) {
+        case 0:
+            version        = data.range(119, 116);
+            traffic_class  = (data.range(115, 112), data.range(127, 124));
+            flow_label     = (data.range(123, 120), data.range(135, 128), data.range(143, 136));
+            payload_length = data.range(159, 144);
+            next_header    = data.range(167, 160);
+            hop_limit      = data.range(175, 168);
+            src_ip         = data.range(303, 176);
+            dest_ip        = data.range(431, 304);
+            break;
+        default:
+            break;
+    }
+}
+
 void UDPHeader::serialize(ap_uint<512> &data, const int phit_idx) const {
     switch (phit_idx) {
         case 0:
@@ -94,14 +133,91 @@ void UDPHeader::deserialize(const ap_uint<512> &data, const int phit_idx) {
     }
 }
 
+void TCPHeader::serialize(ap_uint<512> &data, const int phit_idx) const {
+    switch (phit_idx) {
+        case 0:
+            data.range(287, 272) = src_port;
+            data.range(303, 288) = dest_port;
+            data.range(335, 304) = seq_num;
+            data.range(367, 336) = ack_num;
+            data.range(371, 368) = flags.range(11, 8);
+            data.range(375, 372) = data_offset;
+            data.range(383, 376) = flags.range(7, 0);
+            data.range(399, 384) = window;
+            data.range(415, 400) = checksum;
+            data.range(431, 416) = urgent_ptr;
+            break;
+        default:
+            break;
+    }
+}
+
+void TCPHeader::deserialize(const ap_uint<512> &data, const int phit_idx) {
+    switch (phit_idx) {
+        case 0:
+            src_port    = data.range(287, 272);
+            dest_port   = data.range(303, 288);
+            seq_num     = data.range(335, 304);
+            ack_num     = data.range(367, 336);
+            data_offset = data.range(375, 372);
+            flags       = (data.range(371, 368), data.range(383, 376));
+            window      = data.range(399, 384);
+            checksum    = data.range(415, 400);
+            urgent_ptr  = data.range(431, 416);
+            break;
+        default:
+            break;
+    }
+}
+
 void NetworkPacket::serialize(ap_uint<512> &data, const int phit_idx) const {
     eth_hdr.serialize(data, phit_idx);
     ip_hdr.serialize(data, phit_idx);
-    udp_hdr.serialize(data, phit_idx);
+    if (ip_hdr.is_tcp()) {
+        tcp_hdr.serialize(data, phit_idx);
+    } else {
+        udp_hdr.serialize(data, phit_idx);
+    }
 }
 
 void NetworkPacket::deserialize(const ap_uint<512> &data, const int phit_idx) {
     eth_hdr.deserialize(data, phit_idx);
     ip_hdr.deserialize(data, phit_idx);
     udp_hdr.deserialize(data, phit_idx);
+    tcp_hdr.deserialize(data, phit_idx);
+}
+
+void NetworkPacket::parse(const window_t &window) {
+    eth_hdr.deserialize(window.range(511, 0), 0);
+
+    /* A tag is the TPID in eth_type, 2 bytes of tag control information and the next
+     * ethertype. QinQ is an 802.1ad (or a second 802.1Q) tag followed by an 802.1Q one. */
+    vlan_tags = 0;
+    l3_type = eth_hdr.eth_type;
+    if (eth_hdr.is_vlan()) {
+        ap_uint<16> inner_type = window.range(143, 128);
+        vlan_tags = 1;
+        l3_type = inner_type;
+        if (inner_type == __builtin_bswap16(EthernetHeader::VLAN)) {
+            vlan_tags = 2;
+            l3_type = window.range(175, 160);
+        }
+    }
+
+    /* Each tag moves the IP header by 4 bytes */
+    window_t l3 = window >> (32 * vlan_tags);
+    ip_hdr.deserialize(l3.range(511, 0), 0);
+    ip6_hdr.deserialize(l3.range(511, 0), 0);
+
+    /* IPv4 options and the longer IPv6 header move the L4 header by a multiple of
+     * 4 bytes, at most 8 + 40 bytes in all, which keeps the ports in the window */
+    ap_uint<6> l3_extra = 0;
+    if (is_ipv6()) {
+        l3_extra = ip6_hdr.size() - 20;
+    } else if (ip_hdr.ihl >= 5) {
+        l3_extra = (ip_hdr.ihl - 5) * 4;
+    }
+    window_t l4 = window >> (8 * (4 * vlan_tags + l3_extra));
+    udp_hdr.deserialize(l4.range(511, 0), 0);
+    tcp_hdr.deserialize(l4.range(511, 0), 0);
 }
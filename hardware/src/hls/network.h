@@ -8,13 +8,20 @@ struct EthernetHeader {
 
     enum { /* Ethertype values */
         IPV4 = 0x0800,
-        ARP  = 0x0806
+        ARP  = 0x0806,
+        VLAN = 0x8100,  /* 802.1Q tag */
+        QINQ = 0x88A8,  /* 802.1ad outer tag */
+        IPV6 = 0x86DD
     };
 
     void serialize(ap_uint<512> &data, const int phit_idx) const;
     void deserialize(const ap_uint<512> &data, const int phit_idx);
     int size() const { return 14; } // Size in bytes
     bool is_ipv4() const { return eth_type == __builtin_bswap16(IPV4); }
+    bool is_ipv6() const { return eth_type == __builtin_bswap16(IPV6); }
+    bool is_vlan() const {
+        return eth_type == __builtin_bswap16(VLAN) || eth_type == __builtin_bswap16(QINQ);
+    }
 };
 
 struct IPv4Header {
@@ -38,8 +45,28 @@ struct IPv4Header {
 
     void serialize(ap_uint<512> &data, const int phit_idx) const;
     void deserialize(const ap_uint<512> &data, const int phit_idx);
-    int size() const { return 20; } // Size in bytes
+    int size() const { return ihl * 4; } // Size in bytes, including options
     bool is_udp() const { return protocol == UDP; }
+    bool is_tcp() const { return protocol == TCP; }
+};
+
+/* Extension headers are not followed: next_header is taken as the protocol, so only
+ * UDP and TCP directly after the fixed header yield ports */
+struct IPv6Header {
+    ap_uint<4>   version;
+    ap_uint<8>   traffic_class;
+    ap_uint<20>  flow_label;
+    ap_uint<16>  payload_length;
+    ap_uint<8>   next_header;
+    ap_uint<8>   hop_limit;
+    ap_uint<128> src_ip;
+    ap_uint<128> dest_ip;
+
+    void serialize(ap_uint<512> &data, const int phit_idx) const;
+    void deserialize(const ap_uint<512> &data, const int phit_idx);
+    int size() const { return 40; } // Size in bytes, without extension headers
+    bool is_udp() const { return next_header == IPv4Header::UDP; }
+    bool is_tcp() const { return next_header == IPv4Header::TCP; }
 };
 
 struct UDPHeader {
@@ -53,14 +80,55 @@ struct UDPHeader {
     int size() const { return 8; } // Size in bytes
 };
 
+struct TCPHeader {
+    ap_uint<16> src_port;
+    ap_uint<16> dest_port;
+    ap_uint<32> seq_num;
+    ap_uint<32> ack_num;
+    ap_uint<4>  data_offset;
+    ap_uint<12> flags;
+    ap_uint<16> window;
+    ap_uint<16> checksum;
+    ap_uint<16> urgent_ptr;
+
+    void serialize(ap_uint<512> &data, const int phit_idx) const;
+    void deserialize(const ap_uint<512> &data, const int phit_idx);
+    int size() const { return 20; } // Size in bytes, without options
+};
+
+/* Headers of a frame as the serialize/deserialize methods lay them out: an untagged
+ * Ethernet frame, the IP header at byte 14 and the L4 header right after a 20-byte
+ * IPv4 header. Either the UDP or the TCP header follows; both are parsed from the
+ * same bits and the protocol field tells which one is valid.
+ *
+ * parse() finds them at their actual offsets instead: up to two VLAN tags (802.1Q or
+ * QinQ), IPv4 options and IPv6 push the L3 and L4 headers out by up to 70 bytes, so
+ * it looks at the first two phits of the frame and shifts each header back to where
+ * deserialize() expects it. */
 struct NetworkPacket {
+    /* First two phits of a frame, the first one in the low bits */
+    using window_t = ap_uint<1024>;
+
     EthernetHeader eth_hdr;
     IPv4Header     ip_hdr;
+    IPv6Header     ip6_hdr;
     UDPHeader      udp_hdr;
+    TCPHeader      tcp_hdr;
+
+    /* Ethertype after the VLAN tags, in the byte order of EthernetHeader::eth_type */
+    ap_uint<16>    l3_type;
+    ap_uint<2>     vlan_tags;
 
     void serialize(ap_uint<512> &data, const int phit_idx) const;
     void deserialize(const ap_uint<512> &data, const int phit_idx);
+    void parse(const window_t &window);
     int size() const { return eth_hdr.size() + ip_hdr.size() + udp_hdr.size(); }
+
+    /* Valid after parse(); an IPv4 header shorter than 20 bytes is not IPv4 */
+    bool is_ipv4() const {
+        return l3_type == __builtin_bswap16(EthernetHeader::IPV4) && ip_hdr.ihl >= 5;
+    }
+    bool is_ipv6() const { return l3_type == __builtin_bswap16(EthernetHeader::IPV6); }
 };
 
 #endif // _NETWORK_H_
@@ -1,25 +1,52 @@
+#include "packet_filter.h"
 
-#include <stdint.h>
-#include <ap_axi_sdata.h>
-#include <hls_stream.h>
+static_assert(SKETCH_ROWS <= RULE_TABLE_WAYS && SKETCH_WIDTH == RULE_TABLE_SIZE,
+              "The drop sketch is indexed by the way hashes of the rule table");
+static_assert(SKETCH_TOP_K * HEAVY_HITTER_WORDS <= EXPORT_WORDS,
+              "The heavy hitter list must fit one export page");
 
-#include "network.h"
-#include "hash.h"
-
-using axis_250_t = ap_axiu<512, 48, 0, 0>;
-struct statistics_t {
-    uint64_t pkt_in;
-    uint64_t phit_in;
-    uint64_t pkt_forward;
-    uint64_t pkt_drop;
-};
+/* Counters are addressed by (bank, slot) */
+static const int COUNTER_ADDR_BITS = 1 + RuleTable::SLOT_BITS;
+using counter_addr_t = ap_uint<COUNTER_ADDR_BITS>;
 
 void process_packet(hls::stream<axis_250_t> &s_axis,
                     hls::stream<axis_250_t> &m_axis,
                     ap_uint<32> ipv4_addr,
                     ap_uint<16> udp_port,
                     ap_uint<8>  action,
-                    statistics_t &stats);
+                    statistics_t &stats,
+                    ap_uint<32> rule_seq,
+                    ap_uint<32> commit_seq,
+                    ap_uint<32> &rule_ack,
+                    ap_uint<32> &applied_seq,
+                    ap_uint<8>  default_action,
+                    ap_uint<32> rule_index,
+                    ap_uint<8>  rule_way,
+                    ap_uint<32> src_ipv4_addr,
+                    ap_uint<16> src_port,
+                    ap_uint<8>  ip_protocol,
+                    ap_uint<16> rule_priority,
+                    ap_uint<8>  rule_table,
+                    ap_uint<96> ipv6_addr_head,
+                    ap_uint<96> src_ipv6_addr_head,
+                    ap_uint<32> stats_page,
+                    ap_uint<32> stats_seq,
+                    ap_uint<32> &stats_ack,
+                    ap_uint<8>  sketch_epoch,
+                    ap_uint<32> stats_export[EXPORT_WORDS],
+                    ap_uint<32> snapshot_seq,
+                    ap_uint<32> &snapshot_ack,
+                    ap_uint<64> &stats_cycles,
+                    ap_uint<64> &stats_bytes,
+                    ap_uint<16> rule_bucket,
+                    ap_uint<64> bucket_rate,
+                    ap_uint<32> bucket_burst,
+                    ap_uint<8>  bucket_unit,
+                    ap_uint<16> rule_queue,
+                    ap_uint<8>  metadata_enable,
+                    ap_uint<32> mirror_threshold,
+                    ap_uint<16> mirror_queue,
+                    ap_uint<64> &stats_mirrored);
 
 void packet_filter(hls::stream<axis_250_t> &s_axis,
                    hls::stream<axis_250_t> &m_axis,
@@ -27,7 +54,88 @@ void packet_filter(hls::stream<axis_250_t> &s_axis,
                    ap_uint<32> ipv4_addr,
                    ap_uint<16> udp_port,
                    ap_uint<8>  action, // 0: drop, 1: forward
-                   statistics_t &stats
+                   statistics_t &stats,
+
+                   /* Rule programming handshake: the host writes ipv4_addr, udp_port,
+                    * action, rule_index and rule_way, then bumps rule_seq as a doorbell
+                    * and waits for rule_ack to follow. Rules land in the inactive bank
+                    * until commit_seq is bumped, which swaps banks and sets applied_seq.
+                    * Both take effect in the cycle after the doorbell, whatever the
+                    * traffic. */
+                   ap_uint<32> rule_seq,
+                   ap_uint<32> commit_seq,
+                   ap_uint<32> &rule_ack,
+                   ap_uint<32> &applied_seq,
+
+                   /* Action for packets that match no rule, latched with each commit */
+                   ap_uint<8>  default_action,
+
+                   /* Slot a rule is written to; the host chooses it so that keys can be
+                    * moved between ways without the core hashing them */
+                   ap_uint<32> rule_index,
+                   ap_uint<8>  rule_way,
+
+                   /* Remaining fields of a 5-tuple rule; ipv4_addr and udp_port are the
+                    * destination. Wildcarded fields are zero. rule_table selects the
+                    * masked table, and a write with rule_way == MASK_WAY sets the mask
+                    * of that table from the key fields instead of writing a rule. */
+                   ap_uint<32> src_ipv4_addr,
+                   ap_uint<16> src_port,
+                   ap_uint<8>  ip_protocol,
+                   ap_uint<16> rule_priority,
+                   ap_uint<8>  rule_table,
+
+                   /* Bytes 0-11 of IPv6 rule addresses, ipv4_addr and src_ipv4_addr
+                    * hold bytes 12-15. IPv4 rules use ::ffff:0:0 here. */
+                   ap_uint<96> ipv6_addr_head,
+                   ap_uint<96> src_ipv6_addr_head,
+
+                   /* Per-slot counters and the heavy hitters of the drop path are read
+                    * a page at a time: the host selects a page in stats_page, bumps
+                    * stats_seq and reads stats_export once stats_ack follows. Copying
+                    * a page only uses cycles where no frame is counted. Changing
+                    * sketch_epoch restarts the drop sketch. */
+                   ap_uint<32> stats_page,
+                   ap_uint<32> stats_seq,
+                   ap_uint<32> &stats_ack,
+                   ap_uint<8>  sketch_epoch,
+                   ap_uint<32> stats_export[EXPORT_WORDS],
+
+                   /* stats, stats_cycles and stats_bytes only change when the host
+                    * bumps snapshot_seq: all of them are then copied in the same
+                    * cycle and snapshot_ack follows, so they can be read word by
+                    * word without tearing. stats_cycles counts core clock cycles. */
+                   ap_uint<32> snapshot_seq,
+                   ap_uint<32> &snapshot_ack,
+                   ap_uint<64> &stats_cycles,
+                   ap_uint<64> &stats_bytes,
+
+                   /* Token bucket of a rate limiting rule, written along with the rule.
+                    * A write with rule_way == BUCKET_WAY configures bucket rule_bucket
+                    * instead: bucket_rate tokens per cycle with 32 fractional bits, up
+                    * to bucket_burst tokens, a token being a packet (bucket_unit 0) or
+                    * a byte (bucket_unit 1). */
+                   ap_uint<16> rule_bucket,
+                   ap_uint<64> bucket_rate,
+                   ap_uint<32> bucket_burst,
+                   ap_uint<8>  bucket_unit,
+
+                   /* C2H queue of a steering rule, written along with the rule, or
+                    * QUEUE_RSS to pick one by RSS. A write with rule_way == RSS_WAY sets
+                    * entry rule_index of the RSS table to rule_queue instead. */
+                   ap_uint<16> rule_queue,
+
+                   /* Prepend a metadata phit to forwarded frames. It takes one more
+                    * cycle per frame, so short frames no longer keep up with the
+                    * line rate while it is set. */
+                   ap_uint<8>  metadata_enable,
+
+                   /* A dropped frame is mirrored with a probability of
+                    * mirror_threshold / 2^32, zero turning mirroring off. The number
+                    * of copies is latched with the other statistics. */
+                   ap_uint<32> mirror_threshold,
+                   ap_uint<16> mirror_queue,
+                   ap_uint<64> &stats_mirrored
                    ) {
 #pragma HLS INTERFACE axis          port=s_axis
 #pragma HLS INTERFACE axis          port=m_axis
@@ -35,6 +143,38 @@ void packet_filter(hls::stream<axis_250_t> &s_axis,
 #pragma HLS INTERFACE s_axilite     port=udp_port  bundle=cfg
 #pragma HLS INTERFACE s_axilite     port=action    bundle=cfg
 #pragma HLS INTERFACE s_axilite     port=stats     bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=rule_seq    bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=commit_seq  bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=rule_ack    bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=applied_seq bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=default_action bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=rule_index  bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=rule_way    bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=src_ipv4_addr bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=src_port      bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=ip_protocol   bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=rule_priority bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=rule_table    bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=ipv6_addr_head     bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=src_ipv6_addr_head bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=stats_page    bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=stats_seq     bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=stats_ack     bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=sketch_epoch  bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=stats_export  bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=snapshot_seq  bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=snapshot_ack  bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=stats_cycles  bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=stats_bytes   bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=rule_bucket   bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=bucket_rate   bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=bucket_burst  bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=bucket_unit   bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=rule_queue    bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=metadata_enable bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=mirror_threshold bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=mirror_queue     bundle=cfg
+#pragma HLS INTERFACE s_axilite     port=stats_mirrored   bundle=cfg
 #pragma HLS INTERFACE ap_ctrl_none  port=return
 
 #pragma HLS DISAGGREGATE variable=stats
@@ -42,8 +182,46 @@ void packet_filter(hls::stream<axis_250_t> &s_axis,
 #pragma HLS STABLE    variable=udp_port
 #pragma HLS STABLE    variable=action
 #pragma HLS STABLE    variable=stats
+#pragma HLS STABLE    variable=rule_seq
+#pragma HLS STABLE    variable=commit_seq
+#pragma HLS STABLE    variable=rule_ack
+#pragma HLS STABLE    variable=applied_seq
+#pragma HLS STABLE    variable=default_action
+#pragma HLS STABLE    variable=rule_index
+#pragma HLS STABLE    variable=rule_way
+#pragma HLS STABLE    variable=src_ipv4_addr
+#pragma HLS STABLE    variable=src_port
+#pragma HLS STABLE    variable=ip_protocol
+#pragma HLS STABLE    variable=rule_priority
+#pragma HLS STABLE    variable=rule_table
+#pragma HLS STABLE    variable=ipv6_addr_head
+#pragma HLS STABLE    variable=src_ipv6_addr_head
+#pragma HLS STABLE    variable=stats_page
+#pragma HLS STABLE    variable=stats_seq
+#pragma HLS STABLE    variable=stats_ack
+#pragma HLS STABLE    variable=sketch_epoch
+#pragma HLS STABLE    variable=snapshot_seq
+#pragma HLS STABLE    variable=snapshot_ack
+#pragma HLS STABLE    variable=stats_cycles
+#pragma HLS STABLE    variable=stats_bytes
+#pragma HLS STABLE    variable=rule_bucket
+#pragma HLS STABLE    variable=bucket_rate
+#pragma HLS STABLE    variable=bucket_burst
+#pragma HLS STABLE    variable=bucket_unit
+#pragma HLS STABLE    variable=rule_queue
+#pragma HLS STABLE    variable=metadata_enable
+#pragma HLS STABLE    variable=mirror_threshold
+#pragma HLS STABLE    variable=mirror_queue
+#pragma HLS STABLE    variable=stats_mirrored
 
-    process_packet(s_axis, m_axis, ipv4_addr, udp_port, action, stats);
+    process_packet(s_axis, m_axis, ipv4_addr, udp_port, action, stats,
+                   rule_seq, commit_seq, rule_ack, applied_seq, default_action,
+                   rule_index, rule_way, src_ipv4_addr, src_port, ip_protocol,
+                   rule_priority, rule_table, ipv6_addr_head, src_ipv6_addr_head,
+                   stats_page, stats_seq, stats_ack, sketch_epoch, stats_export,
+                   snapshot_seq, snapshot_ack, stats_cycles, stats_bytes,
+                   rule_bucket, bucket_rate, bucket_burst, bucket_unit, rule_queue,
+                   metadata_enable, mirror_threshold, mirror_queue, stats_mirrored);
 }
 
 void process_packet(hls::stream<axis_250_t> &s_axis,
@@ -51,55 +229,405 @@ void process_packet(hls::stream<axis_250_t> &s_axis,
                     ap_uint<32> ipv4_addr,
                     ap_uint<16> udp_port,
                     ap_uint<8>  action,
-                    statistics_t &stats) {
+                    statistics_t &stats,
+                    ap_uint<32> rule_seq,
+                    ap_uint<32> commit_seq,
+                    ap_uint<32> &rule_ack,
+                    ap_uint<32> &applied_seq,
+                    ap_uint<8>  default_action,
+                    ap_uint<32> rule_index,
+                    ap_uint<8>  rule_way,
+                    ap_uint<32> src_ipv4_addr,
+                    ap_uint<16> src_port,
+                    ap_uint<8>  ip_protocol,
+                    ap_uint<16> rule_priority,
+                    ap_uint<8>  rule_table,
+                    ap_uint<96> ipv6_addr_head,
+                    ap_uint<96> src_ipv6_addr_head,
+                    ap_uint<32> stats_page,
+                    ap_uint<32> stats_seq,
+                    ap_uint<32> &stats_ack,
+                    ap_uint<8>  sketch_epoch,
+                    ap_uint<32> stats_export[EXPORT_WORDS],
+                    ap_uint<32> snapshot_seq,
+                    ap_uint<32> &snapshot_ack,
+                    ap_uint<64> &stats_cycles,
+                    ap_uint<64> &stats_bytes,
+                    ap_uint<16> rule_bucket,
+                    ap_uint<64> bucket_rate,
+                    ap_uint<32> bucket_burst,
+                    ap_uint<8>  bucket_unit,
+                    ap_uint<16> rule_queue,
+                    ap_uint<8>  metadata_enable,
+                    ap_uint<32> mirror_threshold,
+                    ap_uint<16> mirror_queue,
+                    ap_uint<64> &stats_mirrored) {
 #pragma HLS pipeline II=1 style=frp
 
-    static ToeplitzHash hash_table;
+    static RuleTable hash_table;
+#pragma HLS ARRAY_PARTITION variable=hash_table.table dim=2 type=complete
+#pragma HLS ARRAY_PARTITION variable=hash_table.table dim=3 type=complete
+#pragma HLS ARRAY_PARTITION variable=hash_table.mask  dim=0 type=complete
+    /* Every (table, way) memory holds both banks: lookups read the active bank on
+     * one port while rule writes go to the inactive bank on the other, so the two
+     * never touch the same entry. A bank only becomes active through a commit, which
+     * the host issues well after the acks of its rule writes. */
+#pragma HLS BIND_STORAGE variable=hash_table.table type=ram_s2p impl=bram
+#pragma HLS DEPENDENCE variable=hash_table.table inter false
+#pragma HLS DEPENDENCE variable=hash_table.table intra false
     static statistics_t local_stats = {0, 0, 0};
+    static ap_uint<64> local_bytes = 0;
+    static ap_uint<64> local_mirrored = 0;
+    static ap_uint<64> cycles = 0;
+    static ap_uint<32> last_snapshot_seq = 0;
 
-    if (s_axis.empty()) {
-        hash_table.insert(ipv4_addr, udp_port, action);
-        stats = local_stats;
-        return;
-    }
+    /* Packets and bytes per (bank, slot), and the destinations dropped the most */
+    static ForwardedMemory<slot_counter_t, (1 << COUNTER_ADDR_BITS)> counters;
+    static DropSketch drop_sketch;
+    static RateMeter meter;
+    static ap_uint<16> rss_table[RSS_TABLE_SIZE];
+
+    static ap_uint<1>  active_bank = 0;
+    static ap_uint<8>  active_default = 0;
+    static ap_uint<32> last_rule_seq = 0;
+    static ap_uint<32> last_commit_seq = 0;
 
     /* Phit: a portion of a packet that fits in the data bus width */
     static int phit_idx = 0;
     static NetworkPacket network;
 
-    axis_250_t incoming_phit;
-    s_axis >> incoming_phit;
+    /* Headers may reach into the second phit of a frame, so phits leave one cycle
+     * after they arrive: the first phit of a frame is held until the second one is
+     * in (or the frame turns out to be a single phit), and the decision made then
+     * applies to every phit of the frame. */
+    static axis_250_t held_phit;
+    static ap_uint<1> held_valid = 0;
+    static ap_uint<1> held_first = 0;
+    static ap_uint<8> pkt_action = 0;
+    static ap_uint<1> pkt_steer = 0;
+    static ap_uint<16> pkt_queue = 0;
+    static ap_uint<64> held_arrival = 0;
+    static ap_uint<32> pkt_hash = 0;
+    static ap_uint<1>  pkt_meta = 0;
+
+    /* Mirroring of the frame being sent, and phits of its copy sent so far */
+    static ap_uint<32> mirror_lfsr = 1;
+    static ap_uint<1>  pkt_mirror = 0;
+    static ap_uint<2>  mirror_sent = 0;
+
+    /* In the cycle a metadata phit is sent, the held phit stays and the phit that came
+     * in is parked here; it is taken as the input of the next cycle instead of
+     * reading s_axis. */
+    static axis_250_t spare_phit;
+    static ap_uint<1>  spare_valid = 0;
+    static ap_uint<64> spare_arrival = 0;
+
+    /* Slot the frame being sent matched, counted when its last phit leaves */
+    static ap_uint<1>  pkt_hit = 0;
+    static counter_addr_t pkt_counter = 0;
+    static ap_uint<64> pkt_bytes = 0;
+    ap_uint<1>  count_frame = 0;
+    ap_uint<64> count_bytes = 0;
+
+    bool has_input = spare_valid || !s_axis.empty();
+    axis_250_t incoming_phit = {};
+    ap_uint<64> arrival = cycles;
+    if (spare_valid) {
+        incoming_phit = spare_phit;
+        arrival = spare_arrival;
+        spare_valid = 0;
+    } else if (has_input) {
+        s_axis >> incoming_phit;
+    }
+
+    /* With no input, a held first phit can only leave if it is the whole frame */
+    if (held_valid && (has_input || !held_first || held_phit.last)) {
+        if (held_first) {
+            ap_uint<512> next_data = held_phit.last ? ap_uint<512>(0) : incoming_phit.data;
+            network.parse((next_data, held_phit.data));
+
+            /* Packet filtering decision is made based on the 5-tuple; ports are zero
+             * for protocols other than UDP and TCP */
+            pkt_action = active_default;
+            flow_key_t key = 0;
+            ap_uint<16> queue = RuleTable::QUEUE_RSS;
+            if (network.is_ipv4() || network.is_ipv6()) {
+                ap_uint<8> protocol;
+                ip_addr_t src_ip;
+                ip_addr_t dest_ip;
+                if (network.is_ipv6()) {
+                    protocol = network.ip6_hdr.next_header;
+                    src_ip   = network.ip6_hdr.src_ip;
+                    dest_ip  = network.ip6_hdr.dest_ip;
+                } else {
+                    protocol = network.ip_hdr.protocol;
+                    src_ip   = (network.ip_hdr.src_ip, ap_uint<16>(0xFFFF), ap_uint<80>(0));
+                    dest_ip  = (network.ip_hdr.dest_ip, ap_uint<16>(0xFFFF), ap_uint<80>(0));
+                }
+                ap_uint<16> sport = 0;
+                ap_uint<16> dport = 0;
+                if (protocol == IPv4Header::UDP) {
+                    sport = network.udp_hdr.src_port;
+                    dport = network.udp_hdr.dest_port;
+                } else if (protocol == IPv4Header::TCP) {
+                    sport = network.tcp_hdr.src_port;
+                    dport = network.tcp_hdr.dest_port;
+                }
+                key = (protocol, sport, src_ip, dport, dest_ip);
+                RuleTable::slot_t slot;
+                RateMeter::bucket_t bucket;
+                pkt_action = hash_table.lookup(key, active_bank, active_default, pkt_hit, slot,
+                                               bucket, queue);
+                pkt_counter = (active_bank, slot);
+
+                /* Rate limited frames are charged by their length at L2, taken from
+                 * the IP header since the rest of the frame has not arrived yet */
+                if (pkt_action == RuleTable::ACTION_RATE_LIMIT) {
+                    ap_uint<16> ip_length = network.is_ipv6() ? network.ip6_hdr.payload_length :
+                                                                network.ip_hdr.total_length;
+                    ap_uint<16> frame_bytes = (ip_length.range(7, 0), ip_length.range(15, 8));
+                    frame_bytes += network.eth_hdr.size() + 4 * network.vlan_tags +
+                                   (network.is_ipv6() ? network.ip6_hdr.size() : 0);
+                    pkt_action = meter.conform(bucket, frame_bytes, cycles) ? 1 : 0;
+                }
+
+                /* Dropped destinations go to the sketch, indexed like the table ways */
+                if (pkt_action != 1 && pkt_action != RuleTable::ACTION_STEER) {
+                    flow_key_t dest_key = (protocol, ap_uint<16>(0), ip_addr_t(0), dport, dest_ip);
+                    DropSketch::index_t index[SKETCH_ROWS];
+                    for (int r = 0; r < SKETCH_ROWS; r++) {
+#pragma HLS unroll
+                        index[r] = hash_table.compute_hash(dest_key, r) & RuleTable::HASH_MASK;
+                    }
+                    drop_sketch.update((protocol, dport, dest_ip), index);
+                }
+            } else {
+                pkt_hit = 0;
+            }
+
+            /* Steered frames are forwarded; frames other than IP hash as a zero key */
+            ap_uint<32> rss_hash = hash_table.compute_hash(key, 0);
+            pkt_steer = pkt_action == RuleTable::ACTION_STEER;
+            if (pkt_steer) {
+                pkt_queue = queue != RuleTable::QUEUE_RSS ? queue :
+                            rss_table[rss_hash & (RSS_TABLE_SIZE - 1)];
+                pkt_action = 1;
+            }
+            pkt_bytes = 0;
+
+            pkt_hash = rss_hash;
+            pkt_meta = metadata_enable != 0 && pkt_action == 1;
+
+            pkt_mirror = 0;
+            mirror_sent = 0;
+            if (pkt_action != 1 && mirror_threshold != 0) {
+                pkt_mirror = mirror_lfsr < mirror_threshold;
+                mirror_lfsr = (mirror_lfsr >> 1) ^ (mirror_lfsr[0] ? MIRROR_LFSR_TAPS : ap_uint<32>(0));
+            }
+        }
+
+        /* The metadata phit of a frame goes out in place of its first phit, which
+         * is then sent in the next cycle as if it were a later one */
+        bool send_meta = held_first && pkt_meta;
 
-    network.deserialize(incoming_phit.data, phit_idx);
+        /* The copy of a mirrored frame ends after MIRROR_PHITS phits */
+        bool send_mirror = pkt_mirror && mirror_sent < MIRROR_PHITS;
+        bool mirror_last = send_mirror && mirror_sent == MIRROR_PHITS - 1;
+
+        if (pkt_action == 1 || send_mirror) { // forward or mirror
+            ap_uint<48> user = held_phit.user;
+            if (pkt_meta) {
+                user.range(15, 0) = user.range(15, 0) + META_BYTES;
+            }
+            if (pkt_mirror) {
+                if (user.range(15, 0) > MIRROR_BYTES) {
+                    user.range(15, 0) = MIRROR_BYTES;
+                }
+                user[STEER_FLAG_BIT] = 1;
+                user.range(STEER_QUEUE_LOW + STEER_QUEUE_BITS - 1, STEER_QUEUE_LOW) =
+                    mirror_queue.range(STEER_QUEUE_BITS - 1, 0);
+                mirror_sent++;
+            } else if (pkt_steer) {
+                user[STEER_FLAG_BIT] = 1;
+                user.range(STEER_QUEUE_LOW + STEER_QUEUE_BITS - 1, STEER_QUEUE_LOW) =
+                    pkt_queue.range(STEER_QUEUE_BITS - 1, 0);
+            }
+            axis_250_t outgoing_phit;
+            if (send_meta) {
+                ap_uint<32> rule_id = 0;
+                if (pkt_hit) {
+                    rule_id = pkt_counter;
+                    rule_id[META_HIT_BIT] = 1;
+                }
+                outgoing_phit.data = 0;
+                outgoing_phit.data.range(127, 0) = (held_arrival, pkt_hash, rule_id);
+                outgoing_phit.keep = -1;
+                outgoing_phit.user = user;
+                outgoing_phit.last = 0;
+            } else {
+                outgoing_phit = {
+                    .data = held_phit.data,
+                    .keep = held_phit.keep,
+                    .user = user,
+                    .last = held_phit.last || mirror_last
+                };
+            }
+            m_axis << outgoing_phit;
+        }
 
-    ap_uint<32> table_action = 0;
-    /* On the first phit, we have completely received network headers and
-     * can make a packet filtering decision */
-    if (network.eth_hdr.is_ipv4() && network.ip_hdr.is_udp()) {
-        /* Packet filtering decision is make based on target network address:
-         * (dest_ip, dest_port) */
-        table_action = hash_table.lookup(network.ip_hdr.dest_ip, network.udp_hdr.dest_port);
+        if (send_meta) {
+            held_first = 0;
+            if (has_input) {
+                spare_phit = incoming_phit;
+                spare_arrival = arrival;
+                spare_valid = 1;
+                has_input = false;
+            }
+        } else {
+            ap_uint<7> phit_bytes = 0;
+            for (int i = 0; i < 64; i++) {
+#pragma HLS unroll
+                phit_bytes += held_phit.keep[i];
+            }
+            pkt_bytes += phit_bytes;
+
+            if (held_phit.last) {
+                count_frame = pkt_hit;
+                count_bytes = pkt_bytes;
+                local_bytes += pkt_bytes;
+                local_stats.pkt_in++;
+                if (pkt_action == 1) {
+                    local_stats.pkt_forward++;
+                } else {
+                    local_stats.pkt_drop++;
+                }
+                if (pkt_mirror) {
+                    local_mirrored++;
+                }
+            }
+            held_valid = 0;
+        }
     }
 
-    if (table_action == 1) { // forward
-        axis_250_t outgoing_phit;
-        outgoing_phit = {
-            .data = incoming_phit.data,
-            .keep = incoming_phit.keep,
-            .user = incoming_phit.user,
-            .last = incoming_phit.last
-        };
-        m_axis << outgoing_phit;
+    if (has_input) {
+        held_phit = incoming_phit;
+        held_valid = 1;
+        held_first = phit_idx == 0;
+        held_arrival = arrival;
+        if (incoming_phit.last) {
+            local_stats.phit_in += (phit_idx + 1);
+        }
+        phit_idx = incoming_phit.last ? 0 : phit_idx + 1;
     }
 
-    phit_idx = incoming_phit.last ? 0 : phit_idx + 1;
-    if (incoming_phit.last) {
-        local_stats.pkt_in++;
-        local_stats.phit_in += (phit_idx + 1);
-        if (table_action == 1) {
-            local_stats.pkt_forward++;
+    /* Control runs in every cycle, next to the datapath. Each doorbell applies the
+     * rule registers exactly once, after the host finished writing all of them. */
+    if (rule_seq != last_rule_seq) {
+        flow_key_t rule_key = (ip_protocol, src_port, src_ipv4_addr, src_ipv6_addr_head,
+                               udp_port, ipv4_addr, ipv6_addr_head);
+        if (rule_way == MASK_WAY) {
+            hash_table.set_mask(rule_table, rule_key, !active_bank);
+        } else if (rule_way == BUCKET_WAY) {
+            meter.configure(rule_bucket, bucket_rate, bucket_burst, bucket_unit[0]);
+        } else if (rule_way == RSS_WAY) {
+            rss_table[rule_index & (RSS_TABLE_SIZE - 1)] = rule_queue;
         } else {
-            local_stats.pkt_drop++;
+            hash_table.insert(rule_table, rule_way, rule_index, rule_key, action,
+                              rule_priority, rule_bucket, rule_queue, !active_bank);
+        }
+        last_rule_seq = rule_seq;
+    }
+    /* A frame takes its action from a single lookup, so swapping banks in any
+     * cycle still applies a rule set to whole frames */
+    if (commit_seq != last_commit_seq) {
+        active_bank = !active_bank;
+        active_default = default_action;
+        last_commit_seq = commit_seq;
+    }
+    if (sketch_epoch != drop_sketch.current_epoch()) {
+        drop_sketch.reset(sketch_epoch);
+    }
+    rule_ack = last_rule_seq;
+    applied_seq = last_commit_seq;
+
+    /* A snapshot includes everything counted in this cycle */
+    if (snapshot_seq != last_snapshot_seq) {
+        stats = local_stats;
+        stats_bytes = local_bytes;
+        stats_mirrored = local_mirrored;
+        stats_cycles = cycles;
+        last_snapshot_seq = snapshot_seq;
+    }
+    snapshot_ack = last_snapshot_seq;
+    cycles++;
+
+    /* Counter page export. The counters take one read and one write per cycle, and
+     * counting a frame has priority: a page slot is only read in a cycle where no
+     * frame ends on a matched rule. */
+    static ap_uint<32> export_seq = 0;
+    static ap_uint<32> exported_seq = 0;
+    static ap_uint<1>  export_active = 0;
+    static ap_uint<32> export_page = 0;
+    static ap_uint<8>  export_word = 0;
+    static slot_counter_t export_counter;
+
+    if (!export_active && stats_seq != export_seq) {
+        export_active = 1;
+        export_page = stats_page;
+        export_word = 0;
+        export_seq = stats_seq;
+    }
+    bool heavy_hitters = export_page.range(15, 0) == HEAVY_HITTER_PAGE;
+    bool export_read = export_active && !heavy_hitters && export_word.range(1, 0) == 0 &&
+                       !count_frame;
+
+    if (count_frame || export_read) {
+        counter_addr_t addr = pkt_counter;
+        if (!count_frame) {
+            ap_uint<RuleTable::SLOT_BITS> slot = export_page.range(15, 0) * EXPORT_SLOTS +
+                                                  export_word / 4;
+            addr = (ap_uint<1>(export_page[16]), slot);
+        }
+        slot_counter_t counter = counters.read(addr);
+        if (count_frame) {
+            counter.packets++;
+            counter.bytes += count_bytes;
+            counters.write(addr, counter);
+        } else {
+            export_counter = counter;
+        }
+    }
+
+    if (export_active && (heavy_hitters || export_word.range(1, 0) != 0 || export_read)) {
+        ap_uint<32> word = 0;
+        if (heavy_hitters) {
+            DropSketch::Candidate candidate = drop_sketch.candidate(export_word / HEAVY_HITTER_WORDS);
+            switch (export_word % HEAVY_HITTER_WORDS) {
+                case 0: word = candidate.key.range(31, 0);    break;
+                case 1: word = candidate.key.range(63, 32);   break;
+                case 2: word = candidate.key.range(95, 64);   break;
+                case 3: word = candidate.key.range(127, 96);  break;
+                case 4: word = candidate.key.range(151, 128); break;
+                case 5: word = candidate.count;               break;
+                case 6: word = candidate.valid;               break;
+                default: break;
+            }
+        } else {
+            switch (export_word.range(1, 0)) {
+                case 0: word = export_counter.packets.range(31, 0);  break;
+                case 1: word = export_counter.packets.range(63, 32); break;
+                case 2: word = export_counter.bytes.range(31, 0);    break;
+                default: word = export_counter.bytes.range(63, 32);  break;
+            }
+        }
+        stats_export[export_word] = word;
+
+        unsigned last_word = heavy_hitters ? SKETCH_TOP_K * HEAVY_HITTER_WORDS - 1 : EXPORT_WORDS - 1;
+        if (export_word == last_word) {
+            export_active = 0;
+            exported_seq = export_seq;
         }
+        export_word++;
     }
+    stats_ack = exported_seq;
 }
@@ -0,0 +1,105 @@
+#ifndef _PACKET_FILTER_H_
+#define _PACKET_FILTER_H_
+
+#include <stdint.h>
+#include <ap_axi_sdata.h>
+#include <hls_stream.h>
+
+#include "network.h"
+#include "hash.h"
+#include "sketch.h"
+
+using axis_250_t = ap_axiu<512, 48, 0, 0>;
+
+/* rule_way values that program a table mask, a token bucket or an RSS table entry
+ * rather than a rule */
+static const int MASK_WAY   = 0xFF;
+static const int BUCKET_WAY = 0xFE;
+static const int RSS_WAY    = 0xFD;
+
+/* RSS indirection table: a frame steered by RSS goes to the queue of entry
+ * hash & (RSS_TABLE_SIZE - 1), the hash being way 0 of the rule table over the full
+ * key, so all frames of a flow share a queue. */
+static const int RSS_TABLE_SIZE = 128;
+
+/* Steered frames carry their C2H queue in tuser_dst (tuser[47:32]): bit 15 marks the
+ * frame as steered and bits [14:4] hold the queue, counted from the first queue of
+ * the function. The low bits of tuser_dst are passed through for the shell. */
+static const int STEER_FLAG_BIT   = 47;
+static const int STEER_QUEUE_LOW  = 36;
+static const int STEER_QUEUE_BITS = 11;
+
+/* With metadata_enable set, every forwarded frame is preceded by one metadata phit,
+ * in bus byte order: [31:0] the (bank, slot) of the matched rule with META_HIT_BIT
+ * set, or zero on a miss, [63:32] the RSS hash of the frame, [127:64] the cycle its
+ * first phit entered the core. The rest is zero. tuser_size (tuser[15:0]) grows by
+ * META_BYTES on every phit of the frame. */
+static const int META_BYTES   = 64;
+static const int META_HIT_BIT = 31;
+
+/* Sampled dropped frames are mirrored to the C2H queue mirror_queue, cut to their
+ * first MIRROR_PHITS phits, which hold every header the core parses. A copy takes
+ * output cycles its own frame leaves idle, so mirroring never stalls the datapath.
+ * Frames are sampled by a 32-bit Galois LFSR stepped once per dropped frame. */
+static const int MIRROR_PHITS = 2;
+static const int MIRROR_BYTES = MIRROR_PHITS * 64;
+static const ap_uint<32> MIRROR_LFSR_TAPS = 0x80200003; /* x^32 + x^22 + x^2 + x + 1 */
+
+/* Counters are exported a page at a time into stats_export: 4 words per slot
+ * (packets then bytes, low word first), or 8 words per heavy hitter candidate
+ * (dest_ip, then (protocol << 16) | dest_port, count and valid) when stats_page is
+ * HEAVY_HITTER_PAGE. Otherwise stats_page is (bank << 16) | page. */
+static const int EXPORT_WORDS      = 128;
+static const int EXPORT_SLOTS      = EXPORT_WORDS / 4;
+static const int HEAVY_HITTER_PAGE = 0xFFFF;
+static const int HEAVY_HITTER_WORDS = 8;
+
+struct statistics_t {
+    uint64_t pkt_in;
+    uint64_t phit_in;
+    uint64_t pkt_forward;
+    uint64_t pkt_drop;
+};
+
+/* Top level of the core, one call per cycle; the ports are described with its
+ * definition in packet_filter.cc */
+void packet_filter(hls::stream<axis_250_t> &s_axis,
+                   hls::stream<axis_250_t> &m_axis,
+                   ap_uint<32> ipv4_addr,
+                   ap_uint<16> udp_port,
+                   ap_uint<8>  action,
+                   statistics_t &stats,
+                   ap_uint<32> rule_seq,
+                   ap_uint<32> commit_seq,
+                   ap_uint<32> &rule_ack,
+                   ap_uint<32> &applied_seq,
+                   ap_uint<8>  default_action,
+                   ap_uint<32> rule_index,
+                   ap_uint<8>  rule_way,
+                   ap_uint<32> src_ipv4_addr,
+                   ap_uint<16> src_port,
+                   ap_uint<8>  ip_protocol,
+                   ap_uint<16> rule_priority,
+                   ap_uint<8>  rule_table,
+                   ap_uint<96> ipv6_addr_head,
+                   ap_uint<96> src_ipv6_addr_head,
+                   ap_uint<32> stats_page,
+                   ap_uint<32> stats_seq,
+                   ap_uint<32> &stats_ack,
+                   ap_uint<8>  sketch_epoch,
+                   ap_uint<32> stats_export[EXPORT_WORDS],
+                   ap_uint<32> snapshot_seq,
+                   ap_uint<32> &snapshot_ack,
+                   ap_uint<64> &stats_cycles,
+                   ap_uint<64> &stats_bytes,
+                   ap_uint<16> rule_bucket,
+                   ap_uint<64> bucket_rate,
+                   ap_uint<32> bucket_burst,
+                   ap_uint<8>  bucket_unit,
+                   ap_uint<16> rule_queue,
+                   ap_uint<8>  metadata_enable,
+                   ap_uint<32> mirror_threshold,
+                   ap_uint<16> mirror_queue,
+                   ap_uint<64> &stats_mirrored);
+
+#endif // _PACKET_FILTER_H_
@@ -0,0 +1,71 @@
+#include <stdint.h>
+#include <ap_int.h>
+#include "sketch.h"
+
+template<int ROWS, int WIDTH, int TOP_K>
+CountMinSketch<ROWS, WIDTH, TOP_K>::CountMinSketch() {
+    epoch = 0;
+    for (int i = 0; i < TOP_K; i++) {
+        top[i].valid = 0;
+        top[i].key = 0;
+        top[i].count = 0;
+    }
+}
+
+template<int ROWS, int WIDTH, int TOP_K>
+void CountMinSketch<ROWS, WIDTH, TOP_K>::update(drop_key_t key, const index_t index[ROWS]) {
+    ap_uint<32> count[ROWS];
+    ap_uint<32> estimate = 0xFFFFFFFF;
+    for (int r = 0; r < ROWS; r++) {
+#pragma HLS unroll
+        ap_uint<40> value = rows[r].read(index[r]);
+        count[r] = value.range(39, 32) == epoch ? ap_uint<32>(value.range(31, 0)) : ap_uint<32>(0);
+        if (count[r] < estimate) {
+            estimate = count[r];
+        }
+    }
+    if (estimate != 0xFFFFFFFF) {
+        estimate++;
+    }
+    for (int r = 0; r < ROWS; r++) {
+#pragma HLS unroll
+        if (count[r] < estimate) {
+            rows[r].write(index[r], (epoch, estimate));
+        }
+    }
+
+    /* Refresh the count of a known candidate, or replace the lightest one (the
+     * lowest on a tie, an empty one counting as zero) if key is now heavier */
+    int match = -1;
+    int victim = 0;
+    ap_uint<32> lightest = top[0].valid ? top[0].count : ap_uint<32>(0);
+    for (int i = 0; i < TOP_K; i++) {
+#pragma HLS unroll
+        ap_uint<32> weight = top[i].valid ? top[i].count : ap_uint<32>(0);
+        if (top[i].valid && top[i].key == key) {
+            match = i;
+        }
+        if (weight < lightest) {
+            lightest = weight;
+            victim = i;
+        }
+    }
+    if (match >= 0) {
+        top[match].count = estimate;
+    } else if (!top[victim].valid || estimate > lightest) {
+        top[victim].valid = 1;
+        top[victim].key = key;
+        top[victim].count = estimate;
+    }
+}
+
+template<int ROWS, int WIDTH, int TOP_K>
+void CountMinSketch<ROWS, WIDTH, TOP_K>::reset(ap_uint<8> new_epoch) {
+    epoch = new_epoch;
+    for (int i = 0; i < TOP_K; i++) {
+#pragma HLS unroll
+        top[i].valid = 0;
+    }
+}
+
+template class CountMinSketch<SKETCH_ROWS, SKETCH_WIDTH, SKETCH_TOP_K>;
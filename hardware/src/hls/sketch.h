@@ -0,0 +1,59 @@
+#ifndef _SKETCH_H_
+#define _SKETCH_H_
+
+#include "counters.h"
+
+/* Destination of a dropped packet: [127:0] dest_ip, [143:128] dest_port,
+ * [151:144] protocol, laid out like the same fields of flow_key_t */
+static const int DROP_KEY_BITS = 152;
+using drop_key_t = ap_uint<DROP_KEY_BITS>;
+
+/* Count-min sketch of dropped packets per destination, with the TOP_K heaviest
+ * destinations seen so far kept as candidates next to it. Counters are updated
+ * conservatively (only those below the new estimate grow), which keeps estimates
+ * closer to the true counts. Rows are indexed by the caller, so the sketch can
+ * share the hashes of the rule table. */
+template<int ROWS, int WIDTH, int TOP_K>
+class CountMinSketch {
+public:
+    static constexpr int INDEX_BITS = sizeof(WIDTH) * 8 - 1 - __builtin_clz(WIDTH);
+    using index_t = ap_uint<INDEX_BITS>;
+
+    struct Candidate {
+        ap_uint<1>  valid;
+        drop_key_t  key;
+        ap_uint<32> count;
+    };
+
+private:
+    static_assert((WIDTH & (WIDTH - 1)) == 0, "WIDTH must be a power of two");
+
+    /* [31:0] count, [39:32] epoch it was last written in. A counter of an older
+     * epoch reads as zero, so a reset does not have to walk the rows. A counter
+     * left untouched for exactly 256 resets comes back, which only inflates
+     * estimates the way a hash collision would. */
+    ForwardedMemory<ap_uint<40>, WIDTH> rows[ROWS];
+    Candidate top[TOP_K];
+    ap_uint<8> epoch;
+
+public:
+    CountMinSketch();
+
+    /* Count one packet to key, which hashes to index[r] in row r */
+    void update(drop_key_t key, const index_t index[ROWS]);
+
+    /* Start counting from zero again */
+    void reset(ap_uint<8> new_epoch);
+    ap_uint<8> current_epoch() const { return epoch; }
+
+    Candidate candidate(int i) const { return top[i]; }
+};
+
+/* Geometry used by the core; rows are indexed by the way hashes of RuleTable.
+ * Keep software/src/packet_filter_model.h in sync. */
+static const int SKETCH_ROWS  = 4;
+static const int SKETCH_WIDTH = 2048;
+static const int SKETCH_TOP_K = 8;
+using DropSketch = CountMinSketch<SKETCH_ROWS, SKETCH_WIDTH, SKETCH_TOP_K>;
+
+#endif // _SKETCH_H_
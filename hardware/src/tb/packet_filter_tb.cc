@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <random>
+
+#include "packet_filter.h"
+
+/* C-simulation testbench of the core: one call of packet_filter() is one cycle.
+ * Returns non-zero when a check fails, as csim_design expects. */
+
+/* Register file of the core as the host programs it */
+struct Registers {
+    ap_uint<32> ipv4_addr = 0;
+    ap_uint<16> udp_port = 0;
+    ap_uint<8>  action = 0;
+    ap_uint<32> rule_seq = 0;
+    ap_uint<32> commit_seq = 0;
+    ap_uint<8>  default_action = 0;
+    ap_uint<32> rule_index = 0;
+    ap_uint<8>  rule_way = 0;
+    ap_uint<32> src_ipv4_addr = 0;
+    ap_uint<16> src_port = 0;
+    ap_uint<8>  ip_protocol = 0;
+    ap_uint<16> rule_priority = 0;
+    ap_uint<8>  rule_table = 0;
+    ap_uint<96> ipv6_addr_head = 0;
+    ap_uint<96> src_ipv6_addr_head = 0;
+    ap_uint<32> stats_page = 0;
+    ap_uint<32> stats_seq = 0;
+    ap_uint<8>  sketch_epoch = 0;
+    ap_uint<32> snapshot_seq = 0;
+    ap_uint<16> rule_bucket = 0;
+    ap_uint<64> bucket_rate = 0;
+    ap_uint<32> bucket_burst = 0;
+    ap_uint<8>  bucket_unit = 0;
+    ap_uint<16> rule_queue = 0;
+    ap_uint<8>  metadata_enable = 0;
+    ap_uint<32> mirror_threshold = 0;
+    ap_uint<16> mirror_queue = 0;
+
+    /* Outputs */
+    statistics_t stats = {};
+    ap_uint<32> rule_ack = 0;
+    ap_uint<32> applied_seq = 0;
+    ap_uint<32> stats_ack = 0;
+    ap_uint<32> stats_export[EXPORT_WORDS] = {};
+    ap_uint<32> snapshot_ack = 0;
+    ap_uint<64> stats_cycles = 0;
+    ap_uint<64> stats_bytes = 0;
+    ap_uint<64> stats_mirrored = 0;
+};
+
+static void cycle(hls::stream<axis_250_t>& s_axis, hls::stream<axis_250_t>& m_axis,
+                  Registers& r) {
+    packet_filter(s_axis, m_axis, r.ipv4_addr, r.udp_port, r.action, r.stats, r.rule_seq,
+                  r.commit_seq, r.rule_ack, r.applied_seq, r.default_action, r.rule_index,
+                  r.rule_way, r.src_ipv4_addr, r.src_port, r.ip_protocol, r.rule_priority,
+                  r.rule_table, r.ipv6_addr_head, r.src_ipv6_addr_head, r.stats_page,
+                  r.stats_seq, r.stats_ack, r.sketch_epoch, r.stats_export, r.snapshot_seq,
+                  r.snapshot_ack, r.stats_cycles, r.stats_bytes, r.rule_bucket, r.bucket_rate,
+                  r.bucket_burst, r.bucket_unit, r.rule_queue, r.metadata_enable,
+                  r.mirror_threshold, r.mirror_queue, r.stats_mirrored);
+}
+
+/* Single-phit 64-byte IPv4/UDP frame to 10.0.0.1:53 */
+static axis_250_t udp_phit() {
+    uint8_t frame[64] = {0};
+    frame[12] = 0x08;   /* IPv4 */
+    frame[14] = 0x45;
+    frame[23] = 17;     /* UDP */
+    frame[30] = 10;     /* 10.0.0.1 */
+    frame[33] = 1;
+    frame[37] = 53;
+    axis_250_t phit = {};
+    for (int i = 0; i < 64; i++) {
+        phit.data.range(8 * i + 7, 8 * i) = frame[i];
+    }
+    phit.keep = ~ap_uint<64>(0);
+    phit.last = 1;
+    return phit;
+}
+
+/* With a phit offered in every cycle (100% load), rule writes and commits must be
+ * acked within MAX_UPDATE_CYCLES of their doorbell, and no input may back up */
+static int test_update_latency() {
+    const int ROUNDS = 2000;
+    const uint64_t MAX_UPDATE_CYCLES = 1;
+
+    hls::stream<axis_250_t> s_axis, m_axis;
+    Registers r;
+    axis_250_t phit = udp_phit();
+    std::mt19937 rng(15);
+
+    uint64_t cycles = 0, max_latency = 0, total_latency = 0, sent = 0, received = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        /* A random rule into the inactive bank, and a commit every tenth round */
+        r.rule_table = rng() % RULE_TABLES;
+        r.rule_way = rng() % RULE_TABLE_WAYS;
+        r.rule_index = rng() % RULE_TABLE_SIZE;
+        r.ipv4_addr = rng();
+        r.udp_port = rng();
+        r.action = 1;
+        bool commit = round % 10 == 9;
+        if (commit) {
+            r.commit_seq++;
+        } else {
+            r.rule_seq++;
+        }
+
+        uint64_t latency = 0;
+        do {
+            s_axis.write(phit);
+            sent++;
+            cycle(s_axis, m_axis, r);
+            cycles++;
+            latency++;
+            while (!m_axis.empty()) {
+                m_axis.read();
+                received++;
+            }
+            if (latency > 100000) {
+                printf("FAIL: %s %d not acked after %lu cycles\n", commit ? "commit" : "rule write",
+                       round, latency);
+                return 1;
+            }
+        } while (commit ? r.applied_seq != r.commit_seq : r.rule_ack != r.rule_seq);
+        max_latency = std::max(max_latency, latency);
+        total_latency += latency;
+
+        /* Traffic between updates */
+        for (int i = rng() % 8; i > 0; i--) {
+            s_axis.write(phit);
+            sent++;
+            cycle(s_axis, m_axis, r);
+            cycles++;
+        }
+    }
+
+    printf("update latency at 100%% load: %d updates over %lu cycles, max %lu, mean %.2f "
+           "cycles, %lu phits left in the input\n", ROUNDS, cycles, max_latency,
+           static_cast<double>(total_latency) / ROUNDS, static_cast<uint64_t>(s_axis.size()));
+    if (max_latency > MAX_UPDATE_CYCLES || s_axis.size() > 1) {
+        printf("FAIL: updates must be acked within %lu cycles without input backing up\n",
+               MAX_UPDATE_CYCLES);
+        return 1;
+    }
+    return 0;
+}
+
+int main() {
+    int failed = 0;
+    failed += test_update_latency();
+    printf(failed ? "FAIL\n" : "PASS\n");
+    return failed;
+}
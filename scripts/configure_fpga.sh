@@ -38,7 +38,7 @@ sudo setpci -s $DEVICE_BDF0 COMMAND=0x02;
 sudo setpci -s $DEVICE_BDF1 COMMAND=0x02;
 
 FUNC_0_BASE=0
-FUNC_0_NUM=$QUEUE_NUM
+FUNC_0_NUM=$NUM_QUEUES
 FUNC_0_VALUE=$(( FUNC_0_BASE << 16 | FUNC_0_NUM ))
 FUNC_1_BASE=$FUNC_0_NUM
 FUNC_1_NUM=1
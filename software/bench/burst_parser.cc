@@ -0,0 +1,157 @@
+#include <unistd.h>
+#include <random>
+
+#include "deps.h"
+#include "burst_parser.h"
+#include "../tests/frames.h"
+
+/* Cycles per packet to parse the IPv4/UDP headers of received bursts, e.g.
+ *   ./build/bin/bench_burst_parser -n 65536
+ * Compares the per-packet parse of the former handler with BurstParser, over bursts
+ * of 32 UDP packets whose fields are all read afterwards. Warm parses 1024 frames whose headers stay in cache; cold
+ * parses -n frames 2 KB apart in shuffled order, like the mbufs of a large pool,
+ * with their headers and mbufs flushed from the caches before every run. Each
+ * figure is the best of several runs. */
+
+struct Arguments {
+    uint32_t cold_frames = 16384;
+
+    void parse_args(int argc, const char** argv);
+};
+
+static constexpr uint16_t BURST       = ParsedBurst::MAX_PACKETS;
+static constexpr size_t MBUF_STRIDE   = 2048;
+static constexpr size_t HEADROOM      = 128;
+static constexpr uint32_t RUNS        = 15;
+
+/* UDP frames at stride bytes from each other in shuffled order */
+struct Frames {
+    std::vector<uint8_t> memory;
+    std::vector<rte_mbuf> storage;
+    std::vector<rte_mbuf*> mbufs;
+
+    Frames(uint32_t count, size_t stride, std::mt19937& rng)
+        : memory(count * stride), storage(count), mbufs(count) {
+        std::vector<uint32_t> order(count);
+        for (uint32_t i = 0; i < count; i++) {
+            order[i] = i;
+        }
+        std::shuffle(order.begin(), order.end(), rng);
+        for (uint32_t i = 0; i < count; i++) {
+            uint16_t src_port = static_cast<uint16_t>(rng());
+            uint16_t dst_port = static_cast<uint16_t>(rng());
+            std::vector<uint8_t> frame = ipv4_frame(udp_key(rng(), src_port, rng(), dst_port),
+                                                    64 + rng() % (stride - HEADROOM - 64));
+            uint8_t* data = &memory[order[i] * stride + HEADROOM];
+            memcpy(data, frame.data(), frame.size());
+            storage[i].buf_addr = data;
+            storage[i].data_off = 0;
+            storage[i].data_len = static_cast<uint16_t>(frame.size());
+            storage[i].pkt_len = static_cast<uint32_t>(frame.size());
+            mbufs[i] = &storage[i];
+        }
+    }
+
+    void flush() const {
+        for (const rte_mbuf& mbuf : storage) {
+            _mm_clflush(&mbuf);
+            _mm_clflush(mbuf.buf_addr);
+            _mm_clflush(static_cast<uint8_t*>(mbuf.buf_addr) + 64);
+        }
+        _mm_mfence();
+    }
+};
+
+/* The header parse of the handler before BurstParser, one packet at a time */
+static bool parse_packet(rte_mbuf* mbuf, uint64_t& sum) {
+    auto* eth_hdr = rte_pktmbuf_mtod(mbuf, rte_ether_hdr*);
+    if (rte_be_to_cpu_16(eth_hdr->ether_type) != RTE_ETHER_TYPE_IPV4) {
+        return false;
+    }
+    auto* ip_hdr = reinterpret_cast<rte_ipv4_hdr*>(eth_hdr + 1);
+    if (ip_hdr->next_proto_id != IPPROTO_UDP) {
+        return false;
+    }
+    auto* udp_hdr = reinterpret_cast<rte_udp_hdr*>(ip_hdr + 1);
+    size_t dgram_len = rte_be_to_cpu_16(udp_hdr->dgram_len);
+    size_t l4 = sizeof(rte_ether_hdr) + sizeof(rte_ipv4_hdr);
+    if (l4 + dgram_len > rte_pktmbuf_pkt_len(mbuf)) {
+        return false;
+    }
+    sum += rte_be_to_cpu_32(ip_hdr->src_addr) ^ rte_be_to_cpu_32(ip_hdr->dst_addr) ^
+           rte_be_to_cpu_16(udp_hdr->src_port) ^ rte_be_to_cpu_16(udp_hdr->dst_port) ^
+           dgram_len;
+    return true;
+}
+
+/* Best cycles per packet of RUNS runs of parse over every frame, rounds times each */
+template<typename Parse>
+static double best_of(const Frames& frames, uint32_t rounds, bool cold, Parse parse) {
+    double best = 1e18;
+    for (uint32_t run = 0; run < RUNS; run++) {
+        if (cold) {
+            frames.flush();
+        }
+        uint64_t start = rte_rdtsc();
+        for (uint32_t round = 0; round < rounds; round++) {
+            parse();
+        }
+        best = std::min(best, static_cast<double>(rte_rdtsc() - start) /
+                              (static_cast<double>(rounds) * frames.mbufs.size()));
+    }
+    return best;
+}
+
+static void run(const char* name, Frames& frames, uint32_t rounds, bool cold) {
+    uint64_t sum = 0;
+    double per_packet = best_of(frames, rounds, cold, [&frames, &sum] {
+        for (rte_mbuf* mbuf : frames.mbufs) {
+            parse_packet(mbuf, sum);
+        }
+    });
+    printf("%-5s per packet %6.1f", name, per_packet);
+
+    ParsedBurst burst;
+    double per_burst = best_of(frames, rounds, cold, [&frames, &sum, &burst] {
+        for (size_t i = 0; i + BURST <= frames.mbufs.size(); i += BURST) {
+            BurstParser::parse(&frames.mbufs[i], BURST, burst);
+            for (uint32_t udp = burst.udp; udp != 0; udp &= udp - 1) {
+                int j = __builtin_ctz(udp);
+                sum += burst.src_ip[j] ^ burst.dst_ip[j] ^ burst.src_port[j] ^
+                       burst.dst_port[j] ^ burst.payload_len[j];
+            }
+        }
+    });
+    printf(", per burst %6.1f cycles/packet (%lu)\n", per_burst, sum & 1);
+}
+
+int main(int argc, const char** argv) {
+    Arguments args;
+    args.parse_args(argc, argv);
+
+    std::mt19937 rng(22);
+    Frames warm(1024, 256, rng);
+    run("warm", warm, 200, false);
+    Frames cold(args.cold_frames, MBUF_STRIDE, rng);
+    run("cold", cold, 1, true);
+    return 0;
+}
+
+void Arguments::parse_args(int argc, const char** argv) {
+    int c;
+    while ((c = getopt(argc, const_cast<char**>(argv), "n:")) != -1) {
+        switch (c) {
+            case 'n':
+                this->cold_frames = static_cast<uint32_t>(std::stoul(optarg));
+                break;
+
+            case '?':
+            default:
+                log_info("Usage: %s [-n <cold_frames>]", argv[0]);
+                log_fatal("Unknown option: %c", c);
+        }
+    }
+    if (this->cold_frames < BURST) {
+        log_fatal("At least %u cold frames are needed", BURST);
+    }
+}
@@ -0,0 +1,160 @@
+#include <unistd.h>
+#include <rte_cycles.h>
+
+#include "deps.h"
+
+/* Cycles a packet handler spends on log lines that are not printed, e.g.
+ *   ./build/bin/bench_log_levels -n 1000000
+ * The handler logs the addresses, ports and payload of every packet at debug level
+ * while the runtime level is INFO:
+ *   eager     the strings are built first and Log::debug() checks the level, as the
+ *             log macros did before
+ *   runtime   log_debug() with DEBUG compiled in: only the level is checked
+ *   compiled  log_debug() with LOG_COMPILE_LEVEL at INFO: nothing is left
+ *   none      the handler without the log lines */
+
+struct Arguments {
+    uint32_t packets = 1000000;
+
+    void parse_args(int argc, const char** argv);
+};
+
+struct Packet {
+    uint8_t src_mac[6];
+    uint8_t dst_mac[6];
+    uint32_t src_ip;
+    uint32_t dst_ip;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint8_t payload[32];
+};
+
+static std::string mac_str(const uint8_t* mac) {
+    char str[18];
+    snprintf(str, sizeof(str), "%02hhx:%02hhx:%02hhx:%02hhx:%02hhx:%02hhx",
+             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    return str;
+}
+
+static std::string ip_str(uint32_t ip) {
+    char str[16];
+    snprintf(str, sizeof(str), "%u.%u.%u.%u", ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff,
+             ip & 0xff);
+    return str;
+}
+
+static std::string hex_str(const uint8_t* data, size_t len) {
+    std::string str;
+    for (size_t i = 0; i < len; i++) {
+        char byte[3];
+        snprintf(byte, sizeof(byte), "%02x", data[i]);
+        str += byte;
+    }
+    return str;
+}
+
+static volatile uint32_t port_sink;
+
+__attribute__((noinline)) static void handle_eager(const Packet& pkt) {
+    port_sink = pkt.dst_port;
+    Log::debug(__LINE__, __FILENAME__, "  ether_hdr: src=%s, dst=%s",
+               mac_str(pkt.src_mac).c_str(), mac_str(pkt.dst_mac).c_str());
+    Log::debug(__LINE__, __FILENAME__, "  ipv4_hdr: src=%s, dst=%s",
+               ip_str(pkt.src_ip).c_str(), ip_str(pkt.dst_ip).c_str());
+    Log::debug(__LINE__, __FILENAME__, "  udp_hdr: src_port=%d, dst_port=%d",
+               pkt.src_port, pkt.dst_port);
+    Log::debug(__LINE__, __FILENAME__, "  udp_payload: %s",
+               hex_str(pkt.payload, sizeof(pkt.payload)).c_str());
+}
+
+/* log_debug() reads LOG_COMPILE_LEVEL where it is expanded */
+#undef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL 4
+
+__attribute__((noinline)) static void handle_runtime(const Packet& pkt) {
+    port_sink = pkt.dst_port;
+    log_debug("  ether_hdr: src=%s, dst=%s",
+              mac_str(pkt.src_mac).c_str(), mac_str(pkt.dst_mac).c_str());
+    log_debug("  ipv4_hdr: src=%s, dst=%s", ip_str(pkt.src_ip).c_str(), ip_str(pkt.dst_ip).c_str());
+    log_debug("  udp_hdr: src_port=%d, dst_port=%d", pkt.src_port, pkt.dst_port);
+    log_debug("  udp_payload: %s", hex_str(pkt.payload, sizeof(pkt.payload)).c_str());
+}
+
+#undef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL 3
+
+__attribute__((noinline)) static void handle_compiled(const Packet& pkt) {
+    port_sink = pkt.dst_port;
+    log_debug("  ether_hdr: src=%s, dst=%s",
+              mac_str(pkt.src_mac).c_str(), mac_str(pkt.dst_mac).c_str());
+    log_debug("  ipv4_hdr: src=%s, dst=%s", ip_str(pkt.src_ip).c_str(), ip_str(pkt.dst_ip).c_str());
+    log_debug("  udp_hdr: src_port=%d, dst_port=%d", pkt.src_port, pkt.dst_port);
+    log_debug("  udp_payload: %s", hex_str(pkt.payload, sizeof(pkt.payload)).c_str());
+}
+
+__attribute__((noinline)) static void handle_none(const Packet& pkt) {
+    port_sink = pkt.dst_port;
+}
+
+static double cycles_per_packet(void (*handler)(const Packet&), const std::vector<Packet>& pkts,
+                                uint32_t packets) {
+    uint64_t start = rte_rdtsc();
+    for (uint32_t i = 0; i < packets; i++) {
+        handler(pkts[i % pkts.size()]);
+    }
+    return static_cast<double>(rte_rdtsc() - start) / packets;
+}
+
+int main(int argc, const char** argv) {
+    Arguments args;
+    args.parse_args(argc, argv);
+    Log::set_log_level(Log::INFO);
+
+    std::vector<Packet> pkts(256);
+    for (size_t i = 0; i < pkts.size(); i++) {
+        Packet& pkt = pkts[i];
+        for (uint8_t b = 0; b < 6; b++) {
+            pkt.src_mac[b] = static_cast<uint8_t>(i + b);
+            pkt.dst_mac[b] = static_cast<uint8_t>(i * 7 + b);
+        }
+        pkt.src_ip = 0x0a000000 | static_cast<uint32_t>(i);
+        pkt.dst_ip = 0xc0a80201;
+        pkt.src_port = static_cast<uint16_t>(1024 + i);
+        pkt.dst_port = 8500;
+        memset(pkt.payload, static_cast<int>(i), sizeof(pkt.payload));
+    }
+
+    std::pair<const char*, void (*)(const Packet&)> handlers[] = {
+        {"eager", handle_eager}, {"runtime", handle_runtime},
+        {"compiled", handle_compiled}, {"none", handle_none}};
+    for (auto& [name, handler] : handlers) {
+        /* Once to warm up, then the best of three */
+        cycles_per_packet(handler, pkts, args.packets / 10 + 1);
+        double best = 0;
+        for (int run = 0; run < 3; run++) {
+            double cycles = cycles_per_packet(handler, pkts, args.packets);
+            best = run == 0 ? cycles : std::min(best, cycles);
+        }
+        printf("%-8s %8.1f cycles/packet\n", name, best);
+    }
+    return 0;
+}
+
+void Arguments::parse_args(int argc, const char** argv) {
+    int c;
+    while ((c = getopt(argc, const_cast<char**>(argv), "n:")) != -1) {
+        switch (c) {
+            case 'n':
+                this->packets = static_cast<uint32_t>(std::stoul(optarg));
+                break;
+
+            case '?':
+            default:
+                log_info("Usage: %s [-n <packets>]", argv[0]);
+                log_fatal("Unknown option: %c", c);
+        }
+    }
+    if (this->packets == 0) {
+        log_fatal("At least one packet is needed");
+    }
+}
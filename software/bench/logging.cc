@@ -0,0 +1,116 @@
+#include <unistd.h>
+#include <rte_cycles.h>
+
+#include "deps.h"
+
+/* Cycles a log call costs the thread making it, e.g.
+ *   ./build/bin/bench_logging -n 200
+ * for a line with three integers and one with a string, written synchronously to
+ * /dev/null, pushed to the asynchronous ring while it has room, and dropped because
+ * the ring is full. Calls are timed in rounds of BATCH, short enough for the ring
+ * to take a whole round, and the consumer gets to empty it between rounds. */
+
+static const uint32_t BATCH = 512;
+
+struct Arguments {
+    uint32_t rounds = 200;
+
+    void parse_args(int argc, const char** argv);
+};
+
+enum class Line { INTEGERS, STRING };
+
+/* Mean cycles per call of each round */
+static std::vector<double> time_rounds(uint32_t rounds, Line line, bool settle) {
+    static const char* names[] = {"eth0", "eth1", "eth2", "eth3"};
+    std::vector<double> means;
+    for (uint32_t round = 0; round < rounds; round++) {
+        uint64_t start = rte_rdtsc();
+        for (uint32_t i = 0; i < BATCH; i++) {
+            if (line == Line::INTEGERS) {
+                log_info("Received %u packets on thread_id: %u, queue %u", i, round, 3u);
+            } else {
+                log_info("Port %s is up", names[i & 3]);
+            }
+        }
+        means.push_back(static_cast<double>(rte_rdtsc() - start) / BATCH);
+        if (settle) {
+            usleep(2000);
+        }
+    }
+    std::sort(means.begin(), means.end());
+    return means;
+}
+
+static void report(const char* name, Line line, const std::vector<double>& means) {
+    printf("%-6s %-8s median %6.1f, p90 %6.1f cycles/call\n", name,
+           line == Line::INTEGERS ? "integers" : "string",
+           means[means.size() / 2], means[means.size() * 9 / 10]);
+}
+
+int main(int argc, const char** argv) {
+    Arguments args;
+    args.parse_args(argc, argv);
+
+    FILE* null = fopen("/dev/null", "w");
+    log_assert(null != nullptr, "Cannot open /dev/null");
+    Log::set_log_file(null);
+
+    for (Line line : {Line::INTEGERS, Line::STRING}) {
+        report("sync", line, time_rounds(args.rounds, line, false));
+    }
+
+    Log::start_async();
+    for (Line line : {Line::INTEGERS, Line::STRING}) {
+        report("async", line, time_rounds(args.rounds, line, true));
+    }
+    Log::stop_async();
+
+    /* The consumer blocks writing to a pipe nobody reads, so every call drops */
+    int fds[2];
+    log_assert(pipe(fds) == 0, "Cannot create a pipe: %s", strerror(errno));
+    FILE* stalled = fdopen(fds[1], "w");
+    Log::set_log_file(stalled);
+    Log::start_async();
+    time_rounds(256, Line::INTEGERS, false);
+    std::vector<double> dropped[2];
+    for (Line line : {Line::INTEGERS, Line::STRING}) {
+        dropped[static_cast<int>(line)] = time_rounds(args.rounds, line, false);
+    }
+
+    std::thread reader([fd = fds[0]]() {
+        char buf[65536];
+        while (read(fd, buf, sizeof(buf)) > 0) {
+        }
+    });
+    Log::stop_async();
+    Log::set_log_file(stdout);
+    fclose(stalled);
+    reader.join();
+    close(fds[0]);
+    fclose(null);
+
+    for (Line line : {Line::INTEGERS, Line::STRING}) {
+        report("drop", line, dropped[static_cast<int>(line)]);
+    }
+    return 0;
+}
+
+void Arguments::parse_args(int argc, const char** argv) {
+    int c;
+    while ((c = getopt(argc, const_cast<char**>(argv), "n:")) != -1) {
+        switch (c) {
+            case 'n':
+                this->rounds = static_cast<uint32_t>(std::stoul(optarg));
+                break;
+
+            case '?':
+            default:
+                log_info("Usage: %s [-n <rounds>]", argv[0]);
+                log_fatal("Unknown option: %c", c);
+        }
+    }
+    if (this->rounds == 0) {
+        log_fatal("At least one round is needed");
+    }
+}
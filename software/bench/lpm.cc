@@ -0,0 +1,154 @@
+#include <unistd.h>
+#include <chrono>
+#include <random>
+#include <set>
+#include <unordered_map>
+
+#include "deps.h"
+#include "packet_filter.h"
+#include "packet_filter_model.h"
+#include "mmio_backend.h"
+#include "rule_compiler.h"
+#include "../tests/frames.h"
+
+/* CIDR rules on a prefix table shaped like a BGP table, e.g.
+ *   ./build/bin/bench_lpm -n 10000 -l 1000000
+ * The prefixes are compiled into the masked tables of the software model of the
+ * core, then destinations inside and outside of them are looked up both in the
+ * model and in a reference longest prefix match with one hash map per length. The
+ * verdicts of the two must agree unless a table entry collided. The core takes one
+ * lookup per cycle whatever the table holds; the model computes every hash bit by
+ * bit, so its rate is that of the simulation. */
+
+struct Arguments {
+    uint32_t prefixes = 10000;
+    uint32_t lookups = 1000000;
+
+    void parse_args(int argc, const char** argv);
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static uint32_t length_mask(int len) {
+    return len == 0 ? 0 : UINT32_MAX << (32 - len);
+}
+
+int main(int argc, const char** argv) {
+    Arguments args;
+    args.parse_args(argc, argv);
+
+    /* Share of each prefix length in thousandths, roughly that of a BGP table */
+    const std::pair<int, uint32_t> mix[] = {{16, 40}, {18, 30}, {19, 30}, {20, 60},
+                                            {21, 50}, {22, 120}, {23, 100}, {24, 570}};
+    std::mt19937 rng(11);
+    std::vector<std::pair<uint32_t, int>> prefixes;
+    std::set<std::pair<uint32_t, int>> unique;
+    PacketFilter::RuleSet rules;
+    for (const auto& [len, share] : mix) {
+        uint32_t count = std::max<uint32_t>(args.prefixes * share / 1000, 1);
+        while (count > 0) {
+            uint32_t addr = rng() & length_mask(len);
+            if (!unique.emplace(addr, len).second) {
+                continue;
+            }
+            count--;
+            char rule[64];
+            snprintf(rule, sizeof(rule), "udp:*:*:%u.%u.%u.%u/%d:*", addr >> 24,
+                     (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff, len);
+            prefixes.emplace_back(addr, len);
+            rules.push_back(PacketFilter::parse_rule(rule, rng() & 1 ?
+                PacketFilter::RULE_ACTION_FORWARD : PacketFilter::RULE_ACTION_DROP));
+        }
+    }
+
+    /* Reference: the action of each prefix in a map per length */
+    std::map<int, std::unordered_map<uint32_t, bool>, std::greater<int>> reference;
+    for (size_t i = 0; i < prefixes.size(); i++) {
+        reference[prefixes[i].second][prefixes[i].first] =
+            rules[i].action == PacketFilter::RULE_ACTION_FORWARD;
+    }
+    auto lookup = [&reference](uint32_t addr) {
+        for (const auto& [len, table] : reference) {
+            auto it = table.find(addr & length_mask(len));
+            if (it != table.end()) {
+                return it->second;
+            }
+        }
+        return false;
+    };
+
+    auto backend = std::make_shared<SimBackend>();
+    MMIO::set_backend(backend);
+    PacketFilterModel& model = backend->filter_model();
+    PacketFilter filter;
+    filter.set_collision_policy(PacketFilter::COLLISION_WARN);
+    /* Without a line for each prefix that does not fit */
+    Log::set_log_level(Log::ERROR);
+    auto start = std::chrono::steady_clock::now();
+    log_assert(filter.commit(rules), "Commit failed");
+    double commit_secs = seconds_since(start);
+    Log::set_log_level(Log::INFO);
+
+    RuleCompiler compiler;
+    RuleCompiler::Placement placement = compiler.place(rules);
+    printf("commit %lu prefixes in %.1f ms: %lu table entries, %lu collisions\n",
+           prefixes.size(), commit_secs * 1e3, placement.entries, placement.conflicts.size());
+
+    /* Half the destinations inside a prefix, half anywhere */
+    std::vector<uint32_t> addrs(args.lookups);
+    std::vector<std::vector<uint8_t>> frames;
+    for (uint32_t i = 0; i < args.lookups; i++) {
+        const auto& [prefix, len] = prefixes[rng() % prefixes.size()];
+        addrs[i] = i & 1 ? rng() : prefix | (rng() & ~length_mask(len));
+    }
+    std::vector<uint8_t> frame = ipv4_frame(udp_key(0x0a640001, 1234, 0, 5000));
+    auto* ip_hdr = reinterpret_cast<rte_ipv4_hdr*>(frame.data() + sizeof(rte_ether_hdr));
+
+    std::vector<bool> verdicts(args.lookups);
+    start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < args.lookups; i++) {
+        ip_hdr->dst_addr = rte_cpu_to_be_32(addrs[i]);
+        verdicts[i] = model.process(frame.data(), frame.size(), frame.size());
+    }
+    double model_secs = seconds_since(start);
+
+    uint32_t mismatches = 0, forwarded = 0;
+    start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < args.lookups; i++) {
+        bool forward = lookup(addrs[i]);
+        mismatches += forward != verdicts[i];
+        forwarded += forward;
+    }
+    double reference_secs = seconds_since(start);
+
+    printf("lookup model %.2f M/s, reference %.2f M/s\n", args.lookups / model_secs / 1e6,
+           args.lookups / reference_secs / 1e6);
+    printf("verdicts %u of %u forwarded, %u differ from the reference\n", forwarded,
+           args.lookups, mismatches);
+    return 0;
+}
+
+void Arguments::parse_args(int argc, const char** argv) {
+    int c;
+    while ((c = getopt(argc, const_cast<char**>(argv), "n:l:")) != -1) {
+        switch (c) {
+            case 'n':
+                this->prefixes = static_cast<uint32_t>(std::stoul(optarg));
+                break;
+
+            case 'l':
+                this->lookups = static_cast<uint32_t>(std::stoul(optarg));
+                break;
+
+            case '?':
+            default:
+                log_info("Usage: %s [-n <prefixes>] [-l <lookups>]", argv[0]);
+                log_fatal("Unknown option: %c", c);
+        }
+    }
+    if (this->prefixes == 0 || this->lookups == 0) {
+        log_fatal("At least one prefix and one lookup are needed");
+    }
+}
@@ -0,0 +1,132 @@
+#include <unistd.h>
+#include <chrono>
+#include <random>
+
+#include "deps.h"
+#include "rule_compiler.h"
+
+/* Cost of checking a rule set before it is programmed, e.g.
+ *   ./build/bin/bench_rule_compiler -n 100000
+ * The per-way hash of the table-driven compiler against the bit-serial hash of the
+ * model, and place() on a set of random rules over NUM_TABLES masks, which finds the
+ * slot of every rule and reports those that collide. Then the load the cuckoo
+ * tables reach and the insert rate at 1k, 16k and 64k rules, and the most rules of
+ * one mask, which spill from table to table, before the first collision. */
+
+struct Arguments {
+    uint32_t rules = 100000;
+
+    void parse_args(int argc, const char** argv);
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static PacketFilter::RuleSet random_rules(std::mt19937& rng, uint32_t count) {
+    const char* templates[] = {"udp:*:*:10.0.0.1:80", "udp:*:*:10.0.0.1:*",
+                               "udp:10.0.0.1:*:10.0.0.1:80", "udp:10.0.0.1:80:10.0.0.1:80"};
+    static_assert(sizeof(templates) / sizeof(templates[0]) == RuleCompiler::NUM_TABLES,
+                  "One mask per table");
+    PacketFilter::RuleSet rules;
+    for (uint32_t i = 0; i < count; i++) {
+        PacketFilter::Rule rule = PacketFilter::parse_rule(templates[i % RuleCompiler::NUM_TABLES],
+                                                           PacketFilter::RULE_ACTION_FORWARD);
+        rule.match.src_ip = PacketFilter::IPAddress::from_ipv4(rng()) & rule.mask.src_ip;
+        rule.match.dst_ip = PacketFilter::IPAddress::from_ipv4(rng()) & rule.mask.dst_ip;
+        rule.match.src_port = static_cast<uint16_t>(rng()) & rule.mask.src_port;
+        rule.match.dst_port = static_cast<uint16_t>(rng()) & rule.mask.dst_port;
+        rules.push_back(rule);
+    }
+    return rules;
+}
+
+int main(int argc, const char** argv) {
+    Arguments args;
+    args.parse_args(argc, argv);
+
+    RuleCompiler compiler;
+    std::mt19937 rng(1);
+    PacketFilter::RuleSet rules = random_rules(rng, args.rules);
+
+    /* All ways of every key, summed so that the hashes are not optimized away */
+    uint32_t sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& rule : rules) {
+        for (uint32_t way = 0; way < RuleCompiler::TABLE_WAYS; way++) {
+            sum += compiler.hash(rule.match, way);
+        }
+    }
+    double table_secs = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    for (const auto& rule : rules) {
+        for (uint32_t way = 0; way < RuleCompiler::TABLE_WAYS; way++) {
+            sum -= FilterGeometry::compute_hash(rule.match, way);
+        }
+    }
+    double serial_secs = seconds_since(start);
+    log_assert(sum == 0, "Table-driven and bit-serial hashes differ");
+
+    printf("hash   table %7.1f ns/key, bit-serial %7.1f ns/key (%u ways)\n",
+           table_secs * 1e9 / args.rules, serial_secs * 1e9 / args.rules,
+           RuleCompiler::TABLE_WAYS);
+
+    start = std::chrono::steady_clock::now();
+    RuleCompiler::Placement placement = compiler.place(rules);
+    double place_secs = seconds_since(start);
+    printf("place  %u rules in %.1f ms: %lu slots of %u used, %lu collisions, %lu moved\n",
+           args.rules, place_secs * 1e3, placement.used, RuleCompiler::NUM_SLOTS,
+           placement.conflicts.size(), placement.moved);
+
+    for (uint32_t count : {1000, 16000, 64000}) {
+        size_t size = std::min<size_t>(count, rules.size());
+        PacketFilter::RuleSet set(rules.begin(), rules.begin() + size);
+        start = std::chrono::steady_clock::now();
+        placement = compiler.place(set);
+        place_secs = seconds_since(start);
+        printf("load   %5lu rules: %5.1f%% of the slots used, %lu collisions, %.2f M inserts/s\n",
+               set.size(), 100.0 * placement.used / RuleCompiler::NUM_SLOTS,
+               placement.conflicts.size(), set.size() / place_secs / 1e6);
+    }
+
+    /* Rules of the first mask only, enough to fill every table */
+    PacketFilter::RuleSet single;
+    for (const auto& rule : random_rules(rng, RuleCompiler::NUM_TABLES * RuleCompiler::NUM_SLOTS)) {
+        if (rule.mask == rules[0].mask) {
+            single.push_back(rule);
+        }
+    }
+    size_t low = 0, high = single.size();
+    while (low < high) {
+        size_t mid = (low + high + 1) / 2;
+        PacketFilter::RuleSet set(single.begin(), single.begin() + mid);
+        if (compiler.place(set).conflicts.empty()) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    printf("mask   first collision after %lu rules, %.1f%% of %u slots\n", low,
+           100.0 * low / RuleCompiler::NUM_SLOTS, RuleCompiler::NUM_SLOTS);
+    return 0;
+}
+
+void Arguments::parse_args(int argc, const char** argv) {
+    int c;
+    while ((c = getopt(argc, const_cast<char**>(argv), "n:")) != -1) {
+        switch (c) {
+            case 'n':
+                this->rules = static_cast<uint32_t>(std::stoul(optarg));
+                break;
+
+            case '?':
+            default:
+                log_info("Usage: %s [-n <rules>]", argv[0]);
+                log_fatal("Unknown option: %c", c);
+        }
+    }
+    if (this->rules == 0) {
+        log_fatal("At least one rule is needed");
+    }
+}
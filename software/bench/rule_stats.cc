@@ -0,0 +1,157 @@
+#include <unistd.h>
+#include <chrono>
+#include <random>
+
+#include "deps.h"
+#include "packet_filter.h"
+#include "packet_filter_model.h"
+#include "mmio_backend.h"
+#include "../tests/frames.h"
+
+/* Per-rule counters and dropped-destination heavy hitters under skewed traffic, e.g.
+ *   ./build/bin/bench_rule_stats -d 10000 -p 200000
+ * Packets go to -d destinations drawn from a Zipf distribution of several skews,
+ * every tenth destination having a forwarding rule. After feeding them to the
+ * software model, read_rule_stats() is timed and compared with the traffic sent:
+ * rule counters that differ, how many of the true top-K dropped destinations are
+ * among the heavy hitters, and how far their count-min estimates overcount. */
+
+struct Arguments {
+    uint32_t destinations = 10000;
+    uint32_t packets = 200000;
+
+    void parse_args(int argc, const char** argv);
+};
+
+/* Samples 0..n-1, rank r with a probability proportional to 1 / (r + 1)^s */
+class Zipf {
+private:
+    std::vector<double> cdf_;
+    std::uniform_real_distribution<double> uniform_;
+
+public:
+    Zipf(uint32_t n, double s) : cdf_(n) {
+        double sum = 0;
+        for (uint32_t r = 0; r < n; r++) {
+            sum += 1.0 / pow(r + 1, s);
+            cdf_[r] = sum;
+        }
+        for (auto& p : cdf_) {
+            p /= sum;
+        }
+    }
+    uint32_t operator()(std::mt19937& rng) {
+        auto it = std::lower_bound(cdf_.begin(), cdf_.end(), uniform_(rng));
+        return std::min<uint32_t>(it - cdf_.begin(), cdf_.size() - 1);
+    }
+};
+
+static void run(const Arguments& args, double skew) {
+    auto backend = std::make_shared<SimBackend>();
+    MMIO::set_backend(backend);
+    PacketFilterModel& model = backend->filter_model();
+    PacketFilter filter;
+
+    /* Destinations are shuffled so that rank and rule do not line up */
+    std::mt19937 rng(13);
+    std::vector<uint32_t> dst_ips(args.destinations);
+    for (uint32_t i = 0; i < args.destinations; i++) {
+        dst_ips[i] = 0x0a000000 + i;
+    }
+    std::shuffle(dst_ips.begin(), dst_ips.end(), rng);
+
+    PacketFilter::RuleSet rules;
+    std::vector<uint32_t> rule_of(args.destinations, UINT32_MAX);
+    for (uint32_t i = 0; i < args.destinations; i += 10) {
+        char rule[32];
+        snprintf(rule, sizeof(rule), "%u.%u.%u.%u:5000", dst_ips[i] >> 24,
+                 (dst_ips[i] >> 16) & 0xff, (dst_ips[i] >> 8) & 0xff, dst_ips[i] & 0xff);
+        rule_of[i] = rules.size();
+        rules.push_back(PacketFilter::parse_rule(rule, PacketFilter::RULE_ACTION_FORWARD));
+    }
+    log_assert(filter.commit(rules), "Commit failed");
+
+    Zipf zipf(args.destinations, skew);
+    std::vector<uint64_t> sent(args.destinations, 0);
+    std::vector<uint8_t> frame = ipv4_frame(udp_key(0x0a640001, 1234, 0, 5000));
+    auto* ip_hdr = reinterpret_cast<rte_ipv4_hdr*>(frame.data() + sizeof(rte_ether_hdr));
+    for (uint32_t i = 0; i < args.packets; i++) {
+        uint32_t dst = zipf(rng);
+        ip_hdr->dst_addr = rte_cpu_to_be_32(dst_ips[dst]);
+        model.process(frame.data(), frame.size(), frame.size());
+        sent[dst]++;
+    }
+
+    PacketFilter::RuleStats stats;
+    auto start = std::chrono::steady_clock::now();
+    log_assert(filter.read_rule_stats(stats), "Reading rule statistics failed");
+    double read_secs =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    uint32_t wrong = 0;
+    for (uint32_t i = 0; i < args.destinations; i++) {
+        if (rule_of[i] != UINT32_MAX && stats.rules[rule_of[i]].packets != sent[i]) {
+            wrong++;
+        }
+    }
+
+    /* True top-K of the dropped destinations, by packets sent */
+    std::vector<uint32_t> dropped;
+    for (uint32_t i = 0; i < args.destinations; i++) {
+        if (rule_of[i] == UINT32_MAX) {
+            dropped.push_back(i);
+        }
+    }
+    const uint32_t top_k = PacketFilterModel::SKETCH_TOP_K;
+    std::partial_sort(dropped.begin(), dropped.begin() + top_k, dropped.end(),
+                      [&sent](uint32_t a, uint32_t b) { return sent[a] > sent[b]; });
+    uint32_t found = 0;
+    double overcount = 0;
+    for (uint32_t k = 0; k < top_k; k++) {
+        uint32_t dst = dropped[k];
+        auto dst_ip = PacketFilter::IPAddress::from_ipv4(rte_cpu_to_be_32(dst_ips[dst]));
+        for (const auto& hitter : stats.heavy_hitters) {
+            if (hitter.dst_ip == dst_ip) {
+                found++;
+                overcount = std::max(overcount, (double(hitter.packets) - sent[dst]) / sent[dst]);
+            }
+        }
+    }
+    printf("zipf %.1f: read in %.2f ms, %u of %lu rule counters wrong, top-%u recall %u/%u, "
+           "max overcount %.1f%%\n", skew, read_secs * 1e3, wrong, rules.size(), top_k, found,
+           top_k, overcount * 100);
+}
+
+int main(int argc, const char** argv) {
+    Arguments args;
+    args.parse_args(argc, argv);
+    Log::set_log_level(Log::WARN);
+    for (double skew : {0.8, 1.0, 1.2}) {
+        run(args, skew);
+    }
+    return 0;
+}
+
+void Arguments::parse_args(int argc, const char** argv) {
+    int c;
+    while ((c = getopt(argc, const_cast<char**>(argv), "d:p:")) != -1) {
+        switch (c) {
+            case 'd':
+                this->destinations = static_cast<uint32_t>(std::stoul(optarg));
+                break;
+
+            case 'p':
+                this->packets = static_cast<uint32_t>(std::stoul(optarg));
+                break;
+
+            case '?':
+            default:
+                log_info("Usage: %s [-d <destinations>] [-p <packets>]", argv[0]);
+                log_fatal("Unknown option: %c", c);
+        }
+    }
+    if (this->destinations < 10 * PacketFilterModel::SKETCH_TOP_K || this->packets == 0) {
+        log_fatal("At least %u destinations and one packet are needed",
+                  10 * PacketFilterModel::SKETCH_TOP_K);
+    }
+}
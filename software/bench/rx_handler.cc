@@ -0,0 +1,138 @@
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "deps.h"
+#include "dpdk.h"
+
+/* Cost per packet of the rx loop with each way of handling a burst, on a software
+ * port so it runs without the FPGA, e.g.
+ *   sudo ./build/bin/bench_rx_handler -c "bench --no-pci --vdev=net_null0" -d 5
+ * Modes:
+ *   packet    one std::function call and one rte_pktmbuf_free() per mbuf, as the rx
+ *             loop did before burst handlers
+ *   callback  register_callback(): one std::function call per mbuf, bulk free
+ *   burst     register_burst_callback(): one std::function call per burst, bulk free
+ *   inline    register_handler(): the handler is inlined into the loop, bulk free
+ * Each handler reads the ether type of every packet. Every mode runs in a process of
+ * its own, since EAL is only initialized once per process. */
+
+struct Arguments {
+    const char* dpdk_config = nullptr;
+    uint32_t duration = 5;
+    std::vector<std::string> modes = {"packet", "callback", "burst", "inline"};
+
+    void parse_args(int argc, const char** argv);
+};
+
+static volatile uint16_t ether_type_sink;
+
+/* Kept out of line like a handler in another translation unit */
+__attribute__((noinline)) static int touch_packet(uint16_t thread_id, rte_mbuf* mbuf) {
+    ether_type_sink = rte_pktmbuf_mtod(mbuf, rte_ether_hdr*)->ether_type;
+    return 0;
+}
+
+static void register_mode(DPDK& dpdk, const std::string& mode) {
+    if (mode == "packet") {
+        std::function<int(uint16_t, rte_mbuf*)> callback = touch_packet;
+        dpdk.register_burst_callback(0, [callback](uint16_t tid, rte_mbuf** bufs,
+                                                   uint16_t nb_rx) -> uint16_t {
+            for (uint16_t i = 0; i < nb_rx; i++) {
+                callback(tid, bufs[i]);
+                rte_pktmbuf_free(bufs[i]);
+            }
+            return 0;
+        });
+    } else if (mode == "callback") {
+        dpdk.register_callback(0, touch_packet);
+    } else if (mode == "burst") {
+        dpdk.register_burst_callback(0, [](uint16_t tid, rte_mbuf** bufs,
+                                           uint16_t nb_rx) -> uint16_t {
+            for (uint16_t i = 0; i < nb_rx; i++) {
+                touch_packet(tid, bufs[i]);
+            }
+            return nb_rx;
+        });
+    } else if (mode == "inline") {
+        dpdk.register_handler(0, [](uint16_t tid, rte_mbuf** bufs, uint16_t nb_rx) {
+            for (uint16_t i = 0; i < nb_rx; i++) {
+                touch_packet(tid, bufs[i]);
+            }
+            return nb_rx;
+        });
+    } else {
+        log_fatal("Unknown mode: %s", mode.c_str());
+    }
+}
+
+static void run_mode(const Arguments& args, const std::string& mode) {
+    std::string config(args.dpdk_config);
+    DPDK dpdk(config.data(), 1);
+    register_mode(dpdk, mode);
+    uint64_t start = rte_rdtsc();
+    sleep(args.duration);
+    dpdk.stop();
+    double seconds = static_cast<double>(rte_rdtsc() - start) / rte_get_tsc_hz();
+
+    RxLoopSnapshot stats;
+    dpdk.read_rx_loop_stats(0, stats);
+    double mean_burst = stats.busy_polls > 0 ?
+                        static_cast<double>(stats.packets) / stats.busy_polls : 0;
+    printf("%-8s %8.3f Mpps %8.1f cycles/packet, per busy poll: %.1f packets, "
+           "median handler %lu and free %lu cycles\n",
+           mode.c_str(), stats.packets / seconds / 1e6,
+           stats.packets > 0 ? seconds * rte_get_tsc_hz() / stats.packets : 0.0, mean_burst,
+           stats.handler_cycles.percentile(0.5), stats.free_cycles.percentile(0.5));
+    fflush(stdout);
+}
+
+int main(int argc, const char** argv) {
+    Arguments args;
+    args.parse_args(argc, argv);
+
+    for (const std::string& mode : args.modes) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            log_fatal("Cannot fork: %s", strerror(errno));
+        }
+        if (pid == 0) {
+            run_mode(args, mode);
+            return 0;
+        }
+        int status;
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            log_error("Mode %s failed", mode.c_str());
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void Arguments::parse_args(int argc, const char** argv) {
+    int c;
+    while ((c = getopt(argc, const_cast<char**>(argv), "c:d:m:")) != -1) {
+        switch (c) {
+            case 'c':
+                this->dpdk_config = optarg;
+                break;
+
+            case 'd':
+                this->duration = static_cast<uint32_t>(std::stoul(optarg));
+                break;
+
+            case 'm':
+                this->modes = {optarg};
+                break;
+
+            case '?':
+            default:
+                log_info("Usage: %s -c <dpdk_config> [-d <seconds>] [-m packet|callback|burst|inline]",
+                         argv[0]);
+                log_fatal("Unknown option: %c", c);
+        }
+    }
+
+    if (this->dpdk_config == nullptr) {
+        log_fatal("DPDK configuration string is required. Use -c option.");
+    }
+}
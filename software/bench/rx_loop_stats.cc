@@ -0,0 +1,119 @@
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "deps.h"
+#include "dpdk.h"
+
+/* Cost of the RxLoopStats updates of the rx loop, on a software port so it runs
+ * without the FPGA, e.g.
+ *   sudo ./build/bin/bench_rx_loop_stats -c "bench --no-pci --vdev=net_null0" -d 5
+ * Runs the loop of register_handler() with the stats compiled in ("on") and out
+ * ("off"), each in a process of its own since EAL is only initialized once per
+ * process, and prints the cycles per busy poll and per packet of each. The handler
+ * reads the ether type of every packet and counts the polls itself, since the loop
+ * without stats does not. */
+
+struct Arguments {
+    const char* dpdk_config = nullptr;
+    uint32_t duration = 5;
+    std::vector<std::string> modes = {"on", "off"};
+
+    void parse_args(int argc, const char** argv);
+};
+
+/* Written by the rx lcore alone, read once stop() has returned */
+struct Counts {
+    uint64_t polls = 0;
+    uint64_t packets = 0;
+};
+
+static volatile uint16_t ether_type_sink;
+
+template<bool LoopStats>
+static void register_mode(DPDK& dpdk, Counts& counts) {
+    dpdk.register_handler<LoopStats>(0, [&counts](uint16_t tid, rte_mbuf** bufs,
+                                                  uint16_t nb_rx) {
+        for (uint16_t i = 0; i < nb_rx; i++) {
+            ether_type_sink = rte_pktmbuf_mtod(bufs[i], rte_ether_hdr*)->ether_type;
+        }
+        counts.polls++;
+        counts.packets += nb_rx;
+        return nb_rx;
+    });
+}
+
+static void run_mode(const Arguments& args, const std::string& mode) {
+    std::string config(args.dpdk_config);
+    DPDK dpdk(config.data(), 1);
+    Counts counts;
+    if (mode == "on") {
+        register_mode<true>(dpdk, counts);
+    } else if (mode == "off") {
+        register_mode<false>(dpdk, counts);
+    } else {
+        log_fatal("Unknown mode: %s", mode.c_str());
+    }
+    uint64_t start = rte_rdtsc();
+    sleep(args.duration);
+    dpdk.stop();
+    double cycles = static_cast<double>(rte_rdtsc() - start);
+
+    RxLoopSnapshot stats;
+    dpdk.read_rx_loop_stats(0, stats);
+    printf("stats %-3s %8.3f Mpps %8.1f cycles/poll %6.1f cycles/packet, %lu polls counted "
+           "by the loop\n", mode.c_str(), counts.packets / (cycles / rte_get_tsc_hz()) / 1e6,
+           counts.polls > 0 ? cycles / counts.polls : 0.0,
+           counts.packets > 0 ? cycles / counts.packets : 0.0,
+           stats.busy_polls + stats.empty_polls);
+    fflush(stdout);
+}
+
+int main(int argc, const char** argv) {
+    Arguments args;
+    args.parse_args(argc, argv);
+
+    for (const std::string& mode : args.modes) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            log_fatal("Cannot fork: %s", strerror(errno));
+        }
+        if (pid == 0) {
+            run_mode(args, mode);
+            return 0;
+        }
+        int status;
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            log_error("Mode %s failed", mode.c_str());
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void Arguments::parse_args(int argc, const char** argv) {
+    int c;
+    while ((c = getopt(argc, const_cast<char**>(argv), "c:d:m:")) != -1) {
+        switch (c) {
+            case 'c':
+                this->dpdk_config = optarg;
+                break;
+
+            case 'd':
+                this->duration = static_cast<uint32_t>(std::stoul(optarg));
+                break;
+
+            case 'm':
+                this->modes = {optarg};
+                break;
+
+            case '?':
+            default:
+                log_info("Usage: %s -c <dpdk_config> [-d <seconds>] [-m on|off]", argv[0]);
+                log_fatal("Unknown option: %c", c);
+        }
+    }
+
+    if (this->dpdk_config == nullptr) {
+        log_fatal("DPDK configuration string is required. Use -c option.");
+    }
+}
@@ -0,0 +1,249 @@
+#include <unistd.h>
+#include <random>
+#include <sstream>
+
+#include "deps.h"
+#include "dpdk.h"
+#include "packet_filter.h"
+#include "software_filter.h"
+#include "../tests/frames.h"
+
+/* Cost per packet of the software filter of hybrid mode, e.g.
+ *   ./build/bin/bench_software_filter -r 100000
+ *   sudo ./build/bin/bench_software_filter -r 100000 -t 2 -d 5 \
+ *       -c "bench --no-pci --vdev=net_pcap0,rx_pcap=trace.pcap,infinite_rx=1"
+ * The rules are -f <rule>,<rule>,... or else -r generated ones over four masks (UDP
+ * destination and port, TCP destination /24, TCP 5-tuple, UDP source /16), every
+ * other one dropping. Without -c, -n frames of which half hit a rule are filtered
+ * from memory without EAL, for 1000, 10000 and -r rules: lookup() after parse()
+ * alone, and filter_burst() over bursts of mbufs pointing at them. The default -n
+ * keeps their headers in cache, as DDIO does for received packets. With -c, the packets
+ * of a port, e.g. a pcap trace replayed by net_pcap, go through filter_burst() on
+ * -t rx threads for -d seconds, and the rate and lookup cost of each are printed. */
+
+struct Arguments {
+    const char* dpdk_config = nullptr;
+    std::vector<std::string> filter_list;
+    uint32_t rules = 100000;
+    uint32_t frames = 4096;
+    uint16_t num_threads = 1;
+    uint32_t duration = 5;
+
+    void parse_args(int argc, const char** argv);
+};
+
+static constexpr uint16_t BURST = 32;   /* DPDK_BURST_SIZE */
+
+static std::string ip_string(uint32_t ip) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%u.%u.%u.%u", ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff,
+             ip & 0xff);
+    return buf;
+}
+
+/* Rules over four masks, each with a key it matches */
+static void generate_rules(uint32_t count, PacketFilter::RuleSet& rules,
+                           std::vector<PacketFilter::FlowKey>& hits) {
+    std::mt19937 rng(21);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t src_ip = rng() | 0x80000000;
+        uint32_t dst_ip = 0x0a000000 + rng() % 0x01000000;
+        uint16_t src_port = static_cast<uint16_t>(1024 + rng() % 60000);
+        uint16_t dst_port = static_cast<uint16_t>(1 + rng() % 1024);
+        PacketFilter::FlowKey key = udp_key(src_ip, src_port, dst_ip, dst_port);
+        std::string rule;
+        switch (i % 4) {
+            case 0:
+                rule = ip_string(dst_ip) + ":" + std::to_string(dst_port);
+                break;
+            case 1:
+                rule = "tcp:*:*:" + ip_string(dst_ip & 0xffffff00) + "/24:*";
+                key.protocol = IPPROTO_TCP;
+                break;
+            case 2:
+                rule = "tcp:" + ip_string(src_ip) + ":" + std::to_string(src_port) + ":" +
+                       ip_string(dst_ip) + ":" + std::to_string(dst_port);
+                key.protocol = IPPROTO_TCP;
+                break;
+            default:
+                rule = "udp:" + ip_string(src_ip & 0xffff0000) + "/16:*:*:*";
+                break;
+        }
+        rules.push_back(PacketFilter::parse_rule(rule, i % 2 ? PacketFilter::RULE_ACTION_DROP :
+                                                              PacketFilter::RULE_ACTION_FORWARD));
+        hits.push_back(key);
+    }
+}
+
+static void run_memory(const Arguments& args, const PacketFilter::RuleSet& all_rules,
+                       const std::vector<PacketFilter::FlowKey>& hits) {
+    std::vector<uint32_t> counts;
+    for (uint32_t count : {1000u, 10000u, static_cast<uint32_t>(all_rules.size())}) {
+        if (count <= all_rules.size() && (counts.empty() || count > counts.back())) {
+            counts.push_back(count);
+        }
+    }
+
+    for (uint32_t count : counts) {
+        PacketFilter::RuleSet rules(all_rules.begin(), all_rules.begin() + count);
+        SoftwareFilter filter(rules, PacketFilter::RULE_ACTION_DROP, 1);
+
+        /* Misses come from sources no rule has, with the top bit clear */
+        std::mt19937 rng(18);
+        std::vector<std::vector<uint8_t>> frames(args.frames);
+        for (auto& frame : frames) {
+            PacketFilter::FlowKey key = (rng() & 1) ? hits[rng() % count] :
+                udp_key(rng() & 0x7fffffff, 1024 + rng() % 60000,
+                        0x0b000000 + rng() % 0x01000000, 1 + rng() % 1024);
+            frame = ipv4_frame(key, 64 + rng() % 1400);
+        }
+
+        /* Rounds of at least a million packets, the first only warms the caches */
+        uint32_t rounds = std::max<uint32_t>(2, 1000000 / args.frames + 1);
+        uint64_t lookup_cycles = 0;
+        uint64_t matched = 0;
+        for (uint32_t round = 0; round < rounds; round++) {
+            uint64_t start = rte_rdtsc();
+            for (const auto& frame : frames) {
+                PacketFilter::FlowKey key;
+                if (SoftwareFilter::parse(frame.data(), frame.size(), key)) {
+                    matched += filter.lookup(key) != SoftwareFilter::NO_RULE;
+                }
+            }
+            if (round > 0) {
+                lookup_cycles += rte_rdtsc() - start;
+            }
+        }
+
+        std::vector<rte_mbuf> storage(frames.size());
+        for (size_t i = 0; i < frames.size(); i++) {
+            storage[i].buf_addr = frames[i].data();
+            storage[i].data_off = 0;
+            storage[i].data_len = static_cast<uint16_t>(frames[i].size());
+            storage[i].pkt_len = static_cast<uint32_t>(frames[i].size());
+        }
+        SoftwareFilter::ThreadStats warm = {0, 0, 0};
+        for (uint32_t round = 0; round < rounds; round++) {
+            for (size_t i = 0; i < storage.size(); i += BURST) {
+                rte_mbuf* bufs[BURST];
+                size_t left = storage.size() - i;
+                uint16_t nb_rx = static_cast<uint16_t>(std::min<size_t>(BURST, left));
+                for (uint16_t j = 0; j < nb_rx; j++) {
+                    bufs[j] = &storage[i + j];
+                }
+                filter.filter_burst(0, bufs, nb_rx, false);
+            }
+            if (round == 0) {
+                warm = filter.thread_stats(0);
+            }
+        }
+        SoftwareFilter::ThreadStats stats = filter.thread_stats(0);
+
+        double packets = static_cast<double>(args.frames) * (rounds - 1);
+        printf("%6u rules in %zu tables: lookup %5.1f cycles/packet, filter_burst %5.1f "
+               "cycles/packet, %.1f%% matched, %.1f%% dropped\n", count, filter.num_subtables(),
+               lookup_cycles / packets, (stats.cycles - warm.cycles) / packets,
+               100.0 * matched / (packets + args.frames),
+               100.0 * (stats.dropped - warm.dropped) / packets);
+    }
+}
+
+static void run_port(const Arguments& args, const PacketFilter::RuleSet& rules) {
+    std::string config(args.dpdk_config);
+    DPDK dpdk(config.data(), args.num_threads);
+    SoftwareFilter filter(rules, PacketFilter::RULE_ACTION_DROP, args.num_threads);
+    for (uint16_t i = 0; i < args.num_threads; i++) {
+        dpdk.register_handler(i, [&filter](uint16_t thread_id, rte_mbuf** bufs,
+                                           uint16_t nb_rx) -> uint16_t {
+            /* Dropped and forwarded packets alike are freed by the rx loop */
+            filter.filter_burst(thread_id, bufs, nb_rx, false);
+            return nb_rx;
+        });
+    }
+    uint64_t start = rte_rdtsc();
+    sleep(args.duration);
+    dpdk.stop();
+    double seconds = static_cast<double>(rte_rdtsc() - start) / rte_get_tsc_hz();
+
+    uint64_t total = 0;
+    for (uint16_t i = 0; i < args.num_threads; i++) {
+        SoftwareFilter::ThreadStats stats = filter.thread_stats(i);
+        total += stats.packets;
+        printf("thread %u: %8.3f Mpps, %5.1f cycles/packet in filter_burst, %.1f%% dropped\n",
+               i, stats.packets / seconds / 1e6,
+               stats.packets > 0 ? static_cast<double>(stats.cycles) / stats.packets : 0.0,
+               stats.packets > 0 ? 100.0 * stats.dropped / stats.packets : 0.0);
+    }
+    printf("total:    %8.3f Mpps over %zu rules in %zu tables\n", total / seconds / 1e6,
+           rules.size(), filter.num_subtables());
+}
+
+int main(int argc, const char** argv) {
+    Arguments args;
+    args.parse_args(argc, argv);
+
+    PacketFilter::RuleSet rules;
+    std::vector<PacketFilter::FlowKey> hits;
+    if (args.filter_list.empty()) {
+        generate_rules(args.rules, rules, hits);
+    } else {
+        for (const auto& filter : args.filter_list) {
+            rules.push_back(PacketFilter::parse_rule(filter, PacketFilter::RULE_ACTION_FORWARD));
+        }
+    }
+
+    Log::set_log_level(Log::WARN);
+    if (args.dpdk_config != nullptr) {
+        run_port(args, rules);
+    } else if (!hits.empty()) {
+        run_memory(args, rules, hits);
+    } else {
+        log_fatal("Filtering from memory needs generated rules (-r)");
+    }
+    return 0;
+}
+
+void Arguments::parse_args(int argc, const char** argv) {
+    int c;
+    while ((c = getopt(argc, const_cast<char**>(argv), "c:f:r:n:t:d:")) != -1) {
+        switch (c) {
+            case 'c':
+                this->dpdk_config = optarg;
+                break;
+
+            case 'f': {
+                std::stringstream ss(optarg);
+                std::string token;
+                while (std::getline(ss, token, ',')) {
+                    this->filter_list.push_back(token);
+                }
+                break;
+            }
+
+            case 'r':
+                this->rules = static_cast<uint32_t>(std::stoul(optarg));
+                break;
+
+            case 'n':
+                this->frames = static_cast<uint32_t>(std::stoul(optarg));
+                break;
+
+            case 't':
+                this->num_threads = static_cast<uint16_t>(std::stoul(optarg));
+                break;
+
+            case 'd':
+                this->duration = static_cast<uint32_t>(std::stoul(optarg));
+                break;
+
+            case '?':
+            default:
+                log_info("Usage: %s [-f <filter_list> | -r <rules>] [-n <frames>] "
+                         "[-c <dpdk_config> [-t <num_threads>] [-d <seconds>]]", argv[0]);
+                log_fatal("Unknown option: %c", c);
+        }
+    }
+    if (this->rules == 0 || this->frames == 0 || this->num_threads == 0) {
+        log_fatal("At least one rule, frame and thread are needed");
+    }
+}
@@ -0,0 +1,211 @@
+#include <unistd.h>
+#include <random>
+#include <rte_cycles.h>
+#include <rte_mbuf.h>
+#include <rte_ring.h>
+
+#include "deps.h"
+#include "dpdk.h"
+#include "packet_filter.h"
+#include "packet_filter_model.h"
+#include "mmio_backend.h"
+#include "../tests/frames.h"
+
+/* Per-queue balance of frames the filter core steers by RSS, e.g.
+ *   ./build/bin/bench_steering -f 20000
+ *   sudo ./build/bin/bench_steering -c "bench --no-pci --vdev=net_ring0 -l 0-8" -q 8 -d 5
+ * Flows with random 5-tuples send uniform or Zipf traffic, and the software model of
+ * the core picks the queue of every frame. Without -c, the packets and flows each
+ * queue gets are reported for 2, 4, 8 and 16 queues. With -c, the frames are also
+ * received on a net_ring port with -q rx queues: each is enqueued on the ring behind
+ * the queue the model chose, as the core would set it in tuser, and the rx threads
+ * report what they received, with uniform traffic or Zipf with -z. net_ring backs
+ * queue i with the ring ETH_RXTX<i>_<port name>. */
+
+struct Arguments {
+    const char* dpdk_config = nullptr;
+    uint32_t flows = 20000;
+    uint16_t queues = 8;
+    uint32_t duration = 5;
+    bool zipf = false;
+
+    void parse_args(int argc, const char** argv);
+};
+
+/* Frame of each flow and the queue the model steers it to */
+struct Flows {
+    std::vector<std::vector<uint8_t>> frames;
+    std::vector<uint16_t> queues;
+    std::vector<double> cdf;    /* of the packets over flows */
+};
+
+static Flows make_flows(uint32_t count, uint16_t queues, bool zipf) {
+    auto backend = std::make_shared<SimBackend>();
+    MMIO::set_backend(backend);
+    PacketFilterModel& model = backend->filter_model();
+    PacketFilter filter(std::vector<std::string>{"udp:*:*:*:*", "tcp:*:*:*:*"}, queues);
+
+    Flows flows;
+    std::mt19937 rng(17);
+    double sum = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        PacketFilter::FlowKey key = udp_key(rng(), static_cast<uint16_t>(rng()), rng(),
+                                            static_cast<uint16_t>(rng()));
+        key.protocol = rng() & 1 ? IPPROTO_TCP : IPPROTO_UDP;
+        std::vector<uint8_t> frame = ipv4_frame(key);
+        auto verdict = model.classify(frame.data(), frame.size(), frame.size());
+        log_assert(verdict.steered && verdict.queue < queues, "Flow %u not steered", i);
+        flows.frames.push_back(frame);
+        flows.queues.push_back(verdict.queue);
+        sum += zipf ? 1.0 / (i + 1) : 1.0;
+        flows.cdf.push_back(sum);
+    }
+    for (auto& p : flows.cdf) {
+        p /= sum;
+    }
+    return flows;
+}
+
+static uint32_t pick(const Flows& flows, std::mt19937& rng) {
+    double u = std::uniform_real_distribution<double>()(rng);
+    auto it = std::lower_bound(flows.cdf.begin(), flows.cdf.end(), u);
+    return std::min<uint32_t>(it - flows.cdf.begin(), flows.cdf.size() - 1);
+}
+
+static void report(const char* where, const char* what, uint16_t queues, bool zipf,
+                   const std::vector<uint64_t>& packets) {
+    uint64_t total = 0;
+    for (auto n : packets) {
+        total += n;
+    }
+    auto [least, most] = std::minmax_element(packets.begin(), packets.end());
+    double mean = static_cast<double>(total) / queues;
+    printf("%-5s %2u queues, %-7s: %-7s per queue min/mean %.3f, max/mean %.3f\n", where,
+           queues, zipf ? "zipf" : "uniform", what, *least / mean, *most / mean);
+}
+
+static void model_balance(const Arguments& args) {
+    const uint32_t packets = 1000000;
+    for (uint16_t queues : {2, 4, 8, 16}) {
+        for (bool zipf : {false, true}) {
+            Flows flows = make_flows(args.flows, queues, zipf);
+            std::vector<uint64_t> per_queue(queues, 0), flows_per_queue(queues, 0);
+            for (uint16_t queue : flows.queues) {
+                flows_per_queue[queue]++;
+            }
+            std::mt19937 rng(queues);
+            for (uint32_t i = 0; i < packets; i++) {
+                per_queue[flows.queues[pick(flows, rng)]]++;
+            }
+            if (!zipf) {
+                report("model", "flows", queues, zipf, flows_per_queue);
+            }
+            report("model", "packets", queues, zipf, per_queue);
+        }
+    }
+}
+
+static void host_balance(const Arguments& args, bool zipf) {
+    Flows flows = make_flows(args.flows, args.queues, zipf);
+    std::string config(args.dpdk_config);
+    DPDK dpdk(config.data(), args.queues);
+    log_assert(dpdk.ports() == 1 && dpdk.queues_per_port() == args.queues,
+               "Expected one port with %u rx queues", args.queues);
+    for (uint16_t tid = 0; tid < args.queues; tid++) {
+        dpdk.register_handler(tid, [](uint16_t, rte_mbuf**, uint16_t nb_rx) { return nb_rx; });
+    }
+
+    char name[RTE_ETH_NAME_MAX_LEN];
+    log_assert(rte_eth_dev_get_name_by_port(0, name) == 0, "Cannot get the port name");
+    std::vector<rte_ring*> rings(args.queues);
+    for (uint16_t q = 0; q < args.queues; q++) {
+        std::string ring_name = "ETH_RXTX" + std::to_string(q) + "_" + name;
+        rings[q] = rte_ring_lookup(ring_name.c_str());
+        log_assert(rings[q] != nullptr, "No ring %s, is port 0 a net_ring vdev?",
+                   ring_name.c_str());
+    }
+    rte_mempool* pool = rte_pktmbuf_pool_create("steering_pool", 16383, 250, 0,
+                                                RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
+    log_assert(pool != nullptr, "Cannot create the mbuf pool: %s", rte_strerror(rte_errno));
+
+    /* The rx threads see the flows of each ring in the order the model steered them */
+    std::mt19937 rng(args.queues);
+    uint64_t sent = 0, full = 0;
+    uint64_t end = rte_rdtsc() + args.duration * rte_get_tsc_hz();
+    while (rte_rdtsc() < end) {
+        rte_mbuf* mbuf = rte_pktmbuf_alloc(pool);
+        if (mbuf == nullptr) {
+            continue;
+        }
+        uint32_t flow = pick(flows, rng);
+        const std::vector<uint8_t>& frame = flows.frames[flow];
+        memcpy(rte_pktmbuf_append(mbuf, frame.size()), frame.data(), frame.size());
+        if (rte_ring_sp_enqueue_burst(rings[flows.queues[flow]], reinterpret_cast<void**>(&mbuf),
+                                      1, nullptr) == 0) {
+            rte_pktmbuf_free(mbuf);
+            full++;
+            continue;
+        }
+        sent++;
+    }
+    dpdk.stop();
+
+    std::vector<uint64_t> received(args.queues, 0);
+    for (uint16_t tid = 0; tid < args.queues; tid++) {
+        RxLoopSnapshot stats;
+        dpdk.read_rx_loop_stats(tid, stats);
+        received[tid] = stats.packets;
+    }
+    report("host", "packets", args.queues, zipf, received);
+    printf("host  %.3f Mpps enqueued, %lu frames found their ring full\n",
+           sent / static_cast<double>(args.duration) / 1e6, full);
+}
+
+int main(int argc, const char** argv) {
+    Arguments args;
+    args.parse_args(argc, argv);
+    Log::set_log_level(Log::WARN);
+
+    if (args.dpdk_config == nullptr) {
+        model_balance(args);
+        return 0;
+    }
+    host_balance(args, args.zipf);
+    return 0;
+}
+
+void Arguments::parse_args(int argc, const char** argv) {
+    int c;
+    while ((c = getopt(argc, const_cast<char**>(argv), "c:f:q:d:z")) != -1) {
+        switch (c) {
+            case 'c':
+                this->dpdk_config = optarg;
+                break;
+
+            case 'f':
+                this->flows = static_cast<uint32_t>(std::stoul(optarg));
+                break;
+
+            case 'q':
+                this->queues = static_cast<uint16_t>(std::stoul(optarg));
+                break;
+
+            case 'd':
+                this->duration = static_cast<uint32_t>(std::stoul(optarg));
+                break;
+
+            case 'z':
+                this->zipf = true;
+                break;
+
+            case '?':
+            default:
+                log_info("Usage: %s [-c <dpdk_config>] [-f <flows>] [-q <queues>] [-d <seconds>] "
+                         "[-z]", argv[0]);
+                log_fatal("Unknown option: %c", c);
+        }
+    }
+    if (this->flows == 0 || this->queues == 0 || this->queues > 16) {
+        log_fatal("At least one flow and 1 to 16 queues are needed");
+    }
+}
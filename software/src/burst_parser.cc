@@ -0,0 +1,55 @@
+#include "deps.h"
+#include "burst_parser.h"
+
+static constexpr uint32_t ETH_HDR_LEN  = 14;
+static constexpr uint32_t IPV4_MIN_LEN = 20;
+static constexpr uint32_t UDP_HDR_LEN  = 8;
+/* Ethertype and protocol as they read from a little-endian load */
+static constexpr uint32_t ETHER_TYPE_IPV4_LE = 0x0008;
+static constexpr uint32_t IP_PROTO_UDP       = 17;
+
+void BurstParser::parse(rte_mbuf** bufs, uint16_t nb_pkts, ParsedBurst& burst) {
+    burst.count = nb_pkts;
+    burst.udp = 0;
+    burst.malformed = 0;
+    for (uint16_t i = 0; i < nb_pkts; i++) {
+        const uint8_t* data = rte_pktmbuf_mtod(bufs[i], const uint8_t*);
+        uint32_t data_len = rte_pktmbuf_data_len(bufs[i]);
+        uint32_t pkt_len = rte_pktmbuf_pkt_len(bufs[i]);
+        if (data_len < ETH_HDR_LEN + IPV4_MIN_LEN) {
+            continue;
+        }
+        uint16_t ether_type;
+        memcpy(&ether_type, &data[12], sizeof(ether_type));
+        const uint8_t* ip = &data[ETH_HDR_LEN];
+        if (ether_type != ETHER_TYPE_IPV4_LE || ip[9] != IP_PROTO_UDP) {
+            continue;
+        }
+
+        uint32_t l4 = ETH_HDR_LEN + 4 * (ip[0] & 0xF);
+        bool ok = (ip[0] >> 4) == 4 && (ip[0] & 0xF) >= 5 && l4 + UDP_HDR_LEN <= data_len;
+        uint16_t dgram_len = 0;
+        if (ok) {
+            uint16_t ports[2];
+            memcpy(ports, &data[l4], sizeof(ports));
+            memcpy(&dgram_len, &data[l4 + 4], sizeof(dgram_len));
+            dgram_len = __builtin_bswap16(dgram_len);
+            ok = dgram_len >= UDP_HDR_LEN && l4 + dgram_len <= pkt_len;
+
+            uint32_t src_ip, dst_ip;
+            memcpy(&src_ip, &ip[12], sizeof(src_ip));
+            memcpy(&dst_ip, &ip[16], sizeof(dst_ip));
+            burst.src_ip[i] = __builtin_bswap32(src_ip);
+            burst.dst_ip[i] = __builtin_bswap32(dst_ip);
+            burst.src_port[i] = __builtin_bswap16(ports[0]);
+            burst.dst_port[i] = __builtin_bswap16(ports[1]);
+            burst.payload_offset[i] = static_cast<uint16_t>(l4 + UDP_HDR_LEN);
+            burst.payload_len[i] = static_cast<uint16_t>(dgram_len - UDP_HDR_LEN);
+        }
+        if (ok) {
+            burst.udp |= 1u << i;
+        } else {
+            burst.malformed |= 1u << i;
+        }
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef _BURST_PARSER_H_
+#define _BURST_PARSER_H_
+
+#include <rte_mbuf.h>
+
+/* The IPv4/UDP headers of up to MAX_PACKETS packets, one array per field, in host
+ * byte order. Bit i of udp is set when packet i is an untagged IPv4 UDP packet whose
+ * headers and datagram fit the frame; its columns are only meaningful then. Bit i of
+ * malformed is set when the packet is IPv4 UDP but its headers or lengths do not fit. */
+struct ParsedBurst {
+    static constexpr uint16_t MAX_PACKETS = 32;
+
+    uint16_t count;
+    uint32_t udp;
+    uint32_t malformed;
+
+    alignas(64) uint32_t src_ip[MAX_PACKETS];
+    alignas(64) uint32_t dst_ip[MAX_PACKETS];
+    alignas(64) uint16_t src_port[MAX_PACKETS];
+    alignas(64) uint16_t dst_port[MAX_PACKETS];
+    alignas(64) uint16_t payload_offset[MAX_PACKETS];    /* from the start of the frame */
+    alignas(64) uint16_t payload_len[MAX_PACKETS];
+};
+
+/* Parses a burst at once instead of packet by packet into one column per field, so
+ * the handler works on arrays rather than chasing a header pointer per packet.
+ * Headers must be in the first segment, as rte_pktmbuf_mtod() assumes. */
+class BurstParser {
+public:
+    /* Parses bufs[0 .. nb_pkts), at most MAX_PACKETS of them */
+    static void parse(rte_mbuf** bufs, uint16_t nb_pkts, ParsedBurst& burst);
+};
+
+#endif // _BURST_PARSER_H_
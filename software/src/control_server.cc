@@ -0,0 +1,483 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fstream>
+#include <sstream>
+
+#include "deps.h"
+#include "control_server.h"
+
+using Rule = PacketFilter::Rule;
+using RuleSet = PacketFilter::RuleSet;
+
+ControlServer::ControlServer(PacketFilter& filter, std::mutex& filter_mutex,
+                             const std::string& path)
+    : filter_(filter), filter_mutex_(filter_mutex), path_(path) {
+}
+
+ControlServer::~ControlServer() {
+    stop();
+}
+
+bool ControlServer::start() {
+    sockaddr_un addr = {};
+    if (path_.size() >= sizeof(addr.sun_path)) {
+        log_error("Control socket path is too long: %s", path_.c_str());
+        return false;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path_.c_str());
+
+    if (pipe2(wake_fd_, O_CLOEXEC) < 0) {
+        log_error("Cannot create the control wakeup pipe: %s", strerror(errno));
+        return false;
+    }
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd_ < 0) {
+        log_error("Cannot create the control socket: %s", strerror(errno));
+        return false;
+    }
+    /* A socket left behind by a previous run would fail the bind */
+    unlink(path_.c_str());
+    if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        listen(listen_fd_, LISTEN_BACKLOG) < 0) {
+        log_error("Cannot listen on %s: %s", path_.c_str(), strerror(errno));
+        return false;
+    }
+
+    running_ = true;
+    thread_ = std::thread(&ControlServer::run, this);
+    log_info("Control socket listening on %s", path_.c_str());
+    return true;
+}
+
+void ControlServer::stop() {
+    if (thread_.joinable()) {
+        running_ = false;
+        char wake = 0;
+        if (write(wake_fd_[1], &wake, 1) < 0) {
+            log_warn("Cannot wake the control thread: %s", strerror(errno));
+        }
+        thread_.join();
+
+        for (auto& entry : clients_) {
+            close(entry.second.fd);
+        }
+        clients_.clear();
+        unlink(path_.c_str());
+        if (changes_ > 0) {
+            log_info("Control: %lu rule changes in %lu commits, %.1f us average and %.1f us "
+                     "max apply latency", changes_, commits_, latency_us_total_ / changes_,
+                     latency_us_max_);
+        }
+    }
+    for (int* fd : {&listen_fd_, &wake_fd_[0], &wake_fd_[1]}) {
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+void ControlServer::run() {
+    std::vector<pollfd> fds;
+    std::vector<uint64_t> ids;
+    while (running_) {
+        fds.clear();
+        ids.clear();
+        fds.push_back({wake_fd_[0], POLLIN, 0});
+        fds.push_back({listen_fd_, POLLIN, 0});
+        for (const auto& entry : clients_) {
+            short events = POLLIN | (entry.second.out.empty() ? 0 : POLLOUT);
+            fds.push_back({entry.second.fd, events, 0});
+            ids.push_back(entry.first);
+        }
+
+        /* Sleep until the pending changes are due, or for good without any */
+        timespec timeout;
+        timespec* timeout_ptr = nullptr;
+        if (!pending_.empty()) {
+            auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                batch_start_ + std::chrono::microseconds(COALESCE_US) - Clock::now()).count();
+            left = std::max<int64_t>(left, 0);
+            timeout = {static_cast<time_t>(left / 1000000000), static_cast<long>(left % 1000000000)};
+            timeout_ptr = &timeout;
+        }
+        if (ppoll(fds.data(), fds.size(), timeout_ptr, nullptr) < 0 && errno != EINTR) {
+            log_error("Control socket poll failed: %s", strerror(errno));
+            break;
+        }
+        if (fds[0].revents != 0) {
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            accept_client();
+        }
+
+        for (size_t i = 0; i < ids.size(); i++) {
+            if ((fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR)) == 0) {
+                continue;
+            }
+            auto it = clients_.find(ids[i]);
+            if (!read_client(it->second, it->first)) {
+                close(it->second.fd);
+                clients_.erase(it);
+            }
+        }
+
+        if (!pending_.empty() &&
+            Clock::now() - batch_start_ >= std::chrono::microseconds(COALESCE_US)) {
+            apply_pending();
+        }
+
+        for (auto it = clients_.begin(); it != clients_.end();) {
+            Client& client = it->second;
+            ssize_t sent = client.out.empty() ? 0 :
+                send(client.fd, client.out.data(), client.out.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                close(client.fd);
+                it = clients_.erase(it);
+                continue;
+            }
+            client.out.erase(0, std::max<ssize_t>(sent, 0));
+            ++it;
+        }
+    }
+
+    /* Changes already read are still applied, their replies are best effort */
+    apply_pending();
+    for (auto& entry : clients_) {
+        const std::string& out = entry.second.out;
+        if (!out.empty() && send(entry.second.fd, out.data(), out.size(), MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+            log_debug("Dropped the replies of a control client: %s", strerror(errno));
+        }
+    }
+}
+
+void ControlServer::accept_client() {
+    int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_warn("Cannot accept a control client: %s", strerror(errno));
+        }
+        return;
+    }
+    if (clients_.size() >= MAX_CLIENTS) {
+        log_warn("Refusing a control client, %zu already connected", clients_.size());
+        close(fd);
+        return;
+    }
+    clients_[next_client_++] = Client{fd, "", ""};
+}
+
+/* Returns false once the client is gone, after handling what it sent */
+bool ControlServer::read_client(Client& client, uint64_t id) {
+    bool open = true;
+    char buf[4096];
+    while (true) {
+        ssize_t len = recv(client.fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (len > 0) {
+            client.in.append(buf, len);
+            continue;
+        }
+        if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            open = false;
+        }
+        if (len == 0 || errno != EINTR) {
+            break;
+        }
+    }
+
+    size_t start = 0;
+    size_t end;
+    while ((end = client.in.find('\n', start)) != std::string::npos) {
+        std::string line = client.in.substr(start, end - start);
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        handle_line(id, line);
+        start = end + 1;
+    }
+    client.in.erase(0, start);
+    if (client.in.size() > MAX_LINE) {
+        log_warn("Control client sent a line of more than %zu bytes", MAX_LINE);
+        return false;
+    }
+    return open;
+}
+
+void ControlServer::handle_line(uint64_t id, const std::string& line) {
+    std::istringstream ss(line);
+    std::string command, rule, action, extra;
+    ss >> command >> rule >> action >> extra;
+    if (command.empty()) {
+        return;
+    }
+
+    /* Queries see every change sent before them */
+    if (command == "stats" || command == "rules") {
+        apply_pending();
+        reply(id, !rule.empty() ? "error " + command + " takes no arguments" :
+                  command == "stats" ? stats() : rules());
+        return;
+    }
+
+    Change change = {};
+    change.client = id;
+    change.received = Clock::now();
+    if (command == "add" || command == "replace" || command == "del") {
+        change.op = command == "add" ? OP_ADD : command == "replace" ? OP_REPLACE : OP_DELETE;
+        if (rule.empty() || !extra.empty() || (change.op == OP_DELETE && !action.empty()) ||
+            (change.op == OP_REPLACE && action.empty())) {
+            change.error = "usage: " + command + " <rule>" +
+                           (change.op == OP_DELETE ? "" : change.op == OP_ADD ? " [<action>]" :
+                                                                               " <action>");
+        } else if (!PacketFilter::parse_rule(rule, PacketFilter::RULE_ACTION_FORWARD, change.rule)) {
+            change.error = "invalid rule " + rule;
+        } else if (!action.empty() && !parse_action(action, change.rule)) {
+            change.error = "invalid action " + action;
+        }
+    } else if (command == "load") {
+        change.op = OP_LOAD;
+        if (rule.empty() || !action.empty()) {
+            change.error = "usage: load <path>";
+        } else {
+            load_rules(rule, change.rules, change.error);
+        }
+    } else {
+        change.op = OP_ADD;
+        change.error = "unknown command " + command;
+    }
+    stage(std::move(change));
+}
+
+void ControlServer::stage(Change change) {
+    if (pending_.empty()) {
+        std::lock_guard<std::mutex> lock(filter_mutex_);
+        staged_ = filter_.rules();
+        batch_start_ = Clock::now();
+    }
+    if (change.error.empty()) {
+        apply(change, staged_, change.error);
+    }
+    pending_.push_back(std::move(change));
+    if (pending_.size() >= MAX_BATCH) {
+        apply_pending();
+    }
+}
+
+void ControlServer::apply_pending() {
+    if (pending_.empty()) {
+        return;
+    }
+    std::vector<Change> batch;
+    batch.swap(pending_);
+    bool changed = std::any_of(batch.begin(), batch.end(),
+                               [](const Change& change) { return change.error.empty(); });
+    if (changed) {
+        std::lock_guard<std::mutex> lock(filter_mutex_);
+        if (filter_.commit(staged_)) {
+            commits_++;
+            Clock::time_point now = Clock::now();
+            for (auto& change : batch) {
+                change.applied = now;
+            }
+        } else {
+            /* The filter refused the batch as a whole (e.g. a rule it cannot place), so
+             * retry the changes one by one and only refuse those it cannot take */
+            for (auto& change : batch) {
+                RuleSet rules = filter_.rules();
+                if (!change.error.empty() || !apply(change, rules, change.error)) {
+                    continue;
+                }
+                if (!filter_.commit(rules)) {
+                    change.error = "rejected by the filter";
+                    continue;
+                }
+                commits_++;
+                change.applied = Clock::now();
+            }
+        }
+    }
+
+    char buf[64];
+    for (const auto& change : batch) {
+        if (!change.error.empty()) {
+            reply(change.client, "error " + change.error);
+            continue;
+        }
+        double us = std::chrono::duration<double, std::micro>(change.applied - change.received).count();
+        changes_++;
+        latency_us_total_ += us;
+        latency_us_max_ = std::max(latency_us_max_, us);
+        snprintf(buf, sizeof(buf), "ok %.1f", us);
+        reply(change.client, buf);
+    }
+}
+
+void ControlServer::reply(uint64_t id, const std::string& line) {
+    auto it = clients_.find(id);
+    if (it != clients_.end()) {
+        it->second.out += line;
+        it->second.out += '\n';
+    }
+}
+
+std::string ControlServer::stats() {
+    StatsSnapshot now;
+    size_t num_rules;
+    {
+        std::lock_guard<std::mutex> lock(filter_mutex_);
+        if (!filter_.snapshot(now)) {
+            return "error cannot read the statistics";
+        }
+        num_rules = filter_.rules().size();
+    }
+    StatsRate rate = {};
+    if (has_last_snap_) {
+        rate = StatsRate::between(last_snap_, now, PacketFilter::CORE_CLOCK_HZ);
+    }
+    last_snap_ = now;
+    has_last_snap_ = true;
+
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "ok packets=%lu forwarded=%lu dropped=%lu mirrored=%lu bytes=%lu mpps=%.3f "
+             "gbps=%.2f rules=%zu changes=%lu commits=%lu apply_us_avg=%.1f apply_us_max=%.1f",
+             now.packets, now.forwarded, now.dropped, now.mirrored, now.bytes, rate.pps / 1e6,
+             rate.gbps, num_rules, changes_, commits_,
+             changes_ > 0 ? latency_us_total_ / changes_ : 0.0, latency_us_max_);
+    return buf;
+}
+
+std::string ControlServer::rules() {
+    PacketFilter::RuleStats stats;
+    RuleSet rules;
+    {
+        std::lock_guard<std::mutex> lock(filter_mutex_);
+        if (!filter_.read_rule_stats(stats)) {
+            return "error cannot read the rule statistics";
+        }
+        rules = filter_.rules();
+    }
+    std::string out = "ok " + std::to_string(rules.size());
+    for (size_t i = 0; i < rules.size(); i++) {
+        out += "\n" + PacketFilter::format_rule(rules[i]) + " " + format_action(rules[i]) +
+               " packets=" + std::to_string(stats.rules[i].packets) +
+               " bytes=" + std::to_string(stats.rules[i].bytes);
+    }
+    return out;
+}
+
+bool ControlServer::apply(const Change& change, RuleSet& rules, std::string& error) {
+    if (change.op == OP_LOAD) {
+        rules = change.rules;
+        return true;
+    }
+    const Rule& rule = change.rule;
+    auto it = std::find_if(rules.begin(), rules.end(), [&rule](const Rule& r) {
+        return r.mask == rule.mask && (r.match & r.mask) == (rule.match & rule.mask);
+    });
+    if (change.op == OP_ADD) {
+        if (it != rules.end()) {
+            error = "rule exists " + PacketFilter::format_rule(*it);
+            return false;
+        }
+        rules.push_back(rule);
+        return true;
+    }
+    if (it == rules.end()) {
+        error = "no such rule " + PacketFilter::format_rule(rule);
+        return false;
+    }
+    if (change.op == OP_REPLACE) {
+        *it = rule;
+    } else {
+        rules.erase(it);
+    }
+    return true;
+}
+
+bool ControlServer::load_rules(const std::string& path, RuleSet& rules, std::string& error) {
+    std::ifstream file(path);
+    if (!file) {
+        error = "cannot read " + path;
+        return false;
+    }
+    rules.clear();
+    std::string line;
+    for (int line_num = 1; std::getline(file, line); line_num++) {
+        std::istringstream ss(line.substr(0, line.find('#')));
+        std::string spec, action, extra;
+        ss >> spec >> action >> extra;
+        if (spec.empty()) {
+            continue;
+        }
+        Rule rule;
+        if (!extra.empty() || !PacketFilter::parse_rule(spec, PacketFilter::RULE_ACTION_FORWARD, rule) ||
+            (!action.empty() && !parse_action(action, rule))) {
+            error = path + ":" + std::to_string(line_num) + ": invalid rule";
+            return false;
+        }
+        rules.push_back(rule);
+    }
+    return true;
+}
+
+bool ControlServer::parse_action(const std::string& action, Rule& rule) {
+    if (action == "forward" || action == "drop") {
+        rule.action = action == "forward" ? PacketFilter::RULE_ACTION_FORWARD :
+                                            PacketFilter::RULE_ACTION_DROP;
+        return true;
+    }
+    if (action.compare(0, 6, "steer=") == 0) {
+        std::string queue = action.substr(6);
+        char* end;
+        unsigned long value = strtoul(queue.c_str(), &end, 10);
+        if (queue == "rss") {
+            rule.queue = PacketFilter::QUEUE_RSS;
+        } else if (!queue.empty() && *end == '\0' && value < PacketFilter::MAX_QUEUES) {
+            rule.queue = static_cast<uint16_t>(value);
+        } else {
+            return false;
+        }
+        rule.action = PacketFilter::RULE_ACTION_STEER;
+        return true;
+    }
+    if (action.compare(0, 6, "limit=") == 0) {
+        uint64_t rate;
+        uint32_t burst;
+        char unit[4];
+        int end = 0;
+        if (sscanf(action.c_str() + 6, "%lu%3[a-z]:%u%n", &rate, unit, &burst, &end) != 3 ||
+            static_cast<size_t>(end) != action.size() - 6 || burst == 0 ||
+            (strcmp(unit, "pps") != 0 && strcmp(unit, "bps") != 0)) {
+            return false;
+        }
+        rule.action = PacketFilter::RULE_ACTION_RATE_LIMIT;
+        rule.limit = {strcmp(unit, "pps") == 0 ? PacketFilter::RATE_PPS : PacketFilter::RATE_BPS,
+                      rate, burst};
+        return true;
+    }
+    return false;
+}
+
+std::string ControlServer::format_action(const Rule& rule) {
+    switch (rule.action) {
+        case PacketFilter::RULE_ACTION_FORWARD:
+            return "forward";
+        case PacketFilter::RULE_ACTION_DROP:
+            return "drop";
+        case PacketFilter::RULE_ACTION_STEER:
+            return rule.queue == PacketFilter::QUEUE_RSS ? "steer=rss" :
+                                                           "steer=" + std::to_string(rule.queue);
+        case PacketFilter::RULE_ACTION_RATE_LIMIT:
+            return "limit=" + std::to_string(rule.limit.rate) +
+                   (rule.limit.unit == PacketFilter::RATE_PPS ? "pps:" : "bps:") +
+                   std::to_string(rule.limit.burst);
+        default:
+            return "invalid";
+    }
+}
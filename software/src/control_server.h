@@ -0,0 +1,112 @@
+#ifndef _CONTROL_SERVER_H_
+#define _CONTROL_SERVER_H_
+
+#include "packet_filter.h"
+
+/* Control plane of a running filter on a local Unix domain socket, served by its own
+ * thread so rules change without restarting the process. Clients send one command
+ * per line:
+ *
+ *   add <rule> [<action>]      add a rule, forwarded by default
+ *   replace <rule> <action>    change the action of a rule
+ *   del <rule>                 remove a rule
+ *   load <path>                replace all rules with those of a file, one
+ *                              "<rule> [<action>]" per line, '#' starts a comment
+ *   stats                      counters of the core and rates since the last stats
+ *   rules                      the rules with their counters
+ *
+ * Rules are written as for PacketFilter::parse_rule and are told apart by match and
+ * mask. An action is forward, drop, steer=<queue>, steer=rss or
+ * limit=<rate>pps:<burst> / limit=<rate>bps:<burst>.
+ *
+ * Every command gets one reply line in order, "ok ..." or "error <reason>", and
+ * "rules" follows its reply with one line per rule. Rule changes are not applied one
+ * at a time: the changes of all clients that arrive within COALESCE_US of the first
+ * are committed together, so a burst costs a single bank swap and only the table
+ * writes that differ. Their replies carry the apply latency, from the time the
+ * command was read to the end of the commit, in microseconds. */
+class ControlServer {
+private:
+    static constexpr uint32_t COALESCE_US    = 1000;
+    static constexpr size_t MAX_BATCH        = 4096;  /* changes per commit */
+    static constexpr size_t MAX_LINE         = 4096;
+    static constexpr size_t MAX_CLIENTS      = 64;
+    static constexpr int LISTEN_BACKLOG      = 16;
+
+    using Clock = std::chrono::steady_clock;
+
+    enum Op { OP_ADD, OP_REPLACE, OP_DELETE, OP_LOAD };
+
+    /* A command waiting for the next commit. Commands that fail before that keep
+     * their error, so the replies of a client stay in order. */
+    struct Change {
+        uint64_t client;
+        Op op;
+        PacketFilter::Rule rule;
+        PacketFilter::RuleSet rules;    /* OP_LOAD only */
+        std::string error;
+        Clock::time_point received;
+        Clock::time_point applied;
+    };
+
+    struct Client {
+        int fd;
+        std::string in;
+        std::string out;
+    };
+
+    PacketFilter& filter_;
+    std::mutex& filter_mutex_;
+    std::string path_;
+
+    int listen_fd_ = -1;
+    int wake_fd_[2] = {-1, -1};
+    std::thread thread_;
+    std::atomic<bool> running_{false};
+
+    std::map<uint64_t, Client> clients_;
+    uint64_t next_client_ = 0;
+
+    /* Rules as they will be once the pending changes are committed */
+    PacketFilter::RuleSet staged_;
+    std::vector<Change> pending_;
+    Clock::time_point batch_start_;
+
+    StatsSnapshot last_snap_;
+    bool has_last_snap_ = false;
+
+    /* Apply latency of every committed change */
+    uint64_t changes_ = 0;
+    uint64_t commits_ = 0;
+    double latency_us_total_ = 0;
+    double latency_us_max_ = 0;
+
+    void run();
+    void accept_client();
+    bool read_client(Client& client, uint64_t id);
+    void handle_line(uint64_t id, const std::string& line);
+    void stage(Change change);
+    void apply_pending();
+    void reply(uint64_t id, const std::string& line);
+    std::string stats();
+    std::string rules();
+
+    static bool apply(const Change& change, PacketFilter::RuleSet& rules, std::string& error);
+    static bool load_rules(const std::string& path, PacketFilter::RuleSet& rules,
+                           std::string& error);
+
+public:
+    ControlServer(PacketFilter& filter, std::mutex& filter_mutex, const std::string& path);
+    ~ControlServer();
+
+    /* Listens on the socket, replacing a stale one, and starts serving */
+    bool start();
+    /* Applies what is pending and closes every connection */
+    void stop();
+
+    /* <action> as taken by the commands, into rule */
+    static bool parse_action(const std::string& action, PacketFilter::Rule& rule);
+    static std::string format_action(const PacketFilter::Rule& rule);
+};
+
+#endif // _CONTROL_SERVER_H_
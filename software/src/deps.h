@@ -1,11 +1,26 @@
 #ifndef _DEPS_H_
 #define _DEPS_H_
 
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
 #include <vector>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <map>
+#include <chrono>
+#include <atomic>
 #include <mutex>
 #include <condition_variable>
 #include <thread>
 #include <functional>
+#include <memory>
+#include <tuple>
+#include <type_traits>
 
 #include "logging.h"
 class dummy_class {
@@ -6,8 +6,8 @@
 #include "deps.h"
 #include "dpdk.h"
 
-DPDK::DPDK(const char* dpdk_config, int num_threads) {
-    force_quit_ = false;
+DPDK::DPDK(const char* dpdk_config, int num_threads, bool forward) : drain_deadline_(0) {
+    forward_ = forward;
 
     main_thread_ = std::thread([this, dpdk_config, num_threads]() {
         int ret = init_dpdk(dpdk_config, num_threads);
@@ -20,35 +20,116 @@ DPDK::DPDK(const char* dpdk_config, int num_threads) {
 }
 
 DPDK::~DPDK() {
-    if (!force_quit_) {
-        trigger_shutdown();
-    }
     shutdown();
 }
 
 void DPDK::trigger_shutdown() {
-    force_quit_ = true;
+    uint64_t deadline = rte_rdtsc() + DPDK_DRAIN_MS * rte_get_tsc_hz() / 1000;
+    uint64_t running = 0;
+    if (!drain_deadline_.compare_exchange_strong(running, deadline)) {
+        return;
+    }
+    /* Wake the rx loops still waiting for a handler */
+    for (auto& tinfo : thread_infos_) {
+        std::lock_guard<std::mutex> lock(tinfo->callback_mutex);
+        tinfo->callback_cv.notify_all();
+    }
+}
+
+void DPDK::stop() {
+    if (stopped_) {
+        return;
+    }
+    trigger_shutdown();
+    main_thread_.join();
+    rte_eal_mp_wait_lcore();
+    stopped_ = true;
 }
 
 void DPDK::register_callback(uint16_t thread_id, rx_callback_t rx_callback) {
+    /* Per-packet callbacks run on top of the burst loop; mbufs are still freed in bulk */
+    register_handler(thread_id, [rx_callback](uint16_t tid, rte_mbuf** bufs,
+                                              uint16_t nb_rx) -> uint16_t {
+        for (uint16_t i = 0; i < nb_rx; i++) {
+            log_debug("Processing packet %u on thread_id %u with length %u",
+                      i, tid, rte_pktmbuf_pkt_len(bufs[i]));
+
+            /* Process the packet using the registered callback */
+            int ret = rx_callback(tid, bufs[i]);
+            if (ret < 0) {
+                log_warn("Packet processing failed on thread_id %u, packet %u", tid, i);
+            }
+
+            /* Prefetch next packets */
+            if (i + DPDK_PREFETCH_NUM < nb_rx) {
+                rte_prefetch0(rte_pktmbuf_mtod(bufs[i + DPDK_PREFETCH_NUM], uint8_t*));
+            }
+        }
+        return nb_rx;
+    });
+}
+
+void DPDK::register_burst_callback(uint16_t thread_id, rx_burst_callback_t rx_burst_callback) {
+    register_handler(thread_id, rx_burst_callback);
+}
+
+uint16_t DPDK::forward_burst(uint16_t thread_id, rte_mbuf** mbufs, uint16_t nb_pkts) {
+    auto* tinfo = thread_infos_[thread_id].get();
+
+    uint16_t nb_tx = rte_eth_tx_burst(tinfo->tx_port_id, tinfo->queue_id, mbufs, nb_pkts);
+    for (size_t retry = 0; nb_tx < nb_pkts && retry < DPDK_TX_RETRY_NUM; retry++) {
+        nb_tx += rte_eth_tx_burst(tinfo->tx_port_id, tinfo->queue_id,
+                                  mbufs + nb_tx, nb_pkts - nb_tx);
+    }
+
+    tinfo->tx_pkts += nb_tx;
+    if (unlikely(nb_tx < nb_pkts)) {
+        tinfo->tx_drops += nb_pkts - nb_tx;
+        rte_pktmbuf_free_bulk(mbufs + nb_tx, nb_pkts - nb_tx);
+    }
+    return nb_tx;
+}
+
+void DPDK::read_rx_loop_stats(uint16_t thread_id, RxLoopSnapshot& snapshot) const {
     log_assert(thread_id < thread_infos_.size(), "Invalid thread_id: %u", thread_id);
+    thread_infos_[thread_id]->rx_loop_stats.read(snapshot);
+}
 
-    log_debug("Registering callback for thread_id: %u", thread_id);
-    auto& tinfo = thread_infos_[thread_id];
+void DPDK::show_stats() {
+    log_info("DPDK Statistics:");
+    for (auto& tinfo : thread_infos_) {
+        double secs = static_cast<double>(tinfo->stop_tsc - tinfo->start_tsc) / rte_get_tsc_hz();
+        if (tinfo->start_tsc == 0 || secs <= 0) {
+            continue;
+        }
+        log_info("  thread %u (port %u, queue %u): rx %lu (%.3f Mpps), "
+                 "tx %lu (%.3f Mpps), tx dropped %lu",
+                 tinfo->thread_id, tinfo->port_id, tinfo->queue_id,
+                 tinfo->rx_pkts, tinfo->rx_pkts / secs / 1e6,
+                 tinfo->tx_pkts, tinfo->tx_pkts / secs / 1e6,
+                 tinfo->tx_drops);
+        RxLoopSnapshot rx_loop;
+        tinfo->rx_loop_stats.read(rx_loop);
+        log_info("    rx loop: %s", rx_loop.format().c_str());
+    }
 
-    tinfo->rx_callback = rx_callback;
-    {
-        std::lock_guard<std::mutex> lock(tinfo->callback_mutex);
-        tinfo->callback_cv.notify_all();
+    for (uint16_t port_id = 0; port_id < port_num_; port_id++) {
+        struct rte_eth_stats stats;
+        if (rte_eth_stats_get(port_id, &stats) != 0) {
+            continue;
+        }
+        log_info("  port %u: ipackets %lu, imissed %lu, ierrors %lu, "
+                 "opackets %lu, oerrors %lu, rx_nombuf %lu",
+                 port_id, stats.ipackets, stats.imissed, stats.ierrors,
+                 stats.opackets, stats.oerrors, stats.rx_nombuf);
     }
 }
 
 void DPDK::shutdown() {
-    main_thread_.join();
-    rte_eal_mp_wait_lcore();
+    stop();
 
+    show_stats();
     for (uint16_t port_id = 0; port_id < port_num_; port_id++) {
-        /* TODO: add dpdk stats print */
         rte_eth_dev_stop(port_id);
         rte_eth_dev_close(port_id);
     }
@@ -62,58 +143,29 @@ int DPDK::dpdk_rx_loop(void* arg) {
 
     /* Make sure callback is registered before starting the rx loop 
      * to avoid dropping packets or processing packets without a callback. */
+    bool registered;
     {
         std::unique_lock<std::mutex> lock(tinfo->callback_mutex);
         tinfo->callback_cv.wait(lock, [tinfo, dpdk]() -> bool {
-            if (dpdk->force_quit_) {
+            if (dpdk->stopping()) {
                 return true;
             }
             log_debug("Waiting for callback registration on thread_id: %u",
                       tinfo->thread_id);
-            return tinfo->rx_callback != nullptr;
+            return tinfo->rx_loop != nullptr;
         });
+        registered = tinfo->rx_loop != nullptr;
+    }
+
+    /* Loops that got a handler drain their queue even if shutdown came first */
+    if (!registered) {
+        return 0;
     }
 
     log_info("Starting rx loop on thread_id: %u, port_id: %u, queue_id: %u",
              tinfo->thread_id, tinfo->port_id, tinfo->queue_id);
 
-    struct rte_mbuf* bufs[DPDK_BURST_SIZE];
-    while (!dpdk->force_quit_) {
-        uint16_t nb_rx = rte_eth_rx_burst(tinfo->port_id, tinfo->queue_id,
-                                          bufs, DPDK_BURST_SIZE);
-        if (nb_rx == 0) {
-            continue;
-        }
-
-        log_debug("Received %u packets on thread_id: %u", nb_rx, tinfo->thread_id);
-
-        /* Prefetch first packets to the cache for processing */
-        for (uint16_t i = 0; i < nb_rx && i < DPDK_PREFETCH_NUM; i++) {
-            rte_prefetch0(rte_pktmbuf_mtod(bufs[i], uint8_t*));
-        }
-
-        for (uint16_t i = 0; i < nb_rx; i++) {
-            log_debug("Processing packet %u on thread_id %u with length %u",
-                      i, tinfo->thread_id, rte_pktmbuf_pkt_len(bufs[i]));
-
-            /* Process the packet using the registered callback */
-            int ret = tinfo->rx_callback(tinfo->thread_id, bufs[i]);
-            if (ret < 0) {
-                log_warn("Packet processing failed on thread_id %u, packet %u",
-                         tinfo->thread_id, i);
-            }
-
-            /* Free the mbuf after processing */
-            rte_pktmbuf_free(bufs[i]);
-
-            /* Prefetch next packets */
-            if (i + DPDK_PREFETCH_NUM < nb_rx) {
-                rte_prefetch0(rte_pktmbuf_mtod(bufs[i + DPDK_PREFETCH_NUM], uint8_t*));
-            }
-        }
-    }
-
-    return 0;
+    return tinfo->rx_loop(tinfo);
 }
 
 int DPDK::init_dpdk(const char* argv_str, int num_threads) {
@@ -168,7 +220,8 @@ int DPDK::init_dpdk(const char* argv_str, int num_threads) {
         size_t queue_num = num_threads / port_num_;
         for (size_t q = 0; q < queue_num; q++) {
             uint16_t thread_id = port_id * queue_num + q;
-            thread_infos_[thread_id] = std::make_shared<thread_info>(port_id, q, thread_id, this);
+            thread_infos_[thread_id] = std::make_shared<thread_info>(port_id, q, thread_id,
+                                                                     forward_port(port_id), this);
         }
     }
 
@@ -187,6 +240,13 @@ int DPDK::init_dpdk(const char* argv_str, int num_threads) {
     return dpdk_rx_loop(thread_infos_[0].get());
 }
 
+/* Ports are paired (0 <-> 1, 2 <-> 3, ...) for forwarding; an unpaired
+ * last port sends back out of itself. */
+uint16_t DPDK::forward_port(uint16_t port_id) const {
+    uint16_t peer = port_id ^ 1;
+    return peer < port_num_ ? peer : port_id;
+}
+
 int DPDK::port_init(uint16_t port_id) {
     if (!rte_eth_dev_is_valid_port(port_id)) {
         log_error("Invalid port id %u", port_id);
@@ -204,9 +264,25 @@ int DPDK::port_init(uint16_t port_id) {
     struct rte_eth_conf port_conf;
     memset(&port_conf, 0, sizeof(port_conf));
 
-    /* Since we are only receiving packets, we only need to configure RX queues */
+    /* Mbufs of a tx queue all come from the pool of the one thread feeding it */
+    if (forward_ && (dev_info.tx_offload_capa & RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE)) {
+        port_conf.txmode.offloads |= RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE;
+    }
+
+    /* Unless forwarding, we are only receiving packets and only need RX queues */
     size_t queue_num = thread_infos_.size() / port_num_;
-    ret = rte_eth_dev_configure(port_id, queue_num, 0, &port_conf);
+
+    /* Spread flows over the rx queues on ports that hash in the NIC. The FPGA filter
+     * steers its packets through tuser instead (PacketFilter::set_rss_queues()). */
+    uint64_t rss_hf = (RTE_ETH_RSS_IP | RTE_ETH_RSS_UDP | RTE_ETH_RSS_TCP) &
+                      dev_info.flow_type_rss_offloads;
+    if (queue_num > 1 && rss_hf != 0) {
+        port_conf.rxmode.mq_mode = RTE_ETH_MQ_RX_RSS;
+        port_conf.rx_adv_conf.rss_conf.rss_hf = rss_hf;
+    }
+
+    size_t tx_queue_num = forward_ ? queue_num : 0;
+    ret = rte_eth_dev_configure(port_id, queue_num, tx_queue_num, &port_conf);
     if (ret < 0) {
         log_error("Failed to configure port %u: %s", port_id, rte_strerror(-ret));
         return -1;
@@ -214,7 +290,7 @@ int DPDK::port_init(uint16_t port_id) {
 
     /* Adjust number of descriptors */
     uint16_t rx_rings = DPDK_DESC_RING_SIZE;
-    uint16_t tx_rings = 0;
+    uint16_t tx_rings = forward_ ? DPDK_DESC_RING_SIZE : 0;
     ret = rte_eth_dev_adjust_nb_rx_tx_desc(port_id, &rx_rings, &tx_rings);
     if (ret < 0) {
         log_error("Failed to adjust number of descriptors for port %u: %s",
@@ -239,6 +315,18 @@ int DPDK::port_init(uint16_t port_id) {
         }
     }
 
+    struct rte_eth_txconf txconf = dev_info.default_txconf;
+    txconf.offloads = port_conf.txmode.offloads;
+    for (size_t q = 0; q < tx_queue_num; q++) {
+        ret = rte_eth_tx_queue_setup(port_id, q, tx_rings,
+                                     rte_eth_dev_socket_id(port_id), &txconf);
+        if (ret < 0) {
+            log_error("Failed to setup TX queue %zu for port %u: %s",
+                      q, port_id, rte_strerror(-ret));
+            return -1;
+        }
+    }
+
     ret = rte_eth_dev_start(port_id);
     if (ret < 0) {
         log_error("Failed to start port %u: %s", port_id, rte_strerror(-ret));
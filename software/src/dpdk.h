@@ -3,6 +3,8 @@
 
 #include <rte_ethdev.h>
 
+#include "rx_stats.h"
+
 class DPDK {
 private:
     static const size_t DPDK_MAX_MBUFS          = 8192;
@@ -11,18 +13,31 @@ private:
     static const size_t DPDK_BURST_SIZE         = 32;
     static const size_t DPDK_WRITEBACK_THRESH   = 64;
     static const size_t DPDK_PREFETCH_NUM       = 4;
+    static const size_t DPDK_TX_RETRY_NUM       = 8;
+    static const size_t DPDK_DRAIN_MS           = 100;
 
     using rx_callback_t = std::function<int(uint16_t, rte_mbuf* mbuf)>;
+    /* Burst callbacks receive the whole burst returned by rte_eth_rx_burst and return
+     * the number of mbufs, compacted to the front of the array, that the rx loop should
+     * release. Mbufs past that count are owned by the handler (kept or forwarded). */
+    using rx_burst_callback_t = std::function<uint16_t(uint16_t, rte_mbuf** mbufs, uint16_t nb_rx)>;
     struct thread_info;
+    using rx_loop_t = std::function<int(thread_info*)>;
 
     uint16_t port_num_;
     std::vector<rte_mempool*> mbuf_pools_;
 
+    /* Forwarding mode: every rx queue gets a matching tx queue on the paired port */
+    bool forward_;
+
     /* Main thread to initialize DPDK and will be used to launch one of the rx threads */
     std::thread main_thread_;
 
     std::vector<std::shared_ptr<thread_info>> thread_infos_;
-    volatile bool force_quit_;
+    /* 0 while running; once shutdown is triggered, the TSC by which the rx loops stop
+     * even if their queue never runs empty */
+    std::atomic<uint64_t> drain_deadline_;
+    bool stopped_ = false;
 
 
     /* Synchronization for DPDK initialization */
@@ -32,34 +47,172 @@ private:
 private:
     int init_dpdk(const char* argv_str, int num_threads);
     int port_init(uint16_t port_id);
+    uint16_t forward_port(uint16_t port_id) const;
 
     static int dpdk_rx_loop(void* arg);
+    template<bool LoopStats, typename Handler>
+    int rx_burst_loop(thread_info* tinfo, Handler& handler);
+    bool stopping() const { return drain_deadline_.load(std::memory_order_relaxed) != 0; }
     void shutdown();
+    void show_stats();
 
 public:
     DPDK() = delete;
-    DPDK(const char* dpdk_config, int num_threads = 1);
+    DPDK(const char* dpdk_config, int num_threads = 1, bool forward = false);
     ~DPDK();
     void register_callback(uint16_t thread_id, rx_callback_t rx_callback);
+    void register_burst_callback(uint16_t thread_id, rx_burst_callback_t rx_burst_callback);
+
+    /* Bind a handler with the rx_burst_callback_t signature at compile time, so the
+     * hot loop is instantiated for the handler type and the call can be inlined.
+     * With LoopStats false that loop neither reads the TSC nor updates its
+     * RxLoopStats, which then stay zero (bench_rx_loop_stats measures the cost). */
+    template<bool LoopStats = true, typename Handler>
+    void register_handler(uint16_t thread_id, Handler handler);
+    /* Lets the rx loops drain their queues and return, at most DPDK_DRAIN_MS later */
     void trigger_shutdown();
+    /* Triggers shutdown and waits for every rx loop to return, so handlers no longer
+     * run and per-thread counters are final. The ports stay open until destruction. */
+    void stop();
+
+    uint16_t ports() const { return port_num_; }
+    uint16_t threads() const { return thread_infos_.size(); }
+    /* Rx queues of every port, one per thread */
+    uint16_t queues_per_port() const { return thread_infos_.size() / port_num_; }
+
+    /* Zero-copy transmit of a received burst on the thread's paired tx queue.
+     * Retries while the tx ring is full and frees (and counts) whatever could not
+     * be sent, so the caller no longer owns any of the mbufs afterwards. */
+    uint16_t forward_burst(uint16_t thread_id, rte_mbuf** mbufs, uint16_t nb_pkts);
+
+    /* Adds the rx loop counters of a thread to snapshot, safe from any thread */
+    void read_rx_loop_stats(uint16_t thread_id, RxLoopSnapshot& snapshot) const;
+
+    /* Moves the mbufs of a received burst that release() returns true for to the
+     * front, as burst handlers return them, and returns how many there are. Mbufs
+     * are passed to release() in order and the others keep their order, through a
+     * scratch array on the stack rather than the heap. */
+    template<typename Release>
+    static uint16_t compact_burst(rte_mbuf** mbufs, uint16_t nb_pkts, Release release);
 
 private:
     struct thread_info {
         uint16_t port_id;
         uint16_t queue_id;
         uint16_t thread_id;
+        uint16_t tx_port_id;
+
+        /* Per-queue counters, only written by the owning lcore */
+        uint64_t rx_pkts = 0;
+        uint64_t tx_pkts = 0;
+        uint64_t tx_drops = 0;
+        uint64_t start_tsc = 0;
+        uint64_t stop_tsc = 0;
+        RxLoopStats rx_loop_stats;
 
         DPDK* dpdk_instance;
-        rx_callback_t rx_callback;
+        /* Rx loop instantiated for the registered handler */
+        rx_loop_t rx_loop;
 
         /* Synchronization for callback registration since the rx loop may start before
          * the callback is registered. */
         std::mutex callback_mutex;
         std::condition_variable callback_cv;
 
-        thread_info(uint16_t port, uint16_t queue, uint16_t tid, DPDK* instance)
-            : port_id(port), queue_id(queue), thread_id(tid), dpdk_instance(instance) {}
+        thread_info(uint16_t port, uint16_t queue, uint16_t tid, uint16_t tx_port, DPDK* instance)
+            : port_id(port), queue_id(queue), thread_id(tid), tx_port_id(tx_port),
+              dpdk_instance(instance) {}
     };
 };
 
+template<bool LoopStats, typename Handler>
+void DPDK::register_handler(uint16_t thread_id, Handler handler) {
+    log_assert(thread_id < thread_infos_.size(), "Invalid thread_id: %u", thread_id);
+
+    log_debug("Registering handler for thread_id: %u", thread_id);
+    auto& tinfo = thread_infos_[thread_id];
+    {
+        std::lock_guard<std::mutex> lock(tinfo->callback_mutex);
+        tinfo->rx_loop = [this, handler](thread_info* info) mutable -> int {
+            return rx_burst_loop<LoopStats>(info, handler);
+        };
+        tinfo->callback_cv.notify_all();
+    }
+}
+
+template<typename Release>
+uint16_t DPDK::compact_burst(rte_mbuf** mbufs, uint16_t nb_pkts, Release release) {
+    log_assert(nb_pkts <= DPDK_BURST_SIZE, "Burst of %u mbufs is too large", nb_pkts);
+    rte_mbuf* kept[DPDK_BURST_SIZE];
+    uint16_t nb_release = 0;
+    uint16_t nb_kept = 0;
+    for (uint16_t i = 0; i < nb_pkts; i++) {
+        if (release(mbufs[i])) {
+            mbufs[nb_release++] = mbufs[i];
+        } else {
+            kept[nb_kept++] = mbufs[i];
+        }
+    }
+    memcpy(mbufs + nb_release, kept, nb_kept * sizeof(rte_mbuf*));
+    return nb_release;
+}
+
+template<bool LoopStats, typename Handler>
+int DPDK::rx_burst_loop(thread_info* tinfo, Handler& handler) {
+    static_assert(DPDK_BURST_SIZE <= RxLoopSnapshot::MAX_BURST, "Burst sizes are not all counted");
+    struct rte_mbuf* bufs[DPDK_BURST_SIZE];
+    RxLoopStats& stats = tinfo->rx_loop_stats;
+    tinfo->start_tsc = rte_get_tsc_cycles();
+    /* Each stage ends where the next one starts, so a poll reads the TSC at most
+     * three times */
+    uint64_t now = LoopStats ? rte_rdtsc() : 0;
+    /* Once shutdown is triggered the loop keeps going until a poll comes back empty,
+     * so packets already received by the queue are still handled */
+    while (true) {
+        uint16_t nb_rx = rte_eth_rx_burst(tinfo->port_id, tinfo->queue_id,
+                                          bufs, DPDK_BURST_SIZE);
+        uint64_t rx_end = LoopStats ? rte_rdtsc() : 0;
+        if (nb_rx == 0) {
+            if (LoopStats) {
+                stats.empty_poll(rx_end - now);
+                now = rx_end;
+            }
+            if (unlikely(stopping())) {
+                break;
+            }
+            continue;
+        }
+        tinfo->rx_pkts += nb_rx;
+
+        log_debug("Received %u packets on thread_id: %u", nb_rx, tinfo->thread_id);
+
+        /* Prefetch first packets to the cache for processing */
+        for (uint16_t i = 0; i < nb_rx && i < DPDK_PREFETCH_NUM; i++) {
+            rte_prefetch0(rte_pktmbuf_mtod(bufs[i], uint8_t*));
+        }
+
+        /* Release whatever the handler did not keep in a single bulk free */
+        uint16_t nb_free = handler(tinfo->thread_id, bufs, nb_rx);
+        uint64_t handler_end = LoopStats ? rte_rdtsc() : 0;
+        if (nb_free > 0) {
+            rte_pktmbuf_free_bulk(bufs, nb_free);
+        }
+        if (LoopStats) {
+            uint64_t free_end = rte_rdtsc();
+            stats.busy_poll(nb_rx, rx_end - now, handler_end - rx_end, free_end - handler_end);
+            now = free_end;
+        }
+
+        uint64_t deadline = drain_deadline_.load(std::memory_order_relaxed);
+        if (unlikely(deadline != 0 && (LoopStats ? now : rte_rdtsc()) >= deadline)) {
+            log_warn("Rx queue %u of port %u was still receiving after %zu ms of draining",
+                     tinfo->queue_id, tinfo->port_id, DPDK_DRAIN_MS);
+            break;
+        }
+    }
+    tinfo->stop_tsc = rte_get_tsc_cycles();
+
+    return 0;
+}
+
 #endif // _DPDK_H_
@@ -0,0 +1,54 @@
+#include "deps.h"
+#include "filter_geometry.h"
+
+/* toeplitz_key.range(offset + 31, offset) */
+uint32_t FilterGeometry::get_window(int offset) {
+    int word = offset / 32;
+    int bit = offset % 32;
+    if (bit == 0) {
+        return TOEPLITZ_KEY[word];
+    }
+    return (TOEPLITZ_KEY[word] >> bit) | (TOEPLITZ_KEY[word + 1] << (32 - bit));
+}
+
+/* [31:0] dest_ip, [47:32] dest_port, [79:48] src_ip, [95:80] src_port, [103:96] protocol,
+ * with each address folded to the XOR of its four words */
+uint8_t FilterGeometry::hash_byte(const FlowKey& key, uint32_t byte) {
+    auto fold = [](const PacketFilter::IPAddress& addr, uint32_t byte) -> uint8_t {
+        return addr.bytes[byte] ^ addr.bytes[byte + 4] ^ addr.bytes[byte + 8] ^
+               addr.bytes[byte + 12];
+    };
+    switch (byte) {
+        case 0: case 1: case 2: case 3:
+            return fold(key.dst_ip, byte);
+        case 4: case 5:
+            return key.dst_port >> (8 * (byte - 4));
+        case 6: case 7: case 8: case 9:
+            return fold(key.src_ip, byte - 6);
+        case 10: case 11:
+            return key.src_port >> (8 * (byte - 10));
+        default:
+            return key.protocol;
+    }
+}
+
+uint32_t FilterGeometry::toeplitz(const uint8_t* input, uint32_t way) {
+    int base = way * KEY_STRIDE;
+    uint32_t hash = 0;
+    for (uint32_t byte = 0; byte < HASH_INPUT_LEN; byte++) {
+        for (int i = 0; i < 8; i++) {
+            if ((input[byte] >> i) & 1) {
+                hash ^= get_window(base + 8 * byte + i);
+            }
+        }
+    }
+    return hash;
+}
+
+uint32_t FilterGeometry::compute_hash(const FlowKey& key, uint32_t way) {
+    uint8_t input[HASH_INPUT_LEN];
+    for (uint32_t byte = 0; byte < HASH_INPUT_LEN; byte++) {
+        input[byte] = hash_byte(key, byte);
+    }
+    return toeplitz(input, way);
+}
@@ -0,0 +1,48 @@
+#ifndef _FILTER_GEOMETRY_H_
+#define _FILTER_GEOMETRY_H_
+
+#include "packet_filter.h"
+
+/* Table geometry of the packet filter core and the Toeplitz hash that places rules
+ * in it (hardware/src/hls/hash.h and meter.h). PacketFilter, RuleCompiler and
+ * PacketFilterModel all size their tables and hash keys from here.
+ * Keep it in sync with the HLS sources. */
+class FilterGeometry {
+public:
+    using FlowKey = PacketFilter::FlowKey;
+
+    /* RULE_TABLES, RULE_TABLE_SIZE and RULE_TABLE_WAYS in hash.h */
+    static constexpr uint32_t HASH_TABLES     = 4;
+    static constexpr uint32_t HASH_TABLE_SIZE = 2048;
+    static constexpr uint32_t HASH_TABLE_WAYS = 4;
+    static constexpr uint32_t HASH_MASK       = HASH_TABLE_SIZE - 1;
+    static constexpr uint32_t HASH_INPUT_LEN  = 13;  /* bytes of the 104-bit hash_input_t */
+    static constexpr uint32_t KEY_STRIDE      = 136;
+    static constexpr uint32_t TOEPLITZ_WORDS  = 18;  /* 576-bit key */
+
+    /* RATE_BUCKETS in meter.h */
+    static constexpr uint32_t RATE_BUCKETS    = 1024;
+
+private:
+    /* Same predefined key as ToeplitzHash::ToeplitzHash(), word i holds bits [32i+31:32i] */
+    static constexpr uint32_t TOEPLITZ_KEY[TOEPLITZ_WORDS] = {
+        0xD6E31417, 0x376CC87E, 0x011BA7A6, 0xDC1B91BB, 0x7872E224,
+        0xBFD0404B, 0x260374B8, 0xD9270F6F, 0x18DC4386, 0x7C9C37DE,
+        0x6A42B73B, 0xBEAC01FA, 0x3D2F1E0C, 0x9B5A4C37, 0x5C8E0F71,
+        0xA3E4B215, 0x47D1C96E, 0xE0295B83,
+    };
+
+    static uint32_t get_window(int offset);
+
+public:
+    /* Byte `byte` of the hash_input_t a key is folded into (ToeplitzHash::fold()) */
+    static uint8_t hash_byte(const FlowKey& key, uint32_t byte);
+
+    /* Toeplitz hash of way `way` over HASH_INPUT_LEN bytes of hash input */
+    static uint32_t toeplitz(const uint8_t* input, uint32_t way);
+
+    /* Hash of way `way` (ToeplitzHash::compute_hash()), the reference for RuleCompiler */
+    static uint32_t compute_hash(const FlowKey& key, uint32_t way);
+};
+
+#endif // _FILTER_GEOMETRY_H_
@@ -0,0 +1,41 @@
+#include "deps.h"
+#include "filter_metadata.h"
+
+int FilterMetadata::offset_ = -1;
+
+bool FilterMetadata::register_field() {
+    static const rte_mbuf_dynfield field = {
+        .name  = "packet_filter_metadata",
+        .size  = sizeof(FilterMetadata),
+        .align = alignof(FilterMetadata),
+        .flags = 0,
+    };
+    offset_ = rte_mbuf_dynfield_register(&field);
+    if (offset_ < 0) {
+        log_error("Cannot register the metadata mbuf field: %s", rte_strerror(rte_errno));
+        return false;
+    }
+    return true;
+}
+
+bool FilterMetadata::strip(rte_mbuf** mbufs, uint16_t nb_rx) {
+    bool complete = true;
+    for (uint16_t i = 0; i < nb_rx; i++) {
+        rte_mbuf* mbuf = mbufs[i];
+        FilterMetadata* meta = get(mbuf);
+
+        /* The core only prefixes frames, so the whole phit is in the first segment */
+        if (unlikely(rte_pktmbuf_data_len(mbuf) < PREFIX_BYTES)) {
+            memset(meta, 0, sizeof(*meta));
+            complete = false;
+            continue;
+        }
+        /* The fields are little endian on the bus, like the host */
+        memcpy(meta, rte_pktmbuf_mtod(mbuf, uint8_t*), sizeof(*meta));
+        rte_pktmbuf_adj(mbuf, PREFIX_BYTES);
+
+        mbuf->hash.rss = meta->hash;
+        mbuf->ol_flags |= RTE_MBUF_F_RX_RSS_HASH;
+    }
+    return complete;
+}
@@ -0,0 +1,44 @@
+#ifndef _FILTER_METADATA_H_
+#define _FILTER_METADATA_H_
+
+#include <rte_mbuf.h>
+#include <rte_mbuf_dyn.h>
+
+/* What the filter core found out about a forwarded frame. With
+ * PacketFilter::set_metadata() the core sends it in a phit of its own ahead of the
+ * frame; strip() moves it into a dynamic field of the mbuf, so handlers get the rule
+ * and hash of a packet without parsing its headers again. */
+struct FilterMetadata {
+    /* META_BYTES and META_HIT_BIT in packet_filter.cc */
+    static constexpr uint32_t PREFIX_BYTES = 64;
+    static constexpr uint32_t RULE_HIT     = 1u << 31;
+
+    /* RULE_HIT | (bank << 15) | (table, way, index) of the matched rule, 0 on a miss.
+     * Unique among the rules of both banks, so it can index per-rule state
+     * directly; PacketFilter::rule_of() tells which rule it is. */
+    uint32_t rule_id;
+    /* Toeplitz hash of the 5-tuple, the one the RSS table is indexed by */
+    uint32_t hash;
+    /* Core clock cycle the frame entered the core, see CoreClock */
+    uint64_t timestamp;
+
+    bool hit() const { return (rule_id & RULE_HIT) != 0; }
+
+    /* Registers the mbuf field; call once before get() or strip() */
+    static bool register_field();
+    static bool registered() { return offset_ >= 0; }
+
+    static FilterMetadata* get(rte_mbuf* mbuf) {
+        return RTE_MBUF_DYNFIELD(mbuf, offset_, FilterMetadata*);
+    }
+
+    /* Moves the metadata phit of each mbuf into its field, and the hash into
+     * mbuf->hash.rss. Returns false if a frame was too short to carry one; its
+     * field is then zeroed and the frame left as it is. */
+    static bool strip(rte_mbuf** mbufs, uint16_t nb_rx);
+
+private:
+    static int offset_;
+};
+
+#endif // _FILTER_METADATA_H_
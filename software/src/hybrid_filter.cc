@@ -0,0 +1,195 @@
+#include <limits>
+
+#include "deps.h"
+#include "hybrid_filter.h"
+
+HybridFilter::HybridFilter(PacketFilter& filter, std::mutex& filter_mutex,
+                           SoftwareFilter& software, uint32_t max_hardware)
+    : filter_(filter), filter_mutex_(filter_mutex), software_(software),
+      max_hardware_(max_hardware) {
+    const RuleSet& rules = software_.rules();
+    size_t n = rules.size();
+    above_.resize(n);
+    for (uint32_t i = 0; i < n; i++) {
+        for (uint32_t j = 0; j < n; j++) {
+            if (j != i && rules[j].priority >= rules[i].priority && overlap(rules[i], rules[j])) {
+                above_[i].push_back(j);
+            }
+        }
+    }
+    in_hardware_.assign(n, false);
+    rate_.assign(n, 0);
+    last_hardware_.assign(n, 0);
+    last_software_.assign(n, 0);
+}
+
+HybridFilter::~HybridFilter() {
+    stop();
+}
+
+/* Some key matches both rules when they agree on every bit both match on */
+bool HybridFilter::overlap(const Rule& a, const Rule& b) {
+    PacketFilter::FlowKey common = a.mask & b.mask;
+    return (a.match & common) == (b.match & common);
+}
+
+bool HybridFilter::start(bool rss) {
+    last_time_ = std::chrono::steady_clock::now();
+    if (!rebalance()) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(filter_mutex_);
+        if (!filter_.set_default_action(rss ? PacketFilter::RULE_ACTION_STEER :
+                                              PacketFilter::RULE_ACTION_FORWARD)) {
+            return false;
+        }
+    }
+    thread_ = std::thread(&HybridFilter::run, this);
+    return true;
+}
+
+void HybridFilter::stop() {
+    if (!thread_.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        cv_.notify_all();
+    }
+    thread_.join();
+    log_info("Hybrid filter: %zu of %zu rules in hardware, %lu promoted and %lu demoted",
+             hardware_rules(), in_hardware_.size(), promoted_, demoted_);
+}
+
+void HybridFilter::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!cv_.wait_for(lock, std::chrono::milliseconds(PERIOD_MS), [this] { return stop_; })) {
+        lock.unlock();
+        if (!update_rates() || !rebalance()) {
+            log_warn("Hybrid filter could not rebalance its rules");
+        }
+        lock.lock();
+    }
+}
+
+bool HybridFilter::update_rates() {
+    PacketFilter::RuleStats stats;
+    RuleSet stored;
+    {
+        std::lock_guard<std::mutex> lock(filter_mutex_);
+        if (!filter_.read_rule_stats(stats)) {
+            return false;
+        }
+        stored = filter_.rules();
+    }
+    std::map<std::pair<PacketFilter::FlowKey, PacketFilter::FlowKey>, uint64_t> hardware;
+    for (size_t i = 0; i < stored.size(); i++) {
+        hardware[{stored[i].mask, stored[i].match & stored[i].mask}] = stats.rules[i].packets;
+    }
+    std::vector<uint64_t> software = software_.hits();
+
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - last_time_).count();
+    last_time_ = now;
+    if (seconds <= 0) {
+        return true;
+    }
+
+    const RuleSet& rules = software_.rules();
+    for (size_t i = 0; i < rules.size(); i++) {
+        auto it = hardware.find({rules[i].mask, rules[i].match & rules[i].mask});
+        uint64_t count = it == hardware.end() ? 0 : it->second;
+        /* The core counts a rule from zero again once it left both banks */
+        uint64_t hardware_delta = count >= last_hardware_[i] ? count - last_hardware_[i] : count;
+        uint64_t software_delta = software[i] - last_software_[i];
+        last_hardware_[i] = count;
+        last_software_[i] = software[i];
+
+        double rate = (in_hardware_[i] ? hardware_delta : software_delta) / seconds;
+        rate_[i] = RATE_WEIGHT * rate + (1 - RATE_WEIGHT) * rate_[i];
+    }
+    return true;
+}
+
+bool HybridFilter::rebalance() {
+    const RuleSet& rules = software_.rules();
+    size_t n = rules.size();
+    std::vector<uint32_t> order(n);
+    for (uint32_t i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    /* Rate limits cost the software filter an atomic per packet shared by all rx
+     * lcores, and the core none, so those rules go first */
+    auto score = [this, &rules](uint32_t i) {
+        if (rules[i].action == PacketFilter::RULE_ACTION_RATE_LIMIT) {
+            return std::numeric_limits<double>::infinity();
+        }
+        return in_hardware_[i] ? (rate_[i] + MIN_RATE) * HYSTERESIS : rate_[i];
+    };
+    std::stable_sort(order.begin(), order.end(), [&score](uint32_t a, uint32_t b) {
+        return score(a) > score(b);
+    });
+
+    std::vector<bool> hardware(n, false);
+    for (size_t k = 0; k < n && (max_hardware_ == 0 || k < max_hardware_); k++) {
+        hardware[order[k]] = true;
+    }
+    RuleSet stored;
+    while (true) {
+        /* Drop the rules that would be stored without a rule above them */
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (uint32_t i = 0; i < n; i++) {
+                if (hardware[i] && std::any_of(above_[i].begin(), above_[i].end(),
+                                               [&hardware](uint32_t j) { return !hardware[j]; })) {
+                    hardware[i] = false;
+                    changed = true;
+                }
+            }
+        }
+
+        std::vector<uint32_t> index;
+        stored.clear();
+        for (uint32_t i : order) {
+            if (hardware[i]) {
+                stored.push_back(rules[i]);
+                index.push_back(i);
+            }
+        }
+        std::vector<uint32_t> conflicts;
+        {
+            std::lock_guard<std::mutex> lock(filter_mutex_);
+            conflicts = filter_.conflicts(stored);
+        }
+        if (conflicts.empty()) {
+            break;
+        }
+        for (uint32_t rule : conflicts) {
+            hardware[index[rule]] = false;
+        }
+    }
+
+    if (hardware == in_hardware_) {
+        return true;
+    }
+    {
+        std::lock_guard<std::mutex> lock(filter_mutex_);
+        if (!filter_.commit(stored)) {
+            return false;
+        }
+    }
+    size_t promoted = 0;
+    size_t demoted = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        promoted += hardware[i] && !in_hardware_[i];
+        demoted += !hardware[i] && in_hardware_[i];
+    }
+    promoted_ += promoted;
+    demoted_ += demoted;
+    in_hardware_ = hardware;
+    log_info("Hybrid filter: %zu rules in hardware, %zu in software (%zu promoted, %zu demoted)",
+             stored.size(), n - stored.size(), promoted, demoted);
+    return true;
+}
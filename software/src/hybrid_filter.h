@@ -0,0 +1,71 @@
+#ifndef _HYBRID_FILTER_H_
+#define _HYBRID_FILTER_H_
+
+#include "software_filter.h"
+
+/* Hybrid mode: the SoftwareFilter of the rx lcores enforces every rule, and the filter
+ * core holds as many of them as it can store, the busiest first. The core lets the
+ * packets none of its rules match through to the host, which decides them.
+ *
+ * The rules in the core are closed under overlap: a rule is only stored when every
+ * rule that overlaps it with a higher or equal priority is stored too. A packet a rule
+ * of the core matched then gets the decision the whole rule set would give it, so
+ * the core can drop it at line rate and, with metadata, the host need not look it up.
+ *
+ * Every PERIOD_MS the hit rate of each rule is taken from the core counters while it
+ * is stored there and from the software filter otherwise. Rules are ordered by rate,
+ * those in the core counting HYSTERESIS times as busy, plus MIN_RATE, so rules of
+ * similar or negligible rates do not swap back and forth. The longest closed prefix of
+ * that order the core can store is committed, when it changed. */
+class HybridFilter {
+private:
+    static constexpr uint32_t PERIOD_MS  = 1000;
+    static constexpr double RATE_WEIGHT  = 0.5;   /* of the last period in the average */
+    static constexpr double HYSTERESIS   = 2.0;
+    static constexpr double MIN_RATE     = 100;   /* packets/s */
+
+    using Rule = PacketFilter::Rule;
+    using RuleSet = PacketFilter::RuleSet;
+
+    PacketFilter& filter_;
+    std::mutex& filter_mutex_;
+    SoftwareFilter& software_;
+    uint32_t max_hardware_;
+
+    /* Rules that overlap rule i with a higher or equal priority */
+    std::vector<std::vector<uint32_t>> above_;
+    std::vector<bool> in_hardware_;
+    std::vector<double> rate_;
+    std::vector<uint64_t> last_hardware_;
+    std::vector<uint64_t> last_software_;
+    std::chrono::steady_clock::time_point last_time_;
+    uint64_t promoted_ = 0;
+    uint64_t demoted_ = 0;
+
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+
+    static bool overlap(const Rule& a, const Rule& b);
+    bool update_rates();
+    bool rebalance();
+    void run();
+
+public:
+    /* At most max_hardware rules go to the core, 0 for as many as it can store */
+    HybridFilter(PacketFilter& filter, std::mutex& filter_mutex, SoftwareFilter& software,
+                 uint32_t max_hardware = 0);
+    ~HybridFilter();
+
+    /* Places the first rules, lets unmatched packets through the core (steered by RSS
+     * with rss) and starts rebalancing */
+    bool start(bool rss);
+    void stop();
+
+    size_t hardware_rules() const {
+        return std::count(in_hardware_.begin(), in_hardware_.end(), true);
+    }
+};
+
+#endif // _HYBRID_FILTER_H_
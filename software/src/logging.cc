@@ -5,8 +5,20 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
 #include <mutex>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
 
 #include "logging.h"
 
@@ -14,6 +26,18 @@ int Log::log_level = Log::DEBUG;
 FILE* Log::fp_s = stdout;
 std::mutex Log::log_mutex;
 
+std::atomic<bool> Log::async_running_{false};
+std::thread Log::async_thread_;
+std::mutex Log::async_mutex_;
+std::vector<std::unique_ptr<Log::AsyncRing>> Log::async_rings_;
+thread_local Log::AsyncRing* Log::tls_ring_ = nullptr;
+
+uint64_t Log::tsc_base_ = 0;
+double Log::tsc_ns_ = 1.0;
+struct timespec Log::wall_base_;
+
+static const char* level_str[] = {"F", "E", "W", "I", "D"};
+
 void Log::set_log_level(int level) {
     std::lock_guard<std::mutex> lock(log_mutex);
     log_level = level;
@@ -54,6 +78,12 @@ void Log::error(int line, const char* file, const char* msg, ...) {
 }
 
 void Log::fatal(int line, const char* file, const char* msg, ...) {
+    /* Keep everything logged before the fatal message */
+    if (async_running_.load()) {
+        char batch[ASYNC_BATCH_SIZE];
+        drain(batch, sizeof(batch));
+    }
+
     va_list args;
     va_start(args, msg);
     log(Log::FATAL, line, file, msg, args);
@@ -62,6 +92,13 @@ void Log::fatal(int line, const char* file, const char* msg, ...) {
     abort();
 }
 
+void Log::log_printf(int level, int line, const char* file, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    log(level, line, file, fmt, args);
+    va_end(args);
+}
+
 void make_int(char* buf, int val, int digits) {
     char* p = buf + digits;
     for (int i = 0; i < digits; i++) {
@@ -72,10 +109,7 @@ void make_int(char* buf, int val, int digits) {
     }
 }
 
-void current_time(char* buf) {
-    time_t sec_since_epoch = time(nullptr);
-    struct tm tm;
-    localtime_r(&sec_since_epoch, &tm);
+void format_time(char* buf, const struct tm& tm, int msec) {
     make_int(buf, tm.tm_year + 1900, 4);
     buf[4] = '-';
     make_int(buf + 5, tm.tm_mon + 1, 2);
@@ -88,14 +122,19 @@ void current_time(char* buf) {
     buf[16] = ':';
     make_int(buf + 17, tm.tm_sec, 2);
     buf[19] = '.';
+    make_int(buf + 20, msec, 3);
+    buf[23] = '\0';
+}
+
+void current_time(char* buf) {
     struct timeval tv;
     gettimeofday(&tv, nullptr);
-    make_int(buf + 20, tv.tv_usec / 1000, 3);
-    buf[23] = '\0';
+    struct tm tm;
+    localtime_r(&tv.tv_sec, &tm);
+    format_time(buf, tm, tv.tv_usec / 1000);
 }
 
 void Log::log(int level, int line, const char* file, const char* fmt, va_list args) {
-    static const char* level_str[] = {"F", "E", "W", "I", "D"};
     assert(level >= 0 && level <= Log::DEBUG);
     assert(file != nullptr);
 
@@ -115,3 +154,147 @@ void Log::log(int level, int line, const char* file, const char* fmt, va_list ar
     fprintf(fp_s, "%s", log_buf);
 }
 
+
+void Log::start_async() {
+    std::lock_guard<std::mutex> lock(async_mutex_);
+    if (async_running_.load()) {
+        return;
+    }
+
+    /* Calibrate TSC against the wall clock once; records only carry the raw TSC */
+    struct timespec start, end;
+    clock_gettime(CLOCK_REALTIME, &start);
+    uint64_t tsc_start = cycles();
+    usleep(10000);
+    clock_gettime(CLOCK_REALTIME, &end);
+    uint64_t tsc_end = cycles();
+
+    double elapsed_ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    tsc_ns_ = elapsed_ns / static_cast<double>(tsc_end - tsc_start);
+    tsc_base_ = tsc_end;
+    wall_base_ = end;
+
+    async_running_.store(true);
+    async_thread_ = std::thread(async_loop);
+}
+
+void Log::stop_async() {
+    {
+        std::lock_guard<std::mutex> lock(async_mutex_);
+        if (!async_running_.load()) {
+            return;
+        }
+        async_running_.store(false);
+    }
+    async_thread_.join();
+
+    /* Flush whatever producers pushed before they observed the stop */
+    char batch[ASYNC_BATCH_SIZE];
+    drain(batch, sizeof(batch));
+}
+
+Log::AsyncRing* Log::register_ring() {
+    std::lock_guard<std::mutex> lock(async_mutex_);
+    async_rings_.push_back(std::make_unique<AsyncRing>());
+    tls_ring_ = async_rings_.back().get();
+    return tls_ring_;
+}
+
+void Log::async_loop() {
+    std::vector<char> batch(ASYNC_BATCH_SIZE);
+    while (async_running_.load(std::memory_order_relaxed)) {
+        if (drain(batch.data(), batch.size()) == 0) {
+            usleep(ASYNC_IDLE_SLEEP_US);
+        }
+    }
+}
+
+/* Format every pending record in timestamp order across rings and write them out
+ * in batches. Returns the number of records written. */
+size_t Log::drain(char* batch, size_t batch_size) {
+    std::lock_guard<std::mutex> lock(async_mutex_);
+
+    /* Last formatted second, since localtime_r is only needed once per second */
+    static time_t cached_sec = -1;
+    static struct tm cached_tm;
+
+    std::vector<std::pair<uint64_t, uint64_t>> pending(async_rings_.size());
+    for (size_t r = 0; r < async_rings_.size(); r++) {
+        AsyncRing* ring = async_rings_[r].get();
+        pending[r] = {ring->tail.load(std::memory_order_relaxed),
+                      ring->head.load(std::memory_order_acquire)};
+
+        uint64_t dropped = ring->dropped.load(std::memory_order_relaxed);
+        if (dropped != ring->dropped_reported) {
+            char time_buf[TIME_BUF_SIZE];
+            current_time(time_buf);
+            fprintf(fp_s, "%s [%s:%d] %s | async log ring %zu dropped %lu messages\n",
+                    level_str[Log::WARN], __FILENAME__, __LINE__, time_buf,
+                    r, dropped - ring->dropped_reported);
+            ring->dropped_reported = dropped;
+        }
+    }
+
+    size_t count = 0;
+    size_t offset = 0;
+    while (true) {
+        /* Pick the oldest pending record; the number of rings is the number of lcores */
+        int oldest = -1;
+        for (size_t r = 0; r < pending.size(); r++) {
+            if (pending[r].first == pending[r].second) {
+                continue;
+            }
+            const AsyncRecord& rec =
+                async_rings_[r]->records[pending[r].first & (ASYNC_RING_SIZE - 1)];
+            if (oldest < 0 ||
+                rec.tsc < async_rings_[oldest]->records[pending[oldest].first &
+                                                        (ASYNC_RING_SIZE - 1)].tsc) {
+                oldest = r;
+            }
+        }
+        if (oldest < 0) {
+            break;
+        }
+
+        AsyncRing* ring = async_rings_[oldest].get();
+        const AsyncRecord& rec = ring->records[pending[oldest].first & (ASYNC_RING_SIZE - 1)];
+
+        /* Leave room for a full line before formatting */
+        if (batch_size - offset < 4096) {
+            fwrite(batch, 1, offset, fp_s);
+            offset = 0;
+        }
+
+        double ns = wall_base_.tv_nsec + static_cast<double>(
+            static_cast<int64_t>(rec.tsc - tsc_base_)) * tsc_ns_;
+        time_t sec = wall_base_.tv_sec + static_cast<time_t>(ns / 1e9);
+        int msec = static_cast<int>((ns - (sec - wall_base_.tv_sec) * 1e9) / 1e6);
+        msec = msec < 0 ? 0 : (msec > 999 ? 999 : msec);
+        if (sec != cached_sec) {
+            localtime_r(&sec, &cached_tm);
+            cached_sec = sec;
+        }
+        char time_buf[TIME_BUF_SIZE];
+        format_time(time_buf, cached_tm, msec);
+
+        size_t room = batch_size - offset - 1;
+        int len = snprintf(batch + offset, room, "%s [%s:%d] %s | ",
+                           level_str[rec.level], rec.file, rec.line, time_buf);
+        offset += std::min<size_t>(len, room - 1);
+        len = rec.format(batch + offset, batch_size - offset - 1, rec.fmt, rec.payload);
+        offset += std::min<size_t>(len, batch_size - offset - 2);
+        batch[offset++] = '\n';
+
+        pending[oldest].first++;
+        ring->tail.store(pending[oldest].first, std::memory_order_release);
+        count++;
+    }
+
+    if (offset > 0) {
+        fwrite(batch, 1, offset, fp_s);
+    }
+    if (count > 0) {
+        fflush(fp_s);
+    }
+    return count;
+}
@@ -3,10 +3,26 @@
 
 #define __FILENAME__ (__builtin_strchr(__FILE__, '/') + 1)
 
-#define log_debug(msg, ...) Log::debug(__LINE__, __FILENAME__, msg, ## __VA_ARGS__)
-#define log_info(msg, ...) Log::info(__LINE__, __FILENAME__, msg, ## __VA_ARGS__)
-#define log_warn(msg, ...) Log::warn(__LINE__, __FILENAME__, msg, ## __VA_ARGS__)
-#define log_error(msg, ...) Log::error(__LINE__, __FILENAME__, msg, ## __VA_ARGS__)
+/* Messages more verbose than LOG_COMPILE_LEVEL (see CMakeLists.txt) are compiled out,
+ * and the arguments of the remaining ones are only evaluated when the runtime level
+ * lets the line through, so costly formatting arguments can be passed directly. */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL 4
+#endif
+
+#define log_enabled(level) ((level) <= LOG_COMPILE_LEVEL && Log::enabled(level))
+
+#define log_at(level, msg, ...) \
+    do { \
+        if (log_enabled(level)) { \
+            Log::write(level, __LINE__, __FILENAME__, msg, ## __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define log_debug(msg, ...) log_at(Log::DEBUG, msg, ## __VA_ARGS__)
+#define log_info(msg, ...) log_at(Log::INFO, msg, ## __VA_ARGS__)
+#define log_warn(msg, ...) log_at(Log::WARN, msg, ## __VA_ARGS__)
+#define log_error(msg, ...) log_at(Log::ERROR, msg, ## __VA_ARGS__)
 #define log_fatal(msg, ...) Log::fatal(__LINE__, __FILENAME__, msg, ## __VA_ARGS__)
 
 #define log_assert(cond, msg, ...) \
@@ -24,8 +40,175 @@ private:
 
     static const size_t TIME_BUF_SIZE = 24;
 
-private:
+    /* Asynchronous backend: every producer thread owns a SPSC ring of fixed-size records
+     * holding the format pointer and the raw arguments. A background thread formats and
+     * writes them in batches, so the hot path never calls snprintf or fprintf. */
+    static const size_t ASYNC_RECORD_SIZE   = 256;
+    static const size_t ASYNC_RING_SIZE     = 1024; /* records, power of two */
+    static const size_t ASYNC_BATCH_SIZE    = 64 * 1024;
+    static const size_t ASYNC_IDLE_SLEEP_US = 1000;
+
+    using format_fn_t = int (*)(char* buf, size_t len, const char* fmt, const uint8_t* payload);
+
+    struct AsyncRecord {
+        uint64_t tsc;
+        const char* fmt;
+        const char* file;
+        format_fn_t format;
+        int32_t line;
+        int32_t level;
+        uint8_t payload[ASYNC_RECORD_SIZE - 40];
+    };
+    static_assert(sizeof(AsyncRecord) == ASYNC_RECORD_SIZE, "AsyncRecord must be packed");
+
+    struct AsyncRing {
+        /* Producer side */
+        alignas(64) std::atomic<uint64_t> head{0};
+        uint64_t tail_cache = 0;
+        std::atomic<uint64_t> dropped{0};
+
+        /* Consumer side */
+        alignas(64) std::atomic<uint64_t> tail{0};
+        uint64_t dropped_reported = 0;
+
+        AsyncRecord records[ASYNC_RING_SIZE];
+    };
+
+    static std::atomic<bool> async_running_;
+    static std::thread async_thread_;
+    static std::mutex async_mutex_;      /* Protects the ring list and the consumer side */
+    static std::vector<std::unique_ptr<AsyncRing>> async_rings_;
+    static thread_local AsyncRing* tls_ring_;
+
+    /* TSC to wall clock conversion, calibrated once when the backend starts */
+    static uint64_t tsc_base_;
+    static double tsc_ns_;
+    static struct timespec wall_base_;
+
+    /* Arguments are copied by value; C strings are copied after all fixed-size
+     * arguments so they can use (and be truncated to) the rest of the payload. Each
+     * string keeps a byte for the terminator of every string after it, so later
+     * strings come out empty rather than past the record. */
+    struct ArgCursor {
+        uint8_t* fixed;
+        uint8_t* str;
+        uint8_t* end;
+        size_t strings;         /* not copied yet */
+    };
+    struct ArgReader {
+        const uint8_t* fixed;
+        const uint8_t* str;
+    };
+
+    template<typename T>
+    struct LogArg {
+        static_assert(std::is_trivially_copyable<T>::value,
+                      "Log arguments must be trivially copyable");
+        using type = T;
+        static constexpr size_t fixed_size = sizeof(T);
+        static constexpr size_t strings = 0;
+
+        static void put(ArgCursor& cur, T value) {
+            memcpy(cur.fixed, &value, sizeof(T));
+            cur.fixed += sizeof(T);
+        }
+        static T get(ArgReader& rd) {
+            T value;
+            memcpy(&value, rd.fixed, sizeof(T));
+            rd.fixed += sizeof(T);
+            return value;
+        }
+    };
+
+    struct StringArg {
+        using type = const char*;
+        static constexpr size_t fixed_size = 0;
+        static constexpr size_t strings = 1;
+
+        static void put(ArgCursor& cur, const char* value) {
+            if (value == nullptr) {
+                value = "(null)";
+            }
+            cur.strings--;
+            size_t room = cur.end - cur.str - 1 - cur.strings;
+            size_t len = strnlen(value, room);
+            memcpy(cur.str, value, len);
+            cur.str[len] = '\0';
+            cur.str += len + 1;
+        }
+        static const char* get(ArgReader& rd) {
+            const char* value = reinterpret_cast<const char*>(rd.str);
+            rd.str += strlen(value) + 1;
+            return value;
+        }
+    };
+
+    template<typename... Args>
+    static int format_record(char* buf, size_t len, const char* fmt, const uint8_t* payload) {
+        constexpr size_t fixed_size = (LogArg<Args>::fixed_size + ... + 0);
+        ArgReader rd = {payload, payload + fixed_size};
+        /* Braced initialization evaluates the readers left to right */
+        std::tuple<typename LogArg<Args>::type...> args{LogArg<Args>::get(rd)...};
+        (void)rd;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-security"
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+        return std::apply([&](auto... values) {
+            return snprintf(buf, len, fmt, values...);
+        }, args);
+#pragma GCC diagnostic pop
+    }
+
+    template<typename... Args>
+    static void push(int level, int line, const char* file, const char* fmt, Args... args) {
+        constexpr size_t fixed_size = (LogArg<Args>::fixed_size + ... + 0);
+        static_assert(fixed_size + sizeof...(Args) <= sizeof(AsyncRecord::payload),
+                      "Too many log arguments for an async record");
+
+        AsyncRing* ring = tls_ring_ != nullptr ? tls_ring_ : register_ring();
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        if (head - ring->tail_cache >= ASYNC_RING_SIZE) {
+            ring->tail_cache = ring->tail.load(std::memory_order_acquire);
+            if (head - ring->tail_cache >= ASYNC_RING_SIZE) {
+                /* Never block the caller: drop and let the consumer report it */
+                ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1,
+                                    std::memory_order_relaxed);
+                return;
+            }
+        }
+
+        AsyncRecord& rec = ring->records[head & (ASYNC_RING_SIZE - 1)];
+        rec.tsc = cycles();
+        rec.fmt = fmt;
+        rec.file = file;
+        rec.format = &format_record<Args...>;
+        rec.line = line;
+        rec.level = level;
+
+        ArgCursor cur = {rec.payload, rec.payload + fixed_size,
+                         rec.payload + sizeof(rec.payload), (LogArg<Args>::strings + ... + 0)};
+        (LogArg<Args>::put(cur, args), ...);
+        (void)cur;
+
+        ring->head.store(head + 1, std::memory_order_release);
+    }
+
+    static AsyncRing* register_ring();
+    static void async_loop();
+    static size_t drain(char* batch, size_t batch_size);
+
+    static uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+    }
+
     static void log(int level, int line, const char* file, const char* fmt, va_list args);
+    static void log_printf(int level, int line, const char* file, const char* fmt, ...);
 
 public:
     enum Level {
@@ -38,6 +221,23 @@ public:
 
     static void set_log_file(FILE* fp);
     static void set_log_level(int level);
+    static bool enabled(int level) { return level <= log_level; }
+
+    /* Route debug to error messages through the asynchronous backend until stop_async().
+     * Fatal messages are always written synchronously after draining the rings. */
+    static void start_async();
+    static void stop_async();
+
+    template<typename... Args>
+    static void write(int level, int line, const char* file, const char* fmt, Args... args) {
+        if (level > log_level) return;
+
+        if (async_running_.load(std::memory_order_relaxed)) {
+            push(level, line, file, fmt, args...);
+            return;
+        }
+        log_printf(level, line, file, fmt, args...);
+    }
 
     static void debug(int line, const char* file, const char* msg, ...);
     static void info(int line, const char* file, const char* msg, ...);
@@ -46,4 +246,7 @@ public:
     static void fatal(int line, const char* file, const char* msg, ...);
 };
 
+template<> struct Log::LogArg<const char*> : Log::StringArg {};
+template<> struct Log::LogArg<char*> : Log::StringArg {};
+
 #endif // _LOGGING_H_
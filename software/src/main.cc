@@ -1,15 +1,45 @@
 #include <signal.h>
 #include <unistd.h>
 #include <sstream>
+#include <algorithm>
 
 #include "deps.h"
 #include "dpdk.h"
 #include "packet_filter.h"
+#include "filter_metadata.h"
+#include "pcap_writer.h"
+#include "control_server.h"
+#include "hybrid_filter.h"
+#include "burst_parser.h"
+#include "mmio_backend.h"
+#include "metrics_exporter.h"
+#include "stats_sampler.h"
 
 struct Arguments {
     const char* dpdk_config = nullptr;
     uint16_t num_threads = 1;
-    uint32_t duration = 10;
+    uint32_t duration = 10;         /* seconds, 0 to run until SIGINT or SIGTERM */
+    bool forward = false;
+    bool simulate = false;
+    bool rss = false;
+    bool metadata = false;
+    uint32_t stats_period_ms = 0;
+    /* Ring of binary files the sampled counter deltas are written to, none if null */
+    const char* stats_log_path = nullptr;
+
+    /* Sampled dropped packets, written to a ring of pcap files */
+    uint32_t mirror_one_in_n = 0;
+    const char* mirror_path = "mirror.pcap";
+
+    /* Unix domain socket of the control server, none if null */
+    const char* control_path = nullptr;
+
+    /* Shared memory file the counters are published to, none if null */
+    const char* metrics_path = nullptr;
+
+    /* Enforce the rules on the host too, the core only keeps the busiest of them */
+    bool hybrid = false;
+    uint32_t max_hardware_rules = 0;
 
     /* Filter format: <ipv4_addr>:<port>,... */
     std::vector<std::string> filter_list;
@@ -24,9 +54,14 @@ private:
     bool terminate = false;
 
 public:
+    /* Until stopped when the duration is 0 */
     void wait_for(uint64_t duration) {
         std::unique_lock<std::mutex> lock(mutex);
-        cv.wait_for(lock, std::chrono::seconds(duration), [this] { return terminate; });
+        if (duration == 0) {
+            cv.wait(lock, [this] { return terminate; });
+        } else {
+            cv.wait_for(lock, std::chrono::seconds(duration), [this] { return terminate; });
+        }
     }
 
     void force_stop() {
@@ -36,41 +71,312 @@ public:
     }
 };
 
-int network_packet_handler(uint16_t thread_id, rte_mbuf* mbuf);
+/* FPGA-to-host latency of the packets of one thread, from their metadata: sums of
+ * the host time their burst was received and of the core cycle they came in,
+ * both counted from the same snapshot of the core. The average latency follows
+ * once the core clock rate is known. */
+struct alignas(64) LatencyStats {
+    uint64_t packets = 0;
+    unsigned __int128 host_ns = 0;
+    unsigned __int128 core_cycles = 0;
+
+    double average_ns(double ns_per_cycle) const {
+        if (packets == 0) {
+            return 0;
+        }
+        return static_cast<double>(host_ns) / packets -
+               static_cast<double>(core_cycles) / packets * ns_per_cycle;
+    }
+};
+
+uint16_t network_burst_handler(uint16_t thread_id, rte_mbuf** bufs, uint16_t nb_pkts);
+void log_udp_packet(uint16_t thread_id, rte_mbuf* mbuf, const ParsedBurst& burst, uint32_t i);
+uint16_t simulate_filter(PacketFilterModel* model, rte_mbuf** bufs, uint16_t nb_rx,
+                         bool metadata, PcapWriter* mirror);
+void write_mirrored(PcapWriter* mirror, rte_mbuf** bufs, uint16_t nb_rx);
 
 Timeout timeout;
-void signal_handler(int signum) {
-    log_info("Received signal %d, terminating...", signum);
-    timeout.force_stop();
-}
 
 int main(int argc, const char** argv) {
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
+    /* SIGINT and SIGTERM are blocked in every thread, the ones DPDK starts included,
+     * and taken by a thread of their own, which may then log and lock */
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    std::thread([signals]() {
+        int signum;
+        while (sigwait(&signals, &signum) == 0) {
+            log_info("Received signal %d, terminating...", signum);
+            timeout.force_stop();
+        }
+    }).detach();
 
     Arguments args;
     args.parse_args(argc, argv);
 
-    DPDK dpdk(args.dpdk_config, args.num_threads);
+    /* Keep formatting and writing of log lines off the rx lcores */
+    Log::start_async();
+
+    /* Without the FPGA, the filter core is modelled in software and applied on the host */
+    PacketFilterModel* filter_model = nullptr;
+    if (args.simulate) {
+        auto backend = std::make_shared<SimBackend>();
+        filter_model = &backend->filter_model();
+        MMIO::set_backend(backend);
+    }
+
+    DPDK dpdk(args.dpdk_config, args.num_threads, args.forward);
+
+    if (args.metadata && (!MMIO::is_available(0) || !FilterMetadata::register_field())) {
+        log_warn("Packet metadata is not available");
+        args.metadata = false;
+    }
+
+    /* Dropped packets are mirrored to the last rx queue of each port, whose lcore only
+     * writes them out, so the other queues carry the filtered traffic. The simulated
+     * filter writes its samples itself. */
+    std::unique_ptr<PcapWriter> mirror;
+    uint16_t data_queues = dpdk.queues_per_port();
+    bool mirror_lcore = false;
+    if (args.mirror_one_in_n > 0) {
+        if (!MMIO::is_available(0) || (!args.simulate && data_queues < 2)) {
+            log_warn("Mirroring needs the packet filter and two rx queues per port");
+        } else {
+            mirror = std::make_unique<PcapWriter>(args.mirror_path);
+            if (!mirror->open()) {
+                log_fatal("Cannot write mirrored packets to %s", args.mirror_path);
+            }
+            if (!args.simulate) {
+                mirror_lcore = true;
+                data_queues--;
+            }
+        }
+    }
+
+    /* Software-only ports (e.g. net_ring or net_pcap vdevs) have no filter to program
+     * unless it is simulated */
+    std::unique_ptr<PacketFilter> packet_filter;
+    if (MMIO::is_available(0)) {
+        packet_filter = std::make_unique<PacketFilter>(
+            args.hybrid ? std::vector<std::string>() : args.filter_list,
+            args.rss ? data_queues : 0, args.metadata && !args.simulate);
+    }
+    if (mirror && !packet_filter->set_mirror(args.mirror_one_in_n, data_queues)) {
+        log_fatal("Cannot mirror dropped packets");
+    }
+
+    /* In hybrid mode the rx lcores filter with every rule, after the core */
+    std::unique_ptr<SoftwareFilter> software_filter;
+    if (args.hybrid) {
+        if (!packet_filter) {
+            log_fatal("Hybrid mode needs the packet filter");
+        }
+        PacketFilter::RuleSet rules;
+        for (const auto& filter : args.filter_list) {
+            PacketFilter::Rule rule = PacketFilter::parse_rule(filter, PacketFilter::RULE_ACTION_FORWARD);
+            if (args.rss) {
+                rule.action = PacketFilter::RULE_ACTION_STEER;
+                rule.queue = PacketFilter::QUEUE_RSS;
+            }
+            rules.push_back(rule);
+        }
+        software_filter = std::make_unique<SoftwareFilter>(rules, packet_filter->default_action(),
+                                                           args.num_threads);
+    }
+
+    /* Latency is counted from this snapshot, before any handler runs */
+    StatsSnapshot start_snap;
+    std::vector<LatencyStats> latency(args.num_threads);
+    if (args.metadata && !packet_filter->snapshot(start_snap)) {
+        log_fatal("Cannot read the core clock");
+    }
+
     for (uint16_t i = 0; i < args.num_threads; i++) {
-        dpdk.register_callback(i, network_packet_handler);
+        if (mirror_lcore && i % dpdk.queues_per_port() == data_queues) {
+            dpdk.register_handler(i, [&mirror](uint16_t thread_id, rte_mbuf** bufs,
+                                               uint16_t nb_rx) -> uint16_t {
+                write_mirrored(mirror.get(), bufs, nb_rx);
+                return nb_rx;
+            });
+            continue;
+        }
+
+        dpdk.register_handler(i, [&dpdk, &args, &latency, &start_snap, &mirror, &software_filter,
+                                  filter_model](
+                                     uint16_t thread_id, rte_mbuf** bufs,
+                                     uint16_t nb_rx) -> uint16_t {
+            /* Packets dropped by the simulated filter are moved to the front */
+            uint16_t nb_drop = 0;
+            if (filter_model != nullptr) {
+                nb_drop = simulate_filter(filter_model, bufs, nb_rx, args.metadata,
+                                          mirror.get());
+            } else if (args.metadata && !FilterMetadata::strip(bufs, nb_rx)) {
+                log_warn("Packets without metadata on thread_id %u", thread_id);
+            }
+            if (software_filter) {
+                nb_drop += software_filter->filter_burst(thread_id, bufs + nb_drop,
+                                                         nb_rx - nb_drop, args.metadata);
+            }
+
+            if (args.metadata) {
+                LatencyStats& stats = latency[thread_id];
+                uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start_snap.time).count();
+                for (uint16_t j = nb_drop; j < nb_rx; j++) {
+                    stats.core_cycles += FilterMetadata::get(bufs[j])->timestamp -
+                                         start_snap.cycles;
+                }
+                stats.host_ns += static_cast<unsigned __int128>(now) * (nb_rx - nb_drop);
+                stats.packets += nb_rx - nb_drop;
+            }
+
+            if (args.forward) {
+                /* Inline appliance: hand the filtered burst straight back to the NIC */
+                dpdk.forward_burst(thread_id, bufs + nb_drop, nb_rx - nb_drop);
+                return nb_drop;
+            }
+
+            uint16_t failed = network_burst_handler(thread_id, bufs + nb_drop, nb_rx - nb_drop);
+            if (failed > 0) {
+                log_warn("Packet processing failed on thread_id %u for %u packets",
+                         thread_id, failed);
+            }
+            return nb_rx;
+        });
     }
-    PacketFilter packet_filter(args.filter_list);
 
-    log_info("Running for %u seconds...", args.duration);
+    /* The sampler and the control server share the filter once the handlers run */
+    std::mutex filter_mutex;
+    std::unique_ptr<ControlServer> control;
+    if (args.control_path != nullptr) {
+        if (!packet_filter) {
+            log_warn("No packet filter to control");
+        } else if (software_filter) {
+            log_warn("Rules cannot be changed through the control server in hybrid mode");
+        } else {
+            control = std::make_unique<ControlServer>(*packet_filter, filter_mutex,
+                                                      args.control_path);
+            if (!control->start()) {
+                log_fatal("Cannot start the control server");
+            }
+        }
+    }
+
+    std::unique_ptr<HybridFilter> hybrid;
+    if (software_filter) {
+        hybrid = std::make_unique<HybridFilter>(*packet_filter, filter_mutex, *software_filter,
+                                                args.max_hardware_rules);
+        if (!hybrid->start(args.rss)) {
+            log_fatal("Cannot place the rules of the hybrid filter");
+        }
+    }
+
+    std::unique_ptr<MetricsExporter> metrics;
+    if (args.metrics_path != nullptr) {
+        metrics = std::make_unique<MetricsExporter>(
+            dpdk, packet_filter.get(), filter_mutex, args.metrics_path,
+            args.stats_period_ms > 0 ? args.stats_period_ms : MetricsExporter::DEFAULT_PERIOD_MS);
+        if (!metrics->start()) {
+            log_fatal("Cannot publish metrics to %s", args.metrics_path);
+        }
+    }
+
+    /* Counters of the filter core, the ports and the host rx loops every period */
+    std::unique_ptr<StatsLog> stats_log;
+    std::unique_ptr<StatsSampler> sampler;
+    if (args.stats_period_ms > 0 || args.stats_log_path != nullptr) {
+        uint32_t period_ms = args.stats_period_ms > 0 ? args.stats_period_ms :
+                                                        StatsSampler::LOG_PERIOD_MS;
+        if (args.stats_log_path != nullptr) {
+            stats_log = std::make_unique<StatsLog>(args.stats_log_path, dpdk.ports(), period_ms);
+            if (!stats_log->open()) {
+                log_fatal("Cannot write the stats log to %s", args.stats_log_path);
+            }
+        }
+        sampler = std::make_unique<StatsSampler>(dpdk, packet_filter.get(), filter_mutex,
+                                                 period_ms, stats_log.get());
+        sampler->start();
+    }
+
+    if (args.duration == 0) {
+        log_info("Running until SIGINT or SIGTERM...");
+    } else {
+        log_info("Running for %u seconds...", args.duration);
+    }
+    auto run_start = std::chrono::steady_clock::now();
     timeout.wait_for(args.duration);
-    log_info("Time's up, shutting down...");
+    double run_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                                       run_start).count();
+    log_info("Shutting down, draining the rx queues...");
+    timeout.force_stop();
 
-    PacketAdapter packet_adapter;
-    packet_adapter.show_stats();
+    /* The handlers use the filter, the mirror and the latency counters below, so the
+     * rx loops stop first; every counter read from here on is final */
+    dpdk.stop();
+    if (sampler) {
+        sampler->stop();
+    }
+    if (stats_log) {
+        log_info("Wrote %lu samples to %s.*", stats_log->records(), args.stats_log_path);
+    }
+    if (metrics) {
+        metrics->stop();
+    }
+    if (control) {
+        control->stop();
+    }
+    if (hybrid) {
+        hybrid->stop();
+    }
+
+    if (packet_filter) {
+        PacketAdapter packet_adapter;
+        packet_adapter.show_stats();
+
+        packet_filter->show_stats();
+        packet_filter->show_rule_stats();
+    }
+
+    /* Lookup cost per packet and the rate the host filtered at */
+    if (software_filter) {
+        uint64_t total = 0;
+        for (uint16_t i = 0; i < args.num_threads; i++) {
+            SoftwareFilter::ThreadStats stats = software_filter->thread_stats(i);
+            total += stats.packets;
+            if (stats.packets > 0) {
+                log_info("Thread %u: %lu packets through the software filter, %lu dropped, "
+                         "%.1f ns per packet", i, stats.packets, stats.dropped,
+                         stats.cycles * 1e9 / rte_get_tsc_hz() / stats.packets);
+            }
+        }
+        log_info("Software filter: %lu packets, %.3f Mpps", total, total / run_seconds / 1e6);
+    }
+
+    if (mirror) {
+        log_info("Wrote %lu mirrored packets to %s.*", mirror->packets(), args.mirror_path);
+    }
+
+    /* The whole run calibrates the core clock against the host one */
+    StatsSnapshot end_snap;
+    if (args.metadata && packet_filter->snapshot(end_snap)) {
+        CoreClock clock = CoreClock::between(start_snap, end_snap);
+        for (uint16_t i = 0; i < args.num_threads && clock.valid(); i++) {
+            if (latency[i].packets > 0) {
+                log_info("Thread %u: %lu packets, %.2f us average FPGA-to-host latency", i,
+                         latency[i].packets, latency[i].average_ns(clock.ns_per_cycle) / 1e3);
+            }
+        }
+    }
 
-    packet_filter.show_stats();
+    Log::stop_async();
     return 0;
 }
 
 void Arguments::parse_args(int argc, const char** argv) {
     int c;
-    while ((c = getopt(argc, const_cast<char**>(argv), "c:t:d:f:")) != -1) {
+    while ((c = getopt(argc, const_cast<char**>(argv), "c:t:d:f:Fsp:rmM:w:S:yH:x:l:")) != -1) {
         switch (c) {
             case 'c':
                 this->dpdk_config = optarg;
@@ -84,6 +390,54 @@ void Arguments::parse_args(int argc, const char** argv) {
                 this->duration = static_cast<uint32_t>(std::stoi(optarg));
                 break;
 
+            case 'F':
+                this->forward = true;
+                break;
+
+            case 's':
+                this->simulate = true;
+                break;
+
+            case 'r':
+                this->rss = true;
+                break;
+
+            case 'm':
+                this->metadata = true;
+                break;
+
+            case 'M':
+                this->mirror_one_in_n = static_cast<uint32_t>(std::stoul(optarg));
+                break;
+
+            case 'w':
+                this->mirror_path = optarg;
+                break;
+
+            case 'S':
+                this->control_path = optarg;
+                break;
+
+            case 'y':
+                this->hybrid = true;
+                break;
+
+            case 'H':
+                this->max_hardware_rules = static_cast<uint32_t>(std::stoul(optarg));
+                break;
+
+            case 'l':
+                this->stats_log_path = optarg;
+                break;
+
+            case 'x':
+                this->metrics_path = optarg;
+                break;
+
+            case 'p':
+                this->stats_period_ms = static_cast<uint32_t>(std::stoi(optarg));
+                break;
+
             case 'f': {
                 std::string filter_str(optarg);
                 std::stringstream ss(filter_str);
@@ -96,7 +450,7 @@ void Arguments::parse_args(int argc, const char** argv) {
 
             case '?':
             default:
-                log_info("Usage: %s -c <dpdk_config> -t <num_threads> -d <duration> -f <filter_list>", argv[0]);
+                log_info("Usage: %s -c <dpdk_config> -t <num_threads> -d <duration> -f <filter_list> [-F] [-s] [-r] [-m] [-p <stats_period_ms>] [-l <stats_log>] [-M <one_in_n> [-w <pcap_path>]] [-S <control_socket>] [-y [-H <max_hardware_rules>]] [-x <metrics_path>]", argv[0]);
                 log_fatal("Unknown option: %c", c);
         }
     }
@@ -106,60 +460,67 @@ void Arguments::parse_args(int argc, const char** argv) {
     }
 }
 
-int network_packet_handler(uint16_t thread_id, rte_mbuf* mbuf) {
-    log_assert(mbuf != nullptr, "Received null mbuf in packet handler");
-    size_t buffer_offset = 0;
-    size_t pkt_len = rte_pktmbuf_pkt_len(mbuf);
-
-    /* Parse Ethernet header */
-    rte_ether_hdr* eth_hdr = rte_pktmbuf_mtod_offset(mbuf, rte_ether_hdr*, buffer_offset);
-    if (eth_hdr == nullptr) {
-        log_warn("Failed to get Ethernet header");
-        return -1;
-    }
-    if (rte_be_to_cpu_16(eth_hdr->ether_type) != RTE_ETHER_TYPE_IPV4) {
-        log_debug("Non-IPv4 packet received, skipping");
-        return 0;
-    }
-
-    buffer_offset += sizeof(rte_ether_hdr);
-
-    /* Parse IPv4 header */
-    rte_ipv4_hdr* ip_hdr = rte_pktmbuf_mtod_offset(mbuf, rte_ipv4_hdr*, buffer_offset);
-    if (ip_hdr == nullptr) {
-        log_warn("Failed to get IPv4 header");
-        return -1;
-    }
-    if (ip_hdr->next_proto_id != IPPROTO_UDP) {
-        log_debug("Non-UDP packet received, skipping");
-        return 0;
-    }
-
-    buffer_offset += sizeof(rte_ipv4_hdr);
+/* The model has no frames to prefix or copy: its metadata goes straight into the
+ * mbufs and its mirrored packets straight into the pcap ring */
+uint16_t simulate_filter(PacketFilterModel* model, rte_mbuf** bufs, uint16_t nb_rx,
+                         bool metadata, PcapWriter* mirror) {
+    return DPDK::compact_burst(bufs, nb_rx, [model, metadata, mirror](rte_mbuf* mbuf) {
+        PacketFilterModel::Verdict verdict = model->classify(
+            rte_pktmbuf_mtod(mbuf, uint8_t*), rte_pktmbuf_data_len(mbuf),
+            rte_pktmbuf_pkt_len(mbuf));
+        if (metadata && verdict.forward) {
+            *FilterMetadata::get(mbuf) = {verdict.rule_id, verdict.hash, verdict.timestamp};
+            mbuf->hash.rss = verdict.hash;
+            mbuf->ol_flags |= RTE_MBUF_F_RX_RSS_HASH;
+        }
+        if (mirror != nullptr && verdict.mirrored) {
+            uint32_t caplen = std::min<uint32_t>(rte_pktmbuf_data_len(mbuf),
+                                                 verdict.mirror_bytes);
+            mirror->write(rte_pktmbuf_mtod(mbuf, uint8_t*), caplen, rte_pktmbuf_pkt_len(mbuf));
+        }
+        return !verdict.forward;
+    });
+}
 
-    /* Parse UDP header */
-    rte_udp_hdr* udp_hdr = rte_pktmbuf_mtod_offset(mbuf, rte_udp_hdr*, buffer_offset);
-    if (udp_hdr == nullptr) {
-        log_warn("Failed to get UDP header");
-        return -1;
+/* Copies from the core are cut short, so the wire length comes from their headers */
+void write_mirrored(PcapWriter* mirror, rte_mbuf** bufs, uint16_t nb_rx) {
+    for (uint16_t i = 0; i < nb_rx; i++) {
+        const uint8_t* data = rte_pktmbuf_mtod(bufs[i], uint8_t*);
+        uint32_t caplen = rte_pktmbuf_data_len(bufs[i]);
+        mirror->write(data, caplen, PcapWriter::wire_length(data, caplen));
     }
+}
 
-    /* Size sanity check */
-    size_t udp_payload_len = rte_be_to_cpu_16(udp_hdr->dgram_len);
-    if (buffer_offset + udp_payload_len > pkt_len) {
-        log_error("UDP payload length exceeds packet length %zu > %zu",
-                  buffer_offset + udp_payload_len, pkt_len);
-        return -1;
-    }
+/* Parses the burst in groups of ParsedBurst::MAX_PACKETS and works on the parsed
+ * columns. Returns how many IPv4 UDP packets had headers that do not fit the frame. */
+uint16_t network_burst_handler(uint16_t thread_id, rte_mbuf** bufs, uint16_t nb_pkts) {
+    uint16_t failed = 0;
+    ParsedBurst burst;
+    for (uint16_t first = 0; first < nb_pkts; first += ParsedBurst::MAX_PACKETS) {
+        rte_mbuf** group = bufs + first;
+        BurstParser::parse(group, std::min<uint16_t>(nb_pkts - first, ParsedBurst::MAX_PACKETS),
+                           burst);
+
+        for (uint32_t mask = burst.malformed; mask != 0; mask &= mask - 1) {
+            uint32_t i = __builtin_ctz(mask);
+            log_error("Malformed IPv4 UDP packet on thread_id %u, %u bytes", thread_id,
+                      rte_pktmbuf_pkt_len(group[i]));
+        }
+        failed += __builtin_popcount(burst.malformed);
 
-    buffer_offset += sizeof(rte_udp_hdr);
-    uint8_t* udp_payload = rte_pktmbuf_mtod_offset(mbuf, uint8_t*, buffer_offset);
-    if (udp_payload == nullptr) {
-        log_warn("Failed to get UDP payload");
-        return -1;
+        /* Everything below only builds log lines */
+        if (!log_enabled(Log::INFO)) {
+            continue;
+        }
+        for (uint32_t mask = burst.udp; mask != 0; mask &= mask - 1) {
+            uint32_t i = __builtin_ctz(mask);
+            log_udp_packet(thread_id, group[i], burst, i);
+        }
     }
-    size_t payload_len = udp_payload_len - sizeof(rte_udp_hdr);
+    return failed;
+}
 
+void log_udp_packet(uint16_t thread_id, rte_mbuf* mbuf, const ParsedBurst& burst, uint32_t i) {
     /* Helper functions to convert binary data to string */
     auto convert_mac_to_str = [](uint8_t* mac) {
         char mac_str[18];
@@ -170,7 +531,7 @@ int network_packet_handler(uint16_t thread_id, rte_mbuf* mbuf) {
     auto convert_ip_to_str = [](uint32_t ipv4) {
         char ip_str[16];
         sprintf(ip_str, "%d.%d.%d.%d",
-                ipv4 & 0xFF, (ipv4 >> 8) & 0xFF, (ipv4 >> 16) & 0xFF, (ipv4 >> 24) & 0xFF);
+                (ipv4 >> 24) & 0xFF, (ipv4 >> 16) & 0xFF, (ipv4 >> 8) & 0xFF, ipv4 & 0xFF);
         return std::string(ip_str);
     };
     auto convert_bin_to_str = [](uint8_t* data, size_t len) {
@@ -183,6 +544,10 @@ int network_packet_handler(uint16_t thread_id, rte_mbuf* mbuf) {
         return str;
     };
 
+    rte_ether_hdr* eth_hdr = rte_pktmbuf_mtod(mbuf, rte_ether_hdr*);
+    rte_ipv4_hdr* ip_hdr = rte_pktmbuf_mtod_offset(mbuf, rte_ipv4_hdr*, sizeof(rte_ether_hdr));
+    uint8_t* udp_payload = rte_pktmbuf_mtod_offset(mbuf, uint8_t*, burst.payload_offset[i]);
+
     /* Packet information logging */
     log_info("Received UDP packet on thread_id %u", thread_id);
     log_info("  ether_hdr: src=%s, dst=%s, ether_type=%x",
@@ -190,17 +555,22 @@ int network_packet_handler(uint16_t thread_id, rte_mbuf* mbuf) {
                 convert_mac_to_str(eth_hdr->dst_addr.addr_bytes).c_str(),
                 rte_be_to_cpu_16(eth_hdr->ether_type));
     log_info("  ipv4_hdr: src=%s, dst=%s, total_length=%d, next_proto_id=%x",
-                convert_ip_to_str(rte_be_to_cpu_32(ip_hdr->src_addr)).c_str(),
-                convert_ip_to_str(rte_be_to_cpu_32(ip_hdr->dst_addr)).c_str(),
+                convert_ip_to_str(burst.src_ip[i]).c_str(),
+                convert_ip_to_str(burst.dst_ip[i]).c_str(),
                 rte_be_to_cpu_16(ip_hdr->total_length),
                 ip_hdr->next_proto_id);
     log_info("  udp_hdr: src_port=%d, dst_port=%d, dgram_len=%d",
-                rte_be_to_cpu_16(udp_hdr->src_port),
-                rte_be_to_cpu_16(udp_hdr->dst_port),
-                rte_be_to_cpu_16(udp_hdr->dgram_len));
+                burst.src_port[i], burst.dst_port[i],
+                burst.payload_len[i] + static_cast<int>(sizeof(rte_udp_hdr)));
 
-    log_info("  udp_payload (%zu bytes): %s", payload_len, 
+    if (FilterMetadata::registered()) {
+        const FilterMetadata* meta = FilterMetadata::get(mbuf);
+        log_info("  metadata: rule_id=%x, hash=%08x, timestamp=%lu",
+                 meta->rule_id, meta->hash, meta->timestamp);
+    }
+    /* The payload may run into later segments; only the first one is printed */
+    size_t payload_len = std::min<size_t>(burst.payload_len[i],
+                                          rte_pktmbuf_data_len(mbuf) - burst.payload_offset[i]);
+    log_info("  udp_payload (%u bytes): %s", burst.payload_len[i],
              convert_bin_to_str(udp_payload, payload_len).c_str());
-    return 0;
 }
-
@@ -0,0 +1,218 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cstring>
+
+#include "deps.h"
+#include "metrics.h"
+
+static_assert(sizeof(FilterMetrics) % 8 == 0 && sizeof(PortMetrics) % 8 == 0 &&
+              sizeof(ThreadMetrics) % 8 == 0, "Metrics are copied a 64-bit word at a time");
+static_assert(std::is_trivially_copyable<ThreadMetrics>::value &&
+              std::is_trivially_copyable<MetricsHeader>::value, "Metrics are plain data");
+
+void ThreadMetrics::from_snapshot(const RxLoopSnapshot& snapshot) {
+    empty_polls = snapshot.empty_polls;
+    empty_cycles = snapshot.empty_cycles;
+    busy_polls = snapshot.busy_polls;
+    packets = snapshot.packets;
+    std::copy(snapshot.burst_sizes.begin(), snapshot.burst_sizes.end(), burst_sizes);
+    std::copy(snapshot.rx_cycles.counts.begin(), snapshot.rx_cycles.counts.end(), rx_cycles);
+    std::copy(snapshot.handler_cycles.counts.begin(), snapshot.handler_cycles.counts.end(),
+              handler_cycles);
+    std::copy(snapshot.free_cycles.counts.begin(), snapshot.free_cycles.counts.end(),
+              free_cycles);
+}
+
+RxLoopSnapshot ThreadMetrics::to_snapshot() const {
+    RxLoopSnapshot snapshot;
+    snapshot.empty_polls = empty_polls;
+    snapshot.empty_cycles = empty_cycles;
+    snapshot.busy_polls = busy_polls;
+    snapshot.packets = packets;
+    std::copy(std::begin(burst_sizes), std::end(burst_sizes), snapshot.burst_sizes.begin());
+    std::copy(std::begin(rx_cycles), std::end(rx_cycles), snapshot.rx_cycles.counts.begin());
+    std::copy(std::begin(handler_cycles), std::end(handler_cycles),
+              snapshot.handler_cycles.counts.begin());
+    std::copy(std::begin(free_cycles), std::end(free_cycles), snapshot.free_cycles.counts.begin());
+    return snapshot;
+}
+
+MetricsSegment::~MetricsSegment() {
+    if (base_ != nullptr) {
+        munmap(base_, size_);
+    }
+    if (owner_) {
+        unlink(path_.c_str());
+    }
+}
+
+size_t MetricsSegment::layout(uint16_t num_ports, uint16_t num_threads, MetricsHeader& header) {
+    header.num_ports = num_ports;
+    header.num_threads = num_threads;
+    header.ports_offset = sizeof(Fixed);
+    header.threads_offset = header.ports_offset + num_ports * sizeof(PortBlock);
+    return header.threads_offset + num_threads * sizeof(ThreadBlock);
+}
+
+bool MetricsSegment::create(const std::string& path, uint16_t num_ports, uint16_t num_threads,
+                            uint64_t tsc_hz, uint64_t core_clock_hz, uint32_t period_ms) {
+    MetricsHeader header = {};
+    header.magic = METRICS_MAGIC;
+    header.version = METRICS_VERSION;
+    header.pid = getpid();
+    header.tsc_hz = tsc_hz;
+    header.core_clock_hz = core_clock_hz;
+    header.period_ms = period_ms;
+    size_t size = layout(num_ports, num_threads, header);
+    header.size = size;
+
+    std::string tmp_path = path + ".tmp";
+    int fd = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        log_error("Cannot create %s: %s", tmp_path.c_str(), strerror(errno));
+        return false;
+    }
+    if (ftruncate(fd, size) != 0) {
+        log_error("Cannot size %s: %s", tmp_path.c_str(), strerror(errno));
+        close(fd);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        log_error("Cannot map %s: %s", tmp_path.c_str(), strerror(errno));
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    base_ = static_cast<uint8_t*>(base);
+    size_ = size;
+    header_ = &fixed()->header;
+    *header_ = header;
+
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+        log_error("Cannot rename %s to %s: %s", tmp_path.c_str(), path.c_str(), strerror(errno));
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    path_ = path;
+    owner_ = true;
+    return true;
+}
+
+bool MetricsSegment::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        log_error("Cannot open %s: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Fixed)) {
+        log_error("%s is not a metrics segment", path.c_str());
+        close(fd);
+        return false;
+    }
+    void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        log_error("Cannot map %s: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    base_ = static_cast<uint8_t*>(base);
+    size_ = st.st_size;
+    header_ = &fixed()->header;
+
+    MetricsHeader expected = *header_;
+    if (header_->magic != METRICS_MAGIC) {
+        log_error("%s is not a metrics segment", path.c_str());
+        return false;
+    }
+    if (header_->version != METRICS_VERSION) {
+        log_error("%s has layout version %u, expected %u", path.c_str(), header_->version,
+                  METRICS_VERSION);
+        return false;
+    }
+    if (layout(header_->num_ports, header_->num_threads, expected) != size_ ||
+        header_->size != size_ || expected.ports_offset != header_->ports_offset ||
+        expected.threads_offset != header_->threads_offset) {
+        log_error("%s does not match its header", path.c_str());
+        return false;
+    }
+    path_ = path;
+    return true;
+}
+
+template<typename T>
+void MetricsSegment::write_block(Block<T>& block, const T& data) {
+    uint64_t seq = __atomic_load_n(&block.seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&block.seq, seq + 1, __ATOMIC_RELAXED);
+    /* Readers that see any of the new words also see the odd sequence */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    const uint64_t* from = reinterpret_cast<const uint64_t*>(&data);
+    uint64_t* to = reinterpret_cast<uint64_t*>(&block.data);
+    for (size_t i = 0; i < sizeof(T) / 8; i++) {
+        __atomic_store_n(&to[i], from[i], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&block.seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+template<typename T>
+bool MetricsSegment::read_block(const Block<T>& block, T& data) {
+    const uint64_t* from = reinterpret_cast<const uint64_t*>(&block.data);
+    uint64_t* to = reinterpret_cast<uint64_t*>(&data);
+    for (uint32_t retry = 0; retry < READ_RETRIES; retry++) {
+        if (retry > 0) {
+            /* Lets a writer that was preempted mid-block finish */
+            std::this_thread::yield();
+        }
+        uint64_t before = __atomic_load_n(&block.seq, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            continue;
+        }
+        for (size_t i = 0; i < sizeof(T) / 8; i++) {
+            to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+        }
+        /* The copy is complete before the sequence is checked again */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&block.seq, __ATOMIC_RELAXED) == before) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void MetricsSegment::publish_core(const FilterMetrics& metrics) {
+    write_block(fixed()->core, metrics);
+}
+
+void MetricsSegment::publish_adapter(const FilterMetrics& metrics) {
+    write_block(fixed()->adapter, metrics);
+}
+
+void MetricsSegment::publish_port(uint16_t port_id, const PortMetrics& metrics) {
+    log_assert(port_id < header_->num_ports, "Invalid port_id: %u", port_id);
+    write_block(*port(port_id), metrics);
+}
+
+void MetricsSegment::publish_thread(uint16_t thread_id, const ThreadMetrics& metrics) {
+    log_assert(thread_id < header_->num_threads, "Invalid thread_id: %u", thread_id);
+    write_block(*thread(thread_id), metrics);
+}
+
+bool MetricsSegment::read_core(FilterMetrics& metrics) const {
+    return read_block(fixed()->core, metrics);
+}
+
+bool MetricsSegment::read_adapter(FilterMetrics& metrics) const {
+    return read_block(fixed()->adapter, metrics);
+}
+
+bool MetricsSegment::read_port(uint16_t port_id, PortMetrics& metrics) const {
+    return port_id < header_->num_ports && read_block(*port(port_id), metrics);
+}
+
+bool MetricsSegment::read_thread(uint16_t thread_id, ThreadMetrics& metrics) const {
+    return thread_id < header_->num_threads && read_block(*thread(thread_id), metrics);
+}
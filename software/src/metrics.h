@@ -0,0 +1,152 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "rx_stats.h"
+
+/* Counters of the filter core or the packet adapter, as in a StatsSnapshot */
+struct FilterMetrics {
+    uint64_t time_ns;       /* CLOCK_MONOTONIC when read, 0 until first published */
+    uint64_t cycles;
+    uint64_t packets;
+    uint64_t phits;
+    uint64_t bytes;
+    uint64_t forwarded;
+    uint64_t dropped;
+    uint64_t mirrored;
+};
+
+/* The rte_eth_stats of a port */
+struct PortMetrics {
+    static constexpr uint32_t MAX_QUEUES = 16;
+
+    uint64_t time_ns;
+    uint64_t ipackets;
+    uint64_t opackets;
+    uint64_t ibytes;
+    uint64_t obytes;
+    uint64_t imissed;
+    uint64_t ierrors;
+    uint64_t oerrors;
+    uint64_t rx_nombuf;
+    uint64_t q_ipackets[MAX_QUEUES];
+    uint64_t q_opackets[MAX_QUEUES];
+    uint64_t q_ibytes[MAX_QUEUES];
+    uint64_t q_obytes[MAX_QUEUES];
+    uint64_t q_errors[MAX_QUEUES];
+};
+
+/* The RxLoopStats of an rx lcore */
+struct ThreadMetrics {
+    uint64_t time_ns;
+    uint64_t port_id;
+    uint64_t queue_id;
+    uint64_t empty_polls;
+    uint64_t empty_cycles;
+    uint64_t busy_polls;
+    uint64_t packets;
+    uint64_t burst_sizes[RxLoopSnapshot::MAX_BURST + 1];
+    uint64_t rx_cycles[HistogramSnapshot::BUCKETS];
+    uint64_t handler_cycles[HistogramSnapshot::BUCKETS];
+    uint64_t free_cycles[HistogramSnapshot::BUCKETS];
+
+    void from_snapshot(const RxLoopSnapshot& snapshot);
+    RxLoopSnapshot to_snapshot() const;
+};
+
+/* Fixed part of the segment, written once before the file appears under its name */
+struct MetricsHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;              /* of the whole file */
+    uint64_t pid;               /* of the writer */
+    uint64_t tsc_hz;            /* of the cycle counts of ThreadMetrics */
+    uint64_t core_clock_hz;     /* of FilterMetrics::cycles */
+    uint32_t period_ms;
+    uint16_t num_ports;
+    uint16_t num_threads;
+    uint64_t ports_offset;
+    uint64_t threads_offset;
+};
+
+/* A memory-mapped file, normally under /dev/shm, that one process publishes its
+ * counters to and any number of other processes read, version METRICS_VERSION:
+ *
+ *   MetricsHeader | core FilterMetrics | adapter FilterMetrics |
+ *   num_ports PortMetrics | num_threads ThreadMetrics
+ *
+ * Every block after the header is 64-byte aligned and starts with a 64-bit sequence
+ * number, followed by the struct. The writer makes the sequence odd, stores the
+ * block and makes it even again; a reader copies the block and retries when the
+ * sequence was odd or changed meanwhile, yielding in between. The writer never
+ * waits for readers, a reader only gives up after READ_RETRIES torn copies. Every
+ * field is a 64-bit word in host byte order, copied a word at a time. */
+class MetricsSegment {
+public:
+    static constexpr uint32_t METRICS_MAGIC   = 0x584d4650;    /* "PFMX" */
+    static constexpr uint32_t METRICS_VERSION = 2;
+    static constexpr uint32_t READ_RETRIES    = 1000;
+
+    MetricsSegment() = default;
+    MetricsSegment(const MetricsSegment&) = delete;
+    MetricsSegment& operator=(const MetricsSegment&) = delete;
+    /* Unmaps, and removes the file if it was created here */
+    ~MetricsSegment();
+
+    /* Creates the file with zeroed blocks. It is set up under a temporary name and
+     * renamed into place, so readers never see a partial header. */
+    bool create(const std::string& path, uint16_t num_ports, uint16_t num_threads,
+                uint64_t tsc_hz, uint64_t core_clock_hz, uint32_t period_ms);
+    /* Maps an existing file read-only, false unless its layout is this version */
+    bool open(const std::string& path);
+
+    const MetricsHeader& header() const { return *header_; }
+
+    void publish_core(const FilterMetrics& metrics);
+    void publish_adapter(const FilterMetrics& metrics);
+    void publish_port(uint16_t port_id, const PortMetrics& metrics);
+    void publish_thread(uint16_t thread_id, const ThreadMetrics& metrics);
+
+    /* False if no consistent copy could be taken */
+    bool read_core(FilterMetrics& metrics) const;
+    bool read_adapter(FilterMetrics& metrics) const;
+    bool read_port(uint16_t port_id, PortMetrics& metrics) const;
+    bool read_thread(uint16_t thread_id, ThreadMetrics& metrics) const;
+
+private:
+    template<typename T>
+    struct alignas(64) Block {
+        uint64_t seq;
+        T data;
+    };
+    using FilterBlock = Block<FilterMetrics>;
+    using PortBlock = Block<PortMetrics>;
+    using ThreadBlock = Block<ThreadMetrics>;
+
+    struct alignas(64) Fixed {
+        MetricsHeader header;
+        FilterBlock core;
+        FilterBlock adapter;
+    };
+
+    std::string path_;
+    bool owner_ = false;
+    uint8_t* base_ = nullptr;
+    size_t size_ = 0;
+    MetricsHeader* header_ = nullptr;
+
+    static size_t layout(uint16_t num_ports, uint16_t num_threads, MetricsHeader& header);
+    Fixed* fixed() const { return reinterpret_cast<Fixed*>(base_); }
+    PortBlock* port(uint16_t port_id) const {
+        return reinterpret_cast<PortBlock*>(base_ + header_->ports_offset) + port_id;
+    }
+    ThreadBlock* thread(uint16_t thread_id) const {
+        return reinterpret_cast<ThreadBlock*>(base_ + header_->threads_offset) + thread_id;
+    }
+
+    template<typename T>
+    static void write_block(Block<T>& block, const T& data);
+    template<typename T>
+    static bool read_block(const Block<T>& block, T& data);
+};
+
+#endif // _METRICS_H_
@@ -0,0 +1,120 @@
+#include "deps.h"
+#include "metrics_exporter.h"
+
+static uint64_t monotonic_ns(std::chrono::steady_clock::time_point time) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+static FilterMetrics filter_metrics(const StatsSnapshot& snap) {
+    FilterMetrics metrics = {};
+    metrics.time_ns = monotonic_ns(snap.time);
+    metrics.cycles = snap.cycles;
+    metrics.packets = snap.packets;
+    metrics.phits = snap.phits;
+    metrics.bytes = snap.bytes;
+    metrics.forwarded = snap.forwarded;
+    metrics.dropped = snap.dropped;
+    metrics.mirrored = snap.mirrored;
+    return metrics;
+}
+
+MetricsExporter::MetricsExporter(DPDK& dpdk, PacketFilter* filter, std::mutex& filter_mutex,
+                                 const std::string& path, uint32_t period_ms)
+    : dpdk_(dpdk), filter_(filter), filter_mutex_(filter_mutex), path_(path),
+      period_ms_(period_ms) {
+}
+
+MetricsExporter::~MetricsExporter() {
+    stop();
+}
+
+bool MetricsExporter::start() {
+    if (!segment_.create(path_, dpdk_.ports(), dpdk_.threads(), rte_get_tsc_hz(),
+                         static_cast<uint64_t>(PacketFilter::CORE_CLOCK_HZ), period_ms_)) {
+        return false;
+    }
+    if (filter_ != nullptr) {
+        adapter_ = std::make_unique<PacketAdapter>();
+    }
+    publish();
+    thread_ = std::thread(&MetricsExporter::run, this);
+    log_info("Publishing metrics to %s every %u ms", path_.c_str(), period_ms_);
+    return true;
+}
+
+void MetricsExporter::stop() {
+    if (!thread_.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        cv_.notify_all();
+    }
+    thread_.join();
+    publish();
+}
+
+void MetricsExporter::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!cv_.wait_for(lock, std::chrono::milliseconds(period_ms_), [this] { return stop_; })) {
+        lock.unlock();
+        publish();
+        lock.lock();
+    }
+}
+
+void MetricsExporter::publish() {
+    if (filter_ != nullptr) {
+        StatsSnapshot core;
+        StatsSnapshot adapter;
+        bool latched;
+        {
+            std::lock_guard<std::mutex> lock(filter_mutex_);
+            latched = filter_->snapshot(core);
+            adapter = adapter_->snapshot();
+        }
+        if (latched) {
+            segment_.publish_core(filter_metrics(core));
+        }
+        segment_.publish_adapter(filter_metrics(adapter));
+    }
+
+    for (uint16_t port_id = 0; port_id < dpdk_.ports(); port_id++) {
+        struct rte_eth_stats stats;
+        uint64_t time_ns = monotonic_ns(std::chrono::steady_clock::now());
+        if (rte_eth_stats_get(port_id, &stats) != 0) {
+            continue;
+        }
+        PortMetrics metrics = {};
+        metrics.time_ns = time_ns;
+        metrics.ipackets = stats.ipackets;
+        metrics.opackets = stats.opackets;
+        metrics.ibytes = stats.ibytes;
+        metrics.obytes = stats.obytes;
+        metrics.imissed = stats.imissed;
+        metrics.ierrors = stats.ierrors;
+        metrics.oerrors = stats.oerrors;
+        metrics.rx_nombuf = stats.rx_nombuf;
+        uint32_t queues = std::min<uint32_t>(PortMetrics::MAX_QUEUES, RTE_ETHDEV_QUEUE_STAT_CNTRS);
+        for (uint32_t q = 0; q < queues; q++) {
+            metrics.q_ipackets[q] = stats.q_ipackets[q];
+            metrics.q_opackets[q] = stats.q_opackets[q];
+            metrics.q_ibytes[q] = stats.q_ibytes[q];
+            metrics.q_obytes[q] = stats.q_obytes[q];
+            metrics.q_errors[q] = stats.q_errors[q];
+        }
+        segment_.publish_port(port_id, metrics);
+    }
+
+    for (uint16_t thread_id = 0; thread_id < dpdk_.threads(); thread_id++) {
+        RxLoopSnapshot snapshot;
+        ThreadMetrics metrics = {};
+        metrics.time_ns = monotonic_ns(std::chrono::steady_clock::now());
+        dpdk_.read_rx_loop_stats(thread_id, snapshot);
+        metrics.port_id = thread_id / dpdk_.queues_per_port();
+        metrics.queue_id = thread_id % dpdk_.queues_per_port();
+        metrics.from_snapshot(snapshot);
+        segment_.publish_thread(thread_id, metrics);
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef _METRICS_EXPORTER_H_
+#define _METRICS_EXPORTER_H_
+
+#include "dpdk.h"
+#include "packet_filter.h"
+#include "metrics.h"
+
+/* Publishes the counters of the filter core, the packet adapter, every port and
+ * every rx lcore to a MetricsSegment each period, from its own thread. The rx
+ * lcores are only read: their RxLoopStats are relaxed atomics they alone write. */
+class MetricsExporter {
+private:
+    DPDK& dpdk_;
+    PacketFilter* filter_;
+    std::mutex& filter_mutex_;
+    std::string path_;
+    uint32_t period_ms_;
+
+    MetricsSegment segment_;
+    std::unique_ptr<PacketAdapter> adapter_;
+
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+
+    void publish();
+    void run();
+
+public:
+    static constexpr uint32_t DEFAULT_PERIOD_MS = 1000;
+
+    /* Without a filter, only the host counters are published */
+    MetricsExporter(DPDK& dpdk, PacketFilter* filter, std::mutex& filter_mutex,
+                    const std::string& path, uint32_t period_ms);
+    ~MetricsExporter();
+
+    /* Creates the segment and publishes the first sample */
+    bool start();
+    /* Publishes a last sample, the segment is removed on destruction */
+    void stop();
+};
+
+#endif // _METRICS_EXPORTER_H_
@@ -0,0 +1,232 @@
+#include <signal.h>
+#include <unistd.h>
+
+#include "deps.h"
+#include "packet_filter.h"
+#include "metrics.h"
+#include "stats_log.h"
+
+/* Prints the rates of a metrics segment published by main -x, e.g.
+ *   ./build/bin/metrics_reader -i 1000 /dev/shm/packet_filter
+ * It only maps the file read-only, so it can come and go while traffic runs.
+ * With -l, prints the samples of one file of a stats log written by main -l instead. */
+
+struct Arguments {
+    uint32_t interval_ms = 1000;
+    uint32_t samples = 0;       /* 0 to run until the writer exits */
+    const char* path = nullptr;
+    bool stats_log = false;
+
+    void parse_args(int argc, const char** argv);
+};
+
+/* Every block a reader takes in one sample */
+struct Sample {
+    bool core = false;
+    bool adapter = false;
+    FilterMetrics core_metrics = {};
+    FilterMetrics adapter_metrics = {};
+    std::vector<PortMetrics> ports;
+    std::vector<bool> port_valid;
+    std::vector<ThreadMetrics> threads;
+    std::vector<bool> thread_valid;
+
+    void read(const MetricsSegment& segment);
+};
+
+void Sample::read(const MetricsSegment& segment) {
+    const MetricsHeader& header = segment.header();
+    core = segment.read_core(core_metrics) && core_metrics.time_ns != 0;
+    adapter = segment.read_adapter(adapter_metrics) && adapter_metrics.time_ns != 0;
+    ports.resize(header.num_ports);
+    port_valid.assign(header.num_ports, false);
+    for (uint16_t i = 0; i < header.num_ports; i++) {
+        port_valid[i] = segment.read_port(i, ports[i]) && ports[i].time_ns != 0;
+    }
+    threads.resize(header.num_threads);
+    thread_valid.assign(header.num_threads, false);
+    for (uint16_t i = 0; i < header.num_threads; i++) {
+        thread_valid[i] = segment.read_thread(i, threads[i]) && threads[i].time_ns != 0;
+    }
+}
+
+static StatsSnapshot stats_snapshot(const FilterMetrics& metrics) {
+    StatsSnapshot snap = {};
+    snap.time = std::chrono::steady_clock::time_point(std::chrono::nanoseconds(metrics.time_ns));
+    snap.cycles = metrics.cycles;
+    snap.packets = metrics.packets;
+    snap.phits = metrics.phits;
+    snap.bytes = metrics.bytes;
+    snap.forwarded = metrics.forwarded;
+    snap.dropped = metrics.dropped;
+    snap.mirrored = metrics.mirrored;
+    return snap;
+}
+
+static void print_rates(const MetricsHeader& header, const Sample& last, const Sample& now) {
+    /* Blocks not published again since the last sample are skipped */
+    if (last.core && now.core && now.core_metrics.time_ns > last.core_metrics.time_ns) {
+        StatsRate rate = StatsRate::between(stats_snapshot(last.core_metrics),
+                                            stats_snapshot(now.core_metrics),
+                                            header.core_clock_hz);
+        printf("Filter: %.3f Mpps in (%.3f Mpps forwarded, %.3f Mpps dropped), "
+               "%.3f Mphits/s, %.2f Gbps\n",
+               rate.pps / 1e6, rate.forward_pps / 1e6, rate.drop_pps / 1e6,
+               rate.phits_per_sec / 1e6, rate.gbps);
+    }
+    if (last.adapter && now.adapter &&
+        now.adapter_metrics.time_ns > last.adapter_metrics.time_ns) {
+        StatsRate rate = StatsRate::between(stats_snapshot(last.adapter_metrics),
+                                            stats_snapshot(now.adapter_metrics),
+                                            header.core_clock_hz);
+        printf("Adapter: %.3f Mpps received, %.3f Mpps sent, %.3f Mpps dropped\n",
+               rate.pps / 1e6, rate.forward_pps / 1e6, rate.drop_pps / 1e6);
+    }
+
+    for (uint16_t i = 0; i < header.num_ports; i++) {
+        if (!last.port_valid[i] || !now.port_valid[i]) {
+            continue;
+        }
+        const PortMetrics& from = last.ports[i];
+        const PortMetrics& to = now.ports[i];
+        double seconds = (to.time_ns - from.time_ns) / 1e9;
+        if (seconds <= 0) {
+            continue;
+        }
+        printf("Port %u: rx %.3f Mpps (%.2f Gbps), tx %.3f Mpps (%.2f Gbps), "
+               "missed %.0f/s, errors %.0f/s, no mbuf %.0f/s\n", i,
+               (to.ipackets - from.ipackets) / seconds / 1e6,
+               (to.ibytes - from.ibytes) * 8 / seconds / 1e9,
+               (to.opackets - from.opackets) / seconds / 1e6,
+               (to.obytes - from.obytes) * 8 / seconds / 1e9,
+               (to.imissed - from.imissed) / seconds,
+               (to.ierrors - from.ierrors + to.oerrors - from.oerrors) / seconds,
+               (to.rx_nombuf - from.rx_nombuf) / seconds);
+        for (uint32_t q = 0; q < PortMetrics::MAX_QUEUES; q++) {
+            if (to.q_ipackets[q] == from.q_ipackets[q] && to.q_opackets[q] == from.q_opackets[q]) {
+                continue;
+            }
+            printf("  queue %u: rx %.3f Mpps, tx %.3f Mpps\n", q,
+                   (to.q_ipackets[q] - from.q_ipackets[q]) / seconds / 1e6,
+                   (to.q_opackets[q] - from.q_opackets[q]) / seconds / 1e6);
+        }
+    }
+
+    for (uint16_t i = 0; i < header.num_threads; i++) {
+        if (!last.thread_valid[i] || !now.thread_valid[i]) {
+            continue;
+        }
+        const ThreadMetrics& from = last.threads[i];
+        const ThreadMetrics& to = now.threads[i];
+        double seconds = (to.time_ns - from.time_ns) / 1e9;
+        if (seconds <= 0) {
+            continue;
+        }
+        RxLoopSnapshot delta = to.to_snapshot() - from.to_snapshot();
+        printf("Thread %u (port %lu, queue %lu): %.3f Mpps, %s\n", i, to.port_id, to.queue_id,
+               delta.packets / seconds / 1e6, delta.format().c_str());
+    }
+    fflush(stdout);
+}
+
+/* One line per sample, rates over its interval */
+static int print_stats_log(const char* path) {
+    StatsLog::Reader reader;
+    if (!reader.open(path)) {
+        return 1;
+    }
+    printf("%s: %u ports, sampled every %u ms\n", path, reader.header().num_ports,
+           reader.header().period_ms);
+    StatsDelta delta;
+    while (reader.next(delta)) {
+        double seconds = std::max<uint64_t>(delta.interval_us, 1) / 1e6;
+        time_t secs = delta.time_ns / 1000000000ull;
+        tm local;
+        localtime_r(&secs, &local);
+        char time_str[32];
+        strftime(time_str, sizeof(time_str), "%F %T", &local);
+        printf("%s.%03lu filter %.3f Mpps (%.3f forwarded, %.3f dropped), adapter %.3f Mpps "
+               "(%lu dropped), host %.3f Mpps (%.1f%% empty polls)", time_str,
+               delta.time_ns / 1000000 % 1000, delta.core_packets / seconds / 1e6,
+               delta.core_forwarded / seconds / 1e6, delta.core_dropped / seconds / 1e6,
+               delta.adapter_rx / seconds / 1e6, delta.adapter_rx_dropped,
+               delta.host_packets / seconds / 1e6,
+               delta.host_empty_polls + delta.host_busy_polls > 0 ?
+                   100.0 * delta.host_empty_polls /
+                       (delta.host_empty_polls + delta.host_busy_polls) : 0.0);
+        for (size_t i = 0; i < delta.ports.size(); i++) {
+            const StatsDelta::Port& port = delta.ports[i];
+            printf(", port %zu rx %.3f tx %.3f Mpps (%lu missed, %lu errors, %lu no mbuf)", i,
+                   port.ipackets / seconds / 1e6, port.opackets / seconds / 1e6,
+                   port.imissed, port.ierrors, port.rx_nombuf);
+        }
+        printf("\n");
+    }
+    return 0;
+}
+
+int main(int argc, const char** argv) {
+    Arguments args;
+    args.parse_args(argc, argv);
+    if (args.stats_log) {
+        return print_stats_log(args.path);
+    }
+
+    MetricsSegment segment;
+    if (!segment.open(args.path)) {
+        return 1;
+    }
+    const MetricsHeader& header = segment.header();
+    printf("%s: pid %lu, %u ports, %u threads, published every %u ms\n", args.path,
+           header.pid, header.num_ports, header.num_threads, header.period_ms);
+
+    Sample last;
+    last.read(segment);
+    for (uint32_t n = 0; args.samples == 0 || n < args.samples; n++) {
+        usleep(args.interval_ms * 1000);
+        /* The writer publishes once more before it exits, that sample is still read */
+        bool exited = kill(static_cast<pid_t>(header.pid), 0) != 0 && errno == ESRCH;
+        Sample now;
+        now.read(segment);
+        print_rates(header, last, now);
+        last = std::move(now);
+        if (exited) {
+            printf("Writer %lu exited\n", header.pid);
+            break;
+        }
+    }
+    return 0;
+}
+
+void Arguments::parse_args(int argc, const char** argv) {
+    int c;
+    while ((c = getopt(argc, const_cast<char**>(argv), "i:n:l")) != -1) {
+        switch (c) {
+            case 'i':
+                this->interval_ms = static_cast<uint32_t>(std::stoul(optarg));
+                break;
+
+            case 'n':
+                this->samples = static_cast<uint32_t>(std::stoul(optarg));
+                break;
+
+            case 'l':
+                this->stats_log = true;
+                break;
+
+            case '?':
+            default:
+                log_info("Usage: %s [-i <interval_ms>] [-n <samples>] <metrics_path> | -l <stats_log_file>",
+                         argv[0]);
+                log_fatal("Unknown option: %c", c);
+        }
+    }
+
+    if (optind != argc - 1) {
+        log_fatal("Metrics path is required, e.g. /dev/shm/packet_filter");
+    }
+    if (this->interval_ms == 0) {
+        log_fatal("Interval must be at least 1 ms");
+    }
+    this->path = argv[optind];
+}
@@ -0,0 +1,58 @@
+#include <rte_ethdev.h>
+#include <rte_pmd_qdma.h>
+
+#include "deps.h"
+#include "mmio_backend.h"
+
+QdmaBackend::QdmaBackend(uint32_t port_id) : port_id_(port_id) {
+    /* We need to configure DPDK before creating MMIO object */
+    if (rte_pmd_qdma_get_device(port_id) == nullptr) {
+        log_fatal("Port %u is not a QDMA device", port_id);
+    }
+
+    uint8_t port_num = rte_eth_dev_count_avail();
+    log_assert(port_id < port_num, "Invalid port_id: %u", port_id);
+
+    int32_t config_bar, user_bar, bypass_bar;
+    int ret = rte_pmd_qdma_get_bar_details(port_id, &config_bar, &user_bar, &bypass_bar);
+    if (ret != 0) {
+        log_fatal("Failed to get BAR details for port %u: %s",
+                  port_id, rte_strerror(-ret));
+    }
+
+    bar_id_ = static_cast<uint32_t>(user_bar);
+}
+
+bool QdmaBackend::is_available(uint32_t port_id) {
+    return port_id < rte_eth_dev_count_avail() && rte_pmd_qdma_get_device(port_id) != nullptr;
+}
+
+void QdmaBackend::reg_write(uint32_t addr, uint32_t value) {
+    rte_pmd_qdma_compat_pci_write_reg(port_id_, bar_id_, addr, value);
+}
+
+uint32_t QdmaBackend::reg_read(uint32_t addr) {
+    return rte_pmd_qdma_compat_pci_read_reg(port_id_, bar_id_, addr);
+}
+
+void SimBackend::reg_write(uint32_t addr, uint32_t value) {
+    uint32_t offset = addr - PacketFilterModel::base_addr();
+    if (offset < PacketFilterModel::ADDR_SPACE) {
+        filter_model_.reg_write(offset, value);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    regs_[addr] = value;
+}
+
+uint32_t SimBackend::reg_read(uint32_t addr) {
+    uint32_t offset = addr - PacketFilterModel::base_addr();
+    if (offset < PacketFilterModel::ADDR_SPACE) {
+        return filter_model_.reg_read(offset);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = regs_.find(addr);
+    return it == regs_.end() ? 0 : it->second;
+}
@@ -0,0 +1,51 @@
+#ifndef _MMIO_BACKEND_H_
+#define _MMIO_BACKEND_H_
+
+#include "packet_filter_model.h"
+
+/* Register access to the user BAR of the FPGA. Addresses are absolute offsets
+ * within the BAR; MMIO adds the base address of each block. */
+class MMIOBackend {
+public:
+    virtual ~MMIOBackend() {}
+    virtual void reg_write(uint32_t addr, uint32_t value) = 0;
+    virtual uint32_t reg_read(uint32_t addr) = 0;
+};
+
+/* Registers of a QDMA device, accessed through the QDMA PMD */
+class QdmaBackend : public MMIOBackend {
+private:
+    uint32_t port_id_;
+    uint32_t bar_id_;
+
+public:
+    QdmaBackend() = delete;
+    QdmaBackend(uint32_t port_id);
+    ~QdmaBackend() {}
+
+    static bool is_available(uint32_t port_id);
+
+    void reg_write(uint32_t addr, uint32_t value) override;
+    uint32_t reg_read(uint32_t addr) override;
+};
+
+/* In-process register file for running without the FPGA. The packet filter block
+ * is backed by a software model of the HLS core; every other register simply
+ * holds what was last written to it. */
+class SimBackend : public MMIOBackend {
+private:
+    std::mutex mutex_;
+    std::unordered_map<uint32_t, uint32_t> regs_;
+    PacketFilterModel filter_model_;
+
+public:
+    SimBackend() {}
+    ~SimBackend() {}
+
+    void reg_write(uint32_t addr, uint32_t value) override;
+    uint32_t reg_read(uint32_t addr) override;
+
+    PacketFilterModel& filter_model() { return filter_model_; }
+};
+
+#endif // _MMIO_BACKEND_H_
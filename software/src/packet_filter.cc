@@ -1,57 +1,661 @@
 
 #include <assert.h>
-
-#include <rte_ethdev.h>
-#include <rte_pmd_qdma.h>
+#include <arpa/inet.h>
 
 #include <type_traits>
+#include <set>
 
 #include "deps.h"
 #include "packet_filter.h"
+#include "mmio_backend.h"
+#include "rule_compiler.h"
+#include "filter_geometry.h"
+#include "filter_metadata.h"
 
 #define PRINT_STAT(str, val) \
     if (val > 0 && val != static_cast<decltype(val)>(-1)) \
         log_info(str, val);
 
-PacketFilter::PacketFilter(std::vector<std::string> filter_list) : MMIO(0) {
-    set_base_addr(OPENNIC_USER_250_BASE_ADDR + PACKET_FILTER_OFFSET);
+PacketFilter::PacketFilter() : MMIO(0) {
+    init();
+}
+
+PacketFilter::PacketFilter(std::vector<std::string> filter_list, uint16_t rss_queues,
+                           bool metadata)
+    : MMIO(0) {
+    init();
+
+    /* Set either way, a previous run may have left it on. Before the commit, so no
+     * frame is forwarded without the prefix. */
+    set_metadata(metadata);
+    set_mirror(0, 0);
 
+    if (rss_queues > 0 && !set_rss_queues(rss_queues)) {
+        log_fatal("Failed to spread RSS over %u queues", rss_queues);
+    }
+
+    RuleSet rules;
     for (const auto& filter : filter_list) {
-        update_rule(filter, RULE_ACTION_FORWARD);
+        log_info("Adding rule: %s -> %s", filter.c_str(), rss_queues > 0 ? "RSS" : "FORWARD");
+        Rule rule = parse_rule(filter, RULE_ACTION_FORWARD);
+        if (rss_queues > 0) {
+            rule.action = RULE_ACTION_STEER;
+            rule.queue = QUEUE_RSS;
+        }
+        rules.push_back(rule);
+    }
+    if (!commit(rules)) {
+        log_fatal("Failed to program %zu rules", rules.size());
+    }
+}
+
+void PacketFilter::init() {
+    set_base_addr(OPENNIC_USER_250_BASE_ADDR + PACKET_FILTER_OFFSET);
+
+    compiler_ = std::make_shared<RuleCompiler>();
+    for (auto& shadow : shadow_) {
+        shadow.assign(RuleCompiler::NUM_SLOTS, BankSlot{FlowKey{}, RULE_ACTION_INVALID, 0, 0, 0});
+    }
+    for (auto& masks : shadow_masks_) {
+        masks.assign(RuleCompiler::NUM_TABLES, FlowKey{});
+    }
+    for (uint32_t bank = 0; bank < NUM_BANKS; bank++) {
+        slot_rules_[bank].assign(RuleCompiler::NUM_SLOTS, NO_RULE);
+        slot_counters_[bank].assign(RuleCompiler::NUM_SLOTS, RuleCounters{0, 0});
+    }
+
+    /* Continue the doorbell sequences from wherever a previous run left them */
+    rule_seq_ = read<uint32_t>(RegisterMap::RULE_ACK_REG);
+    commit_seq_ = read<uint32_t>(RegisterMap::APPLIED_SEQ_REG);
+    stats_seq_ = read<uint32_t>(RegisterMap::STATS_ACK_REG);
+    snapshot_seq_ = read<uint32_t>(RegisterMap::SNAPSHOT_ACK_REG);
+    sketch_epoch_ = read<uint8_t>(RegisterMap::SKETCH_EPOCH_REG);
+
+    /* The core starts on bank 0 and every commit bumps the sequence by one and swaps
+     * the banks, so its parity tells which bank a previous run left active */
+    active_ = commit_seq_ % NUM_BANKS;
+
+    /* Either bank may still hold the rules of a previous run. The inactive one is
+     * emptied first, so the old rules stay in effect until the swap. */
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < NUM_BANKS; i++) {
+        if (!clear_bank(active_ ^ 1) || !swap_banks()) {
+            log_fatal("Cannot clear the rule banks of the packet filter");
+        }
+    }
+    /* Slot counters keep what the previous run counted, later reads start from there */
+    for (uint32_t bank = 0; bank < NUM_BANKS; bank++) {
+        if (!collect_counters(bank, true)) {
+            log_fatal("Cannot read the slot counters of the packet filter");
+        }
     }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    log_info("Cleared both rule banks in %.3f ms", secs * 1e3);
+}
+
+bool PacketFilter::clear_bank(uint32_t bank) {
+    for (uint32_t table = 0; table < RuleCompiler::NUM_TABLES; table++) {
+        if (!write_mask(table, FlowKey{})) {
+            return false;
+        }
+    }
+    BankSlot empty = {FlowKey{}, RULE_ACTION_INVALID, 0, 0, 0};
+    for (uint32_t slot = 0; slot < RuleCompiler::NUM_SLOTS; slot++) {
+        if (!write_rule(slot, empty)) {
+            return false;
+        }
+    }
+    shadow_[bank].assign(RuleCompiler::NUM_SLOTS, empty);
+    shadow_masks_[bank].assign(RuleCompiler::NUM_TABLES, FlowKey{});
+    return true;
+}
+
+bool PacketFilter::swap_banks() {
+    write<uint8_t>(RegisterMap::DEFAULT_ACTION_REG, static_cast<uint8_t>(default_action_));
+    commit_seq_++;
+    write<uint32_t>(RegisterMap::COMMIT_SEQ_REG, commit_seq_);
+    if (!wait_for(RegisterMap::APPLIED_SEQ_REG, commit_seq_)) {
+        log_error("Packet filter did not apply commit %u", commit_seq_);
+        return false;
+    }
+    active_ ^= 1;
+    return true;
+}
+
+PacketFilter::Rule PacketFilter::parse_rule(const std::string& rule, RuleAction action) {
+    Rule result;
+    if (!parse_rule(rule, action, result)) {
+        log_fatal("Invalid rule: %s", rule.c_str());
+    }
+    return result;
+}
+
+bool PacketFilter::parse_rule(const std::string& rule, RuleAction action, Rule& result) {
+    /* std::stoi throws on fields that are not numbers */
+    try {
+        std::string spec = rule;
+        int priority = -1;
+        size_t at_pos = spec.find('@');
+        if (at_pos != std::string::npos) {
+            priority = std::stoi(spec.substr(at_pos + 1));
+            if (priority < 0 || priority > 0xFFFF) {
+                log_error("Invalid priority: %s", rule.c_str());
+                return false;
+            }
+            spec = spec.substr(0, at_pos);
+        }
+
+        /* Colons inside brackets belong to an IPv6 address */
+        std::vector<std::string> fields(1);
+        bool in_brackets = false;
+        for (char c : spec) {
+            if (c == ':' && !in_brackets) {
+                fields.emplace_back();
+                continue;
+            }
+            in_brackets = c == '[' ? true : c == ']' ? false : in_brackets;
+            fields.back() += c;
+        }
+
+        /* <dst_ip>:<dst_port> is a UDP rule */
+        if (fields.size() == 2) {
+            fields = {"udp", "*", "*", fields[0], fields[1]};
+        }
+        if (fields.size() != 5) {
+            log_error("Invalid rule format: %s", rule.c_str());
+            return false;
+        }
+
+        auto parse_ip = [](const std::string& str, IPAddress& value, IPAddress& mask) {
+            if (str == "*") {
+                value = mask = IPAddress{};
+                return true;
+            }
+            /* <ip>/<prefix length> in CIDR notation */
+            std::string addr = str;
+            int len = -1;
+            size_t slash_pos = str.rfind('/');
+            if (slash_pos != std::string::npos) {
+                addr = str.substr(0, slash_pos);
+                len = std::stoi(str.substr(slash_pos + 1));
+            }
+            /* convert to a 16-byte address in network byte order */
+            if (addr.size() > 2 && addr.front() == '[' && addr.back() == ']') {
+                addr = addr.substr(1, addr.size() - 2);
+                if (inet_pton(AF_INET6, addr.c_str(), value.bytes) != 1) {
+                    log_error("Invalid IPv6 address: %s", str.c_str());
+                    return false;
+                }
+                len = len < 0 ? 128 : len;
+                if (len > 128) {
+                    log_error("Invalid prefix length: %s", str.c_str());
+                    return false;
+                }
+            } else {
+                in_addr ipv4;
+                if (inet_pton(AF_INET, addr.c_str(), &ipv4) != 1) {
+                    log_error("Invalid IP address: %s", str.c_str());
+                    return false;
+                }
+                value = IPAddress::from_ipv4(ipv4.s_addr);
+                len = len < 0 ? 32 : len;
+                if (len > 32) {
+                    log_error("Invalid prefix length: %s", str.c_str());
+                    return false;
+                }
+                /* The ::ffff: prefix is always matched, so IPv4 rules only apply to IPv4 */
+                len += 96;
+            }
+            mask = RuleCompiler::prefix_mask(len);
+            value = value & mask;
+            return true;
+        };
+        auto parse_port = [](const std::string& str, uint16_t& value, uint16_t& mask) {
+            if (str == "*") {
+                value = mask = 0;
+                return true;
+            }
+            /* convert port to uint16_t and network byte order */
+            int port = std::stoi(str);
+            if (port <= 0 || port > 0xFFFF) {
+                log_error("Invalid port: %s", str.c_str());
+                return false;
+            }
+            value = htons(static_cast<uint16_t>(port));
+            mask = 0xFFFF;
+            return true;
+        };
+
+        result = {};
+        const std::string& proto = fields[0];
+        if (proto != "*") {
+            result.match.protocol = proto == "udp" ? 17 : proto == "tcp" ? 6 :
+                                    proto == "icmp" ? 1 : std::stoi(proto);
+            result.mask.protocol = 0xFF;
+        }
+        if (!parse_ip(fields[1], result.match.src_ip, result.mask.src_ip) ||
+            !parse_port(fields[2], result.match.src_port, result.mask.src_port) ||
+            !parse_ip(fields[3], result.match.dst_ip, result.mask.dst_ip) ||
+            !parse_port(fields[4], result.match.dst_port, result.mask.dst_port)) {
+            return false;
+        }
+
+        if (priority < 0) {
+            const FlowKey& mask = result.mask;
+            priority = mask.src_ip.popcount() + mask.dst_ip.popcount() +
+                       __builtin_popcount(mask.src_port) + __builtin_popcount(mask.dst_port) +
+                       __builtin_popcount(mask.protocol);
+        }
+        result.priority = static_cast<uint16_t>(priority);
+        result.action = action;
+        return true;
+    } catch (const std::exception&) {
+        log_error("Invalid rule: %s", rule.c_str());
+        return false;
+    }
+}
+
+std::string PacketFilter::format_rule(const Rule& rule) {
+    auto ip = [](const IPAddress& value, const IPAddress& mask) -> std::string {
+        if (mask == IPAddress{}) return "*";
+        char str[INET6_ADDRSTRLEN];
+        int len = RuleCompiler::prefix_length(mask);
+        if (len >= 96 && value.is_ipv4()) {
+            uint32_t ipv4 = value.ipv4();
+            inet_ntop(AF_INET, &ipv4, str, sizeof(str));
+            return len == 128 ? str : std::string(str) + "/" + std::to_string(len - 96);
+        }
+        inet_ntop(AF_INET6, value.bytes, str, sizeof(str));
+        return "[" + std::string(str) + "]" + (len == 128 ? "" : "/" + std::to_string(len));
+    };
+    auto port = [](uint16_t value, uint16_t mask) -> std::string {
+        return mask == 0 ? "*" : std::to_string(ntohs(value));
+    };
+
+    std::string proto = rule.mask.protocol == 0 ? "*" :
+                        rule.match.protocol == 17 ? "udp" :
+                        rule.match.protocol == 6 ? "tcp" :
+                        rule.match.protocol == 1 ? "icmp" : std::to_string(rule.match.protocol);
+    return proto + ":" + ip(rule.match.src_ip, rule.mask.src_ip) + ":" +
+           port(rule.match.src_port, rule.mask.src_port) + ":" +
+           ip(rule.match.dst_ip, rule.mask.dst_ip) + ":" +
+           port(rule.match.dst_port, rule.mask.dst_port) + "@" +
+           std::to_string(rule.priority);
 }
 
-void PacketFilter::update_rule(std::string net_addr, RuleAction action) {
+void PacketFilter::update_rule(std::string rule, RuleAction action) {
     log_info("Updating rule: %s -> %s",
-             net_addr.c_str(),
+             rule.c_str(),
              action == RULE_ACTION_DROP ? "DROP" : "FORWARD");
 
-    /* Get IP and port from net_addr */
-    size_t colon_pos = net_addr.find(':');
-    log_assert(colon_pos != std::string::npos, "Invalid net_addr format: %s",
-               net_addr.c_str());
-    std::string ip_str = net_addr.substr(0, colon_pos);
-    std::string port_str = net_addr.substr(colon_pos + 1);
+    if (!replace_rule(parse_rule(rule, action))) {
+        log_error("Failed to update rule: %s", rule.c_str());
+    }
+}
+
+bool PacketFilter::set_rate_limit(std::string rule, const RateLimit& limit) {
+    log_info("Rate limiting rule: %s -> %lu %s, burst %u %s", rule.c_str(), limit.rate,
+             limit.unit == RATE_PPS ? "pps" : "bps", limit.burst,
+             limit.unit == RATE_PPS ? "packets" : "bytes");
+
+    Rule parsed = parse_rule(rule, RULE_ACTION_RATE_LIMIT);
+    parsed.limit = limit;
+    if (!replace_rule(parsed)) {
+        log_error("Failed to rate limit rule: %s", rule.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool PacketFilter::set_steering(std::string rule, uint16_t queue) {
+    if (queue != QUEUE_RSS && queue >= MAX_QUEUES) {
+        log_error("Cannot steer rule %s to queue %u, queues go up to %u",
+                  rule.c_str(), queue, MAX_QUEUES - 1);
+        return false;
+    }
+    if (queue == QUEUE_RSS) {
+        log_info("Steering rule: %s -> RSS", rule.c_str());
+    } else {
+        log_info("Steering rule: %s -> queue %u", rule.c_str(), queue);
+    }
+
+    Rule parsed = parse_rule(rule, RULE_ACTION_STEER);
+    parsed.queue = queue;
+    if (!replace_rule(parsed)) {
+        log_error("Failed to steer rule: %s", rule.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool PacketFilter::set_rss_queues(uint16_t num_queues) {
+    if (num_queues == 0 || num_queues > MAX_QUEUES) {
+        log_error("Cannot spread RSS over %u queues", num_queues);
+        return false;
+    }
+
+    /* The table is not banked: entries change under live traffic, one at a time */
+    for (uint32_t entry = 0; entry < RSS_TABLE_SIZE; entry++) {
+        write<uint16_t>(RegisterMap::RULE_QUEUE_REG, static_cast<uint16_t>(entry % num_queues));
+        write<uint32_t>(RegisterMap::RULE_INDEX_REG, entry);
+        write<uint8_t>(RegisterMap::RULE_WAY_REG, RSS_WAY);
+        if (!ring_doorbell()) {
+            return false;
+        }
+    }
+    log_info("RSS spread over %u queues", num_queues);
+    return true;
+}
+
+void PacketFilter::set_metadata(bool enable) {
+    /* Latched by the core for each frame, so it applies to whole frames */
+    write<uint8_t>(RegisterMap::METADATA_REG, enable ? 1 : 0);
+}
 
-    /* convert IPv4 to uint32_t and network byte order */
-    uint32_t ip = inet_addr(ip_str.c_str());
-    log_assert(ip != INADDR_NONE, "Invalid IP address: %s", ip_str.c_str());
+bool PacketFilter::set_mirror(uint32_t one_in_n, uint16_t queue) {
+    if (one_in_n != 0 && queue >= MAX_QUEUES) {
+        log_error("Cannot mirror to queue %u", queue);
+        return false;
+    }
+    uint32_t threshold = one_in_n == 0 ? 0 : static_cast<uint32_t>(
+        std::min<uint64_t>((1ULL << 32) / one_in_n, UINT32_MAX));
+    write<uint16_t>(RegisterMap::MIRROR_QUEUE_REG, queue);
+    write<uint32_t>(RegisterMap::MIRROR_THRESHOLD_REG, threshold);
+    if (one_in_n != 0) {
+        log_info("Mirroring 1 in %u dropped packets to queue %u", one_in_n, queue);
+    }
+    return true;
+}
 
-    /* convert port to uint16_t and network byte order */
-    uint16_t port = htons(static_cast<uint16_t>(std::stoi(port_str)));
-    log_assert(port != 0, "Invalid port: %s", port_str.c_str());
+const PacketFilter::Rule* PacketFilter::rule_of(uint32_t rule_id) const {
+    if ((rule_id & FilterMetadata::RULE_HIT) == 0) {
+        return nullptr;
+    }
+    uint32_t slot = rule_id % RuleCompiler::NUM_SLOTS;
+    uint32_t bank = (rule_id / RuleCompiler::NUM_SLOTS) % NUM_BANKS;
+    uint32_t rule = slot_rules_[bank][slot];
+    return rule == NO_RULE ? nullptr : &bank_rules_[bank][rule];
+}
 
-    /* Write to MMIO registers */
-    write<uint32_t>(RegisterMap::IPV4_ADDR_REG, ip);
-    write<uint16_t>(RegisterMap::UDP_PORT_REG, port);
-    write<uint8_t>(RegisterMap::RULE_ACTION_REG, static_cast<uint8_t>(action));
+bool PacketFilter::replace_rule(const Rule& rule) {
+    RuleSet rules = rules_;
+    auto it = std::find_if(rules.begin(), rules.end(), [&rule](const Rule& r) {
+        return r.mask == rule.mask && (r.match & r.mask) == (rule.match & rule.mask);
+    });
+    if (it != rules.end()) {
+        *it = rule;
+    } else {
+        rules.push_back(rule);
+    }
+    return commit(rules);
+}
+
+bool PacketFilter::commit(const RuleSet& rules) {
+    auto start = std::chrono::steady_clock::now();
+
+    RuleCompiler::Placement placement = compiler_->place(rules);
+    for (const auto& collision : placement.conflicts) {
+        std::string rule = format_rule(rules[collision.rule]);
+        if (collision.slot == RuleCompiler::NO_SLOT) {
+            log_warn("Rule %s needs a table but all %u are taken by other masks",
+                     rule.c_str(), RuleCompiler::NUM_TABLES);
+        } else {
+            log_warn("Rule %s found no free slot (first candidate %u)",
+                     rule.c_str(), collision.slot);
+        }
+    }
+    if (!placement.conflicts.empty() && collision_policy_ == COLLISION_REJECT) {
+        log_error("Rejecting rule set: %zu rules cannot be stored", placement.conflicts.size());
+        return false;
+    }
+    size_t tables = std::count(placement.tables.begin(), placement.tables.end(), true);
+    log_info("Rule set of %zu rules (%zu table entries) uses %zu/%u tables and %zu/%u slots "
+             "(%.1f%% load, %zu entries moved)",
+             rules.size(), placement.entries, tables, RuleCompiler::NUM_TABLES,
+             placement.used, RuleCompiler::NUM_SLOTS,
+             100.0 * placement.used / RuleCompiler::NUM_SLOTS, placement.moved);
+
+    /* Push only the masks and slots that differ from what the inactive bank already
+     * holds. Masks of unused tables are left alone, those tables are empty. Frames
+     * that were still in flight when the bank was swapped out are counted first, the
+     * slots are about to change rules. */
+    uint32_t bank = active_ ^ 1;
+    if (!collect_counters(bank)) {
+        return false;
+    }
+    std::vector<uint32_t> bucket_of;
+    if (!assign_buckets(rules, bucket_of)) {
+        return false;
+    }
+    size_t writes = 0;
+    for (uint32_t table = 0; table < RuleCompiler::NUM_TABLES; table++) {
+        const FlowKey& mask = placement.masks[table];
+        if (!placement.tables[table] || shadow_masks_[bank][table] == mask) {
+            continue;
+        }
+        if (!write_mask(table, mask)) {
+            return false;
+        }
+        shadow_masks_[bank][table] = mask;
+        writes++;
+    }
+
+    auto& shadow = shadow_[bank];
+    for (uint32_t slot = 0; slot < RuleCompiler::NUM_SLOTS; slot++) {
+        const auto& target = placement.slots[slot];
+        BankSlot next = target.used ? BankSlot{target.key, target.action, target.priority,
+                                               bucket_of[target.rule], rules[target.rule].queue}
+                                    : BankSlot{shadow[slot].key, RULE_ACTION_INVALID, 0, 0, 0};
+        if (shadow[slot].action == next.action &&
+            (next.action == RULE_ACTION_INVALID ||
+             (shadow[slot].key == next.key && shadow[slot].priority == next.priority &&
+              shadow[slot].bucket == next.bucket && shadow[slot].queue == next.queue))) {
+            continue;
+        }
+
+        if (!write_rule(slot, next)) {
+            return false;
+        }
+        shadow[slot] = next;
+        writes++;
+    }
+
+    if (!swap_banks()) {
+        return false;
+    }
+    rules_ = rules;
+    compiler_->accept(placement);
+
+    bank_rules_[bank] = rules;
+    for (uint32_t slot = 0; slot < RuleCompiler::NUM_SLOTS; slot++) {
+        slot_rules_[bank][slot] = placement.slots[slot].used ? placement.slots[slot].rule : NO_RULE;
+    }
+    /* Only rules of either bank can still be counted or hold a bucket */
+    std::set<std::pair<FlowKey, FlowKey>> live;
+    std::set<std::tuple<FlowKey, FlowKey, RateLimit>> limited;
+    for (const auto& bank_rules : bank_rules_) {
+        for (const auto& rule : bank_rules) {
+            live.insert({rule.mask, rule.match & rule.mask});
+            if (rule.action == RULE_ACTION_RATE_LIMIT) {
+                limited.insert({rule.mask, rule.match & rule.mask, rule.limit});
+            }
+        }
+    }
+    for (auto it = rule_totals_.begin(); it != rule_totals_.end();) {
+        it = live.count(it->first) ? std::next(it) : rule_totals_.erase(it);
+    }
+    for (auto it = buckets_.begin(); it != buckets_.end();) {
+        it = limited.count(it->first) ? std::next(it) : buckets_.erase(it);
+    }
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    log_info("Committed %zu rules in %.3f ms, %.0f rules/s (%zu table writes, %.0f writes/s)",
+             rules.size(), secs * 1e3, secs > 0 ? rules.size() / secs : 0.0, writes,
+             secs > 0 ? writes / secs : 0.0);
+    return true;
+}
+
+std::vector<uint32_t> PacketFilter::conflicts(const RuleSet& rules) const {
+    RuleCompiler::Placement placement = compiler_->place(rules);
+    std::vector<uint32_t> result;
+    for (const auto& collision : placement.conflicts) {
+        result.push_back(collision.rule);
+    }
+    return result;
+}
+
+bool PacketFilter::set_default_action(RuleAction action) {
+    if (action == RULE_ACTION_RATE_LIMIT) {
+        log_error("The default action cannot be rate limited");
+        return false;
+    }
+    RuleAction previous = default_action_;
+    default_action_ = action;
+    if (!commit(rules_)) {
+        default_action_ = previous;
+        return false;
+    }
+    return true;
+}
+
+void PacketFilter::write_key(const FlowKey& key) {
+    write_address(RegisterMap::SRC_IPV6_HEAD_REG, RegisterMap::SRC_IPV4_ADDR_REG, key.src_ip);
+    write_address(RegisterMap::IPV6_HEAD_REG, RegisterMap::IPV4_ADDR_REG, key.dst_ip);
+    write<uint16_t>(RegisterMap::SRC_PORT_REG, key.src_port);
+    write<uint16_t>(RegisterMap::UDP_PORT_REG, key.dst_port);
+    write<uint8_t>(RegisterMap::IP_PROTOCOL_REG, key.protocol);
+}
+
+/* Bytes 0-11 go to the 96-bit head register and bytes 12-15 to the IPv4 one */
+void PacketFilter::write_address(uint32_t head_offset, uint32_t tail_offset,
+                                 const IPAddress& addr) {
+    for (int i = 0; i < 3; i++) {
+        write<uint32_t>(head_offset + 4 * i, addr.word(i));
+    }
+    write<uint32_t>(tail_offset, addr.word(3));
+}
+
+bool PacketFilter::write_rule(uint32_t slot, const BankSlot& entry) {
+    uint32_t way = slot / RuleCompiler::TABLE_SIZE;
+    write_key(entry.key);
+    write<uint8_t>(RegisterMap::RULE_ACTION_REG, static_cast<uint8_t>(entry.action));
+    write<uint16_t>(RegisterMap::RULE_PRIORITY_REG, entry.priority);
+    write<uint16_t>(RegisterMap::RULE_BUCKET_REG, static_cast<uint16_t>(entry.bucket));
+    write<uint16_t>(RegisterMap::RULE_QUEUE_REG, entry.queue);
+    write<uint8_t>(RegisterMap::RULE_TABLE_REG, static_cast<uint8_t>(way / RuleCompiler::TABLE_WAYS));
+    write<uint8_t>(RegisterMap::RULE_WAY_REG, static_cast<uint8_t>(way % RuleCompiler::TABLE_WAYS));
+    write<uint32_t>(RegisterMap::RULE_INDEX_REG, slot % RuleCompiler::TABLE_SIZE);
+    return ring_doorbell();
+}
+
+bool PacketFilter::write_mask(uint32_t table, const FlowKey& mask) {
+    write_key(mask);
+    write<uint8_t>(RegisterMap::RULE_TABLE_REG, static_cast<uint8_t>(table));
+    write<uint8_t>(RegisterMap::RULE_WAY_REG, MASK_WAY);
+    return ring_doorbell();
+}
+
+/* Buckets of rules that keep their limit are reused, so their tokens carry over */
+bool PacketFilter::assign_buckets(const RuleSet& rules, std::vector<uint32_t>& bucket_of) {
+    std::vector<bool> taken(FilterGeometry::RATE_BUCKETS, false);
+    for (const auto& entry : buckets_) {
+        taken[entry.second] = true;
+    }
+
+    bucket_of.assign(rules.size(), 0);
+    uint32_t next = 0;
+    for (size_t i = 0; i < rules.size(); i++) {
+        const Rule& rule = rules[i];
+        if (rule.action != RULE_ACTION_RATE_LIMIT) {
+            continue;
+        }
+        auto key = std::make_tuple(rule.mask, rule.match & rule.mask, rule.limit);
+        auto it = buckets_.find(key);
+        if (it == buckets_.end()) {
+            while (next < taken.size() && taken[next]) {
+                next++;
+            }
+            if (next == taken.size()) {
+                log_error("Rejecting rule set: more than %zu rate limits in use", taken.size());
+                return false;
+            }
+            if (!write_bucket(next, rule.limit)) {
+                return false;
+            }
+            taken[next] = true;
+            it = buckets_.emplace(key, next).first;
+        }
+        bucket_of[i] = it->second;
+    }
+    return true;
+}
+
+bool PacketFilter::write_bucket(uint32_t bucket, const RateLimit& limit) {
+    /* Tokens per core cycle in 32.32 fixed point; bits/s are charged as bytes */
+    long double per_second = limit.unit == RATE_BPS ? limit.rate / 8.0L : limit.rate;
+    uint64_t rate = static_cast<uint64_t>(per_second * 4294967296.0L / CORE_CLOCK_HZ);
+    write<uint16_t>(RegisterMap::RULE_BUCKET_REG, static_cast<uint16_t>(bucket));
+    write<uint64_t>(RegisterMap::BUCKET_RATE_REG, rate);
+    write<uint32_t>(RegisterMap::BUCKET_BURST_REG, limit.burst);
+    write<uint8_t>(RegisterMap::BUCKET_UNIT_REG, static_cast<uint8_t>(limit.unit));
+    write<uint8_t>(RegisterMap::RULE_WAY_REG, BUCKET_WAY);
+    return ring_doorbell();
+}
+
+bool PacketFilter::ring_doorbell() {
+    /* The core latches the rule registers once per doorbell */
+    rule_seq_++;
+    write<uint32_t>(RegisterMap::RULE_SEQ_REG, rule_seq_);
+    if (!wait_for(RegisterMap::RULE_ACK_REG, rule_seq_)) {
+        log_error("Packet filter did not acknowledge rule write %u", rule_seq_);
+        return false;
+    }
+    return true;
+}
+
+bool PacketFilter::wait_for(uint32_t offset, uint32_t value) {
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::microseconds(HANDSHAKE_TIMEOUT_US);
+    while (read<uint32_t>(offset) != value) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool PacketFilter::snapshot(StatsSnapshot& snap) {
+    /* The core latches somewhere between the doorbell and the ack being read, so
+     * the midpoint is off by at most half an MMIO round trip */
+    auto before = std::chrono::steady_clock::now();
+    snapshot_seq_++;
+    write<uint32_t>(RegisterMap::SNAPSHOT_SEQ_REG, snapshot_seq_);
+    if (!wait_for(RegisterMap::SNAPSHOT_ACK_REG, snapshot_seq_)) {
+        log_error("Packet filter did not take snapshot %u", snapshot_seq_);
+        return false;
+    }
+    snap.time      = before + (std::chrono::steady_clock::now() - before) / 2;
+
+    /* The latched registers do not move until the next snapshot */
+    snap.packets   = read<uint64_t>(RegisterMap::STATS_PKT_IN_REG);
+    snap.phits     = read<uint64_t>(RegisterMap::STATS_PHIT_IN_REG);
+    snap.forwarded = read<uint64_t>(RegisterMap::STATS_PKT_FORWD_REG);
+    snap.dropped   = read<uint64_t>(RegisterMap::STATS_PKT_DROP_REG);
+    snap.cycles    = read<uint64_t>(RegisterMap::STATS_CYCLES_REG);
+    snap.bytes     = read<uint64_t>(RegisterMap::STATS_BYTES_REG);
+    snap.mirrored  = read<uint64_t>(RegisterMap::STATS_MIRRORED_REG);
+    return true;
 }
 
 void PacketFilter::show_stats() {
-    uint64_t pkt_in     = read<uint64_t>(RegisterMap::STATS_PKT_IN_REG);
-    uint64_t phit_in    = read<uint64_t>(RegisterMap::STATS_PHIT_IN_REG);
-    uint64_t pkt_forwd  = read<uint64_t>(RegisterMap::STATS_PKT_FORWD_REG);
-    uint64_t pkt_drop   = read<uint64_t>(RegisterMap::STATS_PKT_DROP_REG);
+    StatsSnapshot snap;
+    if (!snapshot(snap)) {
+        return;
+    }
+    uint64_t pkt_in     = snap.packets;
+    uint64_t phit_in    = snap.phits;
+    uint64_t pkt_forwd  = snap.forwarded;
+    uint64_t pkt_drop   = snap.dropped;
 
     if (pkt_in == 0 && pkt_forwd == 0 && pkt_drop == 0) {
         return;
@@ -61,14 +665,143 @@ void PacketFilter::show_stats() {
     PRINT_STAT("  Phits In:          %lu", phit_in);
     PRINT_STAT("  Packets Forwarded: %lu", pkt_forwd);
     PRINT_STAT("  Packets Dropped:   %lu", pkt_drop);
+    PRINT_STAT("  Packets Mirrored:  %lu", snap.mirrored);
+}
+
+bool PacketFilter::export_page(uint32_t page, uint32_t words[EXPORT_WORDS]) {
+    write<uint32_t>(RegisterMap::STATS_PAGE_REG, page);
+    stats_seq_++;
+    write<uint32_t>(RegisterMap::STATS_SEQ_REG, stats_seq_);
+    if (!wait_for(RegisterMap::STATS_ACK_REG, stats_seq_)) {
+        log_error("Packet filter did not export statistics page %#x", page);
+        return false;
+    }
+    for (uint32_t i = 0; i < EXPORT_WORDS; i++) {
+        words[i] = read<uint32_t>(RegisterMap::STATS_EXPORT_BASE + 4 * i);
+    }
+    return true;
+}
+
+bool PacketFilter::collect_counters(uint32_t bank, bool all_pages) {
+    const auto& slot_rules = slot_rules_[bank];
+    uint32_t words[EXPORT_WORDS];
+    for (uint32_t first = 0; first < RuleCompiler::NUM_SLOTS; first += EXPORT_SLOTS) {
+        auto end = slot_rules.begin() + first + EXPORT_SLOTS;
+        if (!all_pages && std::all_of(slot_rules.begin() + first, end,
+                        [](uint32_t rule) { return rule == NO_RULE; })) {
+            continue;
+        }
+        if (!export_page((bank << 16) | (first / EXPORT_SLOTS), words)) {
+            return false;
+        }
+
+        /* Counters only grow, and keep growing when a slot gets a new rule: the
+         * difference to the last read belongs to the rule the slot held until now */
+        for (uint32_t i = 0; i < EXPORT_SLOTS; i++) {
+            uint32_t slot = first + i;
+            RuleCounters now = {words[4 * i] | (static_cast<uint64_t>(words[4 * i + 1]) << 32),
+                                words[4 * i + 2] | (static_cast<uint64_t>(words[4 * i + 3]) << 32)};
+            RuleCounters& last = slot_counters_[bank][slot];
+            if (slot_rules[slot] != NO_RULE && now.packets != last.packets) {
+                const Rule& rule = bank_rules_[bank][slot_rules[slot]];
+                RuleCounters& total = rule_totals_[{rule.mask, rule.match & rule.mask}];
+                total.packets += now.packets - last.packets;
+                total.bytes += now.bytes - last.bytes;
+            }
+            last = now;
+        }
+    }
+    return true;
+}
+
+bool PacketFilter::read_rule_stats(RuleStats& stats) {
+    /* The inactive bank only counts frames that straddled the last commit */
+    if (!collect_counters(active_) || !collect_counters(active_ ^ 1)) {
+        return false;
+    }
+    stats.rules.clear();
+    for (const auto& rule : rules_) {
+        auto it = rule_totals_.find({rule.mask, rule.match & rule.mask});
+        stats.rules.push_back(it == rule_totals_.end() ? RuleCounters{0, 0} : it->second);
+    }
+
+    uint32_t words[EXPORT_WORDS];
+    if (!export_page(HEAVY_HITTER_PAGE, words)) {
+        return false;
+    }
+    stats.heavy_hitters.clear();
+    for (uint32_t i = 0; i + HEAVY_HITTER_WORDS <= EXPORT_WORDS; i += HEAVY_HITTER_WORDS) {
+        if (words[i + 6] == 0) {
+            continue;
+        }
+        HeavyHitter hitter = {};
+        memcpy(hitter.dst_ip.bytes, &words[i], sizeof(hitter.dst_ip.bytes));
+        hitter.dst_port = static_cast<uint16_t>(words[i + 4]);
+        hitter.protocol = static_cast<uint8_t>(words[i + 4] >> 16);
+        hitter.packets = words[i + 5];
+        stats.heavy_hitters.push_back(hitter);
+    }
+    std::sort(stats.heavy_hitters.begin(), stats.heavy_hitters.end(),
+              [](const HeavyHitter& a, const HeavyHitter& b) { return a.packets > b.packets; });
+    return true;
+}
+
+void PacketFilter::show_rule_stats() {
+    RuleStats stats;
+    if (!read_rule_stats(stats)) {
+        log_error("Failed to read rule statistics");
+        return;
+    }
+
+    bool header = false;
+    for (size_t i = 0; i < rules_.size(); i++) {
+        if (stats.rules[i].packets == 0) {
+            continue;
+        }
+        if (!header) {
+            log_info("Rule Statistics:");
+            header = true;
+        }
+        log_info("  %s: %lu packets, %lu bytes", format_rule(rules_[i]).c_str(),
+                 stats.rules[i].packets, stats.rules[i].bytes);
+    }
+
+    if (!stats.heavy_hitters.empty()) {
+        log_info("Most Dropped Destinations:");
+    }
+    for (const auto& hitter : stats.heavy_hitters) {
+        Rule rule = {};
+        rule.match.dst_ip = hitter.dst_ip;
+        rule.mask.dst_ip = RuleCompiler::prefix_mask(128);
+        rule.match.dst_port = hitter.dst_port;
+        rule.mask.dst_port = hitter.dst_port != 0 ? 0xFFFF : 0;
+        rule.match.protocol = hitter.protocol;
+        rule.mask.protocol = 0xFF;
+        std::string dest = format_rule(rule);
+        log_info("  %s: ~%u packets", dest.substr(0, dest.find('@')).c_str(), hitter.packets);
+    }
+}
+
+void PacketFilter::reset_heavy_hitters() {
+    sketch_epoch_++;
+    write<uint8_t>(RegisterMap::SKETCH_EPOCH_REG, sketch_epoch_);
+}
+
+StatsSnapshot PacketAdapter::snapshot() {
+    StatsSnapshot snap = {};
+    snap.time      = std::chrono::steady_clock::now();
+    snap.packets   = read_counter(RegisterMap::RX_PACKET_RECV_REG);
+    snap.forwarded = read_counter(RegisterMap::TX_PACKET_SENT_REG);
+    snap.dropped   = read_counter(RegisterMap::RX_PACKET_DROPPED_REG);
+    return snap;
 }
 
 void PacketAdapter::show_stats() {
-    uint64_t tx_packet_sent     = read<uint64_t>(RegisterMap::TX_PACKET_SENT_REG);
-    uint64_t tx_packet_dropped  = read<uint64_t>(RegisterMap::TX_PACKET_DROPPED_REG);
-    uint64_t rx_packet_recv     = read<uint64_t>(RegisterMap::RX_PACKET_RECV_REG);
-    uint64_t rx_packet_dropped  = read<uint64_t>(RegisterMap::RX_PACKET_DROPPED_REG);
-    uint64_t rx_packet_error    = read<uint64_t>(RegisterMap::RX_PACKET_ERROR_REG);
+    uint64_t tx_packet_sent     = read_counter(RegisterMap::TX_PACKET_SENT_REG);
+    uint64_t tx_packet_dropped  = read_counter(RegisterMap::TX_PACKET_DROPPED_REG);
+    uint64_t rx_packet_recv     = read_counter(RegisterMap::RX_PACKET_RECV_REG);
+    uint64_t rx_packet_dropped  = read_counter(RegisterMap::RX_PACKET_DROPPED_REG);
+    uint64_t rx_packet_error    = read_counter(RegisterMap::RX_PACKET_ERROR_REG);
 
     if (rx_packet_recv == 0 && tx_packet_sent == 0) {
         return;
@@ -81,43 +814,60 @@ void PacketAdapter::show_stats() {
     PRINT_STAT("  RX Packets Error:       %lu", rx_packet_error);
 }
 
-/* DPDK does not provide APIs to read/write QDMA registers, but QDMA PMD
- * provides two functions to read/write registers through PCIe.
- * We declare them here to use in our MMIO class.
- */
-extern "C" {
-void qdma_pci_write_reg(struct rte_eth_dev *dev, uint32_t bar, uint32_t reg, uint32_t val);
-uint32_t qdma_pci_read_reg(struct rte_eth_dev *dev, uint32_t bar, uint32_t reg);
+CoreClock CoreClock::between(const StatsSnapshot& from, const StatsSnapshot& to) {
+    CoreClock clock;
+    if (from.cycles == 0 || to.cycles <= from.cycles) {
+        return clock;
+    }
+    double ns = std::chrono::duration<double, std::nano>(to.time - from.time).count();
+    clock.base_time = to.time;
+    clock.base_cycles = to.cycles;
+    clock.ns_per_cycle = ns / (to.cycles - from.cycles);
+    return clock;
 }
 
-PacketFilter::MMIO::MMIO(uint32_t port_id) : port_id_(port_id) {
-    /* We need to configure DPDK before creating MMIO object */
-    if (rte_pmd_qdma_get_device(port_id) == nullptr) {
-        log_fatal("Port %u is not a QDMA device", port_id);
+StatsRate StatsRate::between(const StatsSnapshot& from, const StatsSnapshot& to,
+                             double clock_hz) {
+    StatsRate rate = {};
+    if (from.cycles != 0 && to.cycles > from.cycles) {
+        rate.seconds = (to.cycles - from.cycles) / clock_hz;
+    } else {
+        rate.seconds = std::chrono::duration<double>(to.time - from.time).count();
     }
+    if (rate.seconds <= 0) {
+        return rate;
+    }
+    rate.pps           = (to.packets - from.packets) / rate.seconds;
+    rate.phits_per_sec = (to.phits - from.phits) / rate.seconds;
+    rate.gbps          = (to.bytes - from.bytes) * 8 / rate.seconds / 1e9;
+    rate.forward_pps   = (to.forwarded - from.forwarded) / rate.seconds;
+    rate.drop_pps      = (to.dropped - from.dropped) / rate.seconds;
+    return rate;
+}
 
-    uint8_t port_num = rte_eth_dev_count_avail();
-    log_assert(port_id < port_num, "Invalid port_id: %u", port_id);
+std::shared_ptr<MMIOBackend> PacketFilter::MMIO::default_backend_;
 
-    int32_t config_bar, user_bar, bypass_bar;
-    int ret = rte_pmd_qdma_get_bar_details(port_id, &config_bar, &user_bar, &bypass_bar);
-    if (ret != 0) {
-        log_fatal("Failed to get BAR details for port %u: %s",
-                  port_id, rte_strerror(-ret));
-    }
+void PacketFilter::MMIO::set_backend(std::shared_ptr<MMIOBackend> backend) {
+    default_backend_ = backend;
+}
 
-    port_id_ = port_id;
-    bar_id_ = static_cast<uint32_t>(user_bar);
+bool PacketFilter::MMIO::is_available(uint32_t port_id) {
+    return default_backend_ != nullptr || QdmaBackend::is_available(port_id);
+}
+
+PacketFilter::MMIO::MMIO(uint32_t port_id) : base_addr_(0) {
+    backend_ = default_backend_;
+    if (backend_ == nullptr) {
+        backend_ = std::make_shared<QdmaBackend>(port_id);
+    }
 }
 
 void PacketFilter::MMIO::mmio_reg_write(uint32_t offset, uint32_t value) {
     log_assert(base_addr_ != 0, "Base address is not set");
-    rte_pmd_qdma_compat_pci_write_reg(port_id_, bar_id_, base_addr_ + offset, value);
+    backend_->reg_write(base_addr_ + offset, value);
 }
 
 uint32_t PacketFilter::MMIO::mmio_reg_read(uint32_t offset) {
     log_assert(base_addr_ != 0, "Base address is not set");
-    return rte_pmd_qdma_compat_pci_read_reg(port_id_, bar_id_, base_addr_ + offset);
+    return backend_->reg_read(base_addr_ + offset);
 }
-
-
@@ -1,11 +1,23 @@
 #ifndef _PACKET_FILTER_H_
 #define _PACKET_FILTER_H_
 
+class MMIOBackend;
+class RuleCompiler;
+
 class MMIO {
+public:
+    /* Whether port_id can be accessed through the current backend */
+    static bool is_available(uint32_t port_id);
+
+    /* Use the given backend for every MMIO object created afterwards instead of
+     * the QDMA device of their port (e.g. SimBackend to run without the FPGA). */
+    static void set_backend(std::shared_ptr<MMIOBackend> backend);
+
 protected:
+    static std::shared_ptr<MMIOBackend> default_backend_;
+
     uint32_t base_addr_;
-    uint32_t port_id_;
-    uint32_t bar_id_;
+    std::shared_ptr<MMIOBackend> backend_;
 
     void mmio_reg_write(uint32_t offset, uint32_t value);
     uint32_t mmio_reg_read(uint32_t offset);
@@ -44,11 +56,69 @@ protected:
             return static_cast<T>((high << 32) | low);
         }
     }
+
+    /* 64-bit counter that keeps counting while it is read. The high word is read
+     * again after the low one, and the read is retried when a carry got between. */
+    uint64_t read_counter(uint32_t offset) {
+        uint32_t high = mmio_reg_read(offset + 4);
+        while (true) {
+            uint32_t low = mmio_reg_read(offset);
+            uint32_t again = mmio_reg_read(offset + 4);
+            if (again == high) {
+                return (static_cast<uint64_t>(high) << 32) | low;
+            }
+            high = again;
+        }
+    }
+};
+
+/* Counter values sampled together, with the time they were taken */
+struct StatsSnapshot {
+    std::chrono::steady_clock::time_point time;
+    uint64_t cycles;        /* core clock cycles, 0 where the block has no clock counter */
+    uint64_t packets;
+    uint64_t phits;
+    uint64_t bytes;
+    uint64_t forwarded;
+    uint64_t dropped;
+    uint64_t mirrored;      /* dropped packets copied to the mirror queue */
+};
+
+/* Converts core clock cycles, such as the timestamps of FilterMetadata, to the host
+ * clock. Both the core clock rate and its offset are taken from two snapshots of
+ * the core, so the further apart they are, the less a cycle count drifts. */
+struct CoreClock {
+    std::chrono::steady_clock::time_point base_time;
+    uint64_t base_cycles = 0;
+    double ns_per_cycle = 0;
+
+    static CoreClock between(const StatsSnapshot& from, const StatsSnapshot& to);
+    bool valid() const { return ns_per_cycle > 0; }
+    std::chrono::steady_clock::time_point time_of(uint64_t cycles) const {
+        double ns = (static_cast<int64_t>(cycles - base_cycles)) * ns_per_cycle;
+        return base_time + std::chrono::nanoseconds(static_cast<int64_t>(ns));
+    }
+};
+
+/* Per-second rates between two snapshots of the same block */
+struct StatsRate {
+    double seconds;
+    double pps;
+    double phits_per_sec;
+    double gbps;
+    double forward_pps;
+    double drop_pps;
+
+    /* Over the core clock when both snapshots have one, else the host clock */
+    static StatsRate between(const StatsSnapshot& from, const StatsSnapshot& to,
+                             double clock_hz);
 };
 
 
 class PacketFilter : public MMIO {
 private:
+    friend class PacketFilterModel;
+
     static const uint32_t OPENNIC_USER_250_BASE_ADDR = 0x100000;
     static const uint32_t PACKET_FILTER_OFFSET       = 0x2000;
 
@@ -65,22 +135,342 @@ private:
         STATS_PHIT_IN_REG   = 0x40, /* 64 bits */
         STATS_PKT_FORWD_REG = 0x58, /* 64 bits */
         STATS_PKT_DROP_REG  = 0x70, /* 64 bits */
+
+        RULE_SEQ_REG        = 0x88, /* 32 bits, doorbell for one rule write */
+        COMMIT_SEQ_REG      = 0x90, /* 32 bits, doorbell for swapping rule banks */
+        RULE_ACK_REG        = 0x98, /* 32 bits, last rule_seq applied */
+        APPLIED_SEQ_REG     = 0xa8, /* 32 bits, last commit_seq applied */
+        DEFAULT_ACTION_REG  = 0xb8, /* 8 bits, latched on commit */
+        RULE_INDEX_REG      = 0xc0, /* 32 bits, slot within the way */
+        RULE_WAY_REG        = 0xc8, /* 8 bits, MASK_WAY programs a table mask */
+        SRC_IPV4_ADDR_REG   = 0xd0, /* 32 bits */
+        SRC_PORT_REG        = 0xd8, /* 16 bits */
+        IP_PROTOCOL_REG     = 0xe0, /* 8 bits */
+        RULE_PRIORITY_REG   = 0xe8, /* 16 bits */
+        RULE_TABLE_REG      = 0xf0, /* 8 bits */
+        IPV6_HEAD_REG       = 0xf8, /* 96 bits, bytes 0-11 of the destination */
+        SRC_IPV6_HEAD_REG   = 0x108, /* 96 bits, bytes 0-11 of the source */
+        STATS_PAGE_REG      = 0x118, /* 32 bits, (bank << 16) | page, or HEAVY_HITTER_PAGE */
+        STATS_SEQ_REG       = 0x120, /* 32 bits, doorbell for one page export */
+        STATS_ACK_REG       = 0x128, /* 32 bits, last stats_seq exported */
+        SKETCH_EPOCH_REG    = 0x138, /* 8 bits, a new value restarts the drop sketch */
+        SNAPSHOT_SEQ_REG    = 0x140, /* 32 bits, doorbell that latches all statistics */
+        SNAPSHOT_ACK_REG    = 0x148, /* 32 bits, last snapshot_seq latched */
+        STATS_CYCLES_REG    = 0x158, /* 64 bits, core clock cycles at the snapshot */
+        STATS_BYTES_REG     = 0x170, /* 64 bits */
+        RULE_BUCKET_REG     = 0x188, /* 16 bits, token bucket of the rule */
+        BUCKET_RATE_REG     = 0x190, /* 64 bits, tokens per cycle, 32 fractional bits */
+        BUCKET_BURST_REG    = 0x19c, /* 32 bits, tokens */
+        BUCKET_UNIT_REG     = 0x1a4, /* 8 bits, RateUnit */
+        RULE_QUEUE_REG      = 0x1ac, /* 16 bits, C2H queue of the rule, or QUEUE_RSS */
+        METADATA_REG        = 0x1b4, /* 8 bits, prepend a metadata phit to forwarded frames */
+        MIRROR_THRESHOLD_REG = 0x1bc, /* 32 bits, dropped frames mirrored per 2^32, 0 for none */
+        MIRROR_QUEUE_REG    = 0x1c4, /* 16 bits, C2H queue of mirrored frames */
+        STATS_MIRRORED_REG  = 0x1cc, /* 64 bits */
+        STATS_EXPORT_BASE   = 0x200, /* EXPORT_WORDS x 32 bits */
     };
 
+    static const uint32_t MASK_WAY   = 0xFF;
+    static const uint32_t BUCKET_WAY = 0xFE;
+    static const uint32_t RSS_WAY    = 0xFD;
+
+    /* Entries of the RSS indirection table, indexed by the low bits of the hash */
+    static const uint32_t RSS_TABLE_SIZE = 128;
+
+    /* An export page holds the counters of EXPORT_SLOTS slots, 4 words each (packets
+     * then bytes, low word first), or the heavy hitter candidates, 8 words each
+     * (destination address, (protocol << 16) | port, count, valid) */
+    static const uint32_t EXPORT_WORDS       = 128;
+    static const uint32_t EXPORT_SLOTS       = EXPORT_WORDS / 4;
+    static const uint32_t HEAVY_HITTER_PAGE  = 0xFFFF;
+    static const uint32_t HEAVY_HITTER_WORDS = 8;
+    static constexpr uint32_t NO_RULE        = UINT32_MAX;
+
+    /* The core keeps two rule banks: rules are written into the inactive one and a
+     * commit swaps them between packets, so a rule set is applied atomically. */
+    static const uint32_t NUM_BANKS = 2;
+    static constexpr uint32_t HANDSHAKE_TIMEOUT_US = 100000;
+
+public:
+    /* Clock of the 250MHz user box the core runs in */
+    static constexpr double CORE_CLOCK_HZ = 250e6;
+
+    /* Steered packets carry an 11-bit queue, relative to the first queue of the
+     * function. QUEUE_RSS picks one from the RSS table by the hash of the 5-tuple. */
+    static constexpr uint16_t MAX_QUEUES = 2048;
+    static constexpr uint16_t QUEUE_RSS  = 0xFFFF;
+
+    /* Mirrored packets keep their first two phits, which hold all parsed headers */
+    static constexpr uint32_t MIRROR_BYTES = 128;
+
 public:
     enum RuleAction : uint32_t {
         RULE_ACTION_DROP = 0,
         RULE_ACTION_FORWARD = 1,
+        RULE_ACTION_RATE_LIMIT = 2, /* forward up to the rule's RateLimit, drop the rest */
+        RULE_ACTION_STEER = 3,      /* forward to the rule's rx queue */
+        RULE_ACTION_INVALID = 0xFF, /* clears a table slot, never part of a rule set */
     };
 
-    PacketFilter() : MMIO(0) {
-        set_base_addr(OPENNIC_USER_250_BASE_ADDR + PACKET_FILTER_OFFSET);
-    }
-    PacketFilter(std::vector<std::string> filter_list);
+    /* IPv6 address in network byte order. IPv4 addresses are kept IPv4-mapped
+     * (::ffff:a.b.c.d), the way the core widens them. */
+    struct IPAddress {
+        uint8_t bytes[16];
+
+        static IPAddress from_ipv4(uint32_t addr) {
+            IPAddress result = {{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF}};
+            memcpy(&result.bytes[12], &addr, sizeof(addr));
+            return result;
+        }
+        bool is_ipv4() const {
+            static const uint8_t prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+            return memcmp(bytes, prefix, sizeof(prefix)) == 0;
+        }
+        /* Word i in the byte order of the bus, bytes 4i to 4i + 3 */
+        uint32_t word(int i) const {
+            uint32_t value;
+            memcpy(&value, &bytes[4 * i], sizeof(value));
+            return value;
+        }
+        uint32_t ipv4() const { return word(3); }
+        int popcount() const {
+            int count = 0;
+            for (uint8_t byte : bytes) {
+                count += __builtin_popcount(byte);
+            }
+            return count;
+        }
+
+        IPAddress operator&(const IPAddress& mask) const {
+            IPAddress result;
+            for (int i = 0; i < 16; i++) {
+                result.bytes[i] = bytes[i] & mask.bytes[i];
+            }
+            return result;
+        }
+        bool operator==(const IPAddress& other) const {
+            return memcmp(bytes, other.bytes, sizeof(bytes)) == 0;
+        }
+        bool operator!=(const IPAddress& other) const { return !(*this == other); }
+        bool operator<(const IPAddress& other) const {
+            return memcmp(bytes, other.bytes, sizeof(bytes)) < 0;
+        }
+    };
+
+    /* Fields a rule matches on, in network byte order. Ports are zero for protocols
+     * other than UDP and TCP. */
+    struct FlowKey {
+        IPAddress src_ip;
+        IPAddress dst_ip;
+        uint16_t src_port;
+        uint16_t dst_port;
+        uint8_t  protocol;
+
+        FlowKey operator&(const FlowKey& mask) const {
+            return FlowKey{src_ip & mask.src_ip, dst_ip & mask.dst_ip,
+                           static_cast<uint16_t>(src_port & mask.src_port),
+                           static_cast<uint16_t>(dst_port & mask.dst_port),
+                           static_cast<uint8_t>(protocol & mask.protocol)};
+        }
+        bool operator==(const FlowKey& other) const {
+            return src_ip == other.src_ip && dst_ip == other.dst_ip &&
+                   src_port == other.src_port && dst_port == other.dst_port &&
+                   protocol == other.protocol;
+        }
+        bool operator!=(const FlowKey& other) const { return !(*this == other); }
+        bool operator<(const FlowKey& other) const {
+            return std::tie(src_ip, dst_ip, src_port, dst_port, protocol) <
+                   std::tie(other.src_ip, other.dst_ip, other.src_port, other.dst_port,
+                            other.protocol);
+        }
+    };
+
+    enum RateUnit : uint32_t {
+        RATE_PPS = 0,   /* rate in packets/s, burst in packets */
+        RATE_BPS = 1,   /* rate in bits/s, burst in bytes */
+    };
+
+    /* Token bucket of a RULE_ACTION_RATE_LIMIT rule. Frames are charged by their
+     * length without the FCS. */
+    struct RateLimit {
+        RateUnit unit;
+        uint64_t rate;
+        uint32_t burst;
+
+        bool operator<(const RateLimit& other) const {
+            return std::tie(unit, rate, burst) < std::tie(other.unit, other.rate, other.burst);
+        }
+    };
+
+    /* A rule applies to packets whose key equals match on every bit set in mask.
+     * When several rules apply, the highest priority wins. Packets no rule applies
+     * to take the default action. */
+    struct Rule {
+        FlowKey match;
+        FlowKey mask;
+        uint16_t priority;
+        RuleAction action;
+        RateLimit limit;    /* RULE_ACTION_RATE_LIMIT only */
+        uint16_t queue;     /* RULE_ACTION_STEER only, a queue or QUEUE_RSS */
+    };
+    using RuleSet = std::vector<Rule>;
+
+    /* Traffic counted against a rule since the filter was created */
+    struct RuleCounters {
+        uint64_t packets;
+        uint64_t bytes;
+    };
+
+    /* Destination the core dropped the most packets to, with a count-min estimate
+     * that may overcount but never undercounts */
+    struct HeavyHitter {
+        IPAddress dst_ip;
+        uint16_t dst_port;
+        uint8_t  protocol;
+        uint32_t packets;
+    };
+
+    struct RuleStats {
+        std::vector<RuleCounters> rules;        /* indexed like rules() */
+        std::vector<HeavyHitter> heavy_hitters; /* heaviest first */
+    };
+
+    /* What commit() does when rules hash to the same slot */
+    enum CollisionPolicy : uint32_t {
+        COLLISION_REJECT = 0, /* refuse the whole rule set */
+        COLLISION_WARN   = 1, /* program it anyway, the others take the default action */
+    };
+
+private:
+    struct BankSlot {
+        FlowKey key;
+        uint32_t action;    /* RULE_ACTION_INVALID when the slot is empty */
+        uint16_t priority;
+        uint32_t bucket;
+        uint16_t queue;
+    };
+
+    /* Host copy of both hardware banks, one entry per (table, way, index) slot plus
+     * the table masks; shadow_[active_] is what the datapath uses. Both banks are
+     * emptied when the filter is created, whatever a previous run left in them. */
+    std::shared_ptr<RuleCompiler> compiler_;
+    std::vector<BankSlot> shadow_[NUM_BANKS];
+    std::vector<FlowKey> shadow_masks_[NUM_BANKS];
+    RuleSet rules_;
+    RuleAction default_action_ = RULE_ACTION_DROP;
+    uint32_t active_ = 0;
+    uint32_t rule_seq_ = 0;
+    uint32_t commit_seq_ = 0;
+    CollisionPolicy collision_policy_ = COLLISION_REJECT;
+
+    /* Rule set each bank was last programmed with, the rule of every slot in it
+     * (NO_RULE if empty) and the slot counters as last read. Per-rule totals are
+     * keyed by (mask, masked match), so they survive recommits. */
+    RuleSet bank_rules_[NUM_BANKS];
+    std::vector<uint32_t> slot_rules_[NUM_BANKS];
+    std::vector<RuleCounters> slot_counters_[NUM_BANKS];
+    std::map<std::pair<FlowKey, FlowKey>, RuleCounters> rule_totals_;
+    uint32_t stats_seq_ = 0;
+    uint8_t sketch_epoch_ = 0;
+    uint32_t snapshot_seq_ = 0;
+
+    /* Token bucket of each rate limited rule of either bank, by (mask, masked
+     * match, limit). A rule whose limit changes gets a fresh bucket, so the core
+     * never sees a bucket change under a rule of the active bank. */
+    std::map<std::tuple<FlowKey, FlowKey, RateLimit>, uint32_t> buckets_;
+
+    void init();
+    bool clear_bank(uint32_t bank);
+    /* Makes the inactive bank the active one */
+    bool swap_banks();
+    bool write_rule(uint32_t slot, const BankSlot& entry);
+    bool write_mask(uint32_t table, const FlowKey& mask);
+    bool write_bucket(uint32_t bucket, const RateLimit& limit);
+    bool assign_buckets(const RuleSet& rules, std::vector<uint32_t>& bucket_of);
+    bool replace_rule(const Rule& rule);
+    void write_key(const FlowKey& key);
+    void write_address(uint32_t head_offset, uint32_t tail_offset, const IPAddress& addr);
+    bool ring_doorbell();
+    bool wait_for(uint32_t offset, uint32_t value);
+    bool export_page(uint32_t page, uint32_t words[EXPORT_WORDS]);
+    /* Pages whose slots all have no rule are skipped unless all_pages */
+    bool collect_counters(uint32_t bank, bool all_pages = false);
+
+public:
+    PacketFilter();
+    /* Forward the packets of filter_list; with rss_queues, steer them by RSS over
+     * that many rx queues, and with metadata, prefix them with a FilterMetadata */
+    PacketFilter(std::vector<std::string> filter_list, uint16_t rss_queues = 0,
+                 bool metadata = false);
     ~PacketFilter() {}
 
-    void update_rule(std::string net_addr, RuleAction action);
+    /* Either <dst_ip>:<dst_port> for UDP, or
+     * <protocol>:<src_ip>:<src_port>:<dst_ip>:<dst_port>[@<priority>] where any field
+     * may be '*' and protocol is udp, tcp, icmp or a number. Addresses are IPv4 or
+     * IPv6 in brackets ([2001:db8::1]), either with an optional /<prefix length>. The
+     * priority defaults to the number of bits the rule matches on, so more specific
+     * rules win. */
+    static Rule parse_rule(const std::string& rule, RuleAction action);
+    /* Same, but returns false on a malformed rule instead of exiting */
+    static bool parse_rule(const std::string& rule, RuleAction action, Rule& result);
+    static std::string format_rule(const Rule& rule);
+
+    void set_collision_policy(CollisionPolicy policy) { collision_policy_ = policy; }
+
+    /* Program a whole rule set: rules are first placed into hash slots on the host and
+     * checked for collisions, then only slots that differ from the inactive bank are
+     * written and both banks are swapped at once. Returns false if the rule set was
+     * rejected or the hardware did not acknowledge a write or the commit in time. */
+    bool commit(const RuleSet& rules);
+    const RuleSet& rules() const { return rules_; }
+
+    /* Indexes of the rules of a rule set that commit() could not store, found
+     * without writing anything to the core */
+    std::vector<uint32_t> conflicts(const RuleSet& rules) const;
+
+    /* Action for packets that match no rule; applied by recommitting the rule set.
+     * RULE_ACTION_STEER steers them by RSS. */
+    bool set_default_action(RuleAction action);
+    RuleAction default_action() const { return default_action_; }
+
+    /* Add a rule, or change the action of the rule with the same match and mask */
+    void update_rule(std::string rule, RuleAction action);
+
+    /* Rate limit the traffic of a rule, added if needed: up to limit.rate is
+     * forwarded and the rest dropped, whole packets at a time */
+    bool set_rate_limit(std::string rule, const RateLimit& limit);
+
+    /* Forward the traffic of a rule, added if needed, to rx queue `queue` or spread
+     * it by RSS with QUEUE_RSS */
+    bool set_steering(std::string rule, uint16_t queue);
+
+    /* Spread packets steered by RSS evenly over the first num_queues rx queues */
+    bool set_rss_queues(uint16_t num_queues);
+
+    /* Have the core send a FilterMetadata prefix ahead of every forwarded frame */
+    void set_metadata(bool enable);
+
+    /* Copy about one in one_in_n dropped packets, cut to MIRROR_BYTES, to rx queue
+     * `queue`. The copies are sampled at random by the core and carry no metadata.
+     * Zero stops mirroring. */
+    bool set_mirror(uint32_t one_in_n, uint16_t queue);
+
+    /* Rule a FilterMetadata::rule_id refers to, or nullptr on a miss. Only valid
+     * until the next commit, which may reuse the bank of the slot. */
+    const Rule* rule_of(uint32_t rule_id) const;
+
+    /* Latch every counter of the core in the same cycle and read them back */
+    bool snapshot(StatsSnapshot& snap);
     void show_stats();
+
+    /* Read the per-slot counters of both banks and the dropped-traffic heavy hitters.
+     * Pages are copied by the core in cycles where no frame is counted, so reading
+     * never stalls the datapath; only pages holding rules are read. */
+    bool read_rule_stats(RuleStats& stats);
+    void show_rule_stats();
+
+    /* Forget the heavy hitters and start estimating from zero */
+    void reset_heavy_hitters();
 };
 
 class PacketAdapter : public MMIO {
@@ -100,6 +490,10 @@ public:
         set_base_addr(OPENNIC_ADAP_BASE_ADDR);
     }
     ~PacketAdapter() {}
+
+    /* The adapter has no latch: each counter is read consistently on its own,
+     * and tx and rx are only sampled a few microseconds apart */
+    StatsSnapshot snapshot();
     void show_stats();
 };
 
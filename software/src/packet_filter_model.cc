@@ -0,0 +1,416 @@
+#include "deps.h"
+#include "packet_filter.h"
+#include "packet_filter_model.h"
+#include "filter_metadata.h"
+
+PacketFilterModel::PacketFilterModel() {
+    for (auto& bank : table_) {
+        bank.assign(HASH_TABLES * HASH_TABLE_WAYS * HASH_TABLE_SIZE,
+                    Entry{false, FlowKey{}, 0, 0, 0, 0});
+    }
+    memset(mask_, 0, sizeof(mask_));
+    for (auto& counters : counters_) {
+        counters.assign(HASH_TABLES * HASH_TABLE_WAYS * HASH_TABLE_SIZE, SlotCounter{0, 0});
+    }
+    for (auto& row : sketch_) {
+        row.assign(SKETCH_WIDTH, {0, 0});
+    }
+    memset(top_, 0, sizeof(top_));
+    buckets_.assign(RATE_BUCKETS, Bucket{0, 0, false, 0, 0, 0, 0});
+    memset(rss_table_, 0, sizeof(rss_table_));
+    memset(export_, 0, sizeof(export_));
+}
+
+uint32_t PacketFilterModel::base_addr() {
+    return PacketFilter::OPENNIC_USER_250_BASE_ADDR + PacketFilter::PACKET_FILTER_OFFSET;
+}
+
+uint32_t PacketFilterModel::input(uint32_t offset) const {
+    auto it = inputs_.find(offset);
+    return it == inputs_.end() ? 0 : it->second;
+}
+
+void PacketFilterModel::reg_write(uint32_t offset, uint32_t value) {
+    using RegisterMap = PacketFilter::RegisterMap;
+    std::lock_guard<std::mutex> lock(mutex_);
+    inputs_[offset] = value;
+
+    switch (offset) {
+        case RegisterMap::RULE_SEQ_REG:
+            if (value != last_rule_seq_) {
+                /* (ipv4_addr, ipv6_addr_head): the head register holds bytes 0-11 */
+                auto address = [this](uint32_t head, uint32_t tail) {
+                    PacketFilter::IPAddress addr;
+                    for (int i = 0; i < 4; i++) {
+                        uint32_t word = input(i < 3 ? head + 4 * i : tail);
+                        memcpy(&addr.bytes[4 * i], &word, sizeof(word));
+                    }
+                    return addr;
+                };
+                FlowKey key = {address(RegisterMap::SRC_IPV6_HEAD_REG,
+                                       RegisterMap::SRC_IPV4_ADDR_REG),
+                               address(RegisterMap::IPV6_HEAD_REG, RegisterMap::IPV4_ADDR_REG),
+                               static_cast<uint16_t>(input(RegisterMap::SRC_PORT_REG)),
+                               static_cast<uint16_t>(input(RegisterMap::UDP_PORT_REG)),
+                               static_cast<uint8_t>(input(RegisterMap::IP_PROTOCOL_REG))};
+                uint8_t action = input(RegisterMap::RULE_ACTION_REG) & 0xFF;
+                uint16_t priority = input(RegisterMap::RULE_PRIORITY_REG) & 0xFFFF;
+                /* RateMeter::bucket_t truncation */
+                uint32_t bucket = input(RegisterMap::RULE_BUCKET_REG) & (RATE_BUCKETS - 1);
+                uint16_t queue = input(RegisterMap::RULE_QUEUE_REG) & 0xFFFF;
+                uint32_t rule_way = input(RegisterMap::RULE_WAY_REG) & 0xFF;
+                /* ap_uint<TABLE_BITS>, ap_uint<WAY_BITS> and ap_uint<HASH_BITS> truncation */
+                uint32_t table = input(RegisterMap::RULE_TABLE_REG) & (HASH_TABLES - 1);
+                uint32_t way = rule_way & (HASH_TABLE_WAYS - 1);
+                uint32_t index = input(RegisterMap::RULE_INDEX_REG) & HASH_MASK;
+                if (rule_way == PacketFilter::MASK_WAY) {
+                    mask_[active_bank_ ^ 1][table] = key;
+                } else if (rule_way == PacketFilter::BUCKET_WAY) {
+                    Bucket& config = buckets_[bucket];
+                    config.rate = input(RegisterMap::BUCKET_RATE_REG) |
+                                  (static_cast<uint64_t>(input(RegisterMap::BUCKET_RATE_REG + 4)) << 32);
+                    config.burst = input(RegisterMap::BUCKET_BURST_REG);
+                    config.bytes = input(RegisterMap::BUCKET_UNIT_REG) & 1;
+                    config.gen++;
+                } else if (rule_way == PacketFilter::RSS_WAY) {
+                    rss_table_[input(RegisterMap::RULE_INDEX_REG) %
+                               PacketFilter::RSS_TABLE_SIZE] = queue;
+                } else {
+                    table_[active_bank_ ^ 1][(table * HASH_TABLE_WAYS + way) * HASH_TABLE_SIZE +
+                                             index] =
+                        Entry{action != ACTION_INVALID, key, action, priority, bucket, queue};
+                }
+                last_rule_seq_ = value;
+            }
+            break;
+
+        case RegisterMap::STATS_SEQ_REG:
+            if (value != export_seq_) {
+                export_page(input(RegisterMap::STATS_PAGE_REG));
+                export_seq_ = value;
+            }
+            break;
+
+        case RegisterMap::SNAPSHOT_SEQ_REG:
+            if (value != last_snapshot_seq_) {
+                snapshot_ = stats_;
+                snapshot_cycles_ = now_cycles();
+                last_snapshot_seq_ = value;
+            }
+            break;
+
+        case RegisterMap::SKETCH_EPOCH_REG:
+            /* CountMinSketch::reset() */
+            if ((value & 0xFF) != epoch_) {
+                epoch_ = value & 0xFF;
+                for (auto& candidate : top_) {
+                    candidate.valid = false;
+                }
+            }
+            break;
+
+        case RegisterMap::COMMIT_SEQ_REG:
+            if (value != last_commit_seq_) {
+                active_bank_ ^= 1;
+                active_default_ = input(RegisterMap::DEFAULT_ACTION_REG) & 0xFF;
+                last_commit_seq_ = value;
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+uint32_t PacketFilterModel::reg_read(uint32_t offset) {
+    using RegisterMap = PacketFilter::RegisterMap;
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto stat = [offset](uint32_t reg, uint64_t value) -> int64_t {
+        if (offset == reg) return static_cast<uint32_t>(value);
+        if (offset == reg + 4) return static_cast<uint32_t>(value >> 32);
+        return -1;
+    };
+
+    switch (offset) {
+        case RegisterMap::RULE_ACK_REG:
+            return last_rule_seq_;
+        case RegisterMap::APPLIED_SEQ_REG:
+            return last_commit_seq_;
+        case RegisterMap::STATS_ACK_REG:
+            return export_seq_;
+        case RegisterMap::SNAPSHOT_ACK_REG:
+            return last_snapshot_seq_;
+        default:
+            break;
+    }
+    if (offset >= RegisterMap::STATS_EXPORT_BASE &&
+        offset < RegisterMap::STATS_EXPORT_BASE + 4 * PacketFilter::EXPORT_WORDS) {
+        return export_[(offset - RegisterMap::STATS_EXPORT_BASE) / 4];
+    }
+
+    int64_t value;
+    if ((value = stat(RegisterMap::STATS_PKT_IN_REG, snapshot_.pkt_in)) >= 0 ||
+        (value = stat(RegisterMap::STATS_PHIT_IN_REG, snapshot_.phit_in)) >= 0 ||
+        (value = stat(RegisterMap::STATS_PKT_FORWD_REG, snapshot_.pkt_forward)) >= 0 ||
+        (value = stat(RegisterMap::STATS_PKT_DROP_REG, snapshot_.pkt_drop)) >= 0 ||
+        (value = stat(RegisterMap::STATS_BYTES_REG, snapshot_.bytes)) >= 0 ||
+        (value = stat(RegisterMap::STATS_MIRRORED_REG, snapshot_.mirrored)) >= 0 ||
+        (value = stat(RegisterMap::STATS_CYCLES_REG, snapshot_cycles_)) >= 0) {
+        return static_cast<uint32_t>(value);
+    }
+    return input(offset);
+}
+
+uint64_t PacketFilterModel::now_cycles() const {
+    return static_cast<uint64_t>(
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count() *
+        PacketFilter::CORE_CLOCK_HZ);
+}
+
+bool PacketFilterModel::process(const uint8_t* data, size_t data_len, size_t pkt_len) {
+    return process(data, data_len, pkt_len, now_cycles());
+}
+
+bool PacketFilterModel::process(const uint8_t* data, size_t data_len, size_t pkt_len,
+                                uint64_t cycle) {
+    return classify(data, data_len, pkt_len, cycle).forward;
+}
+
+PacketFilterModel::Verdict PacketFilterModel::classify(const uint8_t* data, size_t data_len,
+                                                       size_t pkt_len) {
+    return classify(data, data_len, pkt_len, now_cycles());
+}
+
+PacketFilterModel::Verdict PacketFilterModel::classify(const uint8_t* data, size_t data_len,
+                                                       size_t pkt_len, uint64_t cycle) {
+    /* NetworkPacket::parse() window: the first two phits as seen on the 512-bit bus,
+     * byte i is window.range(8i+7, 8i). A single-phit frame has a zero second phit. */
+    uint8_t window[PARSE_BYTES] = {0};
+    size_t window_len = pkt_len > PHIT_BYTES ? PARSE_BYTES : PHIT_BYTES;
+    memcpy(window, data, std::min(data_len, window_len));
+
+    auto field16 = [&window](size_t byte) -> uint16_t {
+        return window[byte] | (window[byte + 1] << 8);
+    };
+    auto field32 = [&field16](size_t byte) -> uint32_t {
+        return field16(byte) | (static_cast<uint32_t>(field16(byte + 2)) << 16);
+    };
+
+    /* Up to two VLAN tags, QinQ being an 802.1ad or 802.1Q tag then an 802.1Q one */
+    size_t l3 = 14;
+    uint16_t eth_type = field16(12);
+    if (eth_type == __builtin_bswap16(0x8100) || eth_type == __builtin_bswap16(0x88A8)) {
+        eth_type = field16(16);
+        l3 = 18;
+        if (eth_type == __builtin_bswap16(0x8100)) {
+            eth_type = field16(20);
+            l3 = 22;
+        }
+    }
+
+    /* IPv4Header::ihl is the low nibble of the first byte */
+    uint8_t ihl = window[l3] & 0xF;
+    bool ipv4 = eth_type == __builtin_bswap16(0x0800) && ihl >= 5;
+    bool ipv6 = eth_type == __builtin_bswap16(0x86DD);
+
+    FlowKey key = {};
+    size_t l4 = l3;
+    if (ipv6) {
+        key.protocol = window[l3 + 6];
+        memcpy(key.src_ip.bytes, &window[l3 + 8], 16);
+        memcpy(key.dst_ip.bytes, &window[l3 + 24], 16);
+        l4 = l3 + 40;
+    } else if (ipv4) {
+        key.protocol = window[l3 + 9];
+        key.src_ip = PacketFilter::IPAddress::from_ipv4(field32(l3 + 12));
+        key.dst_ip = PacketFilter::IPAddress::from_ipv4(field32(l3 + 16));
+        l4 = l3 + 4 * ihl;
+    }
+    if (key.protocol == 17 || key.protocol == 6) {
+        key.src_port = field16(l4);
+        key.dst_port = field16(l4 + 2);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    /* ToeplitzHash::lookup(): highest priority wins, the lowest table on a tie */
+    uint32_t table_action = active_default_;
+    int best = 0;
+    uint32_t best_slot = 0;
+    uint32_t best_bucket = 0;
+    uint16_t best_queue = PacketFilter::QUEUE_RSS;
+    if (ipv4 || ipv6) {
+        for (int table = HASH_TABLES - 1; table >= 0; table--) {
+            FlowKey masked = key & mask_[active_bank_][table];
+            for (uint32_t way = 0; way < HASH_TABLE_WAYS; way++) {
+                uint32_t index = (table * HASH_TABLE_WAYS + way) * HASH_TABLE_SIZE +
+                                 slot(masked, way);
+                const Entry& entry = table_[active_bank_][index];
+                if (entry.valid && entry.key == masked && entry.priority + 1 >= best) {
+                    table_action = entry.action;
+                    best = entry.priority + 1;
+                    best_slot = index;
+                    best_bucket = entry.bucket;
+                    best_queue = entry.queue;
+                }
+            }
+        }
+    }
+    /* Charged by the L2 length from the IP header, as it is known at the first phit */
+    if (table_action == PacketFilter::RULE_ACTION_RATE_LIMIT) {
+        uint16_t ip_length = __builtin_bswap16(field16(ipv6 ? l3 + 4 : l3 + 2));
+        uint16_t frame_bytes = ip_length + l3 + (ipv6 ? 40 : 0);
+        table_action = conform(best_bucket, frame_bytes, cycle) ? 1 : 0;
+    }
+    /* Frames other than IP are left with a zero key to hash */
+    uint32_t hash = FilterGeometry::compute_hash(key, 0);
+    uint32_t rule_id = best != 0 ? FilterMetadata::RULE_HIT |
+                                   (active_bank_ * HASH_TABLES * HASH_TABLE_WAYS *
+                                    HASH_TABLE_SIZE + best_slot) : 0;
+    Verdict verdict = {table_action == 1, false, 0, rule_id, hash, cycle, false, 0};
+    if (table_action == PacketFilter::RULE_ACTION_STEER) {
+        verdict.forward = true;
+        verdict.steered = true;
+        verdict.queue = best_queue;
+        if (best_queue == PacketFilter::QUEUE_RSS) {
+            verdict.queue = rss_table_[hash % PacketFilter::RSS_TABLE_SIZE];
+        }
+    }
+    bool forward = verdict.forward;
+
+    if (best != 0) {
+        SlotCounter& counter = counters_[active_bank_][best_slot];
+        counter.packets++;
+        counter.bytes += pkt_len;
+    }
+    if ((ipv4 || ipv6) && !forward) {
+        update_sketch(key);
+    }
+    uint32_t mirror_threshold = input(PacketFilter::RegisterMap::MIRROR_THRESHOLD_REG);
+    if (!forward && mirror_threshold != 0) {
+        verdict.mirrored = mirror_lfsr_ < mirror_threshold;
+        mirror_lfsr_ = (mirror_lfsr_ >> 1) ^ (mirror_lfsr_ & 1 ? MIRROR_LFSR_TAPS : 0);
+        stats_.mirrored += verdict.mirrored;
+        /* The copy ends after MIRROR_PHITS phits */
+        if (verdict.mirrored) {
+            verdict.mirror_bytes = static_cast<uint32_t>(
+                std::min<size_t>(pkt_len, PacketFilter::MIRROR_BYTES));
+        }
+    }
+
+    stats_.pkt_in++;
+    stats_.bytes += pkt_len;
+    stats_.phit_in += pkt_len == 0 ? 1 : (pkt_len + PHIT_BYTES - 1) / PHIT_BYTES;
+    if (forward) {
+        stats_.pkt_forward++;
+    } else {
+        stats_.pkt_drop++;
+    }
+    return verdict;
+}
+
+PacketFilterModel::Statistics PacketFilterModel::stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+/* CountMinSketch::update() for the destination of a dropped frame */
+void PacketFilterModel::update_sketch(const FlowKey& key) {
+    FlowKey dest = {};
+    dest.dst_ip = key.dst_ip;
+    dest.dst_port = key.dst_port;
+    dest.protocol = key.protocol;
+
+    uint32_t count[SKETCH_ROWS];
+    uint32_t estimate = UINT32_MAX;
+    for (uint32_t r = 0; r < SKETCH_ROWS; r++) {
+        const auto& counter = sketch_[r][slot(dest, r)];
+        count[r] = counter.second == epoch_ ? counter.first : 0;
+        estimate = std::min(estimate, count[r]);
+    }
+    if (estimate != UINT32_MAX) {
+        estimate++;
+    }
+    for (uint32_t r = 0; r < SKETCH_ROWS; r++) {
+        if (count[r] < estimate) {
+            sketch_[r][slot(dest, r)] = {estimate, epoch_};
+        }
+    }
+
+    int match = -1;
+    uint32_t victim = 0;
+    uint32_t lightest = top_[0].valid ? top_[0].count : 0;
+    for (uint32_t i = 0; i < SKETCH_TOP_K; i++) {
+        const Candidate& candidate = top_[i];
+        uint32_t weight = candidate.valid ? candidate.count : 0;
+        if (candidate.valid && candidate.dst_ip == dest.dst_ip &&
+            candidate.dst_port == dest.dst_port && candidate.protocol == dest.protocol) {
+            match = i;
+        }
+        if (weight < lightest) {
+            lightest = weight;
+            victim = i;
+        }
+    }
+    if (match >= 0) {
+        top_[match].count = estimate;
+    } else if (!top_[victim].valid || estimate > lightest) {
+        top_[victim] = Candidate{true, dest.dst_ip, dest.dst_port, dest.protocol, estimate};
+    }
+}
+
+/* Export engine of the core: the same words, without waiting for idle counter cycles */
+void PacketFilterModel::export_page(uint32_t page) {
+    /* export_word walks all words of a counter page but only the candidate words
+     * of the heavy hitter page, the rest keep what an earlier export left */
+    if ((page & 0xFFFF) == PacketFilter::HEAVY_HITTER_PAGE) {
+        for (uint32_t i = 0; i < SKETCH_TOP_K; i++) {
+            uint32_t* words = &export_[i * PacketFilter::HEAVY_HITTER_WORDS];
+            memcpy(words, top_[i].dst_ip.bytes, sizeof(top_[i].dst_ip.bytes));
+            words[4] = top_[i].dst_port | (static_cast<uint32_t>(top_[i].protocol) << 16);
+            words[5] = top_[i].count;
+            words[6] = top_[i].valid;
+            words[7] = 0;
+        }
+        return;
+    }
+
+    uint32_t bank = (page >> 16) & 1;
+    for (uint32_t i = 0; i < PacketFilter::EXPORT_SLOTS; i++) {
+        /* ap_uint<SLOT_BITS> truncation of the slot number */
+        uint32_t slot = ((page & 0xFFFF) * PacketFilter::EXPORT_SLOTS + i) %
+                        counters_[bank].size();
+        const SlotCounter& counter = counters_[bank][slot];
+        export_[4 * i] = static_cast<uint32_t>(counter.packets);
+        export_[4 * i + 1] = static_cast<uint32_t>(counter.packets >> 32);
+        export_[4 * i + 2] = static_cast<uint32_t>(counter.bytes);
+        export_[4 * i + 3] = static_cast<uint32_t>(counter.bytes >> 32);
+    }
+}
+
+/* TokenBuckets::conform() */
+bool PacketFilterModel::conform(uint32_t bucket, uint16_t frame_bytes, uint64_t now) {
+    Bucket& entry = buckets_[bucket];
+    unsigned __int128 full = static_cast<unsigned __int128>(entry.burst) << 32;
+    uint64_t tokens = static_cast<uint64_t>(full);
+    if (entry.state_gen == entry.gen) {
+        uint64_t elapsed = now - entry.stamp;
+        uint64_t cycles = elapsed >> 32 ? 0xFFFFFFFF : elapsed;
+        /* ap_uint<96> product and sum */
+        unsigned __int128 filled = static_cast<unsigned __int128>(cycles) * entry.rate;
+        unsigned __int128 mask = (static_cast<unsigned __int128>(1) << 96) - 1;
+        filled = ((filled & mask) + entry.tokens) & mask;
+        tokens = filled > full ? static_cast<uint64_t>(full) : static_cast<uint64_t>(filled);
+    }
+
+    uint64_t cost = static_cast<uint64_t>(entry.bytes ? frame_bytes : 1) << 32;
+    bool pass = tokens >= cost;
+    if (pass) {
+        tokens -= cost;
+    }
+    entry.tokens = tokens;
+    entry.stamp = now;
+    entry.state_gen = entry.gen;
+    return pass;
+}
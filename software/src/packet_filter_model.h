@@ -0,0 +1,174 @@
+#ifndef _PACKET_FILTER_MODEL_H_
+#define _PACKET_FILTER_MODEL_H_
+
+#include "packet_filter.h"
+#include "filter_geometry.h"
+
+/* Bit-exact software model of the packet filter HLS core
+ * (hardware/src/hls/packet_filter.cc and hash.cc). It implements the same register
+ * semantics as the core, so the control plane can run against it unchanged, and the
+ * same Toeplitz hash, so rule placement can be checked without hardware.
+ * Keep it in sync with the HLS sources. */
+class PacketFilterModel {
+public:
+    using FlowKey = PacketFilter::FlowKey;
+
+    static constexpr uint32_t HASH_TABLES     = FilterGeometry::HASH_TABLES;
+    static constexpr uint32_t HASH_TABLE_SIZE = FilterGeometry::HASH_TABLE_SIZE;
+    static constexpr uint32_t HASH_TABLE_WAYS = FilterGeometry::HASH_TABLE_WAYS;
+    static constexpr uint32_t HASH_MASK       = FilterGeometry::HASH_MASK;
+    static constexpr uint32_t NUM_BANKS       = 2;
+    static constexpr uint32_t ACTION_INVALID  = 0xFF;
+
+    /* SKETCH_ROWS, SKETCH_WIDTH and SKETCH_TOP_K in sketch.h */
+    static constexpr uint32_t SKETCH_ROWS     = 4;
+    static constexpr uint32_t SKETCH_WIDTH    = HASH_TABLE_SIZE;
+    static constexpr uint32_t SKETCH_TOP_K    = 8;
+
+    static constexpr uint32_t RATE_BUCKETS    = FilterGeometry::RATE_BUCKETS;
+
+    static constexpr uint32_t ADDR_SPACE      = 0x1000;
+    static constexpr size_t   PHIT_BYTES      = 64;
+    static constexpr size_t   PARSE_BYTES     = 2 * PHIT_BYTES; /* NetworkPacket::window_t */
+
+    struct Statistics {
+        uint64_t pkt_in;
+        uint64_t phit_in;
+        uint64_t pkt_forward;
+        uint64_t pkt_drop;
+        uint64_t bytes;
+        uint64_t mirrored;
+    };
+
+    /* ToeplitzHash::Entry */
+    struct Entry {
+        bool valid;
+        FlowKey key;
+        uint8_t action;
+        uint16_t priority;
+        uint32_t bucket;
+        uint16_t queue;
+    };
+
+    /* What the core does with a frame. A steered frame leaves with its C2H queue in
+     * tuser, and rule_id, hash and timestamp make up its FilterMetadata. A mirrored
+     * frame is dropped but its first mirror_bytes, at most MIRROR_BYTES, go to the
+     * mirror queue. */
+    struct Verdict {
+        bool forward;
+        bool steered;
+        uint16_t queue;
+        uint32_t rule_id;
+        uint32_t hash;
+        uint64_t timestamp;
+        bool mirrored;
+        uint32_t mirror_bytes;
+    };
+
+    /* slot_counter_t */
+    struct SlotCounter {
+        uint64_t packets;
+        uint64_t bytes;
+    };
+
+    /* CountMinSketch::Candidate, with the drop key split into its fields */
+    struct Candidate {
+        bool valid;
+        PacketFilter::IPAddress dst_ip;
+        uint16_t dst_port;
+        uint8_t protocol;
+        uint32_t count;
+    };
+
+private:
+    std::mutex mutex_;
+
+    /* table_[bank][(table * HASH_TABLE_WAYS + way) * HASH_TABLE_SIZE + index] */
+    std::vector<Entry> table_[NUM_BANKS];
+    FlowKey mask_[NUM_BANKS][HASH_TABLES];
+
+    /* Input registers as last written by the host */
+    std::unordered_map<uint32_t, uint32_t> inputs_;
+
+    uint32_t active_bank_ = 0;
+    uint8_t active_default_ = 0;
+    uint32_t last_rule_seq_ = 0;
+    uint32_t last_commit_seq_ = 0;
+    Statistics stats_ = {0, 0, 0, 0, 0, 0};
+
+    /* Registers latched by the last snapshot. The model has no clock, cycles are
+     * derived from the host clock at the core frequency. */
+    Statistics snapshot_ = {0, 0, 0, 0, 0, 0};
+    uint64_t snapshot_cycles_ = 0;
+    uint32_t last_snapshot_seq_ = 0;
+    std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+
+    /* counters[(bank, slot)] of the core, indexed like table_ */
+    std::vector<SlotCounter> counters_[NUM_BANKS];
+
+    /* Drop sketch: (count, epoch) per row and counter, and the top-K candidates */
+    std::vector<std::pair<uint32_t, uint8_t>> sketch_[SKETCH_ROWS];
+    Candidate top_[SKETCH_TOP_K];
+    uint8_t epoch_ = 0;
+
+    /* TokenBuckets: configuration and lazily refilled state of every bucket */
+    struct Bucket {
+        uint64_t rate;
+        uint32_t burst;
+        bool bytes;
+        uint8_t gen;
+        uint64_t tokens;
+        uint64_t stamp;
+        uint8_t state_gen;
+    };
+    std::vector<Bucket> buckets_;
+
+    /* RSS indirection table, rss_table in packet_filter.cc */
+    uint16_t rss_table_[PacketFilter::RSS_TABLE_SIZE];
+
+    /* mirror_lfsr in packet_filter.cc, MIRROR_LFSR_TAPS */
+    uint32_t mirror_lfsr_ = 1;
+    static constexpr uint32_t MIRROR_LFSR_TAPS = 0x80200003;
+
+    /* Page export, applied when the doorbell is written */
+    uint32_t export_seq_ = 0;
+    uint32_t export_[PacketFilter::EXPORT_WORDS];
+
+    void update_sketch(const FlowKey& key);
+    bool conform(uint32_t bucket, uint16_t frame_bytes, uint64_t now);
+    uint64_t now_cycles() const;
+    void export_page(uint32_t page);
+
+    uint32_t input(uint32_t offset) const;
+
+    /* Index of a key in one way of a table, or in one row of the sketch */
+    static uint32_t slot(const FlowKey& key, uint32_t way) {
+        return FilterGeometry::compute_hash(key, way) & HASH_MASK;
+    }
+
+public:
+    PacketFilterModel();
+    ~PacketFilterModel() {}
+
+    /* Offset of the core within the user BAR */
+    static uint32_t base_addr();
+
+    /* AXI-Lite side. The core consumes a doorbell in the cycle it is written; the
+     * model applies it immediately, between two frames. */
+    void reg_write(uint32_t offset, uint32_t value);
+    uint32_t reg_read(uint32_t offset);
+
+    /* AXI-Stream side: filter one frame and return whether it is forwarded.
+     * data must hold the first min(data_len, PARSE_BYTES) bytes of the frame. cycle
+     * is the core cycle the decision is made in, which token buckets refill from;
+     * without it the host clock is scaled to the core clock. */
+    bool process(const uint8_t* data, size_t data_len, size_t pkt_len);
+    bool process(const uint8_t* data, size_t data_len, size_t pkt_len, uint64_t cycle);
+    /* Same as process(), with the queue and metadata of the frame */
+    Verdict classify(const uint8_t* data, size_t data_len, size_t pkt_len);
+    Verdict classify(const uint8_t* data, size_t data_len, size_t pkt_len, uint64_t cycle);
+    /* Live counters, regardless of snapshots */
+    Statistics stats();
+};
+
+#endif // _PACKET_FILTER_MODEL_H_
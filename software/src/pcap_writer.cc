@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <arpa/inet.h>
+
+#include "deps.h"
+#include "pcap_writer.h"
+
+PcapWriter::PcapWriter(const std::string& path, uint64_t max_file_bytes, uint32_t max_files)
+    : path_(path), max_file_bytes_(max_file_bytes), max_files_(std::max<uint32_t>(max_files, 1)) {
+}
+
+PcapWriter::~PcapWriter() {
+    if (fp_ != nullptr) {
+        fclose(fp_);
+    }
+}
+
+bool PcapWriter::open() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    file_index_ = max_files_ - 1;
+    return open_next();
+}
+
+bool PcapWriter::open_next() {
+    if (fp_ != nullptr) {
+        fclose(fp_);
+        fp_ = nullptr;
+    }
+    file_index_ = (file_index_ + 1) % max_files_;
+    std::string name = path_ + "." + std::to_string(file_index_);
+    fp_ = fopen(name.c_str(), "wb");
+    if (fp_ == nullptr) {
+        log_error("Cannot open %s: %s", name.c_str(), strerror(errno));
+        return false;
+    }
+
+    FileHeader header = {PCAP_MAGIC_NS, 2, 4, 0, 0, SNAPLEN, LINKTYPE_ETHERNET};
+    if (fwrite(&header, sizeof(header), 1, fp_) != 1) {
+        log_error("Cannot write %s: %s", name.c_str(), strerror(errno));
+        fclose(fp_);
+        fp_ = nullptr;
+        return false;
+    }
+    file_bytes_ = sizeof(header);
+    return true;
+}
+
+bool PcapWriter::write(const uint8_t* data, uint32_t caplen, uint32_t len) {
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (fp_ == nullptr) {
+        return false;
+    }
+    if (file_bytes_ + sizeof(RecordHeader) + caplen > max_file_bytes_ && !open_next()) {
+        return false;
+    }
+
+    RecordHeader record = {static_cast<uint32_t>(now.tv_sec), static_cast<uint32_t>(now.tv_nsec),
+                           caplen, std::max(len, caplen)};
+    if (fwrite(&record, sizeof(record), 1, fp_) != 1 || fwrite(data, 1, caplen, fp_) != caplen) {
+        log_error("Cannot write to %s.%u: %s", path_.c_str(), file_index_, strerror(errno));
+        return false;
+    }
+    file_bytes_ += sizeof(record) + caplen;
+    packets_++;
+    return true;
+}
+
+uint32_t PcapWriter::wire_length(const uint8_t* frame, uint32_t caplen) {
+    auto field16 = [frame](uint32_t byte) -> uint16_t {
+        uint16_t value;
+        memcpy(&value, frame + byte, sizeof(value));
+        return ntohs(value);
+    };
+
+    /* Up to two VLAN tags, like the filter core */
+    uint32_t l3 = 14;
+    if (caplen < l3) {
+        return caplen;
+    }
+    uint16_t eth_type = field16(12);
+    for (int tags = 0; tags < 2 && (eth_type == 0x8100 || eth_type == 0x88A8); tags++) {
+        if (caplen < l3 + 4) {
+            return caplen;
+        }
+        eth_type = field16(l3 + 2);
+        l3 += 4;
+    }
+
+    if (eth_type == 0x0800 && caplen >= l3 + 4) {
+        return std::max<uint32_t>(l3 + field16(l3 + 2), caplen);
+    }
+    if (eth_type == 0x86DD && caplen >= l3 + 6) {
+        return std::max<uint32_t>(l3 + 40 + field16(l3 + 4), caplen);
+    }
+    return caplen;
+}
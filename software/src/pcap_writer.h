@@ -0,0 +1,59 @@
+#ifndef _PCAP_WRITER_H_
+#define _PCAP_WRITER_H_
+
+/* Writes packets into a ring of pcap files, <path>.0 to <path>.<max_files - 1>: once a
+ * file reaches max_file_bytes the next one is started, overwriting the oldest, so a
+ * capture keeps the most recent packets in bounded space. Timestamps have
+ * nanosecond resolution. Packets may be written from several threads. */
+class PcapWriter {
+private:
+    static constexpr uint32_t PCAP_MAGIC_NS    = 0xa1b23c4d;
+    static constexpr uint32_t LINKTYPE_ETHERNET = 1;
+    static constexpr uint32_t SNAPLEN           = 65535;
+
+    struct FileHeader {
+        uint32_t magic;
+        uint16_t version_major;
+        uint16_t version_minor;
+        int32_t  thiszone;
+        uint32_t sigfigs;
+        uint32_t snaplen;
+        uint32_t linktype;
+    };
+    struct RecordHeader {
+        uint32_t ts_sec;
+        uint32_t ts_nsec;
+        uint32_t caplen;
+        uint32_t len;
+    };
+
+    std::mutex mutex_;
+    std::string path_;
+    uint64_t max_file_bytes_;
+    uint32_t max_files_;
+
+    FILE* fp_ = nullptr;
+    uint32_t file_index_ = 0;
+    uint64_t file_bytes_ = 0;
+    uint64_t packets_ = 0;
+
+    bool open_next();
+
+public:
+    PcapWriter(const std::string& path, uint64_t max_file_bytes = 64 << 20,
+               uint32_t max_files = 8);
+    ~PcapWriter();
+
+    /* Creates the first file; false if it cannot be written */
+    bool open();
+
+    /* caplen bytes of a packet that was len bytes long on the wire */
+    bool write(const uint8_t* data, uint32_t caplen, uint32_t len);
+    uint64_t packets() const { return packets_; }
+
+    /* Wire length of a truncated Ethernet frame as told by its IPv4 or IPv6 header,
+     * without the FCS; caplen for anything else */
+    static uint32_t wire_length(const uint8_t* frame, uint32_t caplen);
+};
+
+#endif // _PCAP_WRITER_H_
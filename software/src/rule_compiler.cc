@@ -0,0 +1,390 @@
+#include <map>
+#include <set>
+
+#include "deps.h"
+#include "rule_compiler.h"
+
+RuleCompiler::RuleCompiler() {
+    /* Build the byte tables from the bit-serial reference hash */
+    for (uint32_t way = 0; way < TABLE_WAYS; way++) {
+        for (uint32_t byte = 0; byte < KEY_BYTES; byte++) {
+            for (uint32_t value = 0; value < 256; value++) {
+                uint8_t input[KEY_BYTES] = {0};
+                input[byte] = static_cast<uint8_t>(value);
+                byte_table_[way][byte][value] = FilterGeometry::toeplitz(input, way);
+            }
+        }
+    }
+
+    current_.slots.assign(NUM_SLOTS, Slot{FlowKey{}, 0, 0, 0, false, {}});
+    current_.masks.assign(NUM_TABLES, FlowKey{});
+    current_.tables.assign(NUM_TABLES, false);
+}
+
+RuleCompiler::Placement RuleCompiler::place(const RuleSet& rule_set) const {
+    Placement placement;
+    placement.slots = current_.slots;
+    placement.masks = current_.masks;
+    placement.tables.assign(NUM_TABLES, false);
+
+    /* From here on, rules are table entries and origin maps them back to rule_set */
+    std::vector<uint32_t> origin;
+    RuleSet rules = expand(rule_set, origin);
+    placement.entries = rules.size();
+
+    /* Masks keep the tables they had and new masks take tables nobody uses any more,
+     * or else the extra table of a mask that spilled into several */
+    std::map<FlowKey, std::vector<uint32_t>> tables_of;
+    for (const auto& rule : rules) {
+        tables_of[rule.mask];
+    }
+    for (uint32_t table = 0; table < NUM_TABLES; table++) {
+        auto it = tables_of.find(current_.masks[table]);
+        if (current_.tables[table] && it != tables_of.end()) {
+            it->second.push_back(table);
+            placement.tables[table] = true;
+        }
+    }
+    auto free_table = [&placement]() -> uint32_t {
+        for (uint32_t table = 0; table < NUM_TABLES; table++) {
+            if (!placement.tables[table]) {
+                return table;
+            }
+        }
+        return NO_SLOT;
+    };
+    for (auto& [mask, tables] : tables_of) {
+        if (!tables.empty()) {
+            continue;
+        }
+        uint32_t table = free_table();
+        if (table == NO_SLOT) {
+            auto most = std::max_element(tables_of.begin(), tables_of.end(),
+                                         [](const auto& a, const auto& b) {
+                return a.second.size() < b.second.size();
+            });
+            if (most->second.size() < 2) {
+                continue;
+            }
+            table = most->second.back();
+            most->second.pop_back();
+        }
+        tables.push_back(table);
+        placement.tables[table] = true;
+        placement.masks[table] = mask;
+    }
+
+    /* One entry per distinct (mask, masked match). Expanded prefixes may produce the
+     * same entry: the higher priority one wins, and later rules override earlier ones. */
+    std::map<std::pair<FlowKey, FlowKey>, uint32_t> wanted;
+    for (uint32_t i = 0; i < rules.size(); i++) {
+        if (tables_of[rules[i].mask].empty()) {
+            placement.conflicts.push_back(Collision{origin[i], NO_SLOT});
+            continue;
+        }
+        auto [it, added] = wanted.try_emplace({rules[i].mask, rules[i].match & rules[i].mask}, i);
+        if (!added && rules[it->second].priority <= rules[i].priority) {
+            it->second = i;
+        }
+    }
+
+    /* Keep rules that are still present where they are, drop the rest */
+    std::vector<bool> placed(rules.size(), false);
+    std::vector<uint32_t> table_used(NUM_TABLES, 0);
+    for (uint32_t slot = 0; slot < NUM_SLOTS; slot++) {
+        Slot& entry = placement.slots[slot];
+        if (!entry.used) {
+            continue;
+        }
+        uint32_t table = slot / (TABLE_WAYS * TABLE_SIZE);
+        auto it = placement.tables[table] && placement.masks[table] == current_.masks[table] ?
+                  wanted.find({current_.masks[table], entry.key}) : wanted.end();
+        if (it == wanted.end() || placed[it->second]) {
+            entry.used = false;
+            continue;
+        }
+        const auto& rule = rules[it->second];
+        entry.action = rule.action;
+        entry.priority = rule.priority;
+        entry.rule = origin[it->second];
+        placed[it->second] = true;
+        placement.used++;
+        table_used[table]++;
+    }
+
+    /* Insert the new ones in (mask, key) order, so a rule set always compiles the
+     * same way. A rule goes into the first table of its mask with room, and when
+     * they are all full the mask spills into a free table. */
+    std::vector<uint32_t> failed(NUM_TABLES, 0);
+    uint32_t seed = 1;
+    for (const auto& [where, index] : wanted) {
+        if (placed[index]) {
+            continue;
+        }
+        const auto& rule = rules[index];
+        Slot entry = {where.second, rule.action, rule.priority, origin[index], true, {}};
+        for (uint32_t way = 0; way < TABLE_WAYS; way++) {
+            entry.index[way] = hash(entry.key, way) & TABLE_MASK;
+        }
+        std::vector<uint32_t>& tables = tables_of[where.first];
+        bool stored = false;
+        for (size_t i = 0; !stored; i++) {
+            if (i == tables.size()) {
+                uint32_t table = free_table();
+                if (table == NO_SLOT) {
+                    break;
+                }
+                tables.push_back(table);
+                placement.tables[table] = true;
+                placement.masks[table] = where.first;
+            }
+            /* A full table would only cycle through MAX_KICKS displacements, and so
+             * would most inserts into one where MAX_FAILURES inserts failed already:
+             * those go to the next table while there is one. */
+            uint32_t table = tables[i];
+            bool last = i + 1 == tables.size() && free_table() == NO_SLOT;
+            if ((failed[table] >= MAX_FAILURES && !last) ||
+                table_used[table] == TABLE_WAYS * TABLE_SIZE) {
+                continue;
+            }
+            if (insert(placement, table, entry, seed)) {
+                placement.used++;
+                table_used[table]++;
+                stored = true;
+            } else {
+                failed[table]++;
+            }
+        }
+        if (!stored) {
+            /* entry now holds whichever rule was left without a slot */
+            placement.conflicts.push_back(Collision{entry.rule, slot(entry.key, tables[0], 0)});
+        }
+    }
+    return placement;
+}
+
+/* Smallest number of entries that rules with the given destination prefix lengths
+ * (and how many rules have each) expand to in `tables` tables of `capacity` entries;
+ * a target length with more entries than a table holds spills into several of them.
+ * targets receives the chosen lengths. This is the dynamic program of controlled
+ * prefix expansion: cost[j][k] covers the j shortest lengths with k tables, the
+ * longest of them being lengths[j - 1]. */
+uint64_t RuleCompiler::expansion_cost(const std::map<int, uint64_t>& lengths, uint32_t tables,
+                                      uint64_t capacity, std::vector<int>& targets) {
+    std::vector<int> len;
+    std::vector<uint64_t> count;
+    for (const auto& [l, c] : lengths) {
+        len.push_back(l);
+        count.push_back(c);
+    }
+    size_t m = len.size();
+
+    /* Entries for the lengths in (i, j] all expanded to len[j - 1] */
+    auto span = [&](size_t i, size_t j) -> uint64_t {
+        uint64_t total = 0;
+        for (size_t t = i; t < j; t++) {
+            int shift = len[j - 1] - len[t];
+            if (shift >= 40) {
+                return EXPANSION_LIMIT;
+            }
+            total += count[t] << shift;
+        }
+        return std::min(total, EXPANSION_LIMIT);
+    };
+
+    std::vector<std::vector<uint64_t>> cost(m + 1,
+                                            std::vector<uint64_t>(tables + 1, EXPANSION_LIMIT));
+    std::vector<std::vector<size_t>> prev(m + 1, std::vector<size_t>(tables + 1, 0));
+    std::vector<std::vector<uint32_t>> prev_tables(m + 1, std::vector<uint32_t>(tables + 1, 0));
+    cost[0][0] = 0;
+    for (size_t j = 1; j <= m; j++) {
+        for (uint32_t k = 1; k <= tables; k++) {
+            for (size_t i = 0; i < j; i++) {
+                uint64_t entries = span(i, j);
+                uint64_t needed = std::max<uint64_t>(1, (entries + capacity - 1) / capacity);
+                if (entries >= EXPANSION_LIMIT || needed > k ||
+                    cost[i][k - needed] >= EXPANSION_LIMIT) {
+                    continue;
+                }
+                uint64_t c = std::min(cost[i][k - needed] + entries, EXPANSION_LIMIT);
+                if (c < cost[j][k]) {
+                    cost[j][k] = c;
+                    prev[j][k] = i;
+                    prev_tables[j][k] = k - static_cast<uint32_t>(needed);
+                }
+            }
+        }
+    }
+
+    uint32_t best = 1;
+    for (uint32_t k = 1; k <= tables; k++) {
+        if (cost[m][k] < cost[m][best]) {
+            best = k;
+        }
+    }
+    targets.clear();
+    if (cost[m][best] >= EXPANSION_LIMIT) {
+        return EXPANSION_LIMIT;
+    }
+    for (size_t j = m, k = best; j > 0;) {
+        targets.insert(targets.begin(), len[j - 1]);
+        size_t i = prev[j][k];
+        k = prev_tables[j][k];
+        j = i;
+    }
+    return cost[m][best];
+}
+
+RuleCompiler::RuleSet RuleCompiler::expand(const RuleSet& rules,
+                                           std::vector<uint32_t>& origin) const {
+    origin.resize(rules.size());
+    for (uint32_t i = 0; i < rules.size(); i++) {
+        origin[i] = i;
+    }
+
+    std::set<FlowKey> masks;
+    for (const auto& rule : rules) {
+        masks.insert(rule.mask);
+    }
+    if (masks.size() <= NUM_TABLES) {
+        return rules;
+    }
+
+    /* Rules whose masks only differ in the destination prefix length form a group
+     * that can share tables. A non-prefix destination mask is a group of its own. */
+    auto group_of = [](const FlowKey& mask) -> std::pair<FlowKey, int> {
+        int len = prefix_length(mask.dst_ip);
+        FlowKey rest = mask;
+        if (len >= 0) {
+            rest.dst_ip = IPAddress{};
+        }
+        return {rest, len};
+    };
+    std::map<FlowKey, std::map<int, uint64_t>> groups;
+    std::set<std::pair<FlowKey, FlowKey>> seen;
+    for (const auto& rule : rules) {
+        /* Count distinct prefixes, duplicates share their expanded entries */
+        if (!seen.insert({rule.mask, rule.match & rule.mask}).second) {
+            continue;
+        }
+        auto [rest, len] = group_of(rule.mask);
+        groups[rest][len]++;
+    }
+    if (groups.size() > NUM_TABLES) {
+        return rules;
+    }
+
+    /* Every group needs a table; try every way of sharing out the rest and keep the
+     * one that generates the fewest entries. There are at most NUM_TABLES groups. */
+    std::vector<FlowKey> keys;
+    for (const auto& [rest, lengths] : groups) {
+        keys.push_back(rest);
+    }
+    std::map<FlowKey, std::vector<int>> targets;
+    uint64_t best_cost = UINT64_MAX;
+    std::vector<uint32_t> alloc(keys.size(), 1);
+    uint64_t capacity = TABLE_WAYS * TABLE_SIZE * 9 / 10;
+    std::function<void(size_t, uint32_t)> search = [&](size_t g, uint32_t spare) {
+        if (g + 1 < keys.size()) {
+            for (uint32_t extra = 0; extra <= spare; extra++) {
+                alloc[g] = 1 + extra;
+                search(g + 1, spare - extra);
+            }
+            return;
+        }
+        alloc[g] = 1 + spare;
+        uint64_t total = 0;
+        std::map<FlowKey, std::vector<int>> chosen;
+        for (size_t i = 0; i < keys.size(); i++) {
+            total = std::min(total + expansion_cost(groups[keys[i]], alloc[i], capacity,
+                                                    chosen[keys[i]]),
+                             EXPANSION_LIMIT);
+        }
+        if (total < best_cost || targets.empty()) {
+            best_cost = total;
+            targets = chosen;
+        }
+    };
+    search(0, NUM_TABLES - keys.size());
+    if (best_cost >= EXPANSION_LIMIT) {
+        /* No layout fits: settle for the fewest entries and let placement report
+         * the rules that do not fit */
+        capacity = EXPANSION_LIMIT;
+        best_cost = UINT64_MAX;
+        targets.clear();
+        search(0, NUM_TABLES - keys.size());
+    }
+    if (best_cost >= EXPANSION_LIMIT) {
+        /* Not even that is bounded, e.g. a wildcard sharing a table with full
+         * addresses: leave the rules alone, the masks without a table are reported */
+        return rules;
+    }
+
+    RuleSet expanded;
+    origin.clear();
+    for (uint32_t i = 0; i < rules.size(); i++) {
+        const auto& rule = rules[i];
+        auto [rest, len] = group_of(rule.mask);
+        const auto& group_targets = targets[rest];
+        int target = *std::lower_bound(group_targets.begin(), group_targets.end(), len);
+        if (len < 0 || target == len) {
+            expanded.push_back(rule);
+            origin.push_back(i);
+            continue;
+        }
+
+        /* Enumerate the 2^(target - len) longer prefixes covering the same addresses;
+         * bit b of j goes to address bit target - 1 - b, counted from the top */
+        uint64_t count = target - len < 40 ? 1ULL << (target - len) : EXPANSION_LIMIT;
+        for (uint64_t j = 0; j < count && expanded.size() < EXPANSION_LIMIT; j++) {
+            Rule entry = rule;
+            entry.mask.dst_ip = prefix_mask(target);
+            entry.match.dst_ip = rule.match.dst_ip & rule.mask.dst_ip;
+            for (int b = 0; b < std::min(target - len, 64); b++) {
+                int bit = target - 1 - b;
+                if ((j >> b) & 1) {
+                    entry.match.dst_ip.bytes[bit / 8] |= 0x80 >> (bit % 8);
+                }
+            }
+            expanded.push_back(entry);
+            origin.push_back(i);
+        }
+    }
+    return expanded;
+}
+
+/* Random-walk cuckoo insertion: when every candidate slot of the rule in hand is
+ * taken, it evicts the occupant of one of them (never the slot it was just evicted
+ * from) and carries on with that rule. Returns false with the rule left homeless
+ * in `rule` after MAX_KICKS displacements. */
+bool RuleCompiler::insert(Placement& placement, uint32_t table, Slot& rule,
+                          uint32_t& seed) const {
+    uint32_t from = TABLE_WAYS;
+    for (uint32_t kick = 0; kick <= MAX_KICKS; kick++) {
+        for (uint32_t way = 0; way < TABLE_WAYS; way++) {
+            Slot& entry = placement.slots[slot(rule, table, way)];
+            if (!entry.used) {
+                entry = rule;
+                return true;
+            }
+        }
+        if (kick == MAX_KICKS) {
+            break;
+        }
+
+        /* xorshift32 */
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        uint32_t way = seed % TABLE_WAYS;
+        if (way == from && TABLE_WAYS > 1) {
+            way = (way + 1) % TABLE_WAYS;
+        }
+
+        std::swap(rule, placement.slots[slot(rule, table, way)]);
+        placement.moved++;
+        /* The evicted rule sat in its own slot of this way */
+        from = way;
+    }
+    return false;
+}
@@ -0,0 +1,128 @@
+#ifndef _RULE_COMPILER_H_
+#define _RULE_COMPILER_H_
+
+#include <map>
+
+#include "filter_geometry.h"
+
+/* Host-side placement of rules into the hardware tables. Rules are grouped by mask,
+ * one masked table per distinct mask (tuple space search), and placed into that
+ * table's cuckoo ways; a mask that fills its table spills into tables no other mask
+ * needs, so a single mask can use all of them. It reproduces the core's per-way Toeplitz hashes so slot
+ * occupancy and collisions are known before anything is written to the FPGA, and
+ * it does all cuckoo displacement: the core only writes the slots it is given. */
+class RuleCompiler {
+public:
+    using IPAddress = PacketFilter::IPAddress;
+    using FlowKey = PacketFilter::FlowKey;
+    using Rule    = PacketFilter::Rule;
+    using RuleSet = PacketFilter::RuleSet;
+
+    static constexpr uint32_t NUM_TABLES = FilterGeometry::HASH_TABLES;
+    static constexpr uint32_t TABLE_SIZE = FilterGeometry::HASH_TABLE_SIZE;
+    static constexpr uint32_t TABLE_WAYS = FilterGeometry::HASH_TABLE_WAYS;
+    static constexpr uint32_t TABLE_MASK = FilterGeometry::HASH_MASK;
+    static constexpr uint32_t KEY_BYTES  = FilterGeometry::HASH_INPUT_LEN;
+    static constexpr uint32_t NUM_SLOTS  = NUM_TABLES * TABLE_WAYS * TABLE_SIZE;
+
+    /* Displacements tried before giving up on a rule */
+    static constexpr uint32_t MAX_KICKS = 512;
+    /* Failed inserts after which a table only takes rules its mask has no other
+     * table for */
+    static constexpr uint32_t MAX_FAILURES = 16;
+
+    /* Upper bound on the entries prefix expansion may generate */
+    static constexpr uint64_t EXPANSION_LIMIT = 4 * NUM_SLOTS;
+    static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+    struct Slot {
+        FlowKey key;        /* masked match of the rule stored in the slot */
+        uint32_t action;
+        uint16_t priority;
+        uint32_t rule;      /* index in the rule set */
+        bool used;
+        uint32_t index[TABLE_WAYS]; /* candidate index of key in each way */
+    };
+
+    /* A rule that could not be stored: its mask needs a table when all are taken
+     * (slot is NO_SLOT), or it found no free slot in the tables of its mask (slot is
+     * its first candidate) and would fall back to the default action */
+    struct Collision {
+        uint32_t rule;
+        uint32_t slot;
+    };
+
+    struct Placement {
+        std::vector<Slot> slots;    /* indexed by (table * TABLE_WAYS + way) * TABLE_SIZE + index */
+        std::vector<FlowKey> masks; /* one per table, a mask may have several */
+        std::vector<bool> tables;   /* tables in use */
+        std::vector<Collision> conflicts;
+        size_t entries = 0;     /* table entries after prefix expansion */
+        size_t used = 0;        /* occupied slots */
+        size_t moved = 0;       /* rules displaced to make room for another */
+    };
+
+private:
+    /* The hash is linear over GF(2), so it is the XOR of one precomputed value
+     * per byte of (folded) hash input instead of one key window per bit */
+    uint32_t byte_table_[TABLE_WAYS][KEY_BYTES][256];
+
+    /* Placement of the last accepted rule set. New placements start from it so
+     * that rules which did not change keep their table and slot. */
+    Placement current_;
+
+    bool insert(Placement& placement, uint32_t table, Slot& rule, uint32_t& seed) const;
+
+    /* Controlled prefix expansion: when the rule set has more distinct masks than
+     * there are tables, destination prefixes are expanded to a few chosen lengths
+     * so that rules differing only in prefix length share tables. Each expanded
+     * entry keeps the priority of its rule, so the longest original prefix still
+     * wins. origin maps each returned entry to its rule. */
+    RuleSet expand(const RuleSet& rules, std::vector<uint32_t>& origin) const;
+    static uint64_t expansion_cost(const std::map<int, uint64_t>& lengths, uint32_t tables,
+                                   uint64_t capacity, std::vector<int>& targets);
+
+public:
+    RuleCompiler();
+    ~RuleCompiler() {}
+
+    /* Same value as FilterGeometry::compute_hash(key, way) */
+    uint32_t hash(const FlowKey& key, uint32_t way) const {
+        uint32_t hash = 0;
+        for (uint32_t byte = 0; byte < KEY_BYTES; byte++) {
+            hash ^= byte_table_[way][byte][FilterGeometry::hash_byte(key, byte)];
+        }
+        return hash;
+    }
+    uint32_t slot(const FlowKey& key, uint32_t table, uint32_t way) const {
+        return (table * TABLE_WAYS + way) * TABLE_SIZE + (hash(key, way) & TABLE_MASK);
+    }
+    /* Slot of an entry whose candidate indices are known */
+    static uint32_t slot(const Slot& entry, uint32_t table, uint32_t way) {
+        return (table * TABLE_WAYS + way) * TABLE_SIZE + entry.index[way];
+    }
+
+    /* Prefix length of an address mask, -1 if it is not a prefix. IPv4 prefixes are
+     * 96 bits longer, as they include the ::ffff: of the IPv4-mapped address. */
+    static int prefix_length(const IPAddress& mask) {
+        int len = mask.popcount();
+        return mask == prefix_mask(len) ? len : -1;
+    }
+    static IPAddress prefix_mask(int len) {
+        IPAddress mask = {};
+        for (int i = 0; i < 16; i++) {
+            int bits = std::min(std::max(len - 8 * i, 0), 8);
+            mask.bytes[i] = static_cast<uint8_t>(0xFF00 >> bits);
+        }
+        return mask;
+    }
+
+    /* Every rule that cannot be stored is reported as a collision. When two rules
+     * have the same match and mask, the later one wins. */
+    Placement place(const RuleSet& rules) const;
+
+    /* Make a placement the starting point of the next one, once it is programmed */
+    void accept(const Placement& placement) { current_ = placement; }
+};
+
+#endif // _RULE_COMPILER_H_
@@ -0,0 +1,112 @@
+#include "deps.h"
+#include "rx_stats.h"
+
+uint64_t HistogramSnapshot::count() const {
+    uint64_t total = 0;
+    for (uint64_t count : counts) {
+        total += count;
+    }
+    return total;
+}
+
+uint64_t HistogramSnapshot::percentile(double fraction) const {
+    uint64_t total = count();
+    if (total == 0) {
+        return 0;
+    }
+    /* Rank of the value, counted from 1 */
+    uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(fraction * total + 0.5));
+    uint64_t seen = 0;
+    for (uint32_t bucket = 0; bucket < BUCKETS; bucket++) {
+        seen += counts[bucket];
+        if (seen >= rank) {
+            return lower_bound(bucket);
+        }
+    }
+    return lower_bound(BUCKETS - 1);
+}
+
+HistogramSnapshot HistogramSnapshot::operator-(const HistogramSnapshot& earlier) const {
+    HistogramSnapshot delta;
+    for (uint32_t bucket = 0; bucket < BUCKETS; bucket++) {
+        delta.counts[bucket] = counts[bucket] - earlier.counts[bucket];
+    }
+    return delta;
+}
+
+HistogramSnapshot& HistogramSnapshot::operator+=(const HistogramSnapshot& other) {
+    for (uint32_t bucket = 0; bucket < BUCKETS; bucket++) {
+        counts[bucket] += other.counts[bucket];
+    }
+    return *this;
+}
+
+void CycleHistogram::read(HistogramSnapshot& snapshot) const {
+    for (uint32_t bucket = 0; bucket < HistogramSnapshot::BUCKETS; bucket++) {
+        snapshot.counts[bucket] += counts_[bucket].load(std::memory_order_relaxed);
+    }
+}
+
+RxLoopSnapshot RxLoopSnapshot::operator-(const RxLoopSnapshot& earlier) const {
+    RxLoopSnapshot delta;
+    delta.empty_polls = empty_polls - earlier.empty_polls;
+    delta.empty_cycles = empty_cycles - earlier.empty_cycles;
+    delta.busy_polls = busy_polls - earlier.busy_polls;
+    delta.packets = packets - earlier.packets;
+    delta.rx_cycles = rx_cycles - earlier.rx_cycles;
+    delta.handler_cycles = handler_cycles - earlier.handler_cycles;
+    delta.free_cycles = free_cycles - earlier.free_cycles;
+    for (uint32_t size = 0; size <= MAX_BURST; size++) {
+        delta.burst_sizes[size] = burst_sizes[size] - earlier.burst_sizes[size];
+    }
+    return delta;
+}
+
+RxLoopSnapshot& RxLoopSnapshot::operator+=(const RxLoopSnapshot& other) {
+    empty_polls += other.empty_polls;
+    empty_cycles += other.empty_cycles;
+    busy_polls += other.busy_polls;
+    packets += other.packets;
+    rx_cycles += other.rx_cycles;
+    handler_cycles += other.handler_cycles;
+    free_cycles += other.free_cycles;
+    for (uint32_t size = 0; size <= MAX_BURST; size++) {
+        burst_sizes[size] += other.burst_sizes[size];
+    }
+    return *this;
+}
+
+std::string RxLoopSnapshot::format() const {
+    uint64_t polls = empty_polls + busy_polls;
+    uint64_t full = burst_sizes[MAX_BURST];
+    auto stage = [](const HistogramSnapshot& histogram) {
+        char buf[96];
+        snprintf(buf, sizeof(buf), "%lu/%lu/%lu", histogram.percentile(0.5),
+                 histogram.percentile(0.99), histogram.percentile(0.999));
+        return std::string(buf);
+    };
+
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "%lu polls, %.1f%% empty (%.0f cycles each), %.1f packets per busy poll "
+             "(%.1f%% full); cycles p50/p99/p99.9: rx %s, handler %s, free %s",
+             polls, polls > 0 ? 100.0 * empty_polls / polls : 0.0,
+             empty_polls > 0 ? static_cast<double>(empty_cycles) / empty_polls : 0.0,
+             busy_polls > 0 ? static_cast<double>(packets) / busy_polls : 0.0,
+             busy_polls > 0 ? 100.0 * full / busy_polls : 0.0,
+             stage(rx_cycles).c_str(), stage(handler_cycles).c_str(), stage(free_cycles).c_str());
+    return std::string(buf);
+}
+
+void RxLoopStats::read(RxLoopSnapshot& snapshot) const {
+    snapshot.empty_polls += empty_polls_.load(std::memory_order_relaxed);
+    snapshot.empty_cycles += empty_cycles_.load(std::memory_order_relaxed);
+    snapshot.busy_polls += busy_polls_.load(std::memory_order_relaxed);
+    snapshot.packets += packets_.load(std::memory_order_relaxed);
+    rx_cycles_.read(snapshot.rx_cycles);
+    handler_cycles_.read(snapshot.handler_cycles);
+    free_cycles_.read(snapshot.free_cycles);
+    for (uint32_t size = 0; size <= RxLoopSnapshot::MAX_BURST; size++) {
+        snapshot.burst_sizes[size] += burst_sizes_[size].load(std::memory_order_relaxed);
+    }
+}
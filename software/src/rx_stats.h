@@ -0,0 +1,123 @@
+#ifndef _RX_STATS_H_
+#define _RX_STATS_H_
+
+#include <array>
+
+/* Counts of a CycleHistogram at one point in time */
+struct HistogramSnapshot {
+    static constexpr uint32_t SUB_BITS    = 3;
+    static constexpr uint32_t SUB_BUCKETS = 1u << SUB_BITS;
+    static constexpr uint32_t MAX_BITS    = 40;
+    /* SUB_BUCKETS per bit length below MAX_BITS, and one for the rest */
+    static constexpr uint32_t BUCKETS     = (MAX_BITS - SUB_BITS) * SUB_BUCKETS + 1;
+
+    std::array<uint64_t, BUCKETS> counts{};
+
+    /* Values below SUB_BUCKETS get a bucket each, larger ones SUB_BUCKETS buckets per
+     * power of two, so a value is at most 1/SUB_BUCKETS above its bucket's lower
+     * bound. Values of MAX_BITS bits or more share the last bucket. */
+    static uint32_t bucket_of(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return static_cast<uint32_t>(value);
+        }
+        uint32_t msb = 63 - __builtin_clzll(value);
+        if (msb >= MAX_BITS - 1) {
+            return BUCKETS - 1;
+        }
+        uint32_t shift = msb - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+    }
+    static uint64_t lower_bound(uint32_t bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return bucket;
+        }
+        return static_cast<uint64_t>(SUB_BUCKETS + bucket % SUB_BUCKETS)
+               << (bucket / SUB_BUCKETS - 1);
+    }
+
+    uint64_t count() const;
+    /* Lower bound of the bucket holding the given fraction of the values, 0 if empty */
+    uint64_t percentile(double fraction) const;
+    /* Counts since an earlier snapshot of the same histogram */
+    HistogramSnapshot operator-(const HistogramSnapshot& earlier) const;
+    HistogramSnapshot& operator+=(const HistogramSnapshot& other);
+};
+
+/* Histogram of TSC cycle counts (see HistogramSnapshot for the buckets), written by a
+ * single thread and read by any */
+class CycleHistogram {
+private:
+    std::atomic<uint64_t> counts_[HistogramSnapshot::BUCKETS] = {};
+
+public:
+    void record(uint64_t cycles) {
+        std::atomic<uint64_t>& count = counts_[HistogramSnapshot::bucket_of(cycles)];
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    /* Adds the current counts to snapshot */
+    void read(HistogramSnapshot& snapshot) const;
+};
+
+/* What the rx loop of a thread did so far, see RxLoopStats */
+struct RxLoopSnapshot {
+    static constexpr uint32_t MAX_BURST = 32;
+
+    uint64_t empty_polls = 0;
+    uint64_t empty_cycles = 0;      /* in rte_eth_rx_burst() when it returned nothing */
+    uint64_t busy_polls = 0;
+    uint64_t packets = 0;
+    /* Cycles of each busy poll in rte_eth_rx_burst(), in the handler and in freeing */
+    HistogramSnapshot rx_cycles;
+    HistogramSnapshot handler_cycles;
+    HistogramSnapshot free_cycles;
+    /* Busy polls by the number of packets they returned */
+    std::array<uint64_t, MAX_BURST + 1> burst_sizes{};
+
+    RxLoopSnapshot operator-(const RxLoopSnapshot& earlier) const;
+    RxLoopSnapshot& operator+=(const RxLoopSnapshot& other);
+
+    /* One line of poll counts, burst sizes and stage percentiles */
+    std::string format() const;
+};
+
+/* Counters of one rx loop, updated by its lcore alone on every poll and read by
+ * others at any time. The loop reads the TSC once after an empty poll and three
+ * times around a busy one, and each poll touches a handful of cache lines that no
+ * other lcore writes. */
+class alignas(64) RxLoopStats {
+private:
+    static void add(std::atomic<uint64_t>& counter, uint64_t value) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> empty_polls_{0};
+    std::atomic<uint64_t> empty_cycles_{0};
+    std::atomic<uint64_t> busy_polls_{0};
+    std::atomic<uint64_t> packets_{0};
+    alignas(64) std::atomic<uint64_t> burst_sizes_[RxLoopSnapshot::MAX_BURST + 1] = {};
+    alignas(64) CycleHistogram rx_cycles_;
+    alignas(64) CycleHistogram handler_cycles_;
+    alignas(64) CycleHistogram free_cycles_;
+
+public:
+    void empty_poll(uint64_t rx_cycles) {
+        add(empty_polls_, 1);
+        add(empty_cycles_, rx_cycles);
+    }
+
+    void busy_poll(uint16_t nb_rx, uint64_t rx_cycles, uint64_t handler_cycles,
+                   uint64_t free_cycles) {
+        add(busy_polls_, 1);
+        add(packets_, nb_rx);
+        add(burst_sizes_[std::min<uint32_t>(nb_rx, RxLoopSnapshot::MAX_BURST)], 1);
+        rx_cycles_.record(rx_cycles);
+        handler_cycles_.record(handler_cycles);
+        free_cycles_.record(free_cycles);
+    }
+
+    /* Adds the current counts to snapshot */
+    void read(RxLoopSnapshot& snapshot) const;
+};
+
+#endif // _RX_STATS_H_
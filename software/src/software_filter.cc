@@ -0,0 +1,249 @@
+#include <cmath>
+#include <limits>
+
+#include "deps.h"
+#include "software_filter.h"
+#include "filter_metadata.h"
+#include "dpdk.h"
+
+SoftwareFilter::SoftwareFilter(const RuleSet& rules, PacketFilter::RuleAction default_action,
+                               uint16_t num_threads, uint64_t tsc_hz)
+    : rules_(rules), default_action_(default_action), threads_(num_threads),
+      rate_bucket_of_(rules.size(), NO_RULE), start_tsc_(rte_rdtsc()) {
+    for (auto& thread : threads_) {
+        thread.hits.reset(new std::atomic<uint64_t>[rules_.size()]());
+    }
+
+    std::map<FlowKey, std::vector<uint32_t>> by_mask;
+    uint32_t num_buckets = 0;
+    for (uint32_t i = 0; i < rules_.size(); i++) {
+        by_mask[rules_[i].mask].push_back(i);
+        if (rules_[i].action == PacketFilter::RULE_ACTION_RATE_LIMIT) {
+            rate_bucket_of_[i] = num_buckets++;
+        }
+    }
+
+    /* Rates are in packets/s or bits/s, a bucket counts packets or bytes */
+    double ticks_per_second = static_cast<double>(tsc_hz ? tsc_hz : rte_get_tsc_hz()) *
+                              TICKS_PER_CYCLE;
+    rate_buckets_.reset(new RateBucket[num_buckets]);
+    for (uint32_t i = 0; i < rules_.size(); i++) {
+        if (rate_bucket_of_[i] == NO_RULE) {
+            continue;
+        }
+        const PacketFilter::RateLimit& limit = rules_[i].limit;
+        RateBucket& bucket = rate_buckets_[rate_bucket_of_[i]];
+        bucket.bytes = limit.unit == PacketFilter::RATE_BPS;
+        double units_per_second = bucket.bytes ? limit.rate / 8.0 : limit.rate;
+        bucket.ticks_per_unit = units_per_second > 0 ? ticks_per_second / units_per_second :
+                                                       std::numeric_limits<double>::infinity();
+        bucket.burst_ticks = std::isfinite(bucket.ticks_per_unit) ?
+                             static_cast<uint64_t>(limit.burst * bucket.ticks_per_unit) : 0;
+    }
+    for (const auto& group : by_mask) {
+        Subtable subtable;
+        subtable.mask = group.first;
+        subtable.max_priority = 0;
+        uint32_t buckets = 1;
+        while (buckets * BUCKET_ENTRIES < 2 * group.second.size()) {
+            buckets *= 2;
+        }
+        subtable.bucket_mask = buckets - 1;
+        subtable.buckets.assign(buckets, Bucket{});
+        for (uint32_t rule : group.second) {
+            const Rule& r = rules_[rule];
+            subtable.max_priority = std::max(subtable.max_priority, r.priority);
+            insert(subtable, Entry{r.match & r.mask, r.priority, rule});
+        }
+        subtables_.push_back(std::move(subtable));
+    }
+    std::sort(subtables_.begin(), subtables_.end(), [](const Subtable& a, const Subtable& b) {
+        return a.max_priority > b.max_priority;
+    });
+    log_info("Software filter: %zu rules in %zu tables", rules_.size(), subtables_.size());
+}
+
+uint64_t SoftwareFilter::hash_key(const FlowKey& key) {
+    uint64_t words[5];
+    memcpy(&words[0], key.src_ip.bytes, 16);
+    memcpy(&words[2], key.dst_ip.bytes, 16);
+    words[4] = key.src_port | (static_cast<uint64_t>(key.dst_port) << 16) |
+               (static_cast<uint64_t>(key.protocol) << 32);
+    uint64_t hash = 0x243F6A8885A308D3ULL;
+    for (uint64_t word : words) {
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+/* Linear probing over buckets; the tables are at most half full */
+void SoftwareFilter::insert(Subtable& subtable, const Entry& entry) {
+    uint64_t hash = hash_key(entry.key);
+    uint16_t tag = tag_of(hash);
+    for (uint32_t b = hash & subtable.bucket_mask;; b = (b + 1) & subtable.bucket_mask) {
+        Bucket& bucket = subtable.buckets[b];
+        for (uint32_t i = 0; i < BUCKET_ENTRIES; i++) {
+            if (bucket.tags[i] == EMPTY_TAG) {
+                bucket.tags[i] = tag;
+                bucket.entries[i] = static_cast<uint32_t>(subtable.entries.size());
+                subtable.entries.push_back(entry);
+                return;
+            }
+        }
+    }
+}
+
+uint32_t SoftwareFilter::lookup(const FlowKey& key) const {
+    uint32_t best = NO_RULE;
+    int best_priority = -1;
+    for (const Subtable& subtable : subtables_) {
+        if (subtable.max_priority <= best_priority) {
+            break;
+        }
+        FlowKey masked = key & subtable.mask;
+        uint64_t hash = hash_key(masked);
+        uint16_t tag = tag_of(hash);
+        for (uint32_t b = hash & subtable.bucket_mask;; b = (b + 1) & subtable.bucket_mask) {
+            const Bucket& bucket = subtable.buckets[b];
+            /* Bit 2i of match and empty stands for tag i */
+            uint32_t match = 0;
+            uint32_t empty = 0;
+#if defined(__SSE2__)
+            __m128i tags = _mm_load_si128(reinterpret_cast<const __m128i*>(bucket.tags));
+            match = _mm_movemask_epi8(_mm_cmpeq_epi16(tags, _mm_set1_epi16(tag))) & 0x5555;
+            empty = _mm_movemask_epi8(_mm_cmpeq_epi16(tags, _mm_setzero_si128())) & 0x5555;
+#else
+            for (uint32_t i = 0; i < BUCKET_ENTRIES; i++) {
+                match |= static_cast<uint32_t>(bucket.tags[i] == tag) << (2 * i);
+                empty |= static_cast<uint32_t>(bucket.tags[i] == EMPTY_TAG) << (2 * i);
+            }
+#endif
+            for (; match != 0; match &= match - 1) {
+                const Entry& entry = subtable.entries[bucket.entries[__builtin_ctz(match) / 2]];
+                if (entry.key == masked && entry.priority > best_priority) {
+                    best = entry.rule;
+                    best_priority = entry.priority;
+                }
+            }
+            /* A key is never stored past a bucket with room left */
+            if (empty != 0) {
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+bool SoftwareFilter::parse(const uint8_t* data, size_t data_len, FlowKey& key) {
+    auto field16 = [data, data_len](size_t byte) -> uint16_t {
+        uint16_t value = 0;
+        if (byte + 2 <= data_len) {
+            memcpy(&value, &data[byte], sizeof(value));
+        }
+        return value;
+    };
+
+    /* Up to two VLAN tags, as NetworkPacket::parse() */
+    size_t l3 = 14;
+    uint16_t eth_type = field16(12);
+    if (eth_type == __builtin_bswap16(0x8100) || eth_type == __builtin_bswap16(0x88A8)) {
+        eth_type = field16(16);
+        l3 = 18;
+        if (eth_type == __builtin_bswap16(0x8100)) {
+            eth_type = field16(20);
+            l3 = 22;
+        }
+    }
+
+    key = FlowKey{};
+    size_t l4;
+    if (eth_type == __builtin_bswap16(0x86DD) && l3 + 40 <= data_len) {
+        key.protocol = data[l3 + 6];
+        memcpy(key.src_ip.bytes, &data[l3 + 8], 16);
+        memcpy(key.dst_ip.bytes, &data[l3 + 24], 16);
+        l4 = l3 + 40;
+    } else if (eth_type == __builtin_bswap16(0x0800) && l3 + 20 <= data_len &&
+               (data[l3] & 0xF) >= 5) {
+        uint32_t src, dst;
+        memcpy(&src, &data[l3 + 12], sizeof(src));
+        memcpy(&dst, &data[l3 + 16], sizeof(dst));
+        key.protocol = data[l3 + 9];
+        key.src_ip = PacketFilter::IPAddress::from_ipv4(src);
+        key.dst_ip = PacketFilter::IPAddress::from_ipv4(dst);
+        l4 = l3 + 4 * (data[l3] & 0xF);
+    } else {
+        return false;
+    }
+    if (key.protocol == 17 || key.protocol == 6) {
+        key.src_port = field16(l4);
+        key.dst_port = field16(l4 + 2);
+    }
+    return true;
+}
+
+/* Virtual scheduling form of GCRA: the bucket is full again at full_at, and a packet
+ * that would push that past now plus the burst finds too few tokens */
+bool SoftwareFilter::conform(RateBucket& bucket, uint32_t frame_bytes, uint64_t now) {
+    double cost = bucket.ticks_per_unit * (bucket.bytes ? frame_bytes : 1);
+    if (!(cost <= bucket.burst_ticks)) {
+        return false;
+    }
+    uint64_t ticks = static_cast<uint64_t>(cost);
+    uint64_t full_at = bucket.full_at.load(std::memory_order_relaxed);
+    uint64_t next;
+    do {
+        next = std::max(full_at, now) + ticks;
+        if (next > now + bucket.burst_ticks) {
+            return false;
+        }
+    } while (!bucket.full_at.compare_exchange_weak(full_at, next, std::memory_order_relaxed));
+    return true;
+}
+
+uint16_t SoftwareFilter::filter_burst(uint16_t thread_id, rte_mbuf** bufs, uint16_t nb_rx,
+                                      bool metadata) {
+    uint64_t start = rte_rdtsc();
+    uint64_t now = (start - start_tsc_) * TICKS_PER_CYCLE;
+    ThreadState& thread = threads_[thread_id];
+    uint16_t nb_drop = DPDK::compact_burst(bufs, nb_rx, [this, &thread, metadata,
+                                                         now](rte_mbuf* mbuf) {
+        if (metadata && FilterMetadata::get(mbuf)->hit()) {
+            return false;
+        }
+        FlowKey key;
+        uint32_t rule = NO_RULE;
+        if (parse(rte_pktmbuf_mtod(mbuf, uint8_t*), rte_pktmbuf_data_len(mbuf), key)) {
+            rule = lookup(key);
+        }
+        if (rule == NO_RULE) {
+            return default_action_ == PacketFilter::RULE_ACTION_DROP;
+        }
+        std::atomic<uint64_t>& hits = thread.hits[rule];
+        hits.store(hits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        switch (rules_[rule].action) {
+            case PacketFilter::RULE_ACTION_DROP:
+                return true;
+            case PacketFilter::RULE_ACTION_RATE_LIMIT:
+                return !conform(rate_buckets_[rate_bucket_of_[rule]],
+                                rte_pktmbuf_pkt_len(mbuf), now);
+            default:
+                return false;
+        }
+    });
+
+    thread.stats.packets += nb_rx;
+    thread.stats.dropped += nb_drop;
+    thread.stats.cycles += rte_rdtsc() - start;
+    return nb_drop;
+}
+
+std::vector<uint64_t> SoftwareFilter::hits() const {
+    std::vector<uint64_t> total(rules_.size(), 0);
+    for (const auto& thread : threads_) {
+        for (size_t i = 0; i < rules_.size(); i++) {
+            total[i] += thread.hits[i].load(std::memory_order_relaxed);
+        }
+    }
+    return total;
+}
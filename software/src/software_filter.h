@@ -0,0 +1,121 @@
+#ifndef _SOFTWARE_FILTER_H_
+#define _SOFTWARE_FILTER_H_
+
+#include <rte_mbuf.h>
+
+#include "packet_filter.h"
+
+/* Host-side filter for the rules the filter core cannot hold (hybrid mode, see
+ * HybridFilter). Like the core, it groups rules by mask and looks a packet up in one
+ * table per mask (tuple space search), keeping the highest priority match. Each
+ * table is a bucketized hash of masked keys: a bucket is one cache line holding the
+ * 16-bit tags and entry indexes of BUCKET_ENTRIES keys, all tags are compared at
+ * once and only entries whose tag matches are read. Tables are visited by
+ * decreasing top priority and the search stops once no later table can win.
+ *
+ * The rule set is fixed when the filter is built, so rx lcores read it without
+ * locks. Each rx thread counts the hits of every rule and its own lookup cost.
+ * Rate limited rules share one token bucket among all rx threads, kept as the TSC
+ * time it is full again (GCRA) so a packet takes it with a single compare and swap. */
+class SoftwareFilter {
+public:
+    using FlowKey = PacketFilter::FlowKey;
+    using Rule = PacketFilter::Rule;
+    using RuleSet = PacketFilter::RuleSet;
+
+    static constexpr uint32_t NO_RULE = UINT32_MAX;
+
+    /* Lookup cost of one rx thread */
+    struct ThreadStats {
+        uint64_t packets;
+        uint64_t dropped;
+        uint64_t cycles;    /* TSC cycles spent in filter_burst() */
+    };
+
+private:
+    static constexpr uint32_t BUCKET_ENTRIES = 8;
+    static constexpr uint16_t EMPTY_TAG      = 0;
+
+    struct alignas(64) Bucket {
+        uint16_t tags[BUCKET_ENTRIES];
+        uint32_t entries[BUCKET_ENTRIES];
+    };
+
+    struct Entry {
+        FlowKey key;        /* masked match */
+        uint16_t priority;
+        uint32_t rule;      /* index in the rule set */
+    };
+
+    /* Rules of one mask, at most half the entries of its buckets */
+    struct Subtable {
+        FlowKey mask;
+        uint16_t max_priority;
+        uint32_t bucket_mask;
+        std::vector<Bucket> buckets;
+        std::vector<Entry> entries;
+    };
+
+    /* Token bucket of a rate limited rule in TICKS_PER_CYCLE units of the TSC since
+     * the filter was built. A packet costs ticks_per_unit per packet or byte and
+     * passes when the bucket is then full again within burst_ticks of now. */
+    static constexpr uint64_t TICKS_PER_CYCLE = 16;
+
+    struct alignas(64) RateBucket {
+        std::atomic<uint64_t> full_at{0};
+        double ticks_per_unit = 0;
+        uint64_t burst_ticks = 0;
+        bool bytes = false;
+    };
+
+    struct alignas(64) ThreadState {
+        ThreadStats stats = {0, 0, 0};
+        /* Written by the owning lcore only, read while it runs */
+        std::unique_ptr<std::atomic<uint64_t>[]> hits;
+    };
+
+    RuleSet rules_;
+    PacketFilter::RuleAction default_action_;
+    std::vector<Subtable> subtables_;
+    std::vector<ThreadState> threads_;
+    std::unique_ptr<RateBucket[]> rate_buckets_;
+    std::vector<uint32_t> rate_bucket_of_;  /* per rule, for rate limited rules */
+    uint64_t start_tsc_;
+
+    static uint64_t hash_key(const FlowKey& key);
+    static uint16_t tag_of(uint64_t hash) {
+        return static_cast<uint16_t>(hash >> 48) | 1;
+    }
+    void insert(Subtable& subtable, const Entry& entry);
+    static bool conform(RateBucket& bucket, uint32_t frame_bytes, uint64_t now);
+
+public:
+    /* Packets no rule matches take default_action. Rates are enforced against a TSC
+     * of tsc_hz, rte_get_tsc_hz() with 0. */
+    SoftwareFilter(const RuleSet& rules, PacketFilter::RuleAction default_action,
+                   uint16_t num_threads, uint64_t tsc_hz = 0);
+    ~SoftwareFilter() {}
+
+    /* Key of a frame as the core parses it, from its first data_len bytes. False
+     * for frames other than IPv4 and IPv6, which only the default action applies to. */
+    static bool parse(const uint8_t* data, size_t data_len, FlowKey& key);
+
+    /* Index of the highest priority rule matching key, or NO_RULE */
+    uint32_t lookup(const FlowKey& key) const;
+
+    /* Filter a burst the rx loop of thread thread_id received: the packets to drop
+     * are moved to the front and their count returned. Rate limited rules forward
+     * what their bucket allows, and steering rules keep packets on the queue they
+     * came in. With metadata, packets a rule of the core matched were decided by it
+     * and are forwarded as they are. */
+    uint16_t filter_burst(uint16_t thread_id, rte_mbuf** bufs, uint16_t nb_rx, bool metadata);
+
+    const RuleSet& rules() const { return rules_; }
+    size_t num_subtables() const { return subtables_.size(); }
+
+    /* Packets each rule matched so far, summed over all threads */
+    std::vector<uint64_t> hits() const;
+    ThreadStats thread_stats(uint16_t thread_id) const { return threads_[thread_id].stats; }
+};
+
+#endif // _SOFTWARE_FILTER_H_
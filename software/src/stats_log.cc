@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "deps.h"
+#include "stats_log.h"
+
+static uint64_t realtime_ns() {
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000ull + now.tv_nsec;
+}
+
+static void put_varint(std::vector<uint8_t>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value) | 0x80);
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+StatsLog::StatsLog(const std::string& path, uint16_t num_ports, uint32_t period_ms,
+                   uint64_t max_file_bytes, uint32_t max_files)
+    : path_(path), num_ports_(num_ports), period_ms_(period_ms),
+      max_file_bytes_(max_file_bytes), max_files_(std::max<uint32_t>(max_files, 1)) {
+}
+
+StatsLog::~StatsLog() {
+    if (fp_ != nullptr) {
+        fclose(fp_);
+    }
+}
+
+bool StatsLog::open() {
+    file_index_ = max_files_ - 1;
+    return open_next(realtime_ns());
+}
+
+bool StatsLog::open_next(uint64_t now_ns) {
+    if (fp_ != nullptr) {
+        fclose(fp_);
+        fp_ = nullptr;
+    }
+    file_index_ = (file_index_ + 1) % max_files_;
+    std::string name = path_ + "." + std::to_string(file_index_);
+    fp_ = fopen(name.c_str(), "wb");
+    if (fp_ == nullptr) {
+        log_error("Cannot open %s: %s", name.c_str(), strerror(errno));
+        return false;
+    }
+
+    FileHeader header = {MAGIC, VERSION, num_ports_, period_ms_, 0, now_ns};
+    if (fwrite(&header, sizeof(header), 1, fp_) != 1) {
+        log_error("Cannot write %s: %s", name.c_str(), strerror(errno));
+        fclose(fp_);
+        fp_ = nullptr;
+        return false;
+    }
+    file_bytes_ = sizeof(header);
+    last_ns_ = now_ns;
+    return true;
+}
+
+bool StatsLog::write(const StatsDelta& delta) {
+    if (fp_ == nullptr) {
+        return false;
+    }
+    std::vector<uint8_t> record;
+    auto encode = [this, &record, &delta]() {
+        record.clear();
+        put_varint(record, FIELDS + PORT_FIELDS * num_ports_);
+        put_varint(record, delta.time_ns > last_ns_ ? (delta.time_ns - last_ns_) / 1000 : 0);
+        for (uint64_t field : {delta.interval_us, delta.core_packets, delta.core_forwarded,
+                               delta.core_dropped, delta.core_bytes, delta.adapter_rx,
+                               delta.adapter_rx_dropped, delta.host_packets,
+                               delta.host_empty_polls, delta.host_busy_polls}) {
+            put_varint(record, field);
+        }
+        for (uint16_t i = 0; i < num_ports_; i++) {
+            StatsDelta::Port port = i < delta.ports.size() ? delta.ports[i] : StatsDelta::Port{};
+            for (uint64_t field : {port.ipackets, port.opackets, port.imissed, port.ierrors,
+                                   port.rx_nombuf}) {
+                put_varint(record, field);
+            }
+        }
+    };
+    encode();
+    if (file_bytes_ + record.size() > max_file_bytes_) {
+        if (!open_next(delta.time_ns)) {
+            return false;
+        }
+        encode();
+    }
+
+    /* Flushed per record, so the log can be followed while it is written */
+    if (fwrite(record.data(), 1, record.size(), fp_) != record.size() || fflush(fp_) != 0) {
+        log_error("Cannot write to %s.%u: %s", path_.c_str(), file_index_, strerror(errno));
+        return false;
+    }
+    file_bytes_ += record.size();
+    /* Times are kept to the microsecond the record stored */
+    last_ns_ += (delta.time_ns > last_ns_ ? (delta.time_ns - last_ns_) / 1000 : 0) * 1000;
+    records_++;
+    return true;
+}
+
+StatsLog::Reader::~Reader() {
+    if (fp_ != nullptr) {
+        fclose(fp_);
+    }
+}
+
+bool StatsLog::Reader::open(const std::string& file) {
+    fp_ = fopen(file.c_str(), "rb");
+    if (fp_ == nullptr) {
+        log_error("Cannot open %s: %s", file.c_str(), strerror(errno));
+        return false;
+    }
+    if (fread(&header_, sizeof(header_), 1, fp_) != 1 || header_.magic != MAGIC) {
+        log_error("%s is not a stats log", file.c_str());
+        return false;
+    }
+    if (header_.version != VERSION) {
+        log_error("%s has version %u, expected %u", file.c_str(), header_.version, VERSION);
+        return false;
+    }
+    last_ns_ = header_.start_ns;
+    return true;
+}
+
+bool StatsLog::Reader::read_varint(uint64_t& value) {
+    value = 0;
+    for (uint32_t shift = 0; shift < 64; shift += 7) {
+        int byte = fgetc(fp_);
+        if (byte == EOF) {
+            return false;
+        }
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool StatsLog::Reader::next(StatsDelta& delta) {
+    uint64_t count;
+    if (!read_varint(count) || count < FIELDS) {
+        return false;
+    }
+    std::vector<uint64_t> fields(count);
+    for (uint64_t& field : fields) {
+        if (!read_varint(field)) {
+            return false;
+        }
+    }
+
+    last_ns_ += fields[0] * 1000;
+    delta.time_ns = last_ns_;
+    delta.interval_us = fields[1];
+    delta.core_packets = fields[2];
+    delta.core_forwarded = fields[3];
+    delta.core_dropped = fields[4];
+    delta.core_bytes = fields[5];
+    delta.adapter_rx = fields[6];
+    delta.adapter_rx_dropped = fields[7];
+    delta.host_packets = fields[8];
+    delta.host_empty_polls = fields[9];
+    delta.host_busy_polls = fields[10];
+    delta.ports.clear();
+    for (size_t i = FIELDS; i + PORT_FIELDS <= count; i += PORT_FIELDS) {
+        delta.ports.push_back({fields[i], fields[i + 1], fields[i + 2], fields[i + 3],
+                               fields[i + 4]});
+    }
+    return true;
+}
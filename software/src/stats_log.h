@@ -0,0 +1,97 @@
+#ifndef _STATS_LOG_H_
+#define _STATS_LOG_H_
+
+/* How much the counters grew over one sampling interval */
+struct StatsDelta {
+    struct Port {
+        uint64_t ipackets;
+        uint64_t opackets;
+        uint64_t imissed;
+        uint64_t ierrors;
+        uint64_t rx_nombuf;
+    };
+
+    uint64_t time_ns;           /* CLOCK_REALTIME at the end of the interval */
+    uint64_t interval_us;
+    /* Filter core */
+    uint64_t core_packets;
+    uint64_t core_forwarded;
+    uint64_t core_dropped;
+    uint64_t core_bytes;
+    /* Packet adapter */
+    uint64_t adapter_rx;
+    uint64_t adapter_rx_dropped;
+    /* Summed over the rx lcores */
+    uint64_t host_packets;
+    uint64_t host_empty_polls;
+    uint64_t host_busy_polls;
+    std::vector<Port> ports;
+};
+
+/* Writes a StatsDelta per sample into a ring of binary files, <path>.0 to
+ * <path>.<max_files - 1>, starting the next file, over the oldest, once one reaches
+ * max_file_bytes (see PcapWriter). Each file starts with a FileHeader, followed by
+ * one record per sample: the number of fields, then the fields in the order of
+ * StatsDelta with the ports last, all as unsigned LEB128 varints. The time of a
+ * record is stored as microseconds since the previous one, or since start_ns of
+ * the header, so an idle sample of one port takes about 20 bytes. */
+class StatsLog {
+public:
+    static constexpr uint32_t MAGIC   = 0x53544650;     /* "PFTS" */
+    static constexpr uint16_t VERSION = 1;
+    static constexpr uint32_t FIELDS  = 11;             /* before the ports */
+    static constexpr uint32_t PORT_FIELDS = 5;
+
+    struct FileHeader {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t num_ports;
+        uint32_t period_ms;
+        uint32_t reserved;
+        uint64_t start_ns;      /* CLOCK_REALTIME when the file was started */
+    };
+
+private:
+    std::string path_;
+    uint16_t num_ports_;
+    uint32_t period_ms_;
+    uint64_t max_file_bytes_;
+    uint32_t max_files_;
+
+    FILE* fp_ = nullptr;
+    uint32_t file_index_ = 0;
+    uint64_t file_bytes_ = 0;
+    uint64_t last_ns_ = 0;
+    uint64_t records_ = 0;
+
+    bool open_next(uint64_t now_ns);
+
+public:
+    StatsLog(const std::string& path, uint16_t num_ports, uint32_t period_ms,
+             uint64_t max_file_bytes = 16 << 20, uint32_t max_files = 8);
+    ~StatsLog();
+
+    /* Creates the first file; false if it cannot be written */
+    bool open();
+    bool write(const StatsDelta& delta);
+    uint64_t records() const { return records_; }
+
+    /* Reads the records of one file of the ring */
+    class Reader {
+    private:
+        FILE* fp_ = nullptr;
+        FileHeader header_ = {};
+        uint64_t last_ns_ = 0;
+
+        bool read_varint(uint64_t& value);
+
+    public:
+        ~Reader();
+        bool open(const std::string& file);
+        const FileHeader& header() const { return header_; }
+        /* False at the end of the file or at a truncated record */
+        bool next(StatsDelta& delta);
+    };
+};
+
+#endif // _STATS_LOG_H_
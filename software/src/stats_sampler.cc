@@ -0,0 +1,180 @@
+#include <time.h>
+
+#include "deps.h"
+#include "stats_sampler.h"
+
+StatsSampler::StatsSampler(DPDK& dpdk, PacketFilter* filter, std::mutex& filter_mutex,
+                           uint32_t period_ms, StatsLog* log)
+    : dpdk_(dpdk), filter_(filter), filter_mutex_(filter_mutex), period_ms_(period_ms),
+      log_(log) {
+}
+
+StatsSampler::~StatsSampler() {
+    stop();
+}
+
+void StatsSampler::start() {
+    if (filter_ != nullptr) {
+        adapter_ = std::make_unique<PacketAdapter>();
+    }
+    take(last_);
+    last_logged_ = last_;
+    thread_ = std::thread(&StatsSampler::run, this);
+}
+
+void StatsSampler::stop() {
+    if (!thread_.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        cv_.notify_all();
+    }
+    thread_.join();
+    sample();
+    if (dropping_) {
+        log_warn("Rx drops went on until the end: %lu packets over the last %lu samples",
+                 dropped_, dropping_samples_);
+    }
+    log_info("Took %lu samples %u ms apart, %lu of them with rx drops", samples_, period_ms_,
+             drop_samples_);
+}
+
+void StatsSampler::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!cv_.wait_for(lock, std::chrono::milliseconds(period_ms_), [this] { return stop_; })) {
+        lock.unlock();
+        sample();
+        lock.lock();
+    }
+}
+
+void StatsSampler::take(Sample& sample) {
+    sample.time = std::chrono::steady_clock::now();
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    sample.realtime_ns = static_cast<uint64_t>(now.tv_sec) * 1000000000ull + now.tv_nsec;
+
+    if (filter_ != nullptr) {
+        std::lock_guard<std::mutex> lock(filter_mutex_);
+        sample.core = filter_->snapshot(sample.core_snap);
+        sample.adapter_snap = adapter_->snapshot();
+    }
+
+    sample.ports.resize(dpdk_.ports());
+    for (uint16_t port_id = 0; port_id < dpdk_.ports(); port_id++) {
+        if (rte_eth_stats_get(port_id, &sample.ports[port_id]) != 0) {
+            /* Counts as no change rather than a reset */
+            sample.ports[port_id] = port_id < last_.ports.size() ? last_.ports[port_id] :
+                                                                  rte_eth_stats{};
+        }
+    }
+
+    sample.host = RxLoopSnapshot();
+    for (uint16_t thread_id = 0; thread_id < dpdk_.threads(); thread_id++) {
+        dpdk_.read_rx_loop_stats(thread_id, sample.host);
+    }
+}
+
+StatsDelta StatsSampler::delta(const Sample& from, const Sample& to) const {
+    StatsDelta delta = {};
+    delta.time_ns = to.realtime_ns;
+    delta.interval_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        to.time - from.time).count();
+    if (from.core && to.core) {
+        delta.core_packets = to.core_snap.packets - from.core_snap.packets;
+        delta.core_forwarded = to.core_snap.forwarded - from.core_snap.forwarded;
+        delta.core_dropped = to.core_snap.dropped - from.core_snap.dropped;
+        delta.core_bytes = to.core_snap.bytes - from.core_snap.bytes;
+    }
+    if (filter_ != nullptr) {
+        delta.adapter_rx = to.adapter_snap.packets - from.adapter_snap.packets;
+        delta.adapter_rx_dropped = to.adapter_snap.dropped - from.adapter_snap.dropped;
+    }
+    RxLoopSnapshot host = to.host - from.host;
+    delta.host_packets = host.packets;
+    delta.host_empty_polls = host.empty_polls;
+    delta.host_busy_polls = host.busy_polls;
+    for (size_t i = 0; i < to.ports.size() && i < from.ports.size(); i++) {
+        const rte_eth_stats& a = from.ports[i];
+        const rte_eth_stats& b = to.ports[i];
+        delta.ports.push_back({b.ipackets - a.ipackets, b.opackets - a.opackets,
+                               b.imissed - a.imissed, b.ierrors - a.ierrors,
+                               b.rx_nombuf - a.rx_nombuf});
+    }
+    return delta;
+}
+
+void StatsSampler::log_rates(const Sample& from, const Sample& to) const {
+    if (from.core && to.core) {
+        StatsRate rate = StatsRate::between(from.core_snap, to.core_snap,
+                                            PacketFilter::CORE_CLOCK_HZ);
+        log_info("Filter: %.3f Mpps in (%.3f Mpps forwarded, %.3f Mpps dropped), "
+                 "%.3f Mphits/s, %.2f Gbps",
+                 rate.pps / 1e6, rate.forward_pps / 1e6, rate.drop_pps / 1e6,
+                 rate.phits_per_sec / 1e6, rate.gbps);
+    }
+    log_info("Host: %s", (to.host - from.host).format().c_str());
+}
+
+void StatsSampler::watch_drops(const StatsDelta& delta) {
+    uint64_t drops = delta.adapter_rx_dropped;
+    for (const StatsDelta::Port& port : delta.ports) {
+        drops += port.imissed + port.ierrors + port.rx_nombuf;
+    }
+
+    if (drops == 0) {
+        if (dropping_) {
+            log_info("Rx drops stopped: %lu packets over %lu samples", dropped_,
+                     dropping_samples_);
+            dropping_ = false;
+        }
+        return;
+    }
+    drop_samples_++;
+    if (!dropping_) {
+        double seconds = std::max<uint64_t>(delta.interval_us, 1) / 1e6;
+        std::string where;
+        char buf[128];
+        if (delta.adapter_rx_dropped > 0) {
+            snprintf(buf, sizeof(buf), ", adapter dropped %.0f/s",
+                     delta.adapter_rx_dropped / seconds);
+            where += buf;
+        }
+        for (size_t i = 0; i < delta.ports.size(); i++) {
+            const StatsDelta::Port& port = delta.ports[i];
+            if (port.imissed + port.ierrors + port.rx_nombuf == 0) {
+                continue;
+            }
+            snprintf(buf, sizeof(buf), ", port %zu missed %.0f/s, errors %.0f/s, no mbuf %.0f/s",
+                     i, port.imissed / seconds, port.ierrors / seconds, port.rx_nombuf / seconds);
+            where += buf;
+        }
+        log_warn("Rx drops started%s", where.c_str());
+        dropping_ = true;
+        dropped_ = 0;
+        dropping_samples_ = 0;
+    }
+    dropped_ += drops;
+    dropping_samples_++;
+}
+
+void StatsSampler::sample() {
+    Sample now;
+    take(now);
+    StatsDelta d = delta(last_, now);
+    watch_drops(d);
+    if (log_ != nullptr && !log_->write(d)) {
+        log_warn("Stopped writing the stats log");
+        log_ = nullptr;
+    }
+
+    samples_++;
+    uint32_t log_every = std::max<uint32_t>(1, LOG_PERIOD_MS / period_ms_);
+    if (samples_ % log_every == 0) {
+        log_rates(last_logged_, now);
+        last_logged_ = now;
+    }
+    last_ = std::move(now);
+}
@@ -0,0 +1,69 @@
+#ifndef _STATS_SAMPLER_H_
+#define _STATS_SAMPLER_H_
+
+#include "dpdk.h"
+#include "packet_filter.h"
+#include "stats_log.h"
+
+/* Samples the filter core, the packet adapter, the ports and the rx loops every
+ * period from a thread of its own, for as long as the server runs. Rates are logged
+ * once per sample, or once per LOG_PERIOD_MS over several samples when sampling
+ * faster. Each sample is compared with the last one: packets the ports missed or
+ * could not get an mbuf for, rx errors and packets the adapter dropped are warned
+ * about when they start and when they stop, and every delta goes to the StatsLog,
+ * if any. */
+class StatsSampler {
+public:
+    static constexpr uint32_t LOG_PERIOD_MS = 1000;
+
+private:
+    struct Sample {
+        std::chrono::steady_clock::time_point time;
+        uint64_t realtime_ns = 0;
+        bool core = false;
+        StatsSnapshot core_snap = {};
+        StatsSnapshot adapter_snap = {};
+        std::vector<rte_eth_stats> ports;
+        RxLoopSnapshot host;
+    };
+
+    DPDK& dpdk_;
+    PacketFilter* filter_;
+    std::mutex& filter_mutex_;
+    uint32_t period_ms_;
+    StatsLog* log_;
+    std::unique_ptr<PacketAdapter> adapter_;
+
+    Sample last_;
+    Sample last_logged_;
+    uint64_t samples_ = 0;
+    /* Rx drops of the current run of intervals with drops */
+    bool dropping_ = false;
+    uint64_t dropping_samples_ = 0;
+    uint64_t dropped_ = 0;
+    uint64_t drop_samples_ = 0;
+
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+
+    void take(Sample& sample);
+    StatsDelta delta(const Sample& from, const Sample& to) const;
+    void log_rates(const Sample& from, const Sample& to) const;
+    void watch_drops(const StatsDelta& delta);
+    void sample();
+    void run();
+
+public:
+    /* Without a filter, only the ports and the rx loops are sampled */
+    StatsSampler(DPDK& dpdk, PacketFilter* filter, std::mutex& filter_mutex,
+                 uint32_t period_ms, StatsLog* log = nullptr);
+    ~StatsSampler();
+
+    void start();
+    /* Takes a last sample, so stopping after the rx loops covers all they received */
+    void stop();
+};
+
+#endif // _STATS_SAMPLER_H_
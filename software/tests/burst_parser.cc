@@ -0,0 +1,173 @@
+#include <sys/mman.h>
+#include <random>
+
+#include "deps.h"
+#include "burst_parser.h"
+#include "frames.h"
+
+/* BurstParser against a packet by packet reference parse, on bursts of every size
+ * mixing well-formed UDP frames with other ethertypes, VLAN tags, IP options, bad
+ * versions and IHLs, TCP, and datagram or frame lengths that do not fit. Each frame
+ * ends where a guard page starts, so reading past it faults. */
+
+static constexpr size_t PAGE_BYTES = 4096;
+static constexpr size_t MAX_FRAME  = 200;
+
+/* One frame per page, followed by a page that cannot be read */
+struct GuardedFrames {
+    std::vector<uint8_t*> pages;
+    std::vector<rte_mbuf> storage;
+    std::vector<rte_mbuf*> mbufs;
+
+    explicit GuardedFrames(size_t count) : storage(count), mbufs(count) {
+        for (size_t i = 0; i < count; i++) {
+            void* page = mmap(nullptr, 2 * PAGE_BYTES, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            log_assert(page != MAP_FAILED, "mmap failed: %s", strerror(errno));
+            log_assert(mprotect(static_cast<uint8_t*>(page) + PAGE_BYTES, PAGE_BYTES,
+                                PROT_NONE) == 0, "mprotect failed: %s", strerror(errno));
+            pages.push_back(static_cast<uint8_t*>(page));
+            mbufs[i] = &storage[i];
+        }
+    }
+    ~GuardedFrames() {
+        for (uint8_t* page : pages) {
+            munmap(page, 2 * PAGE_BYTES);
+        }
+    }
+
+    /* A frame of a random kind, most of them well-formed UDP */
+    void fill(size_t i, std::mt19937& rng) {
+        uint8_t frame[MAX_FRAME] = {};
+        uint32_t kind = rng() % 10;
+        frame[12] = kind == 0 ? 0x86 : kind == 1 ? 0x81 : 0x08;
+        frame[13] = kind == 0 ? 0xDD : 0x00;
+        uint8_t ihl = 5 + (rng() % 4 == 0 ? rng() % 11 : 0);
+        if (kind == 2) {
+            ihl = rng() % 5;
+        }
+        frame[14] = static_cast<uint8_t>((kind == 3 ? 6 : 4) << 4 | ihl);
+        frame[23] = kind == 4 ? IPPROTO_TCP : IPPROTO_UDP;
+        for (uint32_t b = 26; b < 34; b++) {
+            frame[b] = static_cast<uint8_t>(rng());
+        }
+
+        uint32_t l4 = 14 + 4 * ihl;
+        uint32_t payload = rng() % 100;
+        uint16_t dgram_len = static_cast<uint16_t>(8 + payload);
+        if (kind == 5) {
+            dgram_len = rng() % 8;
+        } else if (kind == 6) {
+            dgram_len += 1 + rng() % 20;
+        }
+        for (uint32_t b = l4; b < l4 + 4; b++) {
+            frame[b] = static_cast<uint8_t>(rng());
+        }
+        frame[l4 + 4] = static_cast<uint8_t>(dgram_len >> 8);
+        frame[l4 + 5] = static_cast<uint8_t>(dgram_len);
+
+        uint32_t len = std::min<uint32_t>(kind == 7 ? rng() % (l4 + 8) : l4 + 8 + payload,
+                                          MAX_FRAME);
+        uint8_t* data = pages[i] + PAGE_BYTES - len;
+        memcpy(data, frame, len);
+        storage[i].buf_addr = data;
+        storage[i].data_off = 0;
+        storage[i].data_len = static_cast<uint16_t>(len);
+        storage[i].pkt_len = len;
+    }
+};
+
+/* Packet i of a burst as ParsedBurst documents it, read byte by byte */
+static void reference(const rte_mbuf& mbuf, uint32_t i, ParsedBurst& burst) {
+    const uint8_t* data = static_cast<const uint8_t*>(mbuf.buf_addr) + mbuf.data_off;
+    auto be16 = [data](uint32_t byte) -> uint32_t { return data[byte] << 8 | data[byte + 1]; };
+    auto be32 = [be16](uint32_t byte) -> uint32_t { return be16(byte) << 16 | be16(byte + 2); };
+    /* The Ethernet header and a minimal IPv4 header must be in the first segment */
+    if (mbuf.data_len < 34 || be16(12) != 0x0800 || data[23] != IPPROTO_UDP) {
+        return;
+    }
+    uint32_t l4 = 14 + 4 * (data[14] & 0xF);
+    if ((data[14] >> 4) != 4 || (data[14] & 0xF) < 5 || l4 + 8 > mbuf.data_len ||
+        be16(l4 + 4) < 8 || l4 + be16(l4 + 4) > mbuf.pkt_len) {
+        burst.malformed |= 1u << i;
+        return;
+    }
+    burst.udp |= 1u << i;
+    burst.src_ip[i] = be32(26);
+    burst.dst_ip[i] = be32(30);
+    burst.src_port[i] = static_cast<uint16_t>(be16(l4));
+    burst.dst_port[i] = static_cast<uint16_t>(be16(l4 + 2));
+    burst.payload_offset[i] = static_cast<uint16_t>(l4 + 8);
+    burst.payload_len[i] = static_cast<uint16_t>(be16(l4 + 4) - 8);
+}
+
+static bool same(const ParsedBurst& a, const ParsedBurst& b) {
+    if (a.count != b.count || a.udp != b.udp || a.malformed != b.malformed) {
+        return false;
+    }
+    for (uint32_t udp = a.udp; udp != 0; udp &= udp - 1) {
+        int i = __builtin_ctz(udp);
+        if (a.src_ip[i] != b.src_ip[i] || a.dst_ip[i] != b.dst_ip[i] ||
+            a.src_port[i] != b.src_port[i] || a.dst_port[i] != b.dst_port[i] ||
+            a.payload_offset[i] != b.payload_offset[i] ||
+            a.payload_len[i] != b.payload_len[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void test_random() {
+    const size_t num_frames = 4096;
+    GuardedFrames frames(num_frames);
+    std::mt19937 rng(22);
+    uint64_t udp = 0;
+    uint64_t malformed = 0;
+    for (uint32_t round = 0; round < 20; round++) {
+        for (size_t i = 0; i < num_frames; i++) {
+            frames.fill(i, rng);
+        }
+        for (size_t first = 0; first < num_frames;) {
+            uint16_t nb_pkts = static_cast<uint16_t>(std::min<size_t>(
+                1 + rng() % ParsedBurst::MAX_PACKETS, num_frames - first));
+            ParsedBurst expected = {};
+            expected.count = nb_pkts;
+            for (uint16_t i = 0; i < nb_pkts; i++) {
+                reference(frames.storage[first + i], i, expected);
+            }
+            udp += __builtin_popcount(expected.udp);
+            malformed += __builtin_popcount(expected.malformed);
+
+            ParsedBurst burst;
+            BurstParser::parse(&frames.mbufs[first], nb_pkts, burst);
+            log_assert(same(burst, expected), "Parse differs from the reference on frames %zu "
+                       "to %zu", first, first + nb_pkts);
+            first += nb_pkts;
+        }
+    }
+    log_assert(udp > 0 && malformed > 0, "Frames of some kind are missing");
+}
+
+/* The columns of a frame built from a known key */
+static void test_fields() {
+    std::vector<uint8_t> frame = ipv4_frame(udp_key(0x0a640001, 1234, 0xc0a80102, 53), 100);
+    rte_mbuf mbuf = {};
+    mbuf.buf_addr = frame.data();
+    mbuf.data_len = static_cast<uint16_t>(frame.size());
+    mbuf.pkt_len = static_cast<uint32_t>(frame.size());
+    rte_mbuf* bufs[1] = {&mbuf};
+    ParsedBurst burst;
+    BurstParser::parse(bufs, 1, burst);
+    log_assert(burst.count == 1 && burst.udp == 1 && burst.malformed == 0, "Frame not UDP");
+    log_assert(burst.src_ip[0] == 0x0a640001 && burst.dst_ip[0] == 0xc0a80102 &&
+               burst.src_port[0] == 1234 && burst.dst_port[0] == 53, "Wrong addresses or ports");
+    log_assert(burst.payload_offset[0] == 42 && burst.payload_len[0] == 58,
+               "Payload of %u bytes at %u", burst.payload_len[0], burst.payload_offset[0]);
+}
+
+int main() {
+    test_fields();
+    test_random();
+    log_info("Burst parser tests passed");
+    return 0;
+}
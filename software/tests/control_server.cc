@@ -0,0 +1,141 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "deps.h"
+#include "packet_filter.h"
+#include "packet_filter_model.h"
+#include "mmio_backend.h"
+#include "control_server.h"
+#include "frames.h"
+
+/* Load test of the control server against the software model of the core: one
+ * client sends CHANGE_RATE rule changes per second, adds of new rules and deletes of
+ * older ones, and every change must be acknowledged at that rate, within a bounded
+ * apply latency, leaving the core with exactly the rules that should be live. */
+
+static constexpr uint32_t CHANGE_RATE  = 10000;   /* changes per second */
+static constexpr uint32_t SECONDS      = 2;
+static constexpr uint32_t BATCH        = 10;      /* changes sent together */
+static constexpr uint32_t LIVE_RULES   = 1000;    /* rules added before deletes start */
+static constexpr double MAX_LATENCY_US = 50000;
+
+static int connect_to(const std::string& path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    log_assert(fd >= 0, "socket failed: %s", strerror(errno));
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path.c_str());
+    log_assert(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0,
+               "connect to %s failed: %s", path.c_str(), strerror(errno));
+    return fd;
+}
+
+/* Rule k of the test, forward_rule() to 10.0.0.0 + k, port 1000 + k % 50000 */
+static uint16_t port_of(uint32_t k) {
+    return static_cast<uint16_t>(1000 + k % 50000);
+}
+static std::string rule_of(uint32_t k) {
+    char rule[64];
+    snprintf(rule, sizeof(rule), "10.%u.%u.%u:%u", (k >> 16) & 0xff, (k >> 8) & 0xff, k & 0xff,
+             port_of(k));
+    return rule;
+}
+
+static void test_load() {
+    /* Not a line per commit */
+    Log::set_log_level(Log::WARN);
+    auto backend = std::make_shared<SimBackend>();
+    MMIO::set_backend(backend);
+    PacketFilterModel& model = backend->filter_model();
+    PacketFilter filter;
+    std::mutex filter_mutex;
+
+    std::string path = "/tmp/test_control_server_" + std::to_string(getpid()) + ".sock";
+    ControlServer server(filter, filter_mutex, path);
+    log_assert(server.start(), "Control server did not start");
+    int fd = connect_to(path);
+
+    /* Replies are read as they come, so the server never blocks on a full socket */
+    const uint32_t changes = CHANGE_RATE * SECONDS;
+    uint32_t replies = 0, errors = 0;
+    std::vector<double> latencies;
+    std::thread reader([&] {
+        std::string in;
+        char buf[65536];
+        while (replies < changes) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) {
+                break;
+            }
+            in.append(buf, n);
+            size_t end;
+            while ((end = in.find('\n')) != std::string::npos) {
+                std::string line = in.substr(0, end);
+                in.erase(0, end + 1);
+                if (line.compare(0, 3, "ok ") == 0) {
+                    latencies.push_back(atof(line.c_str() + 3));
+                } else {
+                    log_error("Change %u failed: %s", replies, line.c_str());
+                    errors++;
+                }
+                replies++;
+            }
+        }
+    });
+
+    /* Change 2k adds rule k and change 2k + 1 deletes rule k - LIVE_RULES, or changes
+     * the action of rule k while there are fewer than LIVE_RULES */
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < changes; i += BATCH) {
+        std::string batch;
+        for (uint32_t j = i; j < i + BATCH; j++) {
+            uint32_t k = j / 2;
+            if (j % 2 == 0) {
+                batch += "add " + rule_of(k) + (k % 3 ? " forward\n" : " steer=rss\n");
+            } else if (k >= LIVE_RULES) {
+                batch += "del " + rule_of(k - LIVE_RULES) + "\n";
+            } else {
+                batch += "replace " + rule_of(k) + " forward\n";
+            }
+        }
+        ssize_t sent = send(fd, batch.data(), batch.size(), 0);
+        log_assert(sent == static_cast<ssize_t>(batch.size()), "send failed: %s", strerror(errno));
+        std::this_thread::sleep_until(start + std::chrono::microseconds(
+                                                  (i + BATCH) * 1000000ull / CHANGE_RATE));
+    }
+    reader.join();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    close(fd);
+    server.stop();
+    Log::set_log_level(Log::INFO);
+
+    log_assert(replies == changes && errors == 0, "%u of %u changes acknowledged, %u failed",
+               replies, changes, errors);
+    double rate = changes / secs;
+    log_assert(rate >= 0.95 * CHANGE_RATE, "Only %.0f changes/s applied", rate);
+    std::sort(latencies.begin(), latencies.end());
+    double p99 = latencies[latencies.size() * 99 / 100];
+    log_info("%.0f changes/s, apply latency p50 %.0f us, p99 %.0f us, max %.0f us", rate,
+             latencies[latencies.size() / 2], p99, latencies.back());
+    log_assert(latencies.back() <= MAX_LATENCY_US, "Apply latency up to %.0f us",
+               latencies.back());
+
+    /* The last LIVE_RULES rules and no older ones are in the core */
+    const uint32_t added = changes / 2;
+    log_assert(filter.rules().size() == LIVE_RULES, "%lu rules live instead of %u",
+               filter.rules().size(), LIVE_RULES);
+    for (uint32_t k = added - LIVE_RULES; k < added; k++) {
+        log_assert(forwarded(model, 0x0a000000 + k, port_of(k)), "Rule %u not applied", k);
+    }
+    for (uint32_t k = 0; k < added - LIVE_RULES; k += 7) {
+        log_assert(!forwarded(model, 0x0a000000 + k, port_of(k)), "Deleted rule %u still applied",
+                   k);
+    }
+}
+
+int main() {
+    test_load();
+    log_info("Control server tests passed");
+    return 0;
+}
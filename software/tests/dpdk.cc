@@ -0,0 +1,111 @@
+#include <rte_ring.h>
+
+#include "deps.h"
+#include "dpdk.h"
+
+/* DPDK::compact_burst() against std::stable_partition on every split of a full
+ * burst, with mbufs that only need distinct addresses, and the drain of the rx loop
+ * on a net_ring port: packets still queued when shutdown is triggered are handled. */
+
+/* A software port whose ring the test enqueues to, without hugepages or root */
+static constexpr const char* DRAIN_CONFIG =
+    "test_dpdk --no-pci --no-huge -m 512 --in-memory -l 0 --vdev=net_ring0";
+static constexpr uint32_t DRAIN_PACKETS = 1000;
+
+static void test_compact_burst() {
+    const uint16_t burst = 32;
+    std::vector<rte_mbuf> storage(burst);
+    for (uint32_t pattern = 0; pattern < (1u << 16); pattern++) {
+        /* Low bits cover every split of short bursts, high bits those of long ones */
+        uint32_t release_mask = pattern | (pattern * 0x9E3779B1u & 0xFFFF0000u);
+        uint16_t nb_pkts = static_cast<uint16_t>(pattern % (burst + 1));
+
+        rte_mbuf* mbufs[burst];
+        rte_mbuf* expected[burst];
+        for (uint16_t i = 0; i < nb_pkts; i++) {
+            mbufs[i] = expected[i] = &storage[i];
+        }
+        auto release = [&storage, release_mask](rte_mbuf* mbuf) {
+            return (release_mask >> (mbuf - storage.data())) & 1;
+        };
+
+        std::vector<rte_mbuf*> seen;
+        uint16_t nb_release = DPDK::compact_burst(mbufs, nb_pkts, [&](rte_mbuf* mbuf) {
+            seen.push_back(mbuf);
+            return release(mbuf);
+        });
+        auto end = std::stable_partition(expected, expected + nb_pkts, release);
+
+        log_assert(nb_release == end - expected, "Released %u instead of %ld mbufs",
+                   nb_release, end - expected);
+        log_assert(std::equal(mbufs, mbufs + nb_pkts, expected),
+                   "Mbufs out of order for mask %08x", release_mask);
+        log_assert(std::equal(seen.begin(), seen.end(), storage.begin(),
+                              [](rte_mbuf* a, const rte_mbuf& b) { return a == &b; }),
+                   "Mbufs not decided in order");
+    }
+}
+
+static void test_drain() {
+    std::string config(DRAIN_CONFIG);
+    DPDK dpdk(config.data(), 1);
+    log_assert(dpdk.ports() == 1 && dpdk.threads() == 1, "Expected one port and one thread");
+
+    char name[RTE_ETH_NAME_MAX_LEN];
+    log_assert(rte_eth_dev_get_name_by_port(0, name) == 0, "Cannot get the port name");
+    std::string ring_name = std::string("ETH_RXTX0_") + name;
+    rte_ring* ring = rte_ring_lookup(ring_name.c_str());
+    log_assert(ring != nullptr, "No ring %s", ring_name.c_str());
+    rte_mempool* pool = rte_pktmbuf_pool_create("drain_pool", 2047, 0, 0,
+                                                RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
+    log_assert(pool != nullptr, "Cannot create the mbuf pool: %s", rte_strerror(rte_errno));
+
+    /* Frames numbered in their first 4 bytes, all queued before the loop starts */
+    for (uint32_t i = 0; i < DRAIN_PACKETS; i++) {
+        rte_mbuf* mbuf = rte_pktmbuf_alloc(pool);
+        log_assert(mbuf != nullptr, "Mbuf pool ran out at packet %u", i);
+        char* data = rte_pktmbuf_append(mbuf, 64);
+        memset(data, 0, 64);
+        memcpy(data, &i, sizeof(i));
+        log_assert(rte_ring_sp_enqueue_burst(ring, reinterpret_cast<void**>(&mbuf), 1,
+                                             nullptr) == 1, "Ring full at packet %u", i);
+    }
+
+    /* The first burst is held until shutdown was triggered, so the rest of the
+     * packets are still queued when the loop learns it should stop */
+    std::atomic<bool> triggered{false};
+    uint32_t handled = 0;
+    bool in_order = true;
+    dpdk.register_handler(0, [&triggered, &handled, &in_order](uint16_t, rte_mbuf** bufs,
+                                                               uint16_t nb_rx) {
+        while (!triggered.load(std::memory_order_acquire)) {
+            rte_pause();
+        }
+        for (uint16_t i = 0; i < nb_rx; i++) {
+            uint32_t seq;
+            memcpy(&seq, rte_pktmbuf_mtod(bufs[i], uint8_t*), sizeof(seq));
+            in_order &= seq == handled++;
+        }
+        return nb_rx;
+    });
+    dpdk.trigger_shutdown();
+    triggered.store(true, std::memory_order_release);
+    dpdk.stop();
+
+    RxLoopSnapshot stats;
+    dpdk.read_rx_loop_stats(0, stats);
+    log_assert(handled == DRAIN_PACKETS && stats.packets == DRAIN_PACKETS,
+               "%u of %u queued packets handled, %lu counted by the loop", handled,
+               DRAIN_PACKETS, stats.packets);
+    log_assert(in_order, "Packets handled out of order");
+    log_assert(rte_ring_count(ring) == 0, "%u packets left on the ring", rte_ring_count(ring));
+    log_assert(rte_mempool_full(pool), "Mbufs were not all freed");
+    rte_mempool_free(pool);
+}
+
+int main() {
+    test_compact_burst();
+    test_drain();
+    log_info("DPDK tests passed");
+    return 0;
+}
@@ -0,0 +1,61 @@
+#ifndef _FRAMES_H_
+#define _FRAMES_H_
+
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_udp.h>
+
+#include "packet_filter.h"
+#include "packet_filter_model.h"
+
+/* Ethernet frame of len bytes carrying an IPv4 packet with the 5-tuple of an IPv4
+ * key, the ports in the first four bytes after the IP header, for the tests and
+ * benchmarks that feed the filter model or the host parsers */
+inline std::vector<uint8_t> ipv4_frame(const PacketFilter::FlowKey& key, size_t len = 64) {
+    std::vector<uint8_t> frame(len, 0);
+    auto* eth_hdr = reinterpret_cast<rte_ether_hdr*>(frame.data());
+    eth_hdr->ether_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4);
+
+    auto* ip_hdr = reinterpret_cast<rte_ipv4_hdr*>(eth_hdr + 1);
+    ip_hdr->version_ihl = 0x45;
+    ip_hdr->total_length = rte_cpu_to_be_16(static_cast<uint16_t>(len - sizeof(rte_ether_hdr)));
+    ip_hdr->time_to_live = 64;
+    ip_hdr->next_proto_id = key.protocol;
+    ip_hdr->src_addr = key.src_ip.ipv4();
+    ip_hdr->dst_addr = key.dst_ip.ipv4();
+
+    auto* udp_hdr = reinterpret_cast<rte_udp_hdr*>(ip_hdr + 1);
+    udp_hdr->src_port = key.src_port;
+    udp_hdr->dst_port = key.dst_port;
+    udp_hdr->dgram_len = rte_cpu_to_be_16(static_cast<uint16_t>(
+        len - sizeof(rte_ether_hdr) - sizeof(rte_ipv4_hdr)));
+    return frame;
+}
+
+/* UDP key from host order addresses and ports */
+inline PacketFilter::FlowKey udp_key(uint32_t src_ip, uint16_t src_port, uint32_t dst_ip,
+                                     uint16_t dst_port) {
+    PacketFilter::FlowKey key = {};
+    key.src_ip = PacketFilter::IPAddress::from_ipv4(rte_cpu_to_be_32(src_ip));
+    key.dst_ip = PacketFilter::IPAddress::from_ipv4(rte_cpu_to_be_32(dst_ip));
+    key.src_port = rte_cpu_to_be_16(src_port);
+    key.dst_port = rte_cpu_to_be_16(dst_port);
+    key.protocol = IPPROTO_UDP;
+    return key;
+}
+
+/* UDP rule forwarding to dst_ip:dst_port, given in host order */
+inline PacketFilter::Rule forward_rule(uint32_t dst_ip, uint16_t dst_port) {
+    char rule[32];
+    snprintf(rule, sizeof(rule), "%u.%u.%u.%u:%u", dst_ip >> 24, (dst_ip >> 16) & 0xff,
+             (dst_ip >> 8) & 0xff, dst_ip & 0xff, dst_port);
+    return PacketFilter::parse_rule(rule, PacketFilter::RULE_ACTION_FORWARD);
+}
+
+/* Whether the model forwards a UDP frame from 10.100.0.1:1234 to dst_ip:dst_port */
+inline bool forwarded(PacketFilterModel& model, uint32_t dst_ip, uint16_t dst_port) {
+    std::vector<uint8_t> frame = ipv4_frame(udp_key(0x0a640001, 1234, dst_ip, dst_port));
+    return model.classify(frame.data(), frame.size(), frame.size()).forward;
+}
+
+#endif // _FRAMES_H_
@@ -0,0 +1,119 @@
+#include <unistd.h>
+
+#include "deps.h"
+
+/* Asynchronous logging: string arguments that do not fit a record are cut short
+ * without running past it, and a producer whose ring is full drops messages and
+ * counts them instead of waiting for the consumer. */
+
+static std::vector<std::string> read_lines(FILE* fp) {
+    std::vector<std::string> lines;
+    char line[4096];
+    rewind(fp);
+    while (fgets(line, sizeof(line), fp) != nullptr) {
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+/* Text after the level, location and time of a line */
+static std::string message_of(const std::string& line) {
+    size_t start = line.find(" | ");
+    log_assert(start != std::string::npos, "Not a log line: %s", line.c_str());
+    return line.substr(start + 3, line.size() - start - 4);
+}
+
+static void test_long_strings() {
+    FILE* fp = tmpfile();
+    log_assert(fp != nullptr, "Cannot create a temporary file");
+    Log::set_log_file(fp);
+    Log::start_async();
+
+    std::string a(300, 'a');
+    std::string b(300, 'b');
+    log_info("%s|%s", a.c_str(), b.c_str());
+    log_info("%d|%s|%s|%s", 7, "x", a.c_str(), b.c_str());
+    log_info("%s|%s", "short", b.c_str());
+
+    Log::stop_async();
+    Log::set_log_file(stdout);
+    std::vector<std::string> lines = read_lines(fp);
+    fclose(fp);
+
+    log_assert(lines.size() == 3, "Expected 3 lines, got %zu", lines.size());
+    /* The first string leaves a terminator for the second, which comes out empty */
+    size_t payload = 256 - 40;
+    log_assert(message_of(lines[0]) == std::string(payload - 2, 'a') + "|",
+               "Unexpected message: %s", lines[0].c_str());
+    log_assert(message_of(lines[1]) == "7|x|" + std::string(payload - 4 - 2 - 2, 'a') + "|",
+               "Unexpected message: %s", lines[1].c_str());
+    log_assert(message_of(lines[2]) == "short|" + std::string(payload - 6 - 1, 'b'),
+               "Unexpected message: %s", lines[2].c_str());
+}
+
+static void test_full_ring() {
+    /* The consumer blocks writing to a pipe nobody reads yet, so the ring fills up */
+    int fds[2];
+    log_assert(pipe(fds) == 0, "Cannot create a pipe: %s", strerror(errno));
+    FILE* out = fdopen(fds[1], "w");
+    Log::set_log_file(out);
+    Log::start_async();
+
+    const uint32_t messages = 100000;
+    uint64_t max_cycles = 0;
+    for (uint32_t i = 0; i < messages; i++) {
+        uint64_t start = __rdtsc();
+        log_info("message %u", i);
+        max_cycles = std::max<uint64_t>(max_cycles, __rdtsc() - start);
+    }
+
+    /* Every message was pushed or dropped while the consumer was stuck */
+    std::string output;
+    std::thread reader([&output, fd = fds[0]]() {
+        char buf[65536];
+        ssize_t len;
+        while ((len = read(fd, buf, sizeof(buf))) > 0) {
+            output.append(buf, len);
+        }
+    });
+    Log::stop_async();
+    Log::set_log_file(stdout);
+    fclose(out);
+    reader.join();
+    close(fds[0]);
+
+    uint64_t written = 0;
+    uint64_t dropped = 0;
+    uint64_t next = 0;
+    size_t start = 0;
+    while (start < output.size()) {
+        size_t end = output.find('\n', start);
+        log_assert(end != std::string::npos, "Truncated log line");
+        std::string message = message_of(output.substr(start, end - start + 1));
+        unsigned long value;
+        if (sscanf(message.c_str(), "message %lu", &value) == 1) {
+            log_assert(value >= next, "Message %lu out of order", value);
+            next = value + 1;
+            written++;
+        } else if (sscanf(message.c_str(), "async log ring %*u dropped %lu messages",
+                          &value) == 1) {
+            dropped += value;
+        } else {
+            log_fatal("Unexpected message: %s", message.c_str());
+        }
+        start = end + 1;
+    }
+
+    log_info("Full ring: %lu of %u messages written, %lu dropped, longest call %lu cycles",
+             written, messages, dropped, max_cycles);
+    log_assert(written + dropped == messages, "%lu written and %lu dropped of %u messages",
+               written, dropped, messages);
+    log_assert(dropped > 0, "No message was dropped");
+}
+
+int main() {
+    test_long_strings();
+    test_full_ring();
+    log_info("Logging tests passed");
+    return 0;
+}
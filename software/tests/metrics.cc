@@ -0,0 +1,111 @@
+#include <unistd.h>
+
+#include "deps.h"
+#include "metrics.h"
+
+/* The sequence locks of MetricsSegment under contention: a writer thread publishes
+ * every block as fast as it can, each word of a block holding the same value, while
+ * the reader loop copies them through a mapping of its own, as another process
+ * would. Every copy must be internally consistent (no torn reads), and the values
+ * of a block must never go backwards. */
+
+static constexpr uint16_t NUM_PORTS   = 2;
+static constexpr uint16_t NUM_THREADS = 4;
+static constexpr uint32_t RUN_MS      = 1000;
+
+template<typename T>
+static void fill(T& metrics, uint64_t value) {
+    uint64_t* words = reinterpret_cast<uint64_t*>(&metrics);
+    for (size_t i = 0; i < sizeof(T) / 8; i++) {
+        words[i] = value;
+    }
+}
+
+/* Reads the copy of a block: its value, and whether every word holds it */
+template<typename T>
+static bool uniform(const T& metrics, uint64_t& value) {
+    const uint64_t* words = reinterpret_cast<const uint64_t*>(&metrics);
+    value = words[0];
+    for (size_t i = 1; i < sizeof(T) / 8; i++) {
+        if (words[i] != value) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void test_concurrent_reads() {
+    std::string path = "/tmp/test_metrics_" + std::to_string(getpid());
+    MetricsSegment writer;
+    log_assert(writer.create(path, NUM_PORTS, NUM_THREADS, 2000000000ull, 250000000ull, 1),
+               "Cannot create %s", path.c_str());
+    MetricsSegment reader;
+    log_assert(reader.open(path), "Cannot open %s", path.c_str());
+
+    std::atomic<bool> stop{false};
+    uint64_t published = 0;
+    std::thread publisher([&writer, &stop, &published] {
+        FilterMetrics filter;
+        PortMetrics port;
+        ThreadMetrics thread;
+        for (uint64_t value = 1; !stop.load(std::memory_order_relaxed); value++) {
+            fill(filter, value);
+            fill(port, value);
+            fill(thread, value);
+            writer.publish_core(filter);
+            writer.publish_adapter(filter);
+            for (uint16_t i = 0; i < NUM_PORTS; i++) {
+                writer.publish_port(i, port);
+            }
+            for (uint16_t i = 0; i < NUM_THREADS; i++) {
+                writer.publish_thread(i, thread);
+            }
+            published = value;
+        }
+    });
+
+    /* Last value read from each block: core, adapter, ports, threads */
+    std::vector<uint64_t> last(2 + NUM_PORTS + NUM_THREADS, 0);
+    uint64_t reads = 0;
+    uint64_t gave_up = 0;
+    auto check = [&last, &reads, &gave_up](bool read, const auto& metrics, size_t block) {
+        if (!read) {
+            gave_up++;
+            return;
+        }
+        uint64_t value;
+        log_assert(uniform(metrics, value), "Torn read of block %zu", block);
+        log_assert(value >= last[block], "Block %zu went back from %lu to %lu", block,
+                   last[block], value);
+        last[block] = value;
+        reads++;
+    };
+
+    auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(RUN_MS);
+    FilterMetrics filter;
+    PortMetrics port;
+    ThreadMetrics thread;
+    while (std::chrono::steady_clock::now() < end) {
+        check(reader.read_core(filter), filter, 0);
+        check(reader.read_adapter(filter), filter, 1);
+        for (uint16_t i = 0; i < NUM_PORTS; i++) {
+            check(reader.read_port(i, port), port, 2 + i);
+        }
+        for (uint16_t i = 0; i < NUM_THREADS; i++) {
+            check(reader.read_thread(i, thread), thread, 2 + NUM_PORTS + i);
+        }
+    }
+    stop = true;
+    publisher.join();
+
+    log_info("%lu consistent reads of %lu publishes, %lu gave up", reads, published, gave_up);
+    log_assert(published > 1000 && reads > 1000, "Too few publishes or reads to race");
+    log_assert(std::count(last.begin(), last.end(), 0) == 0, "A block was never read");
+    log_assert(gave_up * 100 <= reads, "%lu of %lu reads gave up", gave_up, reads + gave_up);
+}
+
+int main() {
+    test_concurrent_reads();
+    log_info("Metrics tests passed");
+    return 0;
+}
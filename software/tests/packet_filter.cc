@@ -0,0 +1,114 @@
+#include "deps.h"
+#include "packet_filter.h"
+#include "packet_filter_model.h"
+#include "mmio_backend.h"
+#include "frames.h"
+
+/* Rule programming against the software model of the core behind a register file
+ * that counts writes: only the difference to the inactive bank is written, and a
+ * filter created over a core a previous run left rules in, with either bank
+ * active, applies its own rules and none of the old ones. */
+
+class CountingBackend : public MMIOBackend {
+private:
+    SimBackend sim_;
+    uint64_t writes_ = 0;
+
+public:
+    void reg_write(uint32_t addr, uint32_t value) override {
+        writes_++;
+        sim_.reg_write(addr, value);
+    }
+    uint32_t reg_read(uint32_t addr) override { return sim_.reg_read(addr); }
+
+    uint64_t writes() const { return writes_; }
+    PacketFilterModel& filter_model() { return sim_.filter_model(); }
+};
+
+static void test_restart(uint32_t old_commits) {
+    auto backend = std::make_shared<CountingBackend>();
+    MMIO::set_backend(backend);
+    PacketFilterModel& model = backend->filter_model();
+
+    /* Old rules end up in both banks, whichever is active */
+    const uint32_t a = 0x0a000001, b = 0x0a000002, c = 0x0a000003;
+    std::vector<PacketFilter::RuleSet> old_sets = {
+        {forward_rule(a, 5000)}, {forward_rule(a, 5000), forward_rule(c, 5000)},
+        {forward_rule(c, 5000)}};
+    {
+        PacketFilter old_run;
+        for (uint32_t i = 0; i < old_commits; i++) {
+            log_assert(old_run.commit(old_sets[i % old_sets.size()]), "Commit failed");
+        }
+    }
+
+    PacketFilter filter(std::vector<std::string>{"10.0.0.2:5000"});
+    for (int recommit = 0; recommit < 3; recommit++) {
+        log_assert(!forwarded(model, a, 5000) && !forwarded(model, c, 5000),
+                   "Rule of the previous run applied after %u old and %d new commits",
+                   old_commits, recommit + 1);
+        log_assert(forwarded(model, b, 5000), "Rule not applied after %u old and %d new commits",
+                   old_commits, recommit + 1);
+        log_assert(filter.commit(filter.rules()), "Commit failed");
+    }
+}
+
+static void test_diff() {
+    auto backend = std::make_shared<CountingBackend>();
+    MMIO::set_backend(backend);
+    PacketFilterModel& model = backend->filter_model();
+    PacketFilter filter;
+
+    const uint32_t num_rules = 5000;
+    PacketFilter::RuleSet rules;
+    for (uint32_t i = 0; i < num_rules; i++) {
+        rules.push_back(forward_rule(0x0a000000 + i, static_cast<uint16_t>(5000 + i % 16)));
+    }
+
+    uint64_t writes = backend->writes();
+    auto start = std::chrono::steady_clock::now();
+    log_assert(filter.commit(rules), "Commit failed");
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    uint64_t full_writes = backend->writes() - writes;
+    log_info("Programmed %u rules in %.3f ms (%.0f rules/s), %lu register writes",
+             num_rules, secs * 1e3, num_rules / secs, full_writes);
+
+    /* The inactive bank still holds the set before, so all of it is written again */
+    writes = backend->writes();
+    log_assert(filter.commit(rules), "Commit failed");
+    log_assert(backend->writes() - writes == full_writes,
+               "Second commit wrote %lu registers, the first %lu", backend->writes() - writes,
+               full_writes);
+
+    /* Both banks hold the set now: only the commit itself is written */
+    writes = backend->writes();
+    log_assert(filter.commit(rules), "Commit failed");
+    uint64_t same_writes = backend->writes() - writes;
+
+    rules[17].action = PacketFilter::RULE_ACTION_DROP;
+    rules.pop_back();
+    log_assert(filter.commit(rules), "Commit failed");
+    writes = backend->writes();
+    log_assert(filter.commit(rules), "Commit failed");
+    uint64_t changed_writes = backend->writes() - writes;
+    log_info("Recommitting: %lu register writes unchanged, %lu with two rules changed",
+             same_writes, changed_writes);
+    /* What is left is the commit and reading the counters of the bank */
+    log_assert(same_writes < full_writes / 100, "Unchanged rules were written again");
+    log_assert(changed_writes - same_writes < 3 * full_writes / num_rules,
+               "More than the changed rules were written");
+
+    log_assert(!forwarded(model, 0x0a000000 + 17, 5000 + 17 % 16), "Dropped rule forwarded");
+    log_assert(!forwarded(model, 0x0a000000 + num_rules - 1, 5000 + (num_rules - 1) % 16),
+               "Removed rule forwarded");
+    log_assert(forwarded(model, 0x0a000000 + 18, 5000 + 18 % 16), "Rule not forwarded");
+}
+
+int main() {
+    for (uint32_t old_commits = 0; old_commits <= 4; old_commits++) {
+        test_restart(old_commits);
+    }
+    test_diff();
+    log_info("Packet filter tests passed");
+    return 0;
+}
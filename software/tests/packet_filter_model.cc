@@ -0,0 +1,399 @@
+#include <random>
+#include <set>
+#include <unistd.h>
+
+#include "deps.h"
+#include "packet_filter.h"
+#include "packet_filter_model.h"
+#include "mmio_backend.h"
+#include "rule_compiler.h"
+#include "pcap_writer.h"
+#include "frames.h"
+
+/* The software model of the filter core, programmed through PacketFilter over the
+ * simulation backend. */
+
+/* Packets to destinations no rule names are forwarded only if the table matches on
+ * the slot alone, as it did before entries were tagged with their key. The untagged
+ * rate is what a lookup by index would return for the placement of the rules. */
+static void test_aliasing() {
+    auto backend = std::make_shared<SimBackend>();
+    MMIO::set_backend(backend);
+    PacketFilterModel& model = backend->filter_model();
+    PacketFilter filter;
+
+    std::mt19937 rng(8);
+    const uint32_t num_rules = 6000, num_packets = 100000;
+    PacketFilter::RuleSet rules;
+    std::set<std::pair<uint32_t, uint16_t>> destinations;
+    while (rules.size() < num_rules) {
+        uint32_t dst_ip = 0x0a000000 | (rng() & 0xffff);
+        uint16_t dst_port = static_cast<uint16_t>(rng());
+        if (destinations.emplace(dst_ip, dst_port).second) {
+            rules.push_back(forward_rule(dst_ip, dst_port));
+        }
+    }
+    log_assert(filter.commit(rules), "Commit failed");
+
+    RuleCompiler compiler;
+    RuleCompiler::Placement placement = compiler.place(rules);
+    log_assert(placement.conflicts.empty(), "%lu rules collide", placement.conflicts.size());
+    uint32_t table = 0;
+    while (!placement.tables[table] || placement.masks[table] != rules[0].mask) {
+        table++;
+    }
+
+    uint32_t tagged = 0, untagged = 0, sent = 0;
+    while (sent < num_packets) {
+        uint32_t dst_ip = 0x0a000000 | (rng() & 0xffff);
+        uint16_t dst_port = static_cast<uint16_t>(rng());
+        if (destinations.count({dst_ip, dst_port})) {
+            continue;
+        }
+        sent++;
+        tagged += forwarded(model, dst_ip, dst_port);
+        PacketFilter::FlowKey key = udp_key(0x0a640001, 1234, dst_ip, dst_port);
+
+        PacketFilter::FlowKey masked = key & rules[0].mask;
+        for (uint32_t way = 0; way < RuleCompiler::TABLE_WAYS; way++) {
+            if (placement.slots[compiler.slot(masked, table, way)].used) {
+                untagged++;
+                break;
+            }
+        }
+    }
+    log_info("Aliasing with %u rules over %u packets to other destinations: "
+             "%.2f%% untagged, %.2f%% tagged", num_rules, num_packets,
+             100.0 * untagged / num_packets, 100.0 * tagged / num_packets);
+    log_assert(tagged == 0, "%u packets forwarded without a matching rule", tagged);
+    log_assert(untagged > num_packets / 2, "Only %u packets alias into a used slot", untagged);
+
+    for (uint32_t i = 0; i < num_rules; i += 97) {
+        log_assert(forwarded(model, rte_be_to_cpu_32(rules[i].match.dst_ip.ipv4()),
+                             rte_be_to_cpu_16(rules[i].match.dst_port)),
+                   "Packet of rule %u not forwarded", i);
+    }
+}
+
+/* Frames of a pcap file written by PcapWriter */
+static std::vector<std::vector<uint8_t>> read_pcap(const std::string& path) {
+    FILE* fp = fopen(path.c_str(), "rb");
+    log_assert(fp != nullptr, "Cannot open %s: %s", path.c_str(), strerror(errno));
+    uint8_t file_header[24];
+    log_assert(fread(file_header, sizeof(file_header), 1, fp) == 1, "No pcap header");
+
+    std::vector<std::vector<uint8_t>> frames;
+    uint32_t record[4];
+    while (fread(record, sizeof(record), 1, fp) == 1) {
+        std::vector<uint8_t> frame(record[2]);
+        log_assert(fread(frame.data(), 1, frame.size(), fp) == frame.size(), "Truncated pcap");
+        frames.push_back(std::move(frame));
+    }
+    fclose(fp);
+    return frames;
+}
+
+/* Action of the highest priority rule matching a key, the default if none does */
+static PacketFilter::RuleAction reference_action(const PacketFilter::RuleSet& rules,
+                                                 const PacketFilter::FlowKey& key) {
+    const PacketFilter::Rule* best = nullptr;
+    for (const auto& rule : rules) {
+        if ((key & rule.mask) == rule.match && (best == nullptr || rule.priority > best->priority)) {
+            best = &rule;
+        }
+    }
+    return best == nullptr ? PacketFilter::RULE_ACTION_DROP : best->action;
+}
+
+/* Rules over four masks, with wildcards and a more specific rule dropping part of
+ * what a wider one forwards, against TCP and UDP traffic from a pcap file. Every
+ * packet is forwarded exactly when the highest priority matching rule says so. */
+static void test_five_tuple() {
+    auto backend = std::make_shared<SimBackend>();
+    MMIO::set_backend(backend);
+    PacketFilterModel& model = backend->filter_model();
+    PacketFilter filter;
+
+    using Rule = std::pair<const char*, PacketFilter::RuleAction>;
+    PacketFilter::RuleSet rules;
+    for (const auto& [rule, action] : {
+             Rule{"tcp:*:*:10.1.0.5:443", PacketFilter::RULE_ACTION_FORWARD},
+             Rule{"udp:*:*:10.1.0.5:53", PacketFilter::RULE_ACTION_FORWARD},
+             Rule{"udp:10.2.0.7:*:*:*", PacketFilter::RULE_ACTION_FORWARD},
+             Rule{"tcp:10.2.0.7:*:*:*", PacketFilter::RULE_ACTION_FORWARD},
+             Rule{"tcp:10.3.0.9:*:10.1.0.5:443", PacketFilter::RULE_ACTION_DROP},
+             Rule{"udp:10.4.0.1:1000:10.1.0.6:2000", PacketFilter::RULE_ACTION_FORWARD}}) {
+        rules.push_back(PacketFilter::parse_rule(rule, action));
+    }
+    log_assert(filter.commit(rules), "Commit failed");
+
+    const uint32_t src_ips[] = {0x0a020007, 0x0a030009, 0x0a040001, 0x0a090909};
+    const uint32_t dst_ips[] = {0x0a010005, 0x0a010006, 0x0a080808};
+    const uint16_t ports[] = {53, 443, 1000, 2000, 8080};
+    const uint8_t protocols[] = {IPPROTO_TCP, IPPROTO_UDP};
+
+    std::string path = "/tmp/test_packet_filter_model_" + std::to_string(getpid()) + ".pcap";
+    std::vector<PacketFilter::FlowKey> keys;
+    {
+        PcapWriter writer(path);
+        log_assert(writer.open(), "Cannot write %s", path.c_str());
+        std::mt19937 rng(10);
+        for (uint32_t i = 0; i < 20000; i++) {
+            PacketFilter::FlowKey key = udp_key(src_ips[rng() % 4], ports[rng() % 5],
+                                                dst_ips[rng() % 3], ports[rng() % 5]);
+            key.protocol = protocols[rng() % 2];
+            std::vector<uint8_t> frame = ipv4_frame(key, 64 + rng() % 64);
+            log_assert(writer.write(frame.data(), frame.size(), frame.size()), "Write failed");
+            keys.push_back(key);
+        }
+    }
+    std::vector<std::vector<uint8_t>> frames = read_pcap(path + ".0");
+    unlink((path + ".0").c_str());
+    log_assert(frames.size() == keys.size(), "Read %lu of %lu frames", frames.size(), keys.size());
+
+    uint32_t forwarded = 0;
+    for (size_t i = 0; i < frames.size(); i++) {
+        bool forward = model.classify(frames[i].data(), frames[i].size(), frames[i].size()).forward;
+        bool expected = reference_action(rules, keys[i]) == PacketFilter::RULE_ACTION_FORWARD;
+        log_assert(forward == expected, "Packet %lu %s, the reference %s it", i,
+                   forward ? "forwarded" : "dropped", expected ? "forwards" : "drops");
+        forwarded += forward;
+    }
+    log_info("Five-tuple rules: %u of %lu packets forwarded as the reference does", forwarded,
+             frames.size());
+    log_assert(forwarded > 0 && forwarded < frames.size(), "Rules forwarded all or nothing");
+}
+
+/* Rules of a single mask fill every table, not just the first one: each rule is
+ * applied, and the next table of the mask is probed like any other */
+static void test_one_mask() {
+    auto backend = std::make_shared<SimBackend>();
+    MMIO::set_backend(backend);
+    PacketFilterModel& model = backend->filter_model();
+    PacketFilter filter;
+
+    const uint32_t num_rules = 30000;
+    PacketFilter::RuleSet rules;
+    for (uint32_t i = 0; i < num_rules; i++) {
+        rules.push_back(forward_rule(0x0a000000 + i, static_cast<uint16_t>(5000 + i % 16)));
+    }
+    log_assert(filter.commit(rules), "%u rules of one mask did not fit", num_rules);
+    for (uint32_t i = 0; i < num_rules; i++) {
+        log_assert(forwarded(model, 0x0a000000 + i, static_cast<uint16_t>(5000 + i % 16)),
+                   "Rule %u not applied", i);
+    }
+    log_assert(!forwarded(model, 0x0a000000 + num_rules, 5000), "Packet without a rule forwarded");
+}
+
+/* Every rule counts exactly the packets and bytes sent to it, and the destinations
+ * dropped most often are the heavy hitters, estimated at no less than their count */
+static void test_rule_stats() {
+    auto backend = std::make_shared<SimBackend>();
+    MMIO::set_backend(backend);
+    PacketFilterModel& model = backend->filter_model();
+    PacketFilter filter;
+
+    const uint32_t num_rules = 32, num_dropped = 24;
+    PacketFilter::RuleSet rules;
+    for (uint32_t i = 0; i < num_rules; i++) {
+        rules.push_back(forward_rule(0x0a000000 + i, 5000));
+    }
+    log_assert(filter.commit(rules), "Commit failed");
+
+    std::vector<PacketFilter::RuleCounters> expected(num_rules, {0, 0});
+    for (uint32_t i = 0; i < num_rules; i++) {
+        for (uint32_t n = 0; n <= i; n++) {
+            std::vector<uint8_t> frame =
+                ipv4_frame(udp_key(0x0a640001, 1234, 0x0a000000 + i, 5000), 64 + 8 * n);
+            model.process(frame.data(), frame.size(), frame.size());
+            expected[i].packets++;
+            expected[i].bytes += frame.size();
+        }
+    }
+    /* Destination j of the dropped traffic gets 400 / (j + 1) packets */
+    std::vector<uint8_t> frame;
+    for (uint32_t j = 0; j < num_dropped; j++) {
+        frame = ipv4_frame(udp_key(0x0a640001, 1234, 0x0a090000 + j, 6000));
+        for (uint32_t n = 0; n < 400 / (j + 1); n++) {
+            model.process(frame.data(), frame.size(), frame.size());
+        }
+    }
+
+    PacketFilter::RuleStats stats;
+    log_assert(filter.read_rule_stats(stats), "Reading rule statistics failed");
+    log_assert(stats.rules.size() == num_rules, "%lu rule counters", stats.rules.size());
+    for (uint32_t i = 0; i < num_rules; i++) {
+        log_assert(stats.rules[i].packets == expected[i].packets &&
+                   stats.rules[i].bytes == expected[i].bytes,
+                   "Rule %u counted %lu packets and %lu bytes, %lu and %lu were sent", i,
+                   stats.rules[i].packets, stats.rules[i].bytes, expected[i].packets,
+                   expected[i].bytes);
+    }
+
+    const uint32_t top_k = PacketFilterModel::SKETCH_TOP_K;
+    log_assert(stats.heavy_hitters.size() == top_k, "%lu heavy hitters",
+               stats.heavy_hitters.size());
+    for (uint32_t j = 0; j < top_k; j++) {
+        const PacketFilter::HeavyHitter& hitter = stats.heavy_hitters[j];
+        auto dst_ip = PacketFilter::IPAddress::from_ipv4(rte_cpu_to_be_32(0x0a090000 + j));
+        log_assert(hitter.dst_ip == dst_ip && hitter.dst_port == rte_cpu_to_be_16(6000),
+                   "Heavy hitter %u is not the destination dropped %u times", j, 400 / (j + 1));
+        log_assert(hitter.packets >= 400 / (j + 1), "Heavy hitter %u estimated at %u packets, "
+                   "%u were dropped", j, hitter.packets, 400 / (j + 1));
+    }
+}
+
+/* Frames offered back to back at line rate, one phit per cycle, to a rate limited
+ * rule: over the run, what is forwarded stays within one frame of the refill of the
+ * bucket plus its burst, and drops start once the burst is spent */
+static void test_rate_limit() {
+    auto backend = std::make_shared<SimBackend>();
+    MMIO::set_backend(backend);
+    PacketFilterModel& model = backend->filter_model();
+    PacketFilter filter;
+
+    struct Case {
+        PacketFilter::RateLimit limit;
+        size_t frame_len;
+    };
+    const Case cases[] = {
+        {{PacketFilter::RATE_PPS, 1000000, 16}, 64},
+        {{PacketFilter::RATE_PPS, 20000000, 100}, 128},
+        {{PacketFilter::RATE_BPS, 10000000000ULL, 15000}, 1000},
+        {{PacketFilter::RATE_BPS, 1000000000ULL, 3000}, 300},
+    };
+    const uint64_t run_cycles = 250000;  /* 1 ms */
+    uint16_t port = 1000;
+    uint64_t cycle = 0;
+    for (const auto& c : cases) {
+        port++;
+        log_assert(filter.set_rate_limit("udp:*:*:10.0.0.1:" + std::to_string(port), c.limit),
+                   "Setting the rate limit failed");
+        std::vector<uint8_t> frame = ipv4_frame(udp_key(0x0a640001, 1234, 0x0a000001, port),
+                                                c.frame_len);
+        uint64_t phits = (c.frame_len + 63) / 64;
+
+        uint64_t sent = 0, forwarded = 0;
+        for (uint64_t start = cycle; cycle - start < run_cycles; cycle += phits) {
+            forwarded += model.process(frame.data(), frame.size(), frame.size(), cycle);
+            sent++;
+        }
+
+        double secs = run_cycles / PacketFilter::CORE_CLOCK_HZ;
+        bool pps = c.limit.unit == PacketFilter::RATE_PPS;
+        double tokens = forwarded * (pps ? 1.0 : c.frame_len);
+        double refill = pps ? c.limit.rate * secs : c.limit.rate / 8.0 * secs;
+        double frame_tokens = pps ? 1.0 : c.frame_len;
+        log_info("Rate limit of %lu %s, burst %u: %lu of %lu frames of %lu bytes forwarded, "
+                 "%.4g %s", c.limit.rate, pps ? "pps" : "bps", c.limit.burst, forwarded, sent,
+                 c.frame_len, pps ? forwarded / secs : forwarded * c.frame_len * 8 / secs,
+                 pps ? "pps" : "bps");
+        log_assert(tokens >= refill - frame_tokens &&
+                   tokens <= refill + c.limit.burst + frame_tokens,
+                   "Forwarded %.0f tokens, the bucket allows %.0f to %.0f", tokens, refill,
+                   refill + c.limit.burst);
+        log_assert(forwarded < sent, "Nothing was dropped");
+    }
+}
+
+/* Frames forwarded by RSS spread evenly over the queues with every flow on one
+ * queue, and a rule steering to a fixed queue wins over RSS */
+static void test_steering() {
+    auto backend = std::make_shared<SimBackend>();
+    MMIO::set_backend(backend);
+    PacketFilterModel& model = backend->filter_model();
+    const uint16_t queues = 8;
+    PacketFilter filter(std::vector<std::string>{"udp:*:*:*:*", "tcp:*:*:*:*"}, queues);
+    log_assert(filter.set_steering("udp:*:*:10.9.9.9:53", 3), "Setting steering failed");
+
+    std::mt19937 rng(17);
+    const uint32_t num_flows = 2000;
+    std::vector<uint32_t> flows_per_queue(queues, 0);
+    for (uint32_t i = 0; i < num_flows; i++) {
+        PacketFilter::FlowKey key = udp_key(rng(), static_cast<uint16_t>(rng()), rng(),
+                                            static_cast<uint16_t>(rng()));
+        key.protocol = rng() & 1 ? IPPROTO_TCP : IPPROTO_UDP;
+        int queue = -1;
+        for (size_t len : {64, 200, 1500}) {
+            std::vector<uint8_t> frame = ipv4_frame(key, len);
+            auto verdict = model.classify(frame.data(), frame.size(), frame.size());
+            log_assert(verdict.forward && verdict.steered && verdict.queue < queues,
+                       "Flow %u not steered to one of the queues", i);
+            log_assert(queue < 0 || verdict.queue == queue, "Flow %u moved from queue %d to %u",
+                       i, queue, verdict.queue);
+            queue = verdict.queue;
+        }
+        flows_per_queue[queue]++;
+    }
+    auto [least, most] = std::minmax_element(flows_per_queue.begin(), flows_per_queue.end());
+    log_info("RSS over %u queues: %u to %u flows per queue, %u on average", queues, *least,
+             *most, num_flows / queues);
+    log_assert(*least > num_flows / queues * 8 / 10 && *most < num_flows / queues * 12 / 10,
+               "Flows are not spread evenly");
+
+    for (uint32_t i = 0; i < 16; i++) {
+        std::vector<uint8_t> frame = ipv4_frame(udp_key(rng(), static_cast<uint16_t>(rng()),
+                                                        0x0a090909, 53));
+        auto verdict = model.classify(frame.data(), frame.size(), frame.size());
+        log_assert(verdict.steered && verdict.queue == 3, "Pinned flow went to queue %u",
+                   verdict.queue);
+    }
+}
+
+/* A mirror threshold of one in n copies about one in n dropped frames and none of the
+ * forwarded ones, each copy cut to MIRROR_BYTES, and zero stops mirroring */
+static void test_mirror() {
+    auto backend = std::make_shared<SimBackend>();
+    MMIO::set_backend(backend);
+    PacketFilterModel& model = backend->filter_model();
+    PacketFilter filter;
+    log_assert(filter.commit({forward_rule(0x0a000001, 5000)}), "Commit failed");
+
+    std::mt19937 rng(19);
+    for (uint32_t one_in_n : {2u, 8u, 100u}) {
+        log_assert(filter.set_mirror(one_in_n, 0), "Setting mirroring failed");
+        const uint32_t num_frames = 200000;
+        uint32_t dropped = 0, mirrored = 0;
+        for (uint32_t i = 0; i < num_frames; i++) {
+            bool drop = rng() % 4 != 0;
+            size_t len = 64 + rng() % 1437;
+            std::vector<uint8_t> frame =
+                ipv4_frame(udp_key(0x0a640001, 1234, drop ? 0x0a000002 : 0x0a000001, 5000), len);
+            auto verdict = model.classify(frame.data(), frame.size(), frame.size());
+            log_assert(verdict.forward == !drop, "Frame %u %s", i,
+                       drop ? "forwarded" : "dropped");
+            log_assert(!verdict.forward || !verdict.mirrored, "Forwarded frame %u mirrored", i);
+            log_assert(verdict.mirror_bytes == (verdict.mirrored ?
+                       std::min<size_t>(len, PacketFilter::MIRROR_BYTES) : 0),
+                       "Copy of %u bytes of a frame of %lu", verdict.mirror_bytes, len);
+            dropped += drop;
+            mirrored += verdict.mirrored;
+        }
+        double expected = static_cast<double>(dropped) / one_in_n;
+        log_info("Mirroring 1 in %u: %u of %u dropped frames mirrored, %.0f expected",
+                 one_in_n, mirrored, dropped, expected);
+        log_assert(mirrored >= 0.95 * expected && mirrored <= 1.05 * expected,
+                   "%u frames mirrored instead of about %.0f", mirrored, expected);
+    }
+
+    log_assert(filter.set_mirror(0, 0), "Stopping mirroring failed");
+    uint64_t before = model.stats().mirrored;
+    for (uint32_t i = 0; i < 1000; i++) {
+        std::vector<uint8_t> frame = ipv4_frame(udp_key(0x0a640001, 1234, 0x0a000002, 5000));
+        log_assert(!model.classify(frame.data(), frame.size(), frame.size()).mirrored,
+                   "Frame mirrored with mirroring off");
+    }
+    log_assert(model.stats().mirrored == before, "Mirror counter moved with mirroring off");
+}
+
+int main() {
+    test_aliasing();
+    test_five_tuple();
+    test_one_mask();
+    test_rule_stats();
+    test_rate_limit();
+    test_steering();
+    test_mirror();
+    log_info("Packet filter model tests passed");
+    return 0;
+}
@@ -0,0 +1,165 @@
+#include <unistd.h>
+
+#include "deps.h"
+#include "pcap_writer.h"
+#include "frames.h"
+
+/* PcapWriter: the file and record headers it writes, the rotation through its ring
+ * of files once one reaches max_file_bytes, and the wire length it gives truncated
+ * copies of IPv4 and IPv6 frames with up to two VLAN tags. */
+
+static constexpr uint32_t FILE_HEADER_BYTES   = 24;
+static constexpr uint32_t RECORD_HEADER_BYTES = 16;
+
+struct Record {
+    uint32_t ts_sec;
+    uint32_t ts_nsec;
+    uint32_t len;
+    std::vector<uint8_t> data;
+};
+
+/* Records of a pcap file after checking its file header */
+static std::vector<Record> read_records(const std::string& name) {
+    FILE* fp = fopen(name.c_str(), "rb");
+    log_assert(fp != nullptr, "Cannot open %s: %s", name.c_str(), strerror(errno));
+    uint32_t header[FILE_HEADER_BYTES / 4];
+    log_assert(fread(header, sizeof(header), 1, fp) == 1, "No pcap header in %s", name.c_str());
+    log_assert(header[0] == 0xa1b23c4d, "Magic %08x is not that of nanosecond pcap", header[0]);
+    log_assert((header[1] & 0xffff) == 2 && (header[1] >> 16) == 4, "Version is not 2.4");
+    log_assert(header[2] == 0 && header[3] == 0, "Time zone or accuracy set");
+    log_assert(header[4] == 65535 && header[5] == 1, "Snap length %u, link type %u",
+               header[4], header[5]);
+
+    std::vector<Record> records;
+    uint32_t record[RECORD_HEADER_BYTES / 4];
+    while (fread(record, sizeof(record), 1, fp) == 1) {
+        Record r = {record[0], record[1], record[3], std::vector<uint8_t>(record[2])};
+        log_assert(fread(r.data.data(), 1, r.data.size(), fp) == r.data.size(),
+                   "Truncated record in %s", name.c_str());
+        records.push_back(std::move(r));
+    }
+    fclose(fp);
+    return records;
+}
+
+static void test_rotation() {
+    std::string path = "/tmp/test_pcap_writer_" + std::to_string(getpid());
+    const uint32_t caplen = 100, per_file = 3, max_files = 3, num_packets = 10;
+    const uint64_t max_file_bytes = FILE_HEADER_BYTES + per_file * (RECORD_HEADER_BYTES + caplen);
+
+    timespec start;
+    clock_gettime(CLOCK_REALTIME, &start);
+    {
+        PcapWriter writer(path, max_file_bytes, max_files);
+        log_assert(writer.open(), "Cannot open %s.0", path.c_str());
+        for (uint32_t i = 0; i < num_packets; i++) {
+            std::vector<uint8_t> data(caplen, static_cast<uint8_t>(i));
+            /* Every other packet was longer on the wire; a shorter len is not kept */
+            log_assert(writer.write(data.data(), caplen, i % 2 ? 1500 : 50), "Write %u failed",
+                       i);
+        }
+        log_assert(writer.packets() == num_packets, "%lu packets written", writer.packets());
+    }
+
+    /* Packet i went to file i / per_file of the ring, the last one overwrote file 0 */
+    std::vector<std::vector<uint32_t>> expected = {{9}, {3, 4, 5}, {6, 7, 8}};
+    for (uint32_t file = 0; file < max_files; file++) {
+        std::string name = path + "." + std::to_string(file);
+        std::vector<Record> records = read_records(name);
+        log_assert(records.size() == expected[file].size(), "%zu records in %s",
+                   records.size(), name.c_str());
+        for (size_t r = 0; r < records.size(); r++) {
+            uint32_t i = expected[file][r];
+            const Record& record = records[r];
+            log_assert(record.data == std::vector<uint8_t>(caplen, static_cast<uint8_t>(i)),
+                       "Record %zu of %s is not packet %u", r, name.c_str(), i);
+            log_assert(record.len == (i % 2 ? 1500 : caplen), "Packet %u of %u bytes", i,
+                       record.len);
+            log_assert(record.ts_nsec < 1000000000 && record.ts_sec >= start.tv_sec &&
+                       record.ts_sec <= start.tv_sec + 60, "Bad timestamp %u.%09u",
+                       record.ts_sec, record.ts_nsec);
+        }
+        unlink(name.c_str());
+    }
+    log_assert(access((path + "." + std::to_string(max_files)).c_str(), F_OK) != 0,
+               "A file past the ring was written");
+}
+
+static void test_open_failure() {
+    PcapWriter writer("/nonexistent/test_pcap_writer");
+    log_assert(!writer.open(), "Opened a file in a missing directory");
+    uint8_t data[64] = {};
+    log_assert(!writer.write(data, sizeof(data), sizeof(data)), "Wrote without a file");
+    log_assert(writer.packets() == 0, "Counted a packet that was not written");
+}
+
+/* Frame with a VLAN tag of the given type inserted after the MAC addresses */
+static std::vector<uint8_t> tagged(std::vector<uint8_t> frame, uint16_t tpid) {
+    uint8_t tag[4] = {static_cast<uint8_t>(tpid >> 8), static_cast<uint8_t>(tpid), 0, 42};
+    frame.insert(frame.begin() + 12, tag, tag + sizeof(tag));
+    return frame;
+}
+
+static std::vector<uint8_t> ipv6_frame(uint16_t payload_len) {
+    std::vector<uint8_t> frame(14 + 40 + payload_len, 0);
+    frame[12] = 0x86;
+    frame[13] = 0xDD;
+    frame[14] = 0x60;
+    frame[18] = static_cast<uint8_t>(payload_len >> 8);
+    frame[19] = static_cast<uint8_t>(payload_len);
+    frame[20] = IPPROTO_UDP;
+    return frame;
+}
+
+static void test_wire_length() {
+    PacketFilter::FlowKey key = udp_key(0x0a640001, 1234, 0x0a000001, 53);
+    const uint32_t copy = PacketFilter::MIRROR_BYTES;
+    struct Case {
+        const char* name;
+        std::vector<uint8_t> frame;
+        uint32_t caplen;
+        uint32_t expected;
+    };
+    std::vector<Case> cases = {
+        {"IPv4", ipv4_frame(key, 1000), copy, 1000},
+        {"IPv6", ipv6_frame(946), copy, 1000},
+        {"VLAN IPv4", tagged(ipv4_frame(key, 1000), 0x8100), copy, 1004},
+        {"VLAN IPv6", tagged(ipv6_frame(946), 0x8100), copy, 1004},
+        {"QinQ IPv4", tagged(tagged(ipv4_frame(key, 1000), 0x8100), 0x88A8), copy, 1008},
+        {"QinQ IPv6", tagged(tagged(ipv6_frame(946), 0x8100), 0x88A8), copy, 1008},
+        /* A frame shorter than the copy */
+        {"short IPv4", ipv4_frame(key, 80), 80, 80},
+        /* Copies cut before the length field, which keep their own length */
+        {"no Ethernet header", ipv4_frame(key, 1000), 10, 10},
+        {"cut IPv4 header", ipv4_frame(key, 1000), 17, 17},
+        {"cut IPv6 header", ipv6_frame(946), 19, 19},
+        {"cut VLAN tag", tagged(ipv4_frame(key, 1000), 0x8100), 16, 16},
+        {"cut QinQ tag", tagged(tagged(ipv4_frame(key, 1000), 0x8100), 0x88A8), 20, 20},
+        {"cut tagged IPv4", tagged(ipv4_frame(key, 1000), 0x8100), 21, 21},
+    };
+    /* Three tags are more than the core parses */
+    std::vector<uint8_t> three = tagged(tagged(tagged(ipv4_frame(key, 1000), 0x8100), 0x8100),
+                                        0x88A8);
+    cases.push_back({"three tags", three, copy, copy});
+    std::vector<uint8_t> padded = ipv4_frame(key, 60);
+    padded.resize(64);
+    cases.push_back({"padded IPv4", padded, 64, 64});
+    std::vector<uint8_t> arp = ipv4_frame(key, 1000);
+    arp[12] = 0x08;
+    arp[13] = 0x06;
+    cases.push_back({"ARP", arp, copy, copy});
+
+    for (const auto& c : cases) {
+        uint32_t len = PcapWriter::wire_length(c.frame.data(), c.caplen);
+        log_assert(len == c.expected, "Wire length of %s is %u instead of %u", c.name, len,
+                   c.expected);
+    }
+}
+
+int main() {
+    test_rotation();
+    test_open_failure();
+    test_wire_length();
+    log_info("Pcap writer tests passed");
+    return 0;
+}
@@ -0,0 +1,136 @@
+#include <random>
+
+#include "deps.h"
+#include "rule_compiler.h"
+
+/* The rule compiler against the model of the core: its table-driven hash is the
+ * bit-serial Toeplitz hash of the core, every rule of a placement is either in one
+ * of its candidate slots or reported as a collision, and masks with more rules than
+ * a table holds spill into the tables other masks leave free. */
+
+static PacketFilter::RuleSet random_rules(std::mt19937& rng, uint32_t count,
+                                          uint32_t num_masks) {
+    const char* templates[] = {"udp:*:*:10.0.0.1:80", "tcp:10.0.0.1:*:10.0.0.1:*",
+                               "udp:10.0.0.1:*:*:*", "tcp:*:*:10.0.0.1:*"};
+    PacketFilter::RuleSet rules;
+    for (uint32_t i = 0; i < count; i++) {
+        PacketFilter::Rule rule = PacketFilter::parse_rule(templates[i % num_masks],
+                                                           PacketFilter::RULE_ACTION_FORWARD);
+        rule.match.src_ip = PacketFilter::IPAddress::from_ipv4(rng()) & rule.mask.src_ip;
+        rule.match.dst_ip = PacketFilter::IPAddress::from_ipv4(rng()) & rule.mask.dst_ip;
+        rule.match.src_port = static_cast<uint16_t>(rng()) & rule.mask.src_port;
+        rule.match.dst_port = static_cast<uint16_t>(rng()) & rule.mask.dst_port;
+        rules.push_back(rule);
+    }
+    return rules;
+}
+
+static void test_hash(const RuleCompiler& compiler) {
+    std::mt19937 rng(1);
+    for (uint32_t i = 0; i < 100000; i++) {
+        PacketFilter::FlowKey key = {};
+        for (auto& byte : key.src_ip.bytes) {
+            byte = static_cast<uint8_t>(rng());
+        }
+        for (auto& byte : key.dst_ip.bytes) {
+            byte = static_cast<uint8_t>(rng());
+        }
+        key.src_port = static_cast<uint16_t>(rng());
+        key.dst_port = static_cast<uint16_t>(rng());
+        key.protocol = static_cast<uint8_t>(rng());
+        for (uint32_t way = 0; way < RuleCompiler::TABLE_WAYS; way++) {
+            log_assert(compiler.hash(key, way) == FilterGeometry::compute_hash(key, way),
+                       "Hash of way %u differs from the model", way);
+        }
+    }
+}
+
+/* Checks every slot of a placement and returns the number of rules stored */
+static size_t check_placement(const RuleCompiler& compiler, const PacketFilter::RuleSet& rules,
+                              const RuleCompiler::Placement& placement) {
+    std::vector<bool> stored(rules.size(), false);
+    size_t used = 0;
+    for (uint32_t slot = 0; slot < RuleCompiler::NUM_SLOTS; slot++) {
+        const RuleCompiler::Slot& entry = placement.slots[slot];
+        if (!entry.used) {
+            continue;
+        }
+        used++;
+        const PacketFilter::Rule& rule = rules[entry.rule];
+        uint32_t table = slot / (RuleCompiler::TABLE_WAYS * RuleCompiler::TABLE_SIZE);
+        uint32_t way = slot / RuleCompiler::TABLE_SIZE % RuleCompiler::TABLE_WAYS;
+        log_assert(placement.masks[table] == rule.mask, "Rule %u in the table of another mask",
+                   entry.rule);
+        log_assert(entry.key == (rule.match & rule.mask), "Slot %u holds the wrong key", slot);
+        log_assert(compiler.slot(entry.key, table, way) == slot,
+                   "Rule %u is not in its candidate slot of way %u", entry.rule, way);
+        log_assert(!stored[entry.rule], "Rule %u stored twice", entry.rule);
+        stored[entry.rule] = true;
+    }
+    for (const auto& collision : placement.conflicts) {
+        log_assert(!stored[collision.rule], "Stored rule %u reported as a collision",
+                   collision.rule);
+        stored[collision.rule] = true;
+    }
+    log_assert(used == placement.used, "%lu slots used, placement counts %lu", used,
+               placement.used);
+    for (uint32_t i = 0; i < rules.size(); i++) {
+        log_assert(stored[i], "Rule %u neither stored nor reported as a collision", i);
+    }
+    return used;
+}
+
+static void test_placement(const RuleCompiler& compiler, uint32_t count, uint32_t num_masks,
+                           bool fits) {
+    std::mt19937 rng(count);
+    PacketFilter::RuleSet rules = random_rules(rng, count, num_masks);
+    RuleCompiler::Placement placement = compiler.place(rules);
+    size_t used = check_placement(compiler, rules, placement);
+    log_info("%u rules over %u masks: %lu stored in %ld tables, %lu collisions, %lu moved",
+             count, num_masks, used,
+             std::count(placement.tables.begin(), placement.tables.end(), true),
+             placement.conflicts.size(), placement.moved);
+    log_assert(!fits || placement.conflicts.empty(), "%lu of %u rules collide",
+               placement.conflicts.size(), count);
+    log_assert(fits || !placement.conflicts.empty(), "%u rules fit in %u slots", count,
+               RuleCompiler::NUM_SLOTS);
+}
+
+/* A mask that spilled gives its extra tables back to masks that need one */
+static void test_reclaim() {
+    RuleCompiler compiler;
+    std::mt19937 rng(10);
+    PacketFilter::RuleSet rules = random_rules(rng, 30000, 1);
+    RuleCompiler::Placement placement = compiler.place(rules);
+    log_assert(placement.conflicts.empty() &&
+               std::count(placement.tables.begin(), placement.tables.end(), true) ==
+               RuleCompiler::NUM_TABLES, "30000 rules of one mask do not take every table");
+    compiler.accept(placement);
+
+    rules.resize(7000);
+    PacketFilter::RuleSet others = random_rules(rng, 4000, 4);
+    for (const auto& rule : others) {
+        if (rule.mask != rules[0].mask) {
+            rules.push_back(rule);
+        }
+    }
+    placement = compiler.place(rules);
+    check_placement(compiler, rules, placement);
+    log_assert(placement.conflicts.empty(), "%lu rules collide after masks were added",
+               placement.conflicts.size());
+}
+
+int main() {
+    RuleCompiler compiler;
+    test_hash(compiler);
+    /* Half a table, nearly full, more rules than a table holds, nearly every slot of
+     * one mask, and more rules than all tables hold */
+    test_placement(compiler, 4096, 2, true);
+    test_placement(compiler, 7800, 1, true);
+    test_placement(compiler, 20000, 2, true);
+    test_placement(compiler, 30000, 1, true);
+    test_placement(compiler, 34000, 1, false);
+    test_reclaim();
+    log_info("Rule compiler tests passed");
+    return 0;
+}
@@ -0,0 +1,96 @@
+#include <random>
+
+#include "deps.h"
+#include "rx_stats.h"
+
+/* The buckets of HistogramSnapshot: bucket_of() against lower_bound() on every
+ * bucket edge, the 1/SUB_BUCKETS precision on random values, the overflow bucket
+ * shared by every value of MAX_BITS bits or more, and percentile() over counts
+ * recorded through a CycleHistogram. */
+
+using H = HistogramSnapshot;
+
+static void test_buckets() {
+    for (uint64_t value = 0; value < H::SUB_BUCKETS; value++) {
+        log_assert(H::bucket_of(value) == value && H::lower_bound(value) == value,
+                   "Value %lu does not have a bucket of its own", value);
+    }
+    for (uint32_t bucket = 1; bucket < H::BUCKETS; bucket++) {
+        uint64_t lower = H::lower_bound(bucket);
+        log_assert(lower > H::lower_bound(bucket - 1), "Bucket %u starts at %lu, before %u",
+                   bucket, lower, bucket - 1);
+        log_assert(H::bucket_of(lower) == bucket, "Lower bound %lu of bucket %u is in %u",
+                   lower, bucket, H::bucket_of(lower));
+        log_assert(H::bucket_of(lower - 1) == bucket - 1, "Value %lu below bucket %u is in %u",
+                   lower - 1, bucket, H::bucket_of(lower - 1));
+    }
+
+    std::mt19937_64 rng(23);
+    for (uint32_t i = 0; i < 1000000; i++) {
+        uint64_t value = rng() >> (64 - H::MAX_BITS + 1 + rng() % (H::MAX_BITS - 1));
+        uint32_t bucket = H::bucket_of(value);
+        uint64_t lower = H::lower_bound(bucket);
+        log_assert(bucket < H::BUCKETS - 1, "Value %lu of %u bits overflowed", value,
+                   64 - __builtin_clzll(value | 1));
+        log_assert(lower <= value && (value - lower) * H::SUB_BUCKETS <= lower,
+                   "Value %lu is too far above %lu, the lower bound of bucket %u", value,
+                   lower, bucket);
+    }
+}
+
+/* Every value whose most significant bit is bit MAX_BITS - 1 or above */
+static void test_overflow() {
+    const uint64_t first = 1ull << (H::MAX_BITS - 1);
+    log_assert(H::lower_bound(H::BUCKETS - 1) == first, "Overflow bucket starts at %lu",
+               H::lower_bound(H::BUCKETS - 1));
+    log_assert(H::bucket_of(first - 1) == H::BUCKETS - 2, "Value %lu is in bucket %u",
+               first - 1, H::bucket_of(first - 1));
+    for (uint64_t value : {first, first + 1, first + (first >> 1), 2 * first - 1, 2 * first,
+                           first << 10, ~uint64_t{0}}) {
+        log_assert(H::bucket_of(value) == H::BUCKETS - 1, "Value %lu is in bucket %u",
+                   value, H::bucket_of(value));
+    }
+}
+
+static void test_percentile() {
+    H empty;
+    log_assert(empty.count() == 0 && empty.percentile(0.5) == 0, "Empty histogram not 0");
+
+    CycleHistogram histogram;
+    for (uint64_t value = 1; value <= 1000; value++) {
+        histogram.record(value);
+    }
+    H first;
+    histogram.read(first);
+    log_assert(first.count() == 1000, "%lu values recorded", first.count());
+    log_assert(first.percentile(0) == 1, "Minimum is %lu", first.percentile(0));
+    for (double fraction : {0.01, 0.25, 0.5, 0.9, 0.99, 1.0}) {
+        uint64_t value = static_cast<uint64_t>(fraction * 1000 + 0.5);
+        log_assert(first.percentile(fraction) == H::lower_bound(H::bucket_of(value)),
+                   "Percentile %.2f is %lu for value %lu", fraction, first.percentile(fraction),
+                   value);
+    }
+
+    /* Counts since the first read: the values above 1000 alone */
+    histogram.record(5000);
+    histogram.record(1ull << 45);
+    H second;
+    histogram.read(second);
+    H delta = second - first;
+    log_assert(delta.count() == 2, "%lu values since the first read", delta.count());
+    log_assert(delta.percentile(0.5) == H::lower_bound(H::bucket_of(5000)),
+               "Median since the first read is %lu", delta.percentile(0.5));
+    log_assert(delta.percentile(1.0) == H::lower_bound(H::BUCKETS - 1),
+               "Maximum since the first read is %lu", delta.percentile(1.0));
+
+    delta += first;
+    log_assert(delta.counts == second.counts, "Adding the first read back differs");
+}
+
+int main() {
+    test_buckets();
+    test_overflow();
+    test_percentile();
+    log_info("Rx stats tests passed");
+    return 0;
+}
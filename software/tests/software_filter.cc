@@ -0,0 +1,171 @@
+#include <random>
+
+#include "deps.h"
+#include "software_filter.h"
+#include "control_server.h"
+#include "frames.h"
+
+/* SoftwareFilter::filter_burst() on mbufs that point into frames of their own: the
+ * packets to drop are those lookup() decides so, moved to the front with both sides
+ * in order, and rate limited rules forward what their token bucket allows, also
+ * when several rx threads share it. */
+
+/* DPDK_BURST_SIZE, the most the rx loop hands a handler */
+static constexpr uint16_t BURST = 32;
+
+/* Frames and the mbufs over them, without a mempool */
+struct Burst {
+    std::vector<std::vector<uint8_t>> frames;
+    std::vector<rte_mbuf> storage;
+    std::vector<rte_mbuf*> mbufs;
+
+    void add(const std::vector<uint8_t>& frame) { frames.push_back(frame); }
+
+    rte_mbuf** get() {
+        storage.assign(frames.size(), rte_mbuf{});
+        mbufs.resize(frames.size());
+        for (size_t i = 0; i < frames.size(); i++) {
+            storage[i].buf_addr = frames[i].data();
+            storage[i].data_off = 0;
+            storage[i].data_len = static_cast<uint16_t>(frames[i].size());
+            storage[i].pkt_len = static_cast<uint32_t>(frames[i].size());
+            mbufs[i] = &storage[i];
+        }
+        return mbufs.data();
+    }
+};
+
+static PacketFilter::Rule make_rule(const std::string& rule, const std::string& action) {
+    PacketFilter::Rule parsed = PacketFilter::parse_rule(rule, PacketFilter::RULE_ACTION_FORWARD);
+    log_assert(ControlServer::parse_action(action, parsed), "Bad action %s", action.c_str());
+    return parsed;
+}
+
+/* TSC cycles per second, as the filter needs them before EAL sets rte_get_tsc_hz() */
+static uint64_t measure_tsc_hz() {
+    auto start = std::chrono::steady_clock::now();
+    uint64_t start_tsc = rte_rdtsc();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    double seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return static_cast<uint64_t>((rte_rdtsc() - start_tsc) / seconds);
+}
+
+/* Forwards bursts of count frames of len bytes to dst_ip:dst_port and returns how
+ * many filter_burst() kept */
+static uint32_t forwarded(SoftwareFilter& filter, uint16_t thread_id, uint32_t dst_ip,
+                          uint16_t dst_port, uint32_t count, size_t len = 64) {
+    uint32_t kept = 0;
+    while (count > 0) {
+        uint16_t nb_rx = static_cast<uint16_t>(std::min<uint32_t>(count, BURST));
+        Burst burst;
+        for (uint16_t i = 0; i < nb_rx; i++) {
+            burst.add(ipv4_frame(udp_key(0x0a640001 + i, 1234, dst_ip, dst_port), len));
+        }
+        kept += nb_rx - filter.filter_burst(thread_id, burst.get(), nb_rx, false);
+        count -= nb_rx;
+    }
+    return kept;
+}
+
+static void test_filter_burst() {
+    PacketFilter::RuleSet rules = {
+        make_rule("10.0.0.1:53", "forward"),
+        make_rule("udp:*:*:10.0.0.0/24:*@0", "drop"),
+        make_rule("udp:*:*:10.0.0.2:*", "forward"),
+        make_rule("udp:*:*:10.0.1.0/24:80", "steer=rss"),
+    };
+    SoftwareFilter filter(rules, PacketFilter::RULE_ACTION_DROP, 1);
+
+    std::mt19937 rng(21);
+    std::vector<uint64_t> expected_hits(rules.size(), 0);
+    for (uint32_t round = 0; round < 1000; round++) {
+        uint16_t nb_rx = static_cast<uint16_t>(rng() % (BURST + 1));
+        Burst burst;
+        for (uint16_t i = 0; i < nb_rx; i++) {
+            uint32_t dst_ip = 0x0a000000 + rng() % 512;
+            uint16_t dst_port = (rng() & 1) ? 53 : 80;
+            uint16_t src_port = static_cast<uint16_t>(rng());
+            burst.add(ipv4_frame(udp_key(rng(), src_port, dst_ip, dst_port)));
+        }
+        rte_mbuf** mbufs = burst.get();
+
+        /* What lookup() decides, in the order filter_burst() must leave the mbufs */
+        std::vector<rte_mbuf*> expected(mbufs, mbufs + nb_rx);
+        auto end = std::stable_partition(expected.begin(), expected.end(),
+                                         [&](rte_mbuf* mbuf) {
+            PacketFilter::FlowKey key;
+            log_assert(SoftwareFilter::parse(rte_pktmbuf_mtod(mbuf, uint8_t*),
+                                             rte_pktmbuf_data_len(mbuf), key),
+                       "Frame did not parse");
+            uint32_t rule = filter.lookup(key);
+            if (rule == SoftwareFilter::NO_RULE) {
+                return true;
+            }
+            expected_hits[rule]++;
+            return rules[rule].action == PacketFilter::RULE_ACTION_DROP;
+        });
+
+        uint16_t nb_drop = filter.filter_burst(0, mbufs, nb_rx, false);
+        log_assert(nb_drop == end - expected.begin(), "Dropped %u instead of %ld packets",
+                   nb_drop, end - expected.begin());
+        log_assert(std::equal(expected.begin(), expected.end(), mbufs),
+                   "Packets out of order in round %u", round);
+    }
+    log_assert(filter.hits() == expected_hits, "Rule hits differ from the lookups");
+}
+
+static void test_rate_limit(uint64_t tsc_hz) {
+    /* Far below one packet or byte per test, so only the burst passes */
+    PacketFilter::RuleSet rules = {
+        make_rule("10.0.0.1:53", "limit=1pps:100"),
+        make_rule("10.0.0.2:53", "limit=8bps:3000"),
+    };
+    SoftwareFilter filter(rules, PacketFilter::RULE_ACTION_DROP, 1, tsc_hz);
+    uint32_t kept = forwarded(filter, 0, 0x0a000001, 53, 1000);
+    log_assert(kept == 100, "%u packets of a burst of 100 forwarded", kept);
+    kept = forwarded(filter, 0, 0x0a000002, 53, 100, 1000);
+    log_assert(kept == 3, "%u frames of 1000 bytes within a burst of 3000 bytes", kept);
+
+    /* Refill, checked against the time the filter saw go by */
+    rules = {make_rule("10.0.0.1:53", "limit=10000pps:10")};
+    SoftwareFilter refilled(rules, PacketFilter::RULE_ACTION_DROP, 1, tsc_hz);
+    uint64_t start = rte_rdtsc();
+    kept = 0;
+    while (rte_rdtsc() - start < tsc_hz / 5) {
+        kept += forwarded(refilled, 0, 0x0a000001, 53, BURST);
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    double expected = 10 + 10000.0 * (rte_rdtsc() - start) / tsc_hz;
+    log_assert(kept >= 0.95 * expected && kept <= 1.05 * expected,
+               "%u packets forwarded at 10000 pps where %.0f were expected", kept, expected);
+}
+
+static void test_shared_bucket(uint64_t tsc_hz) {
+    const uint16_t num_threads = 4;
+    PacketFilter::RuleSet rules = {make_rule("10.0.0.1:53", "limit=1pps:1000")};
+    SoftwareFilter filter(rules, PacketFilter::RULE_ACTION_DROP, num_threads, tsc_hz);
+
+    std::atomic<uint32_t> kept{0};
+    std::vector<std::thread> threads;
+    for (uint16_t t = 0; t < num_threads; t++) {
+        threads.emplace_back([&filter, &kept, t] {
+            kept += forwarded(filter, t, 0x0a000001, 53, 2000);
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    /* The test takes well under the second of a new token */
+    log_assert(kept == 1000, "%u packets of a burst of 1000 forwarded by %u threads",
+               kept.load(), num_threads);
+}
+
+int main() {
+    test_filter_burst();
+    uint64_t tsc_hz = measure_tsc_hz();
+    test_rate_limit(tsc_hz);
+    test_shared_bucket(tsc_hz);
+    log_info("Software filter tests passed");
+    return 0;
+}
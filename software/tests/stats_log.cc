@@ -0,0 +1,217 @@
+#include <unistd.h>
+#include <random>
+
+#include "deps.h"
+#include "stats_log.h"
+
+/* StatsLog against its Reader, as metrics_reader -l decodes it: the bytes of one
+ * record, samples written across every file of the ring and decoded back with
+ * their times, the version and magic checks of the header, and a truncated record. */
+
+static constexpr uint16_t NUM_PORTS = 2;
+static constexpr uint32_t MAX_FILES = 8;
+
+static std::string log_path(const char* name) {
+    return "/tmp/test_stats_log_" + std::to_string(getpid()) + "_" + name;
+}
+
+static void remove_files(const std::string& path) {
+    for (uint32_t file = 0; file < MAX_FILES; file++) {
+        unlink((path + "." + std::to_string(file)).c_str());
+    }
+}
+
+static std::vector<uint8_t> read_file(const std::string& name) {
+    FILE* fp = fopen(name.c_str(), "rb");
+    log_assert(fp != nullptr, "Cannot open %s: %s", name.c_str(), strerror(errno));
+    std::vector<uint8_t> bytes;
+    for (int byte = fgetc(fp); byte != EOF; byte = fgetc(fp)) {
+        bytes.push_back(static_cast<uint8_t>(byte));
+    }
+    fclose(fp);
+    return bytes;
+}
+
+static void write_file(const std::string& name, const std::vector<uint8_t>& bytes) {
+    FILE* fp = fopen(name.c_str(), "wb");
+    log_assert(fp != nullptr && fwrite(bytes.data(), 1, bytes.size(), fp) == bytes.size(),
+               "Cannot write %s", name.c_str());
+    fclose(fp);
+}
+
+/* Every field but the time, which is only kept to the microsecond */
+static bool same_counters(const StatsDelta& a, const StatsDelta& b) {
+    if (a.interval_us != b.interval_us || a.core_packets != b.core_packets ||
+        a.core_forwarded != b.core_forwarded || a.core_dropped != b.core_dropped ||
+        a.core_bytes != b.core_bytes || a.adapter_rx != b.adapter_rx ||
+        a.adapter_rx_dropped != b.adapter_rx_dropped || a.host_packets != b.host_packets ||
+        a.host_empty_polls != b.host_empty_polls || a.host_busy_polls != b.host_busy_polls ||
+        a.ports.size() != b.ports.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.ports.size(); i++) {
+        const StatsDelta::Port& p = a.ports[i];
+        const StatsDelta::Port& q = b.ports[i];
+        if (p.ipackets != q.ipackets || p.opackets != q.opackets || p.imissed != q.imissed ||
+            p.ierrors != q.ierrors || p.rx_nombuf != q.rx_nombuf) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* A record of one port with a two byte and a ten byte varint, every other field 0 */
+static void test_record_bytes() {
+    std::string path = log_path("bytes");
+    {
+        StatsLog log(path, 1, 250);
+        log_assert(log.open(), "Cannot open %s.0", path.c_str());
+        StatsDelta delta = {};
+        delta.interval_us = 300;
+        delta.core_packets = ~uint64_t{0};
+        /* A time before the start of the file is stored as 0 */
+        log_assert(log.write(delta), "Write failed");
+    }
+    std::vector<uint8_t> bytes = read_file(path + ".0");
+    log_assert(bytes.size() == sizeof(StatsLog::FileHeader) + 27, "File of %zu bytes",
+               bytes.size());
+
+    StatsLog::FileHeader header;
+    memcpy(&header, bytes.data(), sizeof(header));
+    log_assert(header.magic == StatsLog::MAGIC && header.version == StatsLog::VERSION &&
+               header.num_ports == 1 && header.period_ms == 250, "Wrong file header");
+
+    std::vector<uint8_t> expected = {StatsLog::FIELDS + StatsLog::PORT_FIELDS, 0, 0xAC, 0x02};
+    expected.insert(expected.end(), 9, 0xFF);
+    expected.push_back(0x01);
+    expected.insert(expected.end(), 8 + StatsLog::PORT_FIELDS, 0);
+    log_assert(std::equal(expected.begin(), expected.end(),
+                          bytes.begin() + sizeof(StatsLog::FileHeader)), "Wrong record bytes");
+    remove_files(path);
+}
+
+/* Samples written across the whole ring, more than once around it */
+static void test_rotation() {
+    std::string path = log_path("ring");
+    std::mt19937_64 rng(25);
+    /* Fields of every size from 1 to 10 bytes */
+    auto field = [&rng]() { return rng() >> (rng() % 64); };
+
+    std::vector<StatsDelta> written;
+    const uint64_t max_file_bytes = 2048;
+    {
+        StatsLog log(path, NUM_PORTS, 100, max_file_bytes, MAX_FILES);
+        log_assert(log.open(), "Cannot open %s.0", path.c_str());
+        StatsDelta delta = {};
+        delta.time_ns = 1000000000ull * time(nullptr) + 1000000000ull;
+        for (uint32_t i = 0; i < 2000; i++) {
+            /* Whole microseconds apart, so only the first time of a file is rounded */
+            delta.time_ns += 1000 * (1 + rng() % 200000);
+            for (uint64_t* counter : {&delta.interval_us, &delta.core_packets,
+                                      &delta.core_forwarded, &delta.core_dropped,
+                                      &delta.core_bytes, &delta.adapter_rx,
+                                      &delta.adapter_rx_dropped, &delta.host_packets,
+                                      &delta.host_empty_polls, &delta.host_busy_polls}) {
+                *counter = i % 3 == 0 ? 0 : field();
+            }
+            delta.ports.resize(NUM_PORTS);
+            for (StatsDelta::Port& port : delta.ports) {
+                port = {field(), field(), field(), field(), field()};
+            }
+            log_assert(log.write(delta), "Write %u failed", i);
+            written.push_back(delta);
+        }
+        log_assert(log.records() == written.size(), "%lu records written", log.records());
+    }
+
+    /* Files in the order they were started, each holding a run of the samples */
+    std::vector<std::pair<uint64_t, uint32_t>> files;
+    for (uint32_t file = 0; file < MAX_FILES; file++) {
+        std::string name = path + "." + std::to_string(file);
+        log_assert(read_file(name).size() <= max_file_bytes, "%s is too large", name.c_str());
+        StatsLog::Reader reader;
+        log_assert(reader.open(name), "Cannot read %s", name.c_str());
+        log_assert(reader.header().num_ports == NUM_PORTS && reader.header().period_ms == 100,
+                   "Wrong header in %s", name.c_str());
+        files.push_back({reader.header().start_ns, file});
+    }
+    std::sort(files.begin(), files.end());
+
+    std::vector<StatsDelta> read;
+    for (const auto& file : files) {
+        StatsLog::Reader reader;
+        reader.open(path + "." + std::to_string(file.second));
+        StatsDelta delta;
+        while (reader.next(delta)) {
+            read.push_back(delta);
+        }
+    }
+    log_assert(read.size() >= MAX_FILES && read.size() * 2 < written.size(),
+               "%zu of %zu samples left, the ring did not wrap", read.size(), written.size());
+
+    /* The last samples written, the oldest file whole */
+    size_t first = written.size() - read.size();
+    for (size_t i = 0; i < read.size(); i++) {
+        const StatsDelta& w = written[first + i];
+        log_assert(same_counters(read[i], w), "Sample %zu decoded wrong", first + i);
+        log_assert(read[i].time_ns <= w.time_ns && w.time_ns - read[i].time_ns < 1000,
+                   "Sample %zu at %lu instead of %lu", first + i, read[i].time_ns, w.time_ns);
+    }
+    remove_files(path);
+}
+
+static void test_header_checks() {
+    std::string path = log_path("header");
+    {
+        StatsLog log(path, NUM_PORTS, 100);
+        log_assert(log.open(), "Cannot open %s.0", path.c_str());
+        StatsDelta delta = {};
+        delta.ports.resize(NUM_PORTS);
+        for (uint32_t i = 0; i < 3; i++) {
+            delta.core_packets = i;
+            log_assert(log.write(delta), "Write %u failed", i);
+        }
+    }
+    std::string name = path + ".0";
+    std::vector<uint8_t> bytes = read_file(name);
+
+    /* The last record cut short is not decoded, the ones before are */
+    bytes.pop_back();
+    write_file(name, bytes);
+    {
+        StatsLog::Reader reader;
+        log_assert(reader.open(name), "Cannot read %s", name.c_str());
+        StatsDelta delta;
+        uint32_t records = 0;
+        while (reader.next(delta)) {
+            log_assert(delta.core_packets == records, "Record %u decoded wrong", records);
+            records++;
+        }
+        log_assert(records == 2, "%u records decoded from a truncated file", records);
+    }
+
+    std::vector<uint8_t> newer = bytes;
+    newer[offsetof(StatsLog::FileHeader, version)] = StatsLog::VERSION + 1;
+    write_file(name, newer);
+    {
+        StatsLog::Reader reader;
+        log_assert(!reader.open(name), "Read a file of version %u", StatsLog::VERSION + 1);
+    }
+
+    std::vector<uint8_t> other = bytes;
+    other[offsetof(StatsLog::FileHeader, magic)] ^= 1;
+    write_file(name, other);
+    {
+        StatsLog::Reader reader;
+        log_assert(!reader.open(name), "Read a file with another magic");
+    }
+    remove_files(path);
+}
+
+int main() {
+    test_record_bytes();
+    test_rotation();
+    test_header_checks();
+    log_info("Stats log tests passed");
+    return 0;
+}